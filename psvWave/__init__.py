@@ -1,9 +1,20 @@
+import concurrent.futures as _futures
+
 import numpy as _numpy
 import matplotlib.pyplot as _plt
 from typing import Tuple as _Tuple
 
 from ._version import get_versions
 from __psvWave_cpp import fdModel as fdModel
+from __psvWave_cpp import WavefieldOutputSettings as WavefieldOutputSettings
+from __psvWave_cpp import LBFGSSettings as LBFGSSettings
+from __psvWave_cpp import LBFGSIteration as LBFGSIteration
+from __psvWave_cpp import LBFGSResult as LBFGSResult
+from __psvWave_cpp import MultiscaleStage as MultiscaleStage
+from __psvWave_cpp import MultiscaleStageResult as MultiscaleStageResult
+from __psvWave_cpp import SimulationPlan as SimulationPlan
+from __psvWave_cpp import ShotWindow as ShotWindow
+from __psvWave_cpp import kernel_vp, kernel_vs, kernel_rho, kernel_all
 
 __version__ = get_versions()["version"]
 __full_revisionid__ = get_versions()["full-revisionid"]
@@ -125,6 +136,140 @@ def write_dictionary(filename, dictionary):
         config.write(configfile)
 
 
+def read_receiver_file(filename):
+    """Read a binary receiver file as written by ``fdModel.write_receivers_binary``.
+
+    The seismograms are returned as read-only memory maps of the file, so no data is
+    copied until it is accessed.
+
+    :param filename: Path to the receiver file.
+    :returns: Tuple of ux and uz, each of shape (nr, nt), time step, and the receiver
+        grid indices in x and z.
+    """
+    header_type = _numpy.dtype(
+        [
+            ("magic", "S8"),
+            ("byte_order", "<u4"),
+            ("version", "<u4"),
+            ("sample_size", "<u4"),
+            ("n_components", "<i4"),
+            ("nr", "<i4"),
+            ("nt", "<i4"),
+            ("dt", "<f8"),
+            ("data_offset", "<u8"),
+        ]
+    )
+    header = _numpy.fromfile(filename, dtype=header_type, count=1)[0]
+    if header["magic"] != b"PSVRTF" or header["byte_order"] != 0x01020304:
+        raise ValueError(f"{filename} is not a little-endian receiver file.")
+
+    nr, nt = int(header["nr"]), int(header["nt"])
+    geometry = _numpy.fromfile(
+        filename, dtype="<i4", count=2 * nr, offset=header_type.itemsize
+    )
+    data = _numpy.memmap(
+        filename,
+        dtype=f"<f{int(header['sample_size'])}",
+        mode="r",
+        offset=int(header["data_offset"]),
+        shape=(2, nr, nt),
+    )
+    return data[0], data[1], float(header["dt"]), geometry[:nr], geometry[nr:]
+
+
+def read_wavefield_file(filename):
+    """Read a wavefield file as written by ``fdModel.forward_simulate`` with
+    ``output_wavefields=True``.
+
+    The frames are returned as read-only memory maps of the file.
+
+    :param filename: Path to the wavefield file.
+    :returns: Dictionary with the shot and time step of every frame ("shot", "it"),
+        an array of shape (n_frames, nx, nz) for every written field ("vx", "vz",
+        "txx", "tzz", "txz"), and the header entries.
+    """
+    header_type = _numpy.dtype(
+        [
+            ("magic", "S8"),
+            ("byte_order", "<u4"),
+            ("version", "<u4"),
+            ("fields", "<u4"),
+            ("nx", "<i4"),
+            ("nz", "<i4"),
+            ("ix_start", "<i4"),
+            ("iz_start", "<i4"),
+            ("decimation_x", "<i4"),
+            ("decimation_z", "<i4"),
+            ("interval", "<i4"),
+            ("dt", "<f8"),
+            ("dx", "<f8"),
+            ("dz", "<f8"),
+        ]
+    )
+    header = _numpy.fromfile(filename, dtype=header_type, count=1)[0]
+    if header["magic"] != b"PSVWFD" or header["byte_order"] != 0x01020304:
+        raise ValueError(f"{filename} is not a little-endian wavefield file.")
+
+    nx, nz = int(header["nx"]), int(header["nz"])
+    names = [
+        name
+        for bit, name in enumerate(["vx", "vz", "txx", "tzz", "txz"])
+        if int(header["fields"]) & (1 << bit)
+    ]
+    frame_type = _numpy.dtype(
+        [("shot", "<i4"), ("it", "<i4")] + [(name, "<f4", (nx, nz)) for name in names]
+    )
+    frames = _numpy.memmap(
+        filename, dtype=frame_type, mode="r", offset=header_type.itemsize
+    )
+
+    result = {name: header[name] for name in header_type.names if name != "magic"}
+    result["shot"] = frames["shot"]
+    result["it"] = frames["it"]
+    for name in names:
+        result[name] = frames[name]
+    return result
+
+
+_simulation_executor = None
+
+
+def _get_simulation_executor():
+    global _simulation_executor
+    if _simulation_executor is None:
+        _simulation_executor = _futures.ThreadPoolExecutor()
+    return _simulation_executor
+
+
+@_add_method(fdModel)
+def _forward_simulate_async(self: fdModel, *args, executor=None, **kwargs):
+    """Run ``forward_simulate`` in a background thread.
+
+    The simulation releases the GIL, so simulations of several models run in parallel
+    with each other and with the calling thread. Use ``omp_threads_override`` to share
+    the cores between them. Only one simulation per model may run at a time.
+
+    :param executor: ``concurrent.futures.Executor`` to run in, defaults to a shared
+        thread pool.
+    :returns: ``concurrent.futures.Future`` that completes with the simulation.
+    """
+    executor = executor or _get_simulation_executor()
+    return executor.submit(self.forward_simulate, *args, **kwargs)
+
+
+@_add_method(fdModel)
+def _adjoint_simulate_async(self: fdModel, *args, executor=None, **kwargs):
+    """Run ``adjoint_simulate`` in a background thread. See
+    ``forward_simulate_async``.
+
+    :param executor: ``concurrent.futures.Executor`` to run in, defaults to a shared
+        thread pool.
+    :returns: ``concurrent.futures.Future`` that completes with the simulation.
+    """
+    executor = executor or _get_simulation_executor()
+    return executor.submit(self.adjoint_simulate, *args, **kwargs)
+
+
 @_add_method(fdModel)
 def _plot_data(
     self: fdModel,
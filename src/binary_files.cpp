@@ -0,0 +1,383 @@
+#include "binary_files.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <omp.h>
+
+uint64_t receiver_file_data_offset(int nr)
+{
+  uint64_t offset = sizeof(receiver_file_header) + 2 * nr * sizeof(int32_t);
+  return (offset + 7) / 8 * 8;
+}
+
+mapped_file::mapped_file(const std::string &path)
+{
+  int descriptor = open(path.c_str(), O_RDONLY);
+  if (descriptor < 0)
+  {
+    throw std::invalid_argument("Could not open file " + path + ".");
+  }
+
+  struct stat status;
+  if (fstat(descriptor, &status) != 0)
+  {
+    close(descriptor);
+    throw std::invalid_argument("Could not determine the size of file " + path + ".");
+  }
+  length = status.st_size;
+
+  if (length > 0)
+  {
+    void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    if (mapping == MAP_FAILED)
+    {
+      close(descriptor);
+      throw std::invalid_argument("Could not memory map file " + path + ".");
+    }
+    address = static_cast<const char *>(mapping);
+  }
+
+  // The mapping stays valid after closing the descriptor.
+  close(descriptor);
+}
+
+mapped_file::~mapped_file()
+{
+  if (address != nullptr)
+  {
+    munmap(const_cast<char *>(address), length);
+  }
+}
+
+void mapped_file::release(size_t offset, size_t bytes) const
+{
+  if (address == nullptr or offset >= length)
+  {
+    return;
+  }
+  // Only whole pages inside the range can be released.
+  size_t page = size_t(sysconf(_SC_PAGESIZE));
+  size_t begin = (offset + page - 1) / page * page;
+  size_t end = std::min(offset + bytes, length) / page * page;
+  if (end > begin)
+  {
+    madvise(const_cast<char *>(address) + begin, end - begin, MADV_DONTNEED);
+  }
+}
+
+bool file_exists(const std::string &path) { return access(path.c_str(), R_OK) == 0; }
+
+namespace
+{
+const char npy_magic[6] = {'\x93', 'N', 'U', 'M', 'P', 'Y'};
+
+bool ends_with(const std::string &string, const std::string &suffix)
+{
+  return string.size() >= suffix.size() and
+         string.compare(string.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool is_whitespace(char character)
+{
+  return character == ' ' or character == '\n' or character == '\t' or
+         character == '\r' or character == '\v' or character == '\f';
+}
+
+// Copy little-endian samples of sample_size bytes into destination, in parallel.
+void copy_samples(const char *data, size_t sample_size, size_t n_values,
+                  double *destination)
+{
+  if (sample_size == sizeof(double))
+  {
+#pragma omp parallel for
+    for (size_t i = 0; i < n_values; ++i)
+    {
+      std::memcpy(destination + i, data + i * sizeof(double), sizeof(double));
+    }
+  }
+  else
+  {
+#pragma omp parallel for
+    for (size_t i = 0; i < n_values; ++i)
+    {
+      float value;
+      std::memcpy(&value, data + i * sizeof(float), sizeof(float));
+      destination[i] = value;
+    }
+  }
+}
+
+void load_npy(const mapped_file &file, const std::string &path, size_t n_values,
+              double *destination)
+{
+  const char *data = file.data();
+  if (file.size() < 10)
+  {
+    throw std::invalid_argument("NPY file " + path + " is truncated.");
+  }
+
+  int major_version = static_cast<unsigned char>(data[6]);
+  size_t header_length, header_start;
+  if (major_version == 1)
+  {
+    header_start = 10;
+    header_length = static_cast<unsigned char>(data[8]) |
+                    size_t(static_cast<unsigned char>(data[9])) << 8;
+  }
+  else
+  {
+    header_start = 12;
+    if (file.size() < header_start)
+    {
+      throw std::invalid_argument("NPY file " + path + " is truncated.");
+    }
+    header_length = 0;
+    for (int i = 3; i >= 0; --i)
+    {
+      header_length = header_length << 8 | static_cast<unsigned char>(data[8 + i]);
+    }
+  }
+  if (file.size() < header_start + header_length)
+  {
+    throw std::invalid_argument("NPY file " + path + " is truncated.");
+  }
+  std::string header(data + header_start, header_length);
+
+  size_t sample_size = 0;
+  if (header.find("'<f8'") != std::string::npos)
+  {
+    sample_size = sizeof(double);
+  }
+  else if (header.find("'<f4'") != std::string::npos)
+  {
+    sample_size = sizeof(float);
+  }
+  if (sample_size == 0 or header.find("'fortran_order': False") == std::string::npos)
+  {
+    throw std::invalid_argument("NPY file " + path +
+                                " is not a C order little-endian float array.");
+  }
+
+  // Total size from the shape tuple.
+  auto shape_start = header.find('(', header.find("'shape'"));
+  auto shape_end = header.find(')', shape_start);
+  if (shape_start == std::string::npos or shape_end == std::string::npos)
+  {
+    throw std::invalid_argument("NPY file " + path + " has no shape.");
+  }
+  size_t n_file_values = 1;
+  const char *cursor = header.c_str() + shape_start + 1;
+  const char *end = header.c_str() + shape_end;
+  while (cursor < end)
+  {
+    char *next;
+    auto dimension = std::strtoull(cursor, &next, 10);
+    if (next == cursor)
+    {
+      ++cursor;
+      continue;
+    }
+    n_file_values *= dimension;
+    cursor = next;
+  }
+
+  size_t data_offset = header_start + header_length;
+  if (n_file_values != n_values or
+      file.size() != data_offset + n_values * sample_size)
+  {
+    throw std::invalid_argument("NPY file " + path + " holds " +
+                                std::to_string(n_file_values) + " values, expected " +
+                                std::to_string(n_values) + ".");
+  }
+
+  copy_samples(data + data_offset, sample_size, n_values, destination);
+}
+
+// Parse whitespace separated numbers in [begin, end). If destination is null,
+// only count them.
+size_t parse_chunk(const char *begin, const char *end, double *destination,
+                   const std::string &path)
+{
+  size_t count = 0;
+  const char *cursor = begin;
+  char token[64];
+  while (cursor < end)
+  {
+    while (cursor < end and is_whitespace(*cursor))
+    {
+      ++cursor;
+    }
+    if (cursor == end)
+    {
+      break;
+    }
+    const char *token_start = cursor;
+    while (cursor < end and !is_whitespace(*cursor))
+    {
+      ++cursor;
+    }
+    if (destination != nullptr)
+    {
+      // The mapping is not null terminated, so parse a terminated copy.
+      size_t length = cursor - token_start;
+      if (length >= sizeof(token))
+      {
+        throw std::invalid_argument("Could not parse a number in " + path + ".");
+      }
+      std::memcpy(token, token_start, length);
+      token[length] = '\0';
+      char *parsed_end;
+      destination[count] = std::strtod(token, &parsed_end);
+      if (parsed_end != token + length)
+      {
+        throw std::invalid_argument("Could not parse '" + std::string(token) +
+                                    "' in " + path + ".");
+      }
+    }
+    ++count;
+  }
+  return count;
+}
+
+void load_text(const mapped_file &file, const std::string &path, size_t n_values,
+               double *destination)
+{
+  const char *data = file.data();
+  const size_t size = file.size();
+
+  // Chunk boundaries, moved forward onto whitespace so no number is split.
+  int n_chunks = std::max(1, omp_get_max_threads());
+  std::vector<size_t> boundaries(n_chunks + 1, size);
+  boundaries[0] = 0;
+  for (int i_chunk = 1; i_chunk < n_chunks; ++i_chunk)
+  {
+    size_t boundary = std::max(boundaries[i_chunk - 1], size * i_chunk / n_chunks);
+    while (boundary < size and !is_whitespace(data[boundary]))
+    {
+      ++boundary;
+    }
+    boundaries[i_chunk] = boundary;
+  }
+
+  // Count the numbers per chunk, then parse every chunk into its own range.
+  std::vector<size_t> counts(n_chunks);
+#pragma omp parallel for
+  for (int i_chunk = 0; i_chunk < n_chunks; ++i_chunk)
+  {
+    counts[i_chunk] = parse_chunk(data + boundaries[i_chunk],
+                                  data + boundaries[i_chunk + 1], nullptr, path);
+  }
+  std::vector<size_t> offsets(n_chunks + 1, 0);
+  for (int i_chunk = 0; i_chunk < n_chunks; ++i_chunk)
+  {
+    offsets[i_chunk + 1] = offsets[i_chunk] + counts[i_chunk];
+  }
+  if (offsets[n_chunks] < n_values)
+  {
+    throw std::invalid_argument("Not enough data is present in " + path + "!");
+  }
+  if (offsets[n_chunks] > n_values)
+  {
+    throw std::invalid_argument("Too much data is present in " + path + "!");
+  }
+
+  // Exceptions may not leave a parallel region, so they are rethrown after it.
+  std::string error;
+#pragma omp parallel for
+  for (int i_chunk = 0; i_chunk < n_chunks; ++i_chunk)
+  {
+    try
+    {
+      parse_chunk(data + boundaries[i_chunk], data + boundaries[i_chunk + 1],
+                  destination + offsets[i_chunk], path);
+    }
+    catch (const std::invalid_argument &exception)
+    {
+#pragma omp critical
+      error = exception.what();
+    }
+  }
+  if (!error.empty())
+  {
+    throw std::invalid_argument(error);
+  }
+}
+} // namespace
+
+void load_values(const std::string &path, size_t n_values, double *destination)
+{
+  mapped_file file(path);
+
+  if (file.size() >= sizeof(npy_magic) and
+      std::memcmp(file.data(), npy_magic, sizeof(npy_magic)) == 0)
+  {
+    load_npy(file, path, n_values, destination);
+  }
+  else if (ends_with(path, ".bin") or ends_with(path, ".raw"))
+  {
+    if (file.size() == n_values * sizeof(double))
+    {
+      copy_samples(file.data(), sizeof(double), n_values, destination);
+    }
+    else if (file.size() == n_values * sizeof(float))
+    {
+      copy_samples(file.data(), sizeof(float), n_values, destination);
+    }
+    else
+    {
+      throw std::invalid_argument("Raw file " + path + " does not hold " +
+                                  std::to_string(n_values) +
+                                  " float64 or float32 values.");
+    }
+  }
+  else
+  {
+    load_text(file, path, n_values, destination);
+  }
+}
+
+void write_npy(const std::string &path, const double *values,
+               const std::vector<int> &shape)
+{
+  std::string shape_string;
+  size_t n_values = 1;
+  for (auto &&dimension : shape)
+  {
+    shape_string += std::to_string(dimension) + ", ";
+    n_values *= dimension;
+  }
+  if (shape.size() > 1)
+  {
+    shape_string.resize(shape_string.size() - 2);
+  }
+  std::string header =
+      "{'descr': '<f8', 'fortran_order': False, 'shape': (" + shape_string + "), }";
+  // Pad with spaces so that the data is 64 byte aligned, ending in a newline.
+  size_t total = 10 + header.size() + 1;
+  header.append((64 - total % 64) % 64, ' ');
+  header += '\n';
+
+  std::ofstream npy_file(path, std::ios::binary);
+  if (!npy_file.good())
+  {
+    throw std::invalid_argument("Could not open " + path + " for writing.");
+  }
+  npy_file.write(npy_magic, sizeof(npy_magic));
+  const char version[2] = {1, 0};
+  npy_file.write(version, 2);
+  const char header_length[2] = {char(header.size() & 0xff), char(header.size() >> 8)};
+  npy_file.write(header_length, 2);
+  npy_file.write(header.data(), header.size());
+  npy_file.write(reinterpret_cast<const char *>(values), n_values * sizeof(double));
+  if (!npy_file.good())
+  {
+    throw std::invalid_argument("Could not write " + path + ".");
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef BINARY_FILES_H
+#define BINARY_FILES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//! Value of the byte order field as written on the producing machine.
+const uint32_t binary_file_byte_order = 0x01020304;
+
+//! Current version of the binary containers.
+const uint32_t binary_file_version = 1;
+
+//!  \brief Header of a binary receiver file, holding the seismograms of one shot.
+//!
+//!  The header is followed by the horizontal and vertical grid indices of the nr
+//!  receivers (int32), and at data_offset by the ux and uz seismograms, each of
+//!  shape [nr][nt] with samples of sample_size bytes (4: float32, 8: float64).
+struct receiver_file_header
+{
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+  uint32_t sample_size;
+  int32_t n_components;
+  int32_t nr;
+  int32_t nt;
+  double dt;
+  uint64_t data_offset;
+};
+
+//! Magic string identifying binary receiver files.
+const char receiver_file_magic[8] = {'P', 'S', 'V', 'R', 'T', 'F', '\0', '\0'};
+
+//!  \brief Offset of the seismograms in a receiver file, aligned to 8 bytes.
+//!
+//!  @param nr Number of receivers in the file.
+uint64_t receiver_file_data_offset(int nr);
+
+//!  \brief Read-only memory map of a complete file.
+//!
+//!  The mapping is released when the object is destroyed. Throws
+//!  std::invalid_argument when the file can not be opened or mapped.
+class mapped_file
+{
+public:
+  explicit mapped_file(const std::string &path);
+  ~mapped_file();
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  const char *data() const { return address; }
+  size_t size() const { return length; }
+
+  //!  \brief Drop the pages of a range from memory, e.g. after streaming it.
+  //!
+  //!  The range is re-read from the file if it is accessed again.
+  //!
+  //!  @param offset Start of the range in bytes.
+  //!  @param bytes Length of the range in bytes.
+  void release(size_t offset, size_t bytes) const;
+
+private:
+  const char *address = nullptr;
+  size_t length = 0;
+};
+
+//!  \brief Load exactly n_values numbers from a file into destination.
+//!
+//!  The format is detected from the file: NPY files (C order, little-endian float64
+//!  or float32) and raw binary files (extension .bin or .raw, little-endian float64
+//!  or float32 as deduced from the file size) are memory mapped and copied in
+//!  parallel. Anything else is parsed as whitespace separated plaintext, in
+//!  parallel chunks. Throws std::invalid_argument if the file can not be read or
+//!  does not hold exactly n_values numbers.
+//!
+//!  @param path Path to the file.
+//!  @param n_values Number of values expected.
+//!  @param destination Output array of n_values.
+void load_values(const std::string &path, size_t n_values, double *destination);
+
+//!  \brief Write an array as a C order float64 NPY file.
+//!
+//!  @param path Path to the file.
+//!  @param values Values to write, product of shape in total.
+//!  @param shape Shape of the array.
+void write_npy(const std::string &path, const double *values,
+               const std::vector<int> &shape);
+
+//!  \brief Check if a file exists and can be opened for reading.
+//!
+//!  @param path Path to the file.
+bool file_exists(const std::string &path);
+
+#endif
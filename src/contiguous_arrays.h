@@ -1,6 +1,7 @@
 #ifndef CONTIGUOUS_H
 #define CONTIGUOUS_H
 
+#include <memory>
 #include <vector>
 
 template <class T>
@@ -14,6 +15,14 @@ void allocate_array(T *&pointer, std::vector<int> shape)
     pointer = new T[total_size];
 };
 
+// Allocates an array like allocate_array(), owned by the returned pointer instead.
+template <class T>
+std::shared_ptr<T> allocate_shared_array(T *&pointer, std::vector<int> shape)
+{
+    allocate_array(pointer, shape);
+    return std::shared_ptr<T>(pointer, std::default_delete<T[]>());
+};
+
 template <class T>
 void deallocate_array(T *pointer)
 {
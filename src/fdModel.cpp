@@ -3,13 +3,26 @@
 //
 #include "fdModel.h"
 #include "INIReader.h"
+#include "binary_files.h"
+#include "segy.h"
+#include "wavefield_writer.h"
+#include "unsupported/Eigen/FFT"
+#include <algorithm>
 #include <cmath>
+#include <complex>
+#include <cstring>
+#include <exception>
+#include <functional>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <memory>
 #include <omp.h>
+#include <random>
 #include <stdexcept>
+#include <thread>
 
 #define PI 3.14159265
 
@@ -61,7 +74,9 @@ fdModel::fdModel(
   initialize_arrays();
 }
 
-fdModel::fdModel(const fdModel &model)
+fdModel::fdModel(const fdModel &model) : fdModel(model, model.snapshot_storage) {}
+
+fdModel::fdModel(const fdModel &model, bool _snapshot_storage)
     : nt(model.nt), nx_inner(model.nx_inner), nz_inner(model.nz_inner),
       nx_inner_boundary(model.nx_inner_boundary),
       nz_inner_boundary(model.nz_inner_boundary), dx(model.dx), dz(model.dz),
@@ -91,6 +106,12 @@ fdModel::fdModel(const fdModel &model)
   parse_parameters(ix_sources_vector, iz_sources_vector, moment_angles_vector,
                    ix_receivers_vector, iz_receivers_vector);
 
+  snapshot_storage = _snapshot_storage;
+  snapshot_stride_x = model.snapshot_stride_x;
+  snapshot_stride_z = model.snapshot_stride_z;
+  snapshot_cells = model.snapshot_cells;
+  kernel_frequencies = model.kernel_frequencies;
+  kernel_selection = model.kernel_selection;
   allocate_memory();
 
   copy_arrays(model);
@@ -117,6 +138,8 @@ fdModel::~fdModel()
   deallocate_array(vp_kernel);
   deallocate_array(vs_kernel);
   deallocate_array(density_v_kernel);
+  deallocate_array(forward_illumination);
+  deallocate_array(adjoint_illumination);
   deallocate_array(starting_rho);
   deallocate_array(starting_vp);
   deallocate_array(starting_vs);
@@ -124,11 +147,22 @@ fdModel::~fdModel()
   deallocate_array(t);
   deallocate_array(stf);
   deallocate_array(moment);
-  deallocate_array(accu_vx);
-  deallocate_array(accu_vz);
-  deallocate_array(accu_txx);
-  deallocate_array(accu_tzz);
-  deallocate_array(accu_txz);
+  deallocate_array(rtf_ux);
+  deallocate_array(rtf_uz);
+  deallocate_array(rtf_ux_true);
+  deallocate_array(rtf_uz_true);
+  deallocate_array(a_stf_ux);
+  deallocate_array(a_stf_uz);
+  deallocate_snapshots();
+  deallocate_array(rtf_ux_encoded);
+  deallocate_array(rtf_uz_encoded);
+  deallocate_array(rtf_ux_true_encoded);
+  deallocate_array(rtf_uz_true_encoded);
+  deallocate_array(a_stf_ux_encoded);
+  deallocate_array(a_stf_uz_encoded);
+  deallocate_array(misfit_per_trace);
+  deallocate_array(misfit_per_shot);
+  deallocate_array(misfit_per_receiver);
   deallocate_array(ix_receivers);
   deallocate_array(iz_receivers);
   deallocate_array(ix_sources);
@@ -136,6 +170,370 @@ fdModel::~fdModel()
   deallocate_array(moment_angles);
 }
 
+fdModel::fdModel(const fdModel &model, int coarsening, real_simulation max_frequency)
+    : nt((model.nt - 1) / coarsening + 1),
+      nx_inner((model.nx_inner - 1) / coarsening + 1),
+      nz_inner((model.nz_inner - 1) / coarsening + 1),
+      nx_inner_boundary((model.nx_inner_boundary + coarsening - 1) / coarsening),
+      nz_inner_boundary((model.nz_inner_boundary + coarsening - 1) / coarsening),
+      dx(model.dx * coarsening), dz(model.dz * coarsening), dt(model.dt * coarsening),
+      np_boundary(model.np_boundary), np_factor(model.np_factor),
+      scalar_rho(model.scalar_rho), scalar_vp(model.scalar_vp),
+      scalar_vs(model.scalar_vs), n_sources(model.n_sources), n_shots(model.n_shots),
+      which_source_to_fire_in_which_shot(model.which_source_to_fire_in_which_shot),
+      delay_cycles_per_shot(model.delay_cycles_per_shot),
+      peak_frequency(model.peak_frequency), t0(model.t0), nr(model.nr),
+      snapshot_interval(std::max(1, model.snapshot_interval / coarsening)),
+      basis_gridpoints_x(1), basis_gridpoints_z(1),
+      observed_data_folder(model.observed_data_folder), stf_folder(model.stf_folder)
+{
+  if (coarsening < 1 or max_frequency <= 0.0)
+  {
+    throw std::invalid_argument(
+        "The coarsening should be at least 1 and the maximum frequency positive.");
+  }
+
+  // Sources and receivers move to the nearest coarse grid point.
+  auto coarse_location = [&](int fine_location) {
+    return int(std::lround(double(fine_location - model.np_boundary) / coarsening));
+  };
+  std::vector<int> ix_sources_vector, iz_sources_vector;
+  for (int i_source = 0; i_source < n_sources; ++i_source)
+  {
+    ix_sources_vector.push_back(coarse_location(model.ix_sources[i_source]));
+    iz_sources_vector.push_back(coarse_location(model.iz_sources[i_source]));
+  }
+  std::vector<real_simulation> moment_angles_vector(
+      model.moment_angles, model.moment_angles + model.n_sources);
+  std::vector<int> ix_receivers_vector, iz_receivers_vector;
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    ix_receivers_vector.push_back(coarse_location(model.ix_receivers[i_receiver]));
+    iz_receivers_vector.push_back(coarse_location(model.iz_receivers[i_receiver]));
+  }
+
+  parse_parameters(ix_sources_vector, iz_sources_vector, moment_angles_vector,
+                   ix_receivers_vector, iz_receivers_vector);
+
+  kernel_selection = model.kernel_selection;
+  allocate_memory();
+
+  initialize_arrays();
+
+  shot_batch_size = model.shot_batch_size;
+  shot_window_aperture = (model.shot_window_aperture + coarsening - 1) / coarsening;
+  active_region_tolerance = model.active_region_tolerance;
+  active_region_tile_size = model.active_region_tile_size;
+
+  // Average the medium over the fine grid points nearest to every coarse grid
+  // point. Both grids share the first grid point inside the absorbing boundary.
+  const int window_start = -(coarsening - 1) / 2;
+  const int window_end = coarsening / 2;
+#pragma omp parallel for collapse(2)
+  for (int ix = 0; ix < nx; ++ix)
+  {
+    for (int iz = 0; iz < nz; ++iz)
+    {
+      real_simulation sum_vp = 0.0, sum_vs = 0.0, sum_rho = 0.0;
+      int count = 0;
+      for (int jx = window_start; jx <= window_end; ++jx)
+      {
+        for (int jz = window_start; jz <= window_end; ++jz)
+        {
+          int ix_fine = model.np_boundary + (ix - np_boundary) * coarsening + jx;
+          int iz_fine = model.np_boundary + (iz - np_boundary) * coarsening + jz;
+          if (ix_fine < 0 or ix_fine >= model.nx or iz_fine < 0 or iz_fine >= model.nz)
+          {
+            continue;
+          }
+          auto idx_fine = linear_IDX(ix_fine, iz_fine, model.nx, model.nz);
+          sum_vp += model.vp[idx_fine];
+          sum_vs += model.vs[idx_fine];
+          sum_rho += model.rho[idx_fine];
+          count++;
+        }
+      }
+      if (count == 0)
+      {
+        // Coarse boundary points beyond the fine grid take the nearest fine point.
+        int ix_fine = std::min(
+            std::max(model.np_boundary + (ix - np_boundary) * coarsening, 0),
+            model.nx - 1);
+        int iz_fine = std::min(
+            std::max(model.np_boundary + (iz - np_boundary) * coarsening, 0),
+            model.nz - 1);
+        auto idx_fine = linear_IDX(ix_fine, iz_fine, model.nx, model.nz);
+        sum_vp = model.vp[idx_fine];
+        sum_vs = model.vs[idx_fine];
+        sum_rho = model.rho[idx_fine];
+        count = 1;
+      }
+      auto idx = linear_IDX(ix, iz, nx, nz);
+      vp[idx] = sum_vp / count;
+      vs[idx] = sum_vs / count;
+      rho[idx] = sum_rho / count;
+    }
+  }
+  update_from_velocity();
+
+  // Filtered and decimated signals. Sources are injected with 1 / (dx^2 dz^2) and
+  // recorded with 1 / (dx dz), which for a physical moment proportional to
+  // moment * dz / dx^2 gives seismograms proportional to coarsening^-3.
+  std::vector<real_simulation> filtered(model.nt);
+  for (int i_source = 0; i_source < n_sources; ++i_source)
+  {
+    model.low_pass_filter(model.stf + linear_IDX(i_source, 0, n_sources, model.nt),
+                          filtered.data(), max_frequency);
+    for (int it = 0; it < nt; ++it)
+    {
+      stf[linear_IDX(i_source, it, n_sources, nt)] = filtered[it * coarsening];
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+      for (int j = 0; j < 2; ++j)
+      {
+        auto idx_mt = linear_IDX(i_source, i, j, n_sources, 2, 2);
+        moment[idx_mt] = model.moment[idx_mt] * coarsening * coarsening * coarsening;
+      }
+    }
+  }
+  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+  {
+    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+    {
+      auto idx_fine = linear_IDX(i_shot, i_receiver, 0, n_shots, nr, model.nt);
+      auto idx = linear_IDX(i_shot, i_receiver, 0, n_shots, nr, nt);
+      model.low_pass_filter(model.rtf_ux_true + idx_fine, filtered.data(),
+                            max_frequency);
+      for (int it = 0; it < nt; ++it)
+      {
+        rtf_ux_true[idx + it] = filtered[it * coarsening];
+      }
+      model.low_pass_filter(model.rtf_uz_true + idx_fine, filtered.data(),
+                            max_frequency);
+      for (int it = 0; it < nt; ++it)
+      {
+        rtf_uz_true[idx + it] = filtered[it * coarsening];
+      }
+    }
+  }
+}
+
+fdModel::fdModel(const fdModel &model, const simulation_plan &plan)
+    : nt(plan.nt), nx_inner(plan.nx_inner), nz_inner(plan.nz_inner),
+      nx_inner_boundary(
+          int(std::ceil(model.nx_inner_boundary * model.dx / plan.dx - 1e-9))),
+      nz_inner_boundary(
+          int(std::ceil(model.nz_inner_boundary * model.dz / plan.dz - 1e-9))),
+      dx(plan.dx), dz(plan.dz), dt(plan.dt), np_boundary(model.np_boundary),
+      np_factor(model.np_factor), scalar_rho(model.scalar_rho),
+      scalar_vp(model.scalar_vp), scalar_vs(model.scalar_vs), n_sources(model.n_sources),
+      n_shots(model.n_shots),
+      which_source_to_fire_in_which_shot(model.which_source_to_fire_in_which_shot),
+      delay_cycles_per_shot(model.delay_cycles_per_shot),
+      peak_frequency(model.peak_frequency), t0(model.t0), nr(model.nr),
+      snapshot_interval(
+          std::max(1, int(std::lround(model.snapshot_interval * model.dt / plan.dt)))),
+      basis_gridpoints_x(1), basis_gridpoints_z(1),
+      observed_data_folder(model.observed_data_folder), stf_folder(model.stf_folder)
+{
+  // Seismogram amplitudes only follow from the grid spacing if it scales equally
+  // in x and z.
+  const real_simulation scale = plan.dx / model.dx;
+  if (plan.dx <= 0.0 or plan.dz <= 0.0 or plan.dt <= 0.0 or plan.nt < 1 or
+      std::abs(plan.dz / model.dz - scale) > 1e-9 * scale)
+  {
+    throw std::invalid_argument("The planned grid spacing should scale dx and dz by "
+                                "the same factor, and the time step be positive.");
+  }
+  real_simulation min_velocity, max_velocity;
+  model.velocity_extremes(min_velocity, max_velocity);
+  if (plan.dt > stable_time_step(max_velocity, plan.dx, plan.dz))
+  {
+    throw std::invalid_argument("The planned time step is unstable for the model.");
+  }
+  if (nx_inner - 2 * nx_inner_boundary < 1 or nz_inner - 2 * nz_inner_boundary < 1)
+  {
+    throw std::invalid_argument("The planned grid has no free grid points.");
+  }
+
+  // Sources and receivers move to the nearest planned grid point.
+  auto planned_location = [&](int location) {
+    return int(std::lround(double(location - model.np_boundary) / scale));
+  };
+  std::vector<int> ix_sources_vector, iz_sources_vector;
+  for (int i_source = 0; i_source < n_sources; ++i_source)
+  {
+    ix_sources_vector.push_back(planned_location(model.ix_sources[i_source]));
+    iz_sources_vector.push_back(planned_location(model.iz_sources[i_source]));
+  }
+  std::vector<real_simulation> moment_angles_vector(
+      model.moment_angles, model.moment_angles + model.n_sources);
+  std::vector<int> ix_receivers_vector, iz_receivers_vector;
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    ix_receivers_vector.push_back(planned_location(model.ix_receivers[i_receiver]));
+    iz_receivers_vector.push_back(planned_location(model.iz_receivers[i_receiver]));
+  }
+
+  parse_parameters(ix_sources_vector, iz_sources_vector, moment_angles_vector,
+                   ix_receivers_vector, iz_receivers_vector);
+
+  kernel_selection = model.kernel_selection;
+  allocate_memory();
+
+  initialize_arrays();
+
+  shot_batch_size = model.shot_batch_size;
+  shot_window_aperture =
+      static_cast<int>(std::ceil(model.shot_window_aperture * model.dx / dx));
+  active_region_tolerance = model.active_region_tolerance;
+  active_region_tile_size = model.active_region_tile_size;
+
+  // Both grids share the first grid point inside the absorbing boundary.
+#pragma omp parallel for collapse(2)
+  for (int ix = 0; ix < nx; ++ix)
+  {
+    for (int iz = 0; iz < nz; ++iz)
+    {
+      real_simulation x = model.np_boundary + (ix - np_boundary) * scale;
+      real_simulation z = model.np_boundary + (iz - np_boundary) * scale;
+      auto idx = linear_IDX(ix, iz, nx, nz);
+      vp[idx] = model.interpolate_field(model.vp, x, z);
+      vs[idx] = model.interpolate_field(model.vs, x, z);
+      rho[idx] = model.interpolate_field(model.rho, x, z);
+    }
+  }
+  update_from_velocity();
+
+  // Linearly interpolated signals. As for coarsening, seismograms are proportional
+  // to scale^-3 for a fixed moment.
+  auto resample_trace = [&](const real_simulation *trace, real_simulation *resampled) {
+    for (int it = 0; it < nt; ++it)
+    {
+      real_simulation t = std::min(it * dt / model.dt, real_simulation(model.nt - 1));
+      int it_model = std::min(int(t), model.nt - 2);
+      real_simulation w = t - it_model;
+      resampled[it] = (1 - w) * trace[it_model] + w * trace[it_model + 1];
+    }
+  };
+  for (int i_source = 0; i_source < n_sources; ++i_source)
+  {
+    resample_trace(model.stf + linear_IDX(i_source, 0, n_sources, model.nt),
+                   stf + linear_IDX(i_source, 0, n_sources, nt));
+    for (int i = 0; i < 2; ++i)
+    {
+      for (int j = 0; j < 2; ++j)
+      {
+        auto idx_mt = linear_IDX(i_source, i, j, n_sources, 2, 2);
+        moment[idx_mt] = model.moment[idx_mt] * scale * scale * scale;
+      }
+    }
+  }
+  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+  {
+    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+    {
+      auto idx_model = linear_IDX(i_shot, i_receiver, 0, n_shots, nr, model.nt);
+      auto idx = linear_IDX(i_shot, i_receiver, 0, n_shots, nr, nt);
+      resample_trace(model.rtf_ux_true + idx_model, rtf_ux_true + idx);
+      resample_trace(model.rtf_uz_true + idx_model, rtf_uz_true + idx);
+    }
+  }
+}
+
+fdModel::fdModel(const fdModel &model, const shot_window &window)
+    : nt(model.nt), nx_inner(window.ix_end - window.ix_start + 1),
+      nz_inner(model.nz_inner), nx_inner_boundary(0),
+      nz_inner_boundary(model.nz_inner_boundary), dx(model.dx), dz(model.dz),
+      dt(model.dt), np_boundary(model.np_boundary), np_factor(model.np_factor),
+      scalar_rho(model.scalar_rho), scalar_vp(model.scalar_vp),
+      scalar_vs(model.scalar_vs),
+      n_sources(int(model.which_source_to_fire_in_which_shot[window.i_shot].size())),
+      n_shots(1), which_source_to_fire_in_which_shot(1),
+      delay_cycles_per_shot(model.delay_cycles_per_shot),
+      peak_frequency(model.peak_frequency), t0(model.t0),
+      nr(int(window.receivers.size())), snapshot_interval(model.snapshot_interval),
+      basis_gridpoints_x(1), basis_gridpoints_z(1),
+      observed_data_folder(model.observed_data_folder), stf_folder(model.stf_folder)
+{
+  // Grid index x of this model corresponds to x + window.ix_start of the model.
+  const auto &shot_sources = model.which_source_to_fire_in_which_shot[window.i_shot];
+  std::vector<int> ix_sources_vector, iz_sources_vector;
+  std::vector<real_simulation> moment_angles_vector;
+  for (int i_source = 0; i_source < n_sources; ++i_source)
+  {
+    const int source = shot_sources[i_source];
+    ix_sources_vector.push_back(model.ix_sources[source] - model.np_boundary -
+                                window.ix_start);
+    iz_sources_vector.push_back(model.iz_sources[source] - model.np_boundary);
+    moment_angles_vector.push_back(model.moment_angles[source]);
+    which_source_to_fire_in_which_shot[0].push_back(i_source);
+  }
+  std::vector<int> ix_receivers_vector, iz_receivers_vector;
+  for (const auto &receiver : window.receivers)
+  {
+    ix_receivers_vector.push_back(model.ix_receivers[receiver] - model.np_boundary -
+                                  window.ix_start);
+    iz_receivers_vector.push_back(model.iz_receivers[receiver] - model.np_boundary);
+  }
+
+  parse_parameters(ix_sources_vector, iz_sources_vector, moment_angles_vector,
+                   ix_receivers_vector, iz_receivers_vector);
+
+  // The snapshot lattice is the part of the lattice of the model inside the window,
+  // so windowed kernels are the same quadrature as those of the model.
+  snapshot_stride_x = model.snapshot_stride_x;
+  snapshot_stride_z = model.snapshot_stride_z;
+  int x_begin, x_end, z_begin, z_end;
+  model.get_snapshot_cells(x_begin, x_end, z_begin, z_end);
+  snapshot_cells = {x_begin - window.ix_start, x_end - window.ix_start, z_begin, z_end};
+  kernel_frequencies = model.kernel_frequencies;
+  kernel_selection = model.kernel_selection;
+  allocate_memory();
+
+  initialize_arrays();
+
+  active_region_tolerance = model.active_region_tolerance;
+  active_region_tile_size = model.active_region_tile_size;
+
+  // The absorbing boundary of the window lies inside the grid of the model.
+#pragma omp parallel for collapse(2)
+  for (int ix = 0; ix < nx; ++ix)
+  {
+    for (int iz = 0; iz < nz; ++iz)
+    {
+      auto idx = linear_IDX(ix, iz, nx, nz);
+      auto idx_model = linear_IDX(ix + window.ix_start, iz, model.nx, model.nz);
+      vp[idx] = model.vp[idx_model];
+      vs[idx] = model.vs[idx_model];
+      rho[idx] = model.rho[idx_model];
+    }
+  }
+  update_from_velocity();
+
+  for (int i_source = 0; i_source < n_sources; ++i_source)
+  {
+    const int source = shot_sources[i_source];
+    std::copy(model.stf + linear_IDX(source, 0, model.n_sources, nt),
+              model.stf + linear_IDX(source + 1, 0, model.n_sources, nt),
+              stf + linear_IDX(i_source, 0, n_sources, nt));
+    std::copy(model.moment + linear_IDX(source, 0, 0, model.n_sources, 2, 2),
+              model.moment + linear_IDX(source + 1, 0, 0, model.n_sources, 2, 2),
+              moment + linear_IDX(i_source, 0, 0, n_sources, 2, 2));
+  }
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    auto idx_model = linear_IDX(window.i_shot, window.receivers[i_receiver], 0,
+                                model.n_shots, model.nr, nt);
+    auto idx = linear_IDX(0, i_receiver, 0, n_shots, nr, nt);
+    std::copy(model.rtf_ux_true + idx_model, model.rtf_ux_true + idx_model + nt,
+              rtf_ux_true + idx);
+    std::copy(model.rtf_uz_true + idx_model, model.rtf_uz_true + idx_model + nt,
+              rtf_uz_true + idx);
+  }
+}
+
 void fdModel::allocate_memory()
 {
   shape_grid = {nx, nz};
@@ -159,6 +557,8 @@ void fdModel::allocate_memory()
   allocate_array(vp_kernel, shape_grid);
   allocate_array(vs_kernel, shape_grid);
   allocate_array(density_v_kernel, shape_grid);
+  allocate_array(forward_illumination, shape_grid);
+  allocate_array(adjoint_illumination, shape_grid);
   allocate_array(starting_rho, shape_grid);
   allocate_array(starting_vp, shape_grid);
   allocate_array(starting_vs, shape_grid);
@@ -182,12 +582,176 @@ void fdModel::allocate_memory()
   allocate_array(a_stf_ux, shape_receivers);
   allocate_array(a_stf_uz, shape_receivers);
 
-  shape_accu = {n_shots, snapshots, nx, nz};
-  allocate_array(accu_vx, shape_accu);
-  allocate_array(accu_vz, shape_accu);
-  allocate_array(accu_txx, shape_accu);
-  allocate_array(accu_tzz, shape_accu);
-  allocate_array(accu_txz, shape_accu);
+  shape_encoded_receivers = {nr, nt};
+  allocate_array(rtf_ux_encoded, shape_encoded_receivers);
+  allocate_array(rtf_uz_encoded, shape_encoded_receivers);
+  allocate_array(rtf_ux_true_encoded, shape_encoded_receivers);
+  allocate_array(rtf_uz_true_encoded, shape_encoded_receivers);
+  allocate_array(a_stf_ux_encoded, shape_encoded_receivers);
+  allocate_array(a_stf_uz_encoded, shape_encoded_receivers);
+  encoding_polarities.assign(n_shots, real_simulation(1.0));
+  encoding_shifts.assign(n_shots, 0);
+
+  shape_trace_misfits = {n_shots, nr};
+  allocate_array(misfit_per_trace, shape_trace_misfits);
+  shape_shot_misfits = {n_shots};
+  allocate_array(misfit_per_shot, shape_shot_misfits);
+  shape_receiver_misfits = {nr};
+  allocate_array(misfit_per_receiver, shape_receiver_misfits);
+
+  allocate_snapshots();
+}
+
+void fdModel::allocate_snapshots()
+{
+  // Snapshot points in one direction: every grid point, or the centres of the cells
+  // of stride grid points that divide the grid points from begin to end, as far as
+  // they lie inside the inner boundary.
+  auto snapshot_points = [](int stride, int n, int begin, int end, int inner_begin,
+                            int inner_end, std::vector<int> &index,
+                            std::vector<real_simulation> &weight)
+  {
+    index.clear();
+    weight.clear();
+    if (stride == 1)
+    {
+      for (int i = 0; i < n; ++i)
+      {
+        index.push_back(i);
+        weight.push_back(1.0);
+      }
+      return;
+    }
+    for (int start = begin; start < end; start += stride)
+    {
+      const int width = std::min(stride, end - start);
+      const int centre = start + width / 2;
+      if (centre >= inner_begin and centre < inner_end)
+      {
+        index.push_back(centre);
+        weight.push_back(width);
+      }
+    }
+  };
+  int x_begin, x_end, z_begin, z_end;
+  get_snapshot_cells(x_begin, x_end, z_begin, z_end);
+  snapshot_points(snapshot_stride_x, nx, x_begin, x_end, np_boundary + nx_inner_boundary,
+                  np_boundary + nx_inner - nx_inner_boundary, snapshot_ix,
+                  snapshot_weight_x);
+  snapshot_points(snapshot_stride_z, nz, z_begin, z_end, np_boundary + nz_inner_boundary,
+                  np_boundary + nz_inner - nz_inner_boundary, snapshot_iz,
+                  snapshot_weight_z);
+  nx_snapshot = int(snapshot_ix.size());
+  nz_snapshot = int(snapshot_iz.size());
+
+  // With kernel frequencies accu_* hold the real and imaginary parts of the Fourier
+  // transforms of the forward fields instead of the snapshots.
+  const int n_frequencies = int(kernel_frequencies.size());
+  const real_simulation snapshot_dt = snapshot_interval * dt;
+  kernel_frequency_weights.resize(n_frequencies);
+  for (int i_frequency = 0; i_frequency < n_frequencies; ++i_frequency)
+  {
+    // Width of the band of the frequency, halfway to its neighbours.
+    real_simulation band = 1.0 / (snapshots * snapshot_dt);
+    if (n_frequencies > 1)
+    {
+      band = 0.5 * (kernel_frequencies[std::min(i_frequency + 1, n_frequencies - 1)] -
+                    kernel_frequencies[std::max(i_frequency - 1, 0)]);
+      if (i_frequency == 0 or i_frequency == n_frequencies - 1)
+      {
+        band *= 2.0;
+      }
+    }
+    // Negative frequencies mirror positive ones, except for zero and the Nyquist
+    // frequency.
+    const bool mirrored = kernel_frequencies[i_frequency] > 0.0 and
+                          kernel_frequencies[i_frequency] < (0.5 - 1e-9) / snapshot_dt;
+    kernel_frequency_weights[i_frequency] =
+        snapshot_dt * snapshot_dt * band * (mirrored ? 2.0 : 1.0);
+  }
+  transform_cos.resize(snapshots * n_frequencies);
+  transform_sin.resize(snapshots * n_frequencies);
+  for (int i_snapshot = 0; i_snapshot < snapshots; ++i_snapshot)
+  {
+    for (int i_frequency = 0; i_frequency < n_frequencies; ++i_frequency)
+    {
+      const real_simulation phase =
+          2.0 * M_PI * kernel_frequencies[i_frequency] * i_snapshot * snapshot_dt;
+      transform_cos[linear_IDX(i_snapshot, i_frequency, snapshots, n_frequencies)] =
+          std::cos(phase);
+      transform_sin[linear_IDX(i_snapshot, i_frequency, snapshots, n_frequencies)] =
+          std::sin(phase);
+    }
+  }
+
+  shape_accu = {snapshot_storage ? (shared_snapshot_slot ? 1 : n_shots) : 0,
+                n_frequencies > 0 ? 2 * n_frequencies : snapshots, nx_snapshot,
+                nz_snapshot};
+  // Fields the selected kernels do not need get no storage.
+  shape_unused_accu = {0, shape_accu[1], nx_snapshot, nz_snapshot};
+  const bool velocities = kernels_need_velocities();
+  const bool shear_stress = kernels_need_shear_stress();
+  accu_vx_storage =
+      allocate_shared_array(accu_vx, velocities ? shape_accu : shape_unused_accu);
+  accu_vz_storage =
+      allocate_shared_array(accu_vz, velocities ? shape_accu : shape_unused_accu);
+  accu_txx_storage = allocate_shared_array(accu_txx, shape_accu);
+  accu_tzz_storage = allocate_shared_array(accu_tzz, shape_accu);
+  accu_txz_storage =
+      allocate_shared_array(accu_txz, shear_stress ? shape_accu : shape_unused_accu);
+
+  shape_adjoint_transform = {2 * n_frequencies, nx_snapshot, nz_snapshot};
+  const std::vector<int> shape_unused_transform = {0};
+  allocate_array(adjoint_transform_vx,
+                 velocities ? shape_adjoint_transform : shape_unused_transform);
+  allocate_array(adjoint_transform_vz,
+                 velocities ? shape_adjoint_transform : shape_unused_transform);
+  allocate_array(adjoint_transform_txx, shape_adjoint_transform);
+  allocate_array(adjoint_transform_tzz, shape_adjoint_transform);
+  allocate_array(adjoint_transform_txz,
+                 shear_stress ? shape_adjoint_transform : shape_unused_transform);
+}
+
+void fdModel::get_snapshot_cells(int &x_begin, int &x_end, int &z_begin,
+                                 int &z_end) const
+{
+  if (snapshot_cells.empty())
+  {
+    x_begin = np_boundary + nx_inner_boundary;
+    x_end = x_begin + nx_free_parameters;
+    z_begin = np_boundary + nz_inner_boundary;
+    z_end = z_begin + nz_free_parameters;
+    return;
+  }
+  x_begin = snapshot_cells[0];
+  x_end = snapshot_cells[1];
+  z_begin = snapshot_cells[2];
+  z_end = snapshot_cells[3];
+}
+
+bool fdModel::kernels_need_velocities() const
+{
+  return kernel_selection & kernel_rho;
+}
+
+bool fdModel::kernels_need_shear_stress() const
+{
+  return kernel_selection & (kernel_vs | kernel_rho);
+}
+
+void fdModel::deallocate_snapshots()
+{
+  // Views of the snapshots may still share the arrays.
+  accu_vx_storage.reset();
+  accu_vz_storage.reset();
+  accu_txx_storage.reset();
+  accu_tzz_storage.reset();
+  accu_txz_storage.reset();
+  deallocate_array(adjoint_transform_vx);
+  deallocate_array(adjoint_transform_vz);
+  deallocate_array(adjoint_transform_txx);
+  deallocate_array(adjoint_transform_tzz);
+  deallocate_array(adjoint_transform_txz);
 }
 
 void fdModel::initialize_arrays()
@@ -300,6 +864,9 @@ void fdModel::initialize_arrays()
 
 void fdModel::copy_arrays(const fdModel &model)
 {
+  // Snapshots are only copied between models that both store them, as far as both
+  // have slots for them.
+  const int n_copied_shots = std::min(shape_accu[0], model.shape_accu[0]);
 
 #pragma omp parallel for collapse(2)
   for (int ix = 0; ix < nx; ix++)
@@ -326,24 +893,28 @@ void fdModel::copy_arrays(const fdModel &model)
       vp_kernel[idx] = model.vp_kernel[idx];
       vs_kernel[idx] = model.vs_kernel[idx];
       density_v_kernel[idx] = model.density_v_kernel[idx];
+      forward_illumination[idx] = model.forward_illumination[idx];
+      adjoint_illumination[idx] = model.adjoint_illumination[idx];
       starting_rho[idx] = model.starting_rho[idx];
       starting_vp[idx] = model.starting_vp[idx];
       starting_vs[idx] = model.starting_vs[idx];
       taper[idx] = model.taper[idx];
-
-#pragma omp parallel for collapse(2)
-      for (int i_shot = 0; i_shot < n_shots; i_shot++)
-      {
-        for (int i_snapshot = 0; i_snapshot < snapshots; i_snapshot++)
-        {
-          auto accu_idx = linear_IDX(i_shot, i_snapshot, ix, iz, n_shots, snapshots, nx, nz);
-          accu_vx[accu_idx] = model.accu_vx[accu_idx];
-          accu_vz[accu_idx] = model.accu_vz[accu_idx];
-          accu_txx[accu_idx] = model.accu_txx[accu_idx];
-          accu_tzz[accu_idx] = model.accu_tzz[accu_idx];
-          accu_txz[accu_idx] = model.accu_txz[accu_idx];
-        }
-      }
+    }
+  }
+#pragma omp parallel for collapse(1)
+  for (int accu_idx = 0;
+       accu_idx < n_copied_shots * shape_accu[1] * nx_snapshot * nz_snapshot; accu_idx++)
+  {
+    if (kernels_need_velocities())
+    {
+      accu_vx[accu_idx] = model.accu_vx[accu_idx];
+      accu_vz[accu_idx] = model.accu_vz[accu_idx];
+    }
+    accu_txx[accu_idx] = model.accu_txx[accu_idx];
+    accu_tzz[accu_idx] = model.accu_tzz[accu_idx];
+    if (kernels_need_shear_stress())
+    {
+      accu_txz[accu_idx] = model.accu_txz[accu_idx];
     }
   }
 #pragma omp parallel for collapse(1)
@@ -385,6 +956,47 @@ void fdModel::copy_arrays(const fdModel &model)
       }
     }
   }
+#pragma omp parallel for collapse(2)
+  for (int ir = 0; ir < nr; ir++)
+  {
+    for (int it = 0; it < nt; it++)
+    {
+      auto idx = linear_IDX(ir, it, nr, nt);
+      rtf_ux_encoded[idx] = model.rtf_ux_encoded[idx];
+      rtf_uz_encoded[idx] = model.rtf_uz_encoded[idx];
+      rtf_ux_true_encoded[idx] = model.rtf_ux_true_encoded[idx];
+      rtf_uz_true_encoded[idx] = model.rtf_uz_true_encoded[idx];
+      a_stf_ux_encoded[idx] = model.a_stf_ux_encoded[idx];
+      a_stf_uz_encoded[idx] = model.a_stf_uz_encoded[idx];
+    }
+  }
+  for (int i_shot = 0; i_shot < n_shots; i_shot++)
+  {
+    misfit_per_shot[i_shot] = model.misfit_per_shot[i_shot];
+    for (int ir = 0; ir < nr; ir++)
+    {
+      auto idx = linear_IDX(i_shot, ir, n_shots, nr);
+      misfit_per_trace[idx] = model.misfit_per_trace[idx];
+    }
+  }
+  for (int ir = 0; ir < nr; ir++)
+  {
+    misfit_per_receiver[ir] = model.misfit_per_receiver[ir];
+  }
+  encoding_polarities = model.encoding_polarities;
+  encoding_shifts = model.encoding_shifts;
+  encoding_generator = model.encoding_generator;
+  shot_batch_size = model.shot_batch_size;
+  shot_window_aperture = model.shot_window_aperture;
+  basis = model.basis;
+  basis_transpose = model.basis_transpose;
+  basis_average = model.basis_average;
+  free_parameters = model.free_parameters;
+  wavefield_output = model.wavefield_output;
+  step_callback = model.step_callback;
+  step_callback_interval = model.step_callback_interval;
+  active_region_tolerance = model.active_region_tolerance;
+  active_region_tile_size = model.active_region_tile_size;
 }
 
 void fdModel::parse_parameters(const std::vector<int> ix_sources_vector,
@@ -403,8 +1015,17 @@ void fdModel::parse_parameters(const std::vector<int> ix_sources_vector,
   // Basis functions
   assert(nx_free_parameters % basis_gridpoints_x == 0 and
          nz_free_parameters % basis_gridpoints_z == 0);
-  free_parameters = 3 * nx_free_parameters * nz_free_parameters /
-                    (basis_gridpoints_x * basis_gridpoints_z);
+  free_grid_points.clear();
+  for (int ix = 0; ix < nx_free_parameters; ++ix)
+  {
+    for (int iz = 0; iz < nz_free_parameters; ++iz)
+    {
+      free_grid_points.push_back(linear_IDX(ix + nx_inner_boundary + np_boundary,
+                                            iz + nz_inner_boundary + np_boundary, nx,
+                                            nz));
+    }
+  }
+  set_basis(block_basis());
 
   // Parse source setup.
   ix_sources = new int[n_sources];
@@ -526,21 +1147,14 @@ void fdModel::parse_configuration_file(const char *configuration_file_relative_p
 void fdModel::forward_simulate(int i_shot, bool store_fields, bool verbose,
                                bool output_wavefields)
 {
-// Set dynamic physical fields to zero to reflect initial conditions.
-#pragma omp parallel for collapse(2)
-  for (int ix = 0; ix < nx; ++ix)
+  if (store_fields)
   {
-    for (int iz = 0; iz < nz; ++iz)
-    {
-      auto idx = linear_IDX(ix, iz, nx, nz);
-      vx[idx] = 0.0;
-      vz[idx] = 0.0;
-      txx[idx] = 0.0;
-      tzz[idx] = 0.0;
-      txz[idx] = 0.0;
-    }
+    require_snapshot_storage();
   }
 
+  // Set dynamic physical fields to zero to reflect initial conditions.
+  reset_wavefields();
+
   // If verbose, clock time of modelling.
   double startTime = 0, stopTime = 0, secsElapsed = 0;
   if (verbose)
@@ -548,261 +1162,570 @@ void fdModel::forward_simulate(int i_shot, bool store_fields, bool verbose,
     startTime = real_simulation(omp_get_wtime());
   }
 
+  // Pointers to the traces of this shot.
+  real_simulation *shot_ux = rtf_ux + linear_IDX(i_shot, 0, 0, n_shots, nr, nt);
+  real_simulation *shot_uz = rtf_uz + linear_IDX(i_shot, 0, 0, n_shots, nr, nt);
+
+  std::unique_ptr<wavefield_writer> writer;
+  if (output_wavefields)
+  {
+    writer.reset(new wavefield_writer(wavefield_output, nx, nz, dt, dx, dz));
+  }
+
   // Time-loop starts here
   for (int it = 0; it < nt; ++it)
   {
-    // Take wavefield snapshot at requited intervals.
-    if (it % snapshot_interval == 0 and store_fields)
+    forward_time_step(i_shot, it, store_fields, shot_ux, shot_uz);
+
+    // Hand the wavefields to the background writer.
+    if (writer and it % wavefield_output.interval == 0)
     {
-#pragma omp parallel for collapse(2)
-      for (int ix = 0; ix < nx; ++ix)
-      {
-        for (int iz = 0; iz < nz; ++iz)
-        {
-          auto idx_grid = linear_IDX(ix, iz, nx, nz);
-          auto idx_accu = linear_IDX(i_shot, it / snapshot_interval, ix, iz, n_shots, snapshots, nx, nz);
-
-          accu_vx[idx_accu] = vx[idx_grid];
-          accu_vz[idx_accu] = vz[idx_grid];
-          accu_txx[idx_accu] = txx[idx_grid];
-          accu_txz[idx_accu] = txz[idx_grid];
-          accu_tzz[idx_accu] = tzz[idx_grid];
-        }
-      }
+      writer->push(i_shot, it, vx, vz, txx, tzz, txz);
     }
+  }
 
-// Record seismograms by integrating velocity into displacement for every
-// time-step.
-#pragma omp parallel for collapse(1)
-    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
-    {
-      auto idx_rtf = linear_IDX(i_shot, i_receiver, it, n_shots, nr, nt);
-      auto idx_loc = linear_IDX(ix_receivers[i_receiver], iz_receivers[i_receiver], nx, nz);
+  if (writer)
+  {
+    writer->finish();
+  }
 
-      if (it == 0)
-      {
-        rtf_ux[idx_rtf] = dt * vx[idx_loc] / (dx * dz);
-        rtf_uz[idx_rtf] = dt * vz[idx_loc] / (dx * dz);
+  // Output timing if verbose.
+  if (verbose)
+  {
+    stopTime = omp_get_wtime();
+    secsElapsed = stopTime - startTime;
+    std::cout << "Seconds elapsed for forward wave simulation: " << secsElapsed
+              << std::endl;
+  }
+}
+
+void fdModel::forward_time_step(int i_shot, int it, bool store_fields,
+                                real_simulation *shot_ux, real_simulation *shot_uz)
+{
+  // Take wavefield snapshot at requited intervals.
+  if (it % snapshot_interval == 0 and store_fields)
+  {
+    store_snapshot(snapshot_slot(i_shot), it / snapshot_interval);
+  }
+
+  // Record seismograms by integrating velocity into displacement for every
+  // time-step.
+  record_receivers(shot_ux, shot_uz, it);
+
+  // Time integrate dynamic fields for stress and velocity.
+  update_stresses(dt);
+  update_velocities(dt);
+
+  // Inject sources at appropriate location and times.
+  for (const auto &i_source : which_source_to_fire_in_which_shot[i_shot])
+  {
+    inject_source(i_source, it, 1.0);
+  }
+}
+
+void fdModel::require_snapshot_storage() const
+{
+  if (!snapshot_storage)
+  {
+    throw std::invalid_argument("This model was created without snapshot storage.");
+  }
+}
+
+void fdModel::share_snapshot_slot()
+{
+  snapshot_storage = true;
+  shared_snapshot_slot = true;
+
+  deallocate_snapshots();
+  allocate_snapshots();
+}
+
+int fdModel::snapshot_slot(int i_shot) const { return shared_snapshot_slot ? 0 : i_shot; }
+
+void fdModel::begin_forward_simulation(int i_shot, bool store_fields)
+{
+  if (store_fields)
+  {
+    require_snapshot_storage();
+  }
+  if (i_shot < 0 or i_shot >= n_shots)
+  {
+    throw std::invalid_argument("Shot index out of range.");
+  }
+  reset_wavefields();
+  stepping_shot = i_shot;
+  stepping_time_step = 0;
+  stepping_store_fields = store_fields;
+}
+
+int fdModel::step(int n_steps)
+{
+  if (stepping_shot < 0)
+  {
+    throw std::invalid_argument("No simulation was started with "
+                                "begin_forward_simulation().");
+  }
+
+  real_simulation *shot_ux = rtf_ux + linear_IDX(stepping_shot, 0, 0, n_shots, nr, nt);
+  real_simulation *shot_uz = rtf_uz + linear_IDX(stepping_shot, 0, 0, n_shots, nr, nt);
+
+  for (int i_step = 0; i_step < n_steps and stepping_time_step < nt; ++i_step)
+  {
+    forward_time_step(stepping_shot, stepping_time_step, stepping_store_fields, shot_ux,
+                      shot_uz);
+    stepping_time_step++;
+
+    if (step_callback and step_callback_interval > 0 and
+        stepping_time_step % step_callback_interval == 0)
+    {
+      if (!step_callback(stepping_shot, stepping_time_step))
+      {
+        break;
       }
-      else
+    }
+  }
+  return stepping_time_step;
+}
+
+bool fdModel::simulation_finished() const
+{
+  return stepping_shot < 0 or stepping_time_step >= nt;
+}
+
+void fdModel::forward_simulate_batch(const std::vector<int> &shots, bool store_fields,
+                                     bool verbose)
+{
+  if (store_fields)
+  {
+    require_snapshot_storage();
+    if (shared_snapshot_slot and shots.size() > 1)
+    {
+      throw std::invalid_argument(
+          "Batched shots cannot store fields in a shared snapshot slot.");
+    }
+  }
+  for (const auto &i_shot : shots)
+  {
+    if (i_shot < 0 or i_shot >= n_shots)
+    {
+      throw std::invalid_argument("Shot index in batch is out of range.");
+    }
+  }
+
+  double startTime = 0, stopTime = 0, secsElapsed = 0;
+  if (verbose)
+  {
+    startTime = real_simulation(omp_get_wtime());
+  }
+
+  // Simulate in batches of at most 8 shots, using the narrowest lane width that
+  // fits the batch.
+  for (size_t i_first = 0; i_first < shots.size(); i_first += 8)
+  {
+    std::vector<int> batch(shots.begin() + i_first,
+                           shots.begin() + std::min(shots.size(), i_first + 8));
+    if (batch.size() == 1)
+    {
+      forward_simulate(batch[0], store_fields, false);
+    }
+    else if (batch.size() <= 2)
+    {
+      forward_simulate_lanes<2>(batch, store_fields);
+    }
+    else if (batch.size() <= 4)
+    {
+      forward_simulate_lanes<4>(batch, store_fields);
+    }
+    else
+    {
+      forward_simulate_lanes<8>(batch, store_fields);
+    }
+  }
+
+  if (verbose)
+  {
+    stopTime = omp_get_wtime();
+    secsElapsed = stopTime - startTime;
+    std::cout << "Seconds elapsed for batched forward wave simulation of "
+              << shots.size() << " shots: " << secsElapsed << std::endl;
+  }
+}
+
+template <int lanes>
+void fdModel::forward_simulate_lanes(const std::vector<int> &shots, bool store_fields)
+{
+  const int n_batch = shots.size();
+
+  // Dynamic fields with the shot as innermost dimension, such that one SIMD lane
+  // is one shot. Unused lanes stay zero.
+  std::vector<int> shape_batch = {nx, nz, lanes};
+  real_simulation *batch_vx, *batch_vz, *batch_txx, *batch_tzz, *batch_txz;
+  allocate_array(batch_vx, shape_batch);
+  allocate_array(batch_vz, shape_batch);
+  allocate_array(batch_txx, shape_batch);
+  allocate_array(batch_tzz, shape_batch);
+  allocate_array(batch_txz, shape_batch);
+
+#pragma omp parallel for collapse(1)
+  for (int idx = 0; idx < nx * nz * lanes; ++idx)
+  {
+    batch_vx[idx] = 0.0;
+    batch_vz[idx] = 0.0;
+    batch_txx[idx] = 0.0;
+    batch_tzz[idx] = 0.0;
+    batch_txz[idx] = 0.0;
+  }
+
+  for (int it = 0; it < nt; ++it)
+  {
+    // Scatter the lanes into the snapshots of their shots.
+    if (it % snapshot_interval == 0 and store_fields)
+    {
+#pragma omp parallel for collapse(2)
+      for (int ix = 0; ix < nx_snapshot; ++ix)
+      {
+        for (int iz = 0; iz < nz_snapshot; ++iz)
+        {
+          auto idx_grid = linear_IDX(snapshot_ix[ix], snapshot_iz[iz], nx, nz);
+          for (int lane = 0; lane < n_batch; ++lane)
+          {
+            auto idx_lane = idx_grid * lanes + lane;
+            store_snapshot_point(snapshot_slot(shots[lane]), it / snapshot_interval,
+                                 ix, iz, batch_vx[idx_lane], batch_vz[idx_lane],
+                                 batch_txx[idx_lane], batch_tzz[idx_lane],
+                                 batch_txz[idx_lane]);
+          }
+        }
+      }
+    }
+
+    // Record seismograms of every lane.
+#pragma omp parallel for collapse(2)
+    for (int lane = 0; lane < n_batch; ++lane)
+    {
+      for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
       {
-        auto idx_rtf_t_min_1 = linear_IDX(i_shot, i_receiver, it - 1, n_shots, nr, nt);
+        auto idx_rtf = linear_IDX(shots[lane], i_receiver, it, n_shots, nr, nt);
+        auto idx_lane =
+            linear_IDX(ix_receivers[i_receiver], iz_receivers[i_receiver], nx, nz) *
+                lanes +
+            lane;
 
-        rtf_ux[idx_rtf] =
-            rtf_ux[idx_rtf_t_min_1] + dt * vx[idx_loc] / (dx * dz);
-        rtf_uz[idx_rtf] =
-            rtf_uz[idx_rtf_t_min_1] + dt * vz[idx_loc] / (dx * dz);
+        if (it == 0)
+        {
+          rtf_ux[idx_rtf] = dt * batch_vx[idx_lane] / (dx * dz);
+          rtf_uz[idx_rtf] = dt * batch_vz[idx_lane] / (dx * dz);
+        }
+        else
+        {
+          rtf_ux[idx_rtf] = rtf_ux[idx_rtf - 1] + dt * batch_vx[idx_lane] / (dx * dz);
+          rtf_uz[idx_rtf] = rtf_uz[idx_rtf - 1] + dt * batch_vz[idx_lane] / (dx * dz);
+        }
       }
     }
 
-// Time integrate dynamic fields for stress ...
+    // Time integrate stress; the static fields are loaded once for all lanes.
 #pragma omp parallel for collapse(2)
     for (int ix = 2; ix < nx - 2; ++ix)
     {
       for (int iz = 2; iz < nz - 2; ++iz)
       {
-
         int idx = linear_IDX(ix, iz, nx, nz);
-        int idx_xp1 = linear_IDX(ix + 1, iz, nx, nz);
-        int idx_xp2 = linear_IDX(ix + 2, iz, nx, nz);
-        int idx_xm1 = linear_IDX(ix - 1, iz, nx, nz);
-        int idx_xm2 = linear_IDX(ix - 2, iz, nx, nz);
-        int idx_zm1 = linear_IDX(ix, iz - 1, nx, nz);
-        int idx_zm2 = linear_IDX(ix, iz - 2, nx, nz);
-        int idx_zp1 = linear_IDX(ix, iz + 1, nx, nz);
-        int idx_zp2 = linear_IDX(ix, iz + 2, nx, nz);
-
-        txx[idx] =
-            taper[idx] *
-            (txx[idx] + dt * (lm[idx] *
-                                  (c1 * (vx[idx_xp1] - vx[idx]) +
-                                   c2 * (vx[idx_xm1] - vx[idx_xp2])) /
-                                  dx +
-                              la[idx] *
-                                  (c1 * (vz[idx] - vz[idx_zm1]) +
-                                   c2 * (vz[idx_zm2] - vz[idx_zp1])) /
-                                  dz));
-        tzz[idx] =
-            taper[idx] *
-            (tzz[idx] + dt * (la[idx] *
-                                  (c1 * (vx[idx_xp1] - vx[idx]) +
-                                   c2 * (vx[idx_xm1] - vx[idx_xp2])) /
-                                  dx +
-                              (lm[idx]) *
-                                  (c1 * (vz[idx] - vz[idx_zm1]) +
-                                   c2 * (vz[idx_zm2] - vz[idx_zp1])) /
-                                  dz));
-        txz[idx] = taper[idx] *
-                   (txz[idx] + dt * mu[idx] *
-                                   ((c1 * (vx[idx_zp1] - vx[idx]) +
-                                     c2 * (vx[idx_zm1] - vx[idx_zp2])) /
-                                        dz +
-                                    (c1 * (vz[idx] - vz[idx_xm1]) +
-                                     c2 * (vz[idx_xm2] - vz[idx_xp1])) /
-                                        dx));
+        int idx_xp1 = linear_IDX(ix + 1, iz, nx, nz) * lanes;
+        int idx_xp2 = linear_IDX(ix + 2, iz, nx, nz) * lanes;
+        int idx_xm1 = linear_IDX(ix - 1, iz, nx, nz) * lanes;
+        int idx_xm2 = linear_IDX(ix - 2, iz, nx, nz) * lanes;
+        int idx_zm1 = linear_IDX(ix, iz - 1, nx, nz) * lanes;
+        int idx_zm2 = linear_IDX(ix, iz - 2, nx, nz) * lanes;
+        int idx_zp1 = linear_IDX(ix, iz + 1, nx, nz) * lanes;
+        int idx_zp2 = linear_IDX(ix, iz + 2, nx, nz) * lanes;
+
+        const real_simulation taper_point = taper[idx];
+        const real_simulation lm_point = lm[idx];
+        const real_simulation la_point = la[idx];
+        const real_simulation mu_point = mu[idx];
+
+        real_simulation *txx_point = batch_txx + idx * lanes;
+        real_simulation *tzz_point = batch_tzz + idx * lanes;
+        real_simulation *txz_point = batch_txz + idx * lanes;
+        const real_simulation *vx_point = batch_vx + idx * lanes;
+        const real_simulation *vz_point = batch_vz + idx * lanes;
+
+#pragma omp simd
+        for (int lane = 0; lane < lanes; ++lane)
+        {
+          txx_point[lane] =
+              taper_point *
+              (txx_point[lane] +
+               dt * (lm_point *
+                         (c1 * (batch_vx[idx_xp1 + lane] - vx_point[lane]) +
+                          c2 * (batch_vx[idx_xm1 + lane] - batch_vx[idx_xp2 + lane])) /
+                         dx +
+                     la_point *
+                         (c1 * (vz_point[lane] - batch_vz[idx_zm1 + lane]) +
+                          c2 * (batch_vz[idx_zm2 + lane] - batch_vz[idx_zp1 + lane])) /
+                         dz));
+          tzz_point[lane] =
+              taper_point *
+              (tzz_point[lane] +
+               dt * (la_point *
+                         (c1 * (batch_vx[idx_xp1 + lane] - vx_point[lane]) +
+                          c2 * (batch_vx[idx_xm1 + lane] - batch_vx[idx_xp2 + lane])) /
+                         dx +
+                     (lm_point) *
+                         (c1 * (vz_point[lane] - batch_vz[idx_zm1 + lane]) +
+                          c2 * (batch_vz[idx_zm2 + lane] - batch_vz[idx_zp1 + lane])) /
+                         dz));
+          txz_point[lane] =
+              taper_point *
+              (txz_point[lane] +
+               dt * mu_point *
+                   ((c1 * (batch_vx[idx_zp1 + lane] - vx_point[lane]) +
+                     c2 * (batch_vx[idx_zm1 + lane] - batch_vx[idx_zp2 + lane])) /
+                        dz +
+                    (c1 * (vz_point[lane] - batch_vz[idx_xm1 + lane]) +
+                     c2 * (batch_vz[idx_xm2 + lane] - batch_vz[idx_xp1 + lane])) /
+                        dx));
+        }
       }
     }
-// ... and time integrate dynamic fields for velocity.
+
+    // Time integrate velocity.
 #pragma omp parallel for collapse(2)
     for (int ix = 2; ix < nx - 2; ++ix)
     {
       for (int iz = 2; iz < nz - 2; ++iz)
       {
         int idx = linear_IDX(ix, iz, nx, nz);
-        int idx_xp1 = linear_IDX(ix + 1, iz, nx, nz);
-        int idx_xp2 = linear_IDX(ix + 2, iz, nx, nz);
-        int idx_xm1 = linear_IDX(ix - 1, iz, nx, nz);
-        int idx_xm2 = linear_IDX(ix - 2, iz, nx, nz);
-        int idx_zm1 = linear_IDX(ix, iz - 1, nx, nz);
-        int idx_zm2 = linear_IDX(ix, iz - 2, nx, nz);
-        int idx_zp1 = linear_IDX(ix, iz + 1, nx, nz);
-        int idx_zp2 = linear_IDX(ix, iz + 2, nx, nz);
-
-        vx[idx] = taper[idx] *
-                  (vx[idx] + b_vx[idx] * dt *
-                                 ((c1 * (txx[idx] - txx[idx_xm1]) +
-                                   c2 * (txx[idx_xm2] - txx[idx_xp1])) /
-                                      dx +
-                                  (c1 * (txz[idx] - txz[idx_zm1]) +
-                                   c2 * (txz[idx_zm2] - txz[idx_zp1])) /
-                                      dz));
-        vz[idx] = taper[idx] *
-                  (vz[idx] + b_vz[idx] * dt *
-                                 ((c1 * (txz[idx_xp1] - txz[idx]) +
-                                   c2 * (txz[idx_xm1] - txz[idx_xp2])) /
-                                      dx +
-                                  (c1 * (tzz[idx_zp1] - tzz[idx]) +
-                                   c2 * (tzz[idx_zm1] - tzz[idx_zp2])) /
-                                      dz));
+        int idx_xp1 = linear_IDX(ix + 1, iz, nx, nz) * lanes;
+        int idx_xp2 = linear_IDX(ix + 2, iz, nx, nz) * lanes;
+        int idx_xm1 = linear_IDX(ix - 1, iz, nx, nz) * lanes;
+        int idx_xm2 = linear_IDX(ix - 2, iz, nx, nz) * lanes;
+        int idx_zm1 = linear_IDX(ix, iz - 1, nx, nz) * lanes;
+        int idx_zm2 = linear_IDX(ix, iz - 2, nx, nz) * lanes;
+        int idx_zp1 = linear_IDX(ix, iz + 1, nx, nz) * lanes;
+        int idx_zp2 = linear_IDX(ix, iz + 2, nx, nz) * lanes;
+
+        const real_simulation taper_point = taper[idx];
+        const real_simulation b_vx_point = b_vx[idx];
+        const real_simulation b_vz_point = b_vz[idx];
+
+        real_simulation *vx_point = batch_vx + idx * lanes;
+        real_simulation *vz_point = batch_vz + idx * lanes;
+        const real_simulation *txx_point = batch_txx + idx * lanes;
+        const real_simulation *tzz_point = batch_tzz + idx * lanes;
+        const real_simulation *txz_point = batch_txz + idx * lanes;
+
+#pragma omp simd
+        for (int lane = 0; lane < lanes; ++lane)
+        {
+          vx_point[lane] =
+              taper_point *
+              (vx_point[lane] +
+               b_vx_point * dt *
+                   ((c1 * (txx_point[lane] - batch_txx[idx_xm1 + lane]) +
+                     c2 * (batch_txx[idx_xm2 + lane] - batch_txx[idx_xp1 + lane])) /
+                        dx +
+                    (c1 * (txz_point[lane] - batch_txz[idx_zm1 + lane]) +
+                     c2 * (batch_txz[idx_zm2 + lane] - batch_txz[idx_zp1 + lane])) /
+                        dz));
+          vz_point[lane] =
+              taper_point *
+              (vz_point[lane] +
+               b_vz_point * dt *
+                   ((c1 * (batch_txz[idx_xp1 + lane] - txz_point[lane]) +
+                     c2 * (batch_txz[idx_xm1 + lane] - batch_txz[idx_xp2 + lane])) /
+                        dx +
+                    (c1 * (batch_tzz[idx_zp1 + lane] - tzz_point[lane]) +
+                     c2 * (batch_tzz[idx_zm1 + lane] - batch_tzz[idx_zp2 + lane])) /
+                        dz));
+        }
       }
     }
 
-    // Inject sources at appropriate location and times.
-    for (const auto &i_source : which_source_to_fire_in_which_shot[i_shot])
+    // Inject the sources of every shot into its own lane.
+    for (int lane = 0; lane < n_batch; ++lane)
+    {
+      for (const auto &i_source : which_source_to_fire_in_which_shot[shots[lane]])
+      {
+        inject_source(i_source, it, 1.0, batch_vx, batch_vz, lanes, lane);
+      }
+    }
+  }
+
+  deallocate_array(batch_vx);
+  deallocate_array(batch_vz);
+  deallocate_array(batch_txx);
+  deallocate_array(batch_tzz);
+  deallocate_array(batch_txz);
+}
+
+void fdModel::reciprocal_simulate(bool verbose)
+{
+  double startTime = 0, stopTime = 0, secsElapsed = 0;
+  if (verbose)
+  {
+    startTime = real_simulation(omp_get_wtime());
+  }
+
+  // Length of the zero padded convolution
+  const int n_fft = 2 * nt;
+
+  // Spectra of the source time functions, shared by all receivers.
+  std::vector<std::vector<std::complex<real_simulation>>> stf_spectra(n_sources);
+#pragma omp parallel for
+  for (int i_source = 0; i_source < n_sources; ++i_source)
+  {
+    Eigen::FFT<real_simulation> fft;
+    std::vector<real_simulation> padded(n_fft, 0.0);
+    for (int it = 0; it < nt; ++it)
     {
-      // Don't parallelize in assignment! Creates race condition
-      // |-inject source
-      // | (x,x)-couple
-      auto idx_mt = linear_IDX(i_source, 0, 0, n_sources, 2, 2);
-
-      auto idx_stf = linear_IDX(i_source, it, n_sources, nt);
-
-      auto idx = linear_IDX(ix_sources[i_source], iz_sources[i_source], nx, nz);
-
-      auto idx_xm1 = linear_IDX(ix_sources[i_source] - 1, iz_sources[i_source], nx, nz);
-      auto idx_zm1 = linear_IDX(ix_sources[i_source], iz_sources[i_source] - 1, nx, nz);
-
-      auto idx_xp1 = linear_IDX(ix_sources[i_source] + 1, iz_sources[i_source], nx, nz);
-      auto idx_zp1 = linear_IDX(ix_sources[i_source], iz_sources[i_source] + 1, nx, nz);
-
-      auto idx_xp1zm1 = linear_IDX(ix_sources[i_source] + 1, iz_sources[i_source] - 1, nx, nz);
-      auto idx_xm1zp1 = linear_IDX(ix_sources[i_source] - 1, iz_sources[i_source] + 1, nx, nz);
-      auto idx_xm1zm1 = linear_IDX(ix_sources[i_source] - 1, iz_sources[i_source] - 1, nx, nz);
-
-      vx[idx_xm1] -=
-          moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_xm1] / (dx * dx * dx * dx);
-      vx[idx] +=
-          moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx] / (dx * dx * dx * dx);
-
-      // | (z,z)-couple
-      idx_mt = linear_IDX(i_source, 1, 1, n_sources, 2, 2);
-      vz[idx_zm1] -=
-          moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_zm1] / (dz * dz * dz * dz);
-      vz[idx] +=
-          moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx] / (dz * dz * dz * dz);
-
-      // | (x,z)-couple
-      idx_mt = linear_IDX(i_source, 0, 1, n_sources, 2, 2);
-      vx[idx_xm1zp1] +=
-          0.25 * moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_xm1zp1] /
-          (dx * dx * dx * dx);
-      vx[idx_zp1] +=
-          0.25 * moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_zp1] / (dx * dx * dx * dx);
-      vx[idx_xm1zm1] -=
-          0.25 * moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_xm1zm1] /
-          (dx * dx * dx * dx);
-      vx[idx_zm1] -=
-          0.25 * moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_zm1] / (dx * dx * dx * dx);
-
-      // | (z,x)-couple
-      idx_mt = linear_IDX(i_source, 1, 0, n_sources, 2, 2);
-      vz[idx_xp1zm1] +=
-          0.25 * moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_xp1zm1] /
-          (dz * dz * dz * dz);
-      vz[idx_xp1] +=
-          0.25 * moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_xp1] / (dz * dz * dz * dz);
-      vz[idx_xm1zm1] -=
-          0.25 * moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_xm1zm1] /
-          (dz * dz * dz * dz);
-      vz[idx_xm1] -=
-          0.25 * moment[idx_mt] * stf[idx_stf] * dt *
-          b_vz[idx_xm1] / (dz * dz * dz * dz);
-    }
-
-    if (it % 10 == 0 and output_wavefields)
-    {
-      // Write wavefields
-      std::string filename_vp = "snapshots/vx" + zero_pad_number(it, 5) + ".txt";
-      std::string filename_vs = "snapshots/vz" + zero_pad_number(it, 5) + ".txt";
-
-      std::ofstream file_vx(filename_vp);
-      std::ofstream file_vz(filename_vs);
-
-      for (int ix = 0; ix < nx; ++ix)
+      padded[it] = stf[linear_IDX(i_source, it, n_sources, nt)];
+    }
+    fft.fwd(stf_spectra[i_source], padded);
+  }
+
+  // Strain rate readings per source, moment tensor component and time step.
+  std::vector<int> shape_readings = {n_sources, 4, nt};
+  real_simulation *readings;
+  allocate_array(readings, shape_readings);
+
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    for (int component = 0; component < 2; ++component)
+    {
+      auto idx_receiver =
+          linear_IDX(ix_receivers[i_receiver], iz_receivers[i_receiver], nx, nz);
+      real_simulation *field = component == 0 ? vx : vz;
+      real_simulation *buoyancy = component == 0 ? b_vx : b_vz;
+
+      reset_wavefields();
+
+      for (int it = 0; it < nt; ++it)
       {
-        for (int iz = 0; iz < nz; ++iz)
+        // Read the transposed source injection stencils at every source.
+        for (int i_source = 0; i_source < n_sources; ++i_source)
         {
+          auto ix = ix_sources[i_source];
+          auto iz = iz_sources[i_source];
+
           auto idx = linear_IDX(ix, iz, nx, nz);
+          auto idx_xm1 = linear_IDX(ix - 1, iz, nx, nz);
+          auto idx_zm1 = linear_IDX(ix, iz - 1, nx, nz);
+          auto idx_xp1 = linear_IDX(ix + 1, iz, nx, nz);
+          auto idx_zp1 = linear_IDX(ix, iz + 1, nx, nz);
+          auto idx_xp1zm1 = linear_IDX(ix + 1, iz - 1, nx, nz);
+          auto idx_xm1zp1 = linear_IDX(ix - 1, iz + 1, nx, nz);
+          auto idx_xm1zm1 = linear_IDX(ix - 1, iz - 1, nx, nz);
+
+          // The forward injection scales horizontal velocities with b_vz, which
+          // is undone here to obtain the equivalent force.
+          // | (x,x)-couple
+          readings[linear_IDX(i_source, 0, it, n_sources, 4, nt)] =
+              (vx[idx] * b_vz[idx] / b_vx[idx] -
+               vx[idx_xm1] * b_vz[idx_xm1] / b_vx[idx_xm1]) /
+              (dx * dx * dx * dx);
+          // | (x,z)-couple
+          readings[linear_IDX(i_source, 1, it, n_sources, 4, nt)] =
+              0.25 *
+              (vx[idx_xm1zp1] * b_vz[idx_xm1zp1] / b_vx[idx_xm1zp1] +
+               vx[idx_zp1] * b_vz[idx_zp1] / b_vx[idx_zp1] -
+               vx[idx_xm1zm1] * b_vz[idx_xm1zm1] / b_vx[idx_xm1zm1] -
+               vx[idx_zm1] * b_vz[idx_zm1] / b_vx[idx_zm1]) /
+              (dx * dx * dx * dx);
+          // | (z,x)-couple
+          readings[linear_IDX(i_source, 2, it, n_sources, 4, nt)] =
+              0.25 * (vz[idx_xp1zm1] + vz[idx_xp1] - vz[idx_xm1zm1] - vz[idx_xm1]) /
+              (dz * dz * dz * dz);
+          // | (z,z)-couple
+          readings[linear_IDX(i_source, 3, it, n_sources, 4, nt)] =
+              (vz[idx] - vz[idx_zm1]) / (dz * dz * dz * dz);
+        }
+
+        update_stresses(dt);
+        update_velocities(dt);
+
+        // Impulsive point force at the receiver, with the receiver's scaling.
+        if (it == 0)
+        {
+          activate_point(ix_receivers[i_receiver], iz_receivers[i_receiver]);
+          field[idx_receiver] += dt * buoyancy[idx_receiver] / (dx * dz);
+        }
+      }
+
+      // Contract every source's readings with its moment tensor, integrate to
+      // displacement and convolve with its source time function.
+      std::vector<std::vector<real_simulation>> traces(n_sources);
+#pragma omp parallel for
+      for (int i_source = 0; i_source < n_sources; ++i_source)
+      {
+        Eigen::FFT<real_simulation> fft;
+        std::vector<real_simulation> green(n_fft, 0.0);
+        real_simulation integrated = 0.0;
+        for (int it = 0; it < nt; ++it)
+        {
+          real_simulation strain_rate = 0.0;
+          for (int m = 0; m < 4; ++m)
+          {
+            strain_rate += moment[linear_IDX(i_source, m / 2, m % 2, n_sources, 2, 2)] *
+                           readings[linear_IDX(i_source, m, it, n_sources, 4, nt)];
+          }
+          integrated += dt * strain_rate;
+          green[it] = integrated;
+        }
+
+        std::vector<std::complex<real_simulation>> spectrum;
+        fft.fwd(spectrum, green);
+        for (int i_frequency = 0; i_frequency < n_fft; ++i_frequency)
+        {
+          spectrum[i_frequency] *= stf_spectra[i_source][i_frequency];
+        }
+        fft.inv(traces[i_source], spectrum);
+      }
 
-          file_vx << vx[idx] << " ";
-          file_vz << vz[idx] << " ";
+      // Stack the sources of every shot into its seismograms.
+      real_simulation *rtf = component == 0 ? rtf_ux : rtf_uz;
+#pragma omp parallel for
+      for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+      {
+        for (int it = 0; it < nt; ++it)
+        {
+          real_simulation sample = 0.0;
+          for (const auto &i_source : which_source_to_fire_in_which_shot[i_shot])
+          {
+            sample += traces[i_source][it];
+          }
+          rtf[linear_IDX(i_shot, i_receiver, it, n_shots, nr, nt)] = sample;
         }
-        file_vx << std::endl;
-        file_vz << std::endl;
       }
-      file_vx.close();
-      file_vz.close();
     }
   }
 
-  // Output timing if verbose.
+  deallocate_array(readings);
+
   if (verbose)
   {
     stopTime = omp_get_wtime();
     secsElapsed = stopTime - startTime;
-    std::cout << "Seconds elapsed for forward wave simulation: " << secsElapsed
-              << std::endl;
+    std::cout << "Seconds elapsed for reciprocal wave simulation of " << 2 * nr
+              << " receiver components: " << secsElapsed << std::endl;
   }
 }
 
 void fdModel::adjoint_simulate(int i_shot, bool verbose)
 {
-  // Reset dynamical fields
-  for (int ix = 0; ix < nx; ++ix)
-  {
-    for (int iz = 0; iz < nz; ++iz)
-    {
+  adjoint_simulate_slot(snapshot_slot(i_shot),
+                        a_stf_ux + linear_IDX(i_shot, 0, 0, n_shots, nr, nt),
+                        a_stf_uz + linear_IDX(i_shot, 0, 0, n_shots, nr, nt), verbose);
+}
 
-      auto idx = linear_IDX(ix, iz, nx, nz);
+void fdModel::adjoint_simulate_slot(int i_slot, const real_simulation *a_ux,
+                                    const real_simulation *a_uz, bool verbose)
+{
+  require_snapshot_storage();
 
-      vx[idx] = 0.0;
-      vz[idx] = 0.0;
-      txx[idx] = 0.0;
-      tzz[idx] = 0.0;
-      txz[idx] = 0.0;
-    }
-  }
+  // Reset dynamical fields
+  reset_wavefields();
 
   // If verbose, count time
   double startTime = 0, stopTime = 0, secsElapsed = 0;
@@ -811,151 +1734,46 @@ void fdModel::adjoint_simulate(int i_shot, bool verbose)
     startTime = real_simulation(omp_get_wtime());
   }
 
+  // Restart the Fourier transforms of the adjoint fields.
+  const int n_transform = shape_adjoint_transform[0] * nx_snapshot * nz_snapshot;
+  if (kernels_need_velocities())
+  {
+    std::fill(adjoint_transform_vx, adjoint_transform_vx + n_transform, 0.0);
+    std::fill(adjoint_transform_vz, adjoint_transform_vz + n_transform, 0.0);
+  }
+  std::fill(adjoint_transform_txx, adjoint_transform_txx + n_transform, 0.0);
+  std::fill(adjoint_transform_tzz, adjoint_transform_tzz + n_transform, 0.0);
+  if (kernels_need_shear_stress())
+  {
+    std::fill(adjoint_transform_txz, adjoint_transform_txz + n_transform, 0.0);
+  }
+
   for (int it = nt - 1; it >= 0; --it)
   {
     // Correlate wavefields
     if (it % snapshot_interval == 0)
-    { // Todo, [X] rewrite for only relevant
-      // parameters [ ] Check if done properly
-#pragma omp parallel for collapse(2)
-      for (int ix = np_boundary + nx_inner_boundary;
-           ix < np_boundary + nx_inner - nx_inner_boundary; ++ix)
-      {
-        for (int iz = np_boundary + nz_inner_boundary;
-             iz < np_boundary + nz_inner - nz_inner_boundary; ++iz)
-        {
-
-          auto idx = linear_IDX(ix, iz, nx, nz);
-
-          auto idx_accu = linear_IDX(i_shot, it / snapshot_interval, ix, iz, n_shots, snapshots, nx, nz);
-
-          density_l_kernel[idx] -=
-              snapshot_interval * dt *
-              (accu_vx[idx_accu] * vx[idx] + accu_vz[idx_accu] * vz[idx]);
-
-          lambda_kernel[idx] +=
-              snapshot_interval * dt *
-              (((accu_txx[idx_accu] - (accu_tzz[idx_accu] * la[idx]) /
-                                          lm[idx]) +
-                (accu_tzz[idx_accu] - (accu_txx[idx_accu] * la[idx]) /
-                                          lm[idx])) *
-               ((txx[idx] - (tzz[idx] * la[idx]) / lm[idx]) +
-                (tzz[idx] - (txx[idx] * la[idx]) / lm[idx]))) /
-              ((lm[idx] - ((la[idx] * la[idx]) / (lm[idx]))) *
-               (lm[idx] - ((la[idx] * la[idx]) / (lm[idx]))));
-
-          mu_kernel[idx] +=
-              snapshot_interval * dt * 2 *
-              ((((txx[idx] - (tzz[idx] * la[idx]) / lm[idx]) *
-                 (accu_txx[idx_accu] - (accu_tzz[idx_accu] * la[idx]) /
-                                           lm[idx])) +
-                ((tzz[idx] - (txx[idx] * la[idx]) / lm[idx]) *
-                 (accu_tzz[idx_accu] - (accu_txx[idx_accu] * la[idx]) /
-                                           lm[idx]))) /
-                   ((lm[idx] - ((la[idx] * la[idx]) / (lm[idx]))) *
-                    (lm[idx] - ((la[idx] * la[idx]) / (lm[idx])))) +
-               2 * (txz[idx] * accu_txz[idx_accu] /
-                    (4 * mu[idx] * mu[idx])));
-        }
-      }
-    }
-
-// Reverse time integrate dynamic fields for stress
-#pragma omp parallel for collapse(2)
-    for (int ix = 2; ix < nx - 2; ++ix)
     {
-      for (int iz = 2; iz < nz - 2; ++iz)
+      if (kernel_frequencies.empty())
       {
-
-        auto idx = linear_IDX(ix, iz, nx, nz);
-
-        auto idx_xp1 = linear_IDX(ix + 1, iz, nx, nz);
-        auto idx_xp2 = linear_IDX(ix + 2, iz, nx, nz);
-        auto idx_xm1 = linear_IDX(ix - 1, iz, nx, nz);
-        auto idx_xm2 = linear_IDX(ix - 2, iz, nx, nz);
-
-        auto idx_zm1 = linear_IDX(ix, iz - 1, nx, nz);
-        auto idx_zm2 = linear_IDX(ix, iz - 2, nx, nz);
-        auto idx_zp1 = linear_IDX(ix, iz + 1, nx, nz);
-        auto idx_zp2 = linear_IDX(ix, iz + 2, nx, nz);
-
-        txx[idx] =
-            taper[idx] *
-            (txx[idx] - dt * (lm[idx] *
-                                  (c1 * (vx[idx_xp1] - vx[idx]) +
-                                   c2 * (vx[idx_xm1] - vx[idx_xp2])) /
-                                  dx +
-                              la[idx] *
-                                  (c1 * (vz[idx] - vz[idx_zm1]) +
-                                   c2 * (vz[idx_zm2] - vz[idx_zp1])) /
-                                  dz));
-        tzz[idx] =
-            taper[idx] *
-            (tzz[idx] - dt * (la[idx] *
-                                  (c1 * (vx[idx_xp1] - vx[idx]) +
-                                   c2 * (vx[idx_xm1] - vx[idx_xp2])) /
-                                  dx +
-                              (lm[idx]) *
-                                  (c1 * (vz[idx] - vz[idx_zm1]) +
-                                   c2 * (vz[idx_zm2] - vz[idx_zp1])) /
-                                  dz));
-        txz[idx] = taper[idx] *
-                   (txz[idx] - dt * mu[idx] *
-                                   ((c1 * (vx[idx_zp1] - vx[idx]) +
-                                     c2 * (vx[idx_zm1] - vx[idx_zp2])) /
-                                        dz +
-                                    (c1 * (vz[idx] - vz[idx_xm1]) +
-                                     c2 * (vz[idx_xm2] - vz[idx_xp1])) /
-                                        dx));
+        correlate_kernels(i_slot, it / snapshot_interval);
       }
-    }
-// Reverse time integrate dynamic fields for velocity
-#pragma omp parallel for collapse(2)
-    for (int ix = 2; ix < nx - 2; ++ix)
-    {
-      for (int iz = 2; iz < nz - 2; ++iz)
+      else
       {
-
-        auto idx = linear_IDX(ix, iz, nx, nz);
-
-        auto idx_xp1 = linear_IDX(ix + 1, iz, nx, nz);
-        auto idx_xp2 = linear_IDX(ix + 2, iz, nx, nz);
-        auto idx_xm1 = linear_IDX(ix - 1, iz, nx, nz);
-        auto idx_xm2 = linear_IDX(ix - 2, iz, nx, nz);
-
-        auto idx_zm1 = linear_IDX(ix, iz - 1, nx, nz);
-        auto idx_zm2 = linear_IDX(ix, iz - 2, nx, nz);
-        auto idx_zp1 = linear_IDX(ix, iz + 1, nx, nz);
-        auto idx_zp2 = linear_IDX(ix, iz + 2, nx, nz);
-
-        vx[idx] = taper[idx] *
-                  (vx[idx] - b_vx[idx] * dt *
-                                 ((c1 * (txx[idx] - txx[idx_xm1]) +
-                                   c2 * (txx[idx_xm2] - txx[idx_xp1])) /
-                                      dx +
-                                  (c1 * (txz[idx] - txz[idx_zm1]) +
-                                   c2 * (txz[idx_zm2] - txz[idx_zp1])) /
-                                      dz));
-        vz[idx] = taper[idx] *
-                  (vz[idx] - b_vz[idx] * dt *
-                                 ((c1 * (txz[idx_xp1] - txz[idx]) +
-                                   c2 * (txz[idx_xm1] - txz[idx_xp2])) /
-                                      dx +
-                                  (c1 * (tzz[idx_zp1] - tzz[idx]) +
-                                   c2 * (tzz[idx_zm1] - tzz[idx_zp2])) /
-                                      dz));
+        accumulate_adjoint_transform(it / snapshot_interval);
       }
     }
 
+    // Reverse time integrate dynamic fields for stress and velocity.
+    update_stresses(-dt);
+    update_velocities(-dt);
+
     // Inject adjoint sources
-    for (int ir = 0; ir < nr; ++ir)
-    {
-      auto idx_rec_loc = linear_IDX(ix_receivers[ir], iz_receivers[ir], nx, nz);
-      auto idx_rec = linear_IDX(i_shot, ir, it, n_shots, nr, nt);
+    inject_adjoint_sources(a_ux, a_uz, it);
+  }
 
-      vx[idx_rec_loc] += dt * b_vx[idx_rec_loc] * a_stf_ux[idx_rec] / (dx * dz);
-      vz[idx_rec_loc] += dt * b_vz[idx_rec_loc] * a_stf_uz[idx_rec] / (dx * dz);
-    }
+  if (not kernel_frequencies.empty())
+  {
+    correlate_frequency_kernels(i_slot);
   }
 
   // Output timing
@@ -968,341 +1786,2316 @@ void fdModel::adjoint_simulate(int i_shot, bool verbose)
   }
 }
 
-void fdModel::write_receivers() { write_receivers(std::string("")); }
-
-void fdModel::write_receivers(const std::string prefix)
+void fdModel::reset_wavefields()
 {
-  std::string filename_ux;
-  std::string filename_uz;
-
-  std::ofstream receiver_file_ux;
-  std::ofstream receiver_file_uz;
-
-  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+#pragma omp parallel for collapse(2)
+  for (int ix = 0; ix < nx; ++ix)
   {
-    filename_ux = observed_data_folder + "/rtf_ux" + std::to_string(i_shot) + ".txt";
-    filename_uz = observed_data_folder + "/rtf_uz" + std::to_string(i_shot) + ".txt";
-
-    receiver_file_ux.open(filename_ux);
-    receiver_file_uz.open(filename_uz);
-
-    receiver_file_ux.precision(std::numeric_limits<real_simulation>::digits10 + 10);
-    receiver_file_uz.precision(std::numeric_limits<real_simulation>::digits10 + 10);
-
-    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+    for (int iz = 0; iz < nz; ++iz)
     {
-      receiver_file_ux << std::endl;
-      receiver_file_uz << std::endl;
-      for (int it = 0; it < nt; ++it)
-      {
-        auto idx_rec = linear_IDX(i_shot, i_receiver, it, n_shots, nr, nt);
-        receiver_file_ux << rtf_ux[idx_rec] << " ";
-        receiver_file_uz << rtf_uz[idx_rec] << " ";
-      }
+      auto idx = linear_IDX(ix, iz, nx, nz);
+      vx[idx] = 0.0;
+      vz[idx] = 0.0;
+      txx[idx] = 0.0;
+      tzz[idx] = 0.0;
+      txz[idx] = 0.0;
     }
-    receiver_file_ux.close();
-    receiver_file_uz.close();
   }
+
+  reset_active_region();
 }
 
-void fdModel::write_sources()
+void fdModel::reset_active_region()
 {
-  std::string filename_sources;
-  std::ofstream shot_file;
+  if (active_region_tile_size < 4)
+  {
+    throw std::invalid_argument(
+        "The active region tile size should be at least 4 grid points.");
+  }
+  nx_tiles = (nx + active_region_tile_size - 1) / active_region_tile_size;
+  nz_tiles = (nz + active_region_tile_size - 1) / active_region_tile_size;
+  tile_active.assign(nx_tiles * nz_tiles, 0);
+  active_tiles.clear();
+  active_row_amplitude.clear();
+}
 
-  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+void fdModel::activate_point(int ix, int iz)
+{
+  if (active_region_tolerance <= 0.0)
   {
-    filename_sources = stf_folder + "/sources_shot_" + std::to_string(i_shot) + ".txt";
+    return;
+  }
+  for (int jx = std::max(ix - 1, 0); jx <= std::min(ix + 1, nx - 1); ++jx)
+  {
+    for (int jz = std::max(iz - 1, 0); jz <= std::min(iz + 1, nz - 1); ++jz)
+    {
+      int tile = linear_IDX(jx / active_region_tile_size, jz / active_region_tile_size,
+                            nx_tiles, nz_tiles);
+      if (!tile_active[tile])
+      {
+        tile_active[tile] = 1;
+        active_tiles.push_back(tile);
+      }
+    }
+  }
+  active_row_amplitude.resize(active_tiles.size() * active_region_tile_size, 0.0);
+}
 
-    shot_file.open(filename_sources);
+void fdModel::expand_active_region()
+{
+  const int n_active = active_tiles.size();
+  const int tile_size = active_region_tile_size;
 
-    shot_file.precision(std::numeric_limits<real_simulation>::digits10 + 10);
+  std::vector<real_simulation> tile_amplitude(n_active, 0.0);
+  real_simulation max_amplitude = 0.0;
+  for (int i_tile = 0; i_tile < n_active; ++i_tile)
+  {
+    for (int i_row = i_tile * tile_size; i_row < (i_tile + 1) * tile_size; ++i_row)
+    {
+      tile_amplitude[i_tile] =
+          std::max(tile_amplitude[i_tile], active_row_amplitude[i_row]);
+    }
+    max_amplitude = std::max(max_amplitude, tile_amplitude[i_tile]);
+  }
 
-    for (int i_source : which_source_to_fire_in_which_shot[i_shot])
+  for (int i_tile = 0; i_tile < n_active; ++i_tile)
+  {
+    if (tile_amplitude[i_tile] == 0.0 or
+        tile_amplitude[i_tile] <= active_region_tolerance * max_amplitude)
     {
-      shot_file << std::endl;
-      for (int it = 0; it < nt; ++it)
+      continue;
+    }
+    int ix_tile = active_tiles[i_tile] / nz_tiles;
+    int iz_tile = active_tiles[i_tile] % nz_tiles;
+    for (int jx = std::max(ix_tile - 1, 0); jx <= std::min(ix_tile + 1, nx_tiles - 1);
+         ++jx)
+    {
+      for (int jz = std::max(iz_tile - 1, 0); jz <= std::min(iz_tile + 1, nz_tiles - 1);
+           ++jz)
       {
-        auto idx_source = linear_IDX(i_source, it, n_sources, nt);
-        shot_file << stf[idx_source] << " ";
+        int tile = linear_IDX(jx, jz, nx_tiles, nz_tiles);
+        if (!tile_active[tile])
+        {
+          tile_active[tile] = 1;
+          active_tiles.push_back(tile);
+        }
       }
     }
-    shot_file.close();
   }
+  active_row_amplitude.resize(active_tiles.size() * tile_size, 0.0);
 }
 
-void fdModel::update_from_velocity()
+real_simulation fdModel::active_region_fraction() const
+{
+  if (active_region_tolerance <= 0.0)
+  {
+    return 1.0;
+  }
+  return real_simulation(active_tiles.size()) / (nx_tiles * nz_tiles);
+}
+
+bool fdModel::active_tile_row(int i_row, int &ix, int &iz_start, int &iz_end) const
+{
+  const int tile = active_tiles[i_row / active_region_tile_size];
+  ix = (tile / nz_tiles) * active_region_tile_size + i_row % active_region_tile_size;
+  iz_start = std::max((tile % nz_tiles) * active_region_tile_size, 2);
+  iz_end = std::min((tile % nz_tiles + 1) * active_region_tile_size, nz - 2);
+  return ix >= 2 and ix < nx - 2;
+}
+
+inline void fdModel::store_snapshot_point(int i_slot, int i_snapshot, int i_point_x,
+                                          int i_point_z, real_simulation vx_point,
+                                          real_simulation vz_point,
+                                          real_simulation txx_point,
+                                          real_simulation tzz_point,
+                                          real_simulation txz_point)
+{
+  const int n_frequencies = int(kernel_frequencies.size());
+  if (n_frequencies == 0)
+  {
+    auto idx_accu = linear_IDX(i_slot, i_snapshot, i_point_x, i_point_z, n_shots,
+                               snapshots, nx_snapshot, nz_snapshot);
+
+    if (kernels_need_velocities())
+    {
+      accu_vx[idx_accu] = vx_point;
+      accu_vz[idx_accu] = vz_point;
+    }
+    accu_txx[idx_accu] = txx_point;
+    if (kernels_need_shear_stress())
+    {
+      accu_txz[idx_accu] = txz_point;
+    }
+    accu_tzz[idx_accu] = tzz_point;
+    return;
+  }
+
+  // Running Fourier transforms, restarted at the first snapshot.
+  for (int i_frequency = 0; i_frequency < n_frequencies; ++i_frequency)
+  {
+    auto idx_real = linear_IDX(i_slot, 2 * i_frequency, i_point_x, i_point_z, n_shots,
+                               2 * n_frequencies, nx_snapshot, nz_snapshot);
+    auto idx_imaginary = idx_real + nx_snapshot * nz_snapshot;
+    auto idx_transform = linear_IDX(i_snapshot, i_frequency, snapshots, n_frequencies);
+    const real_simulation c = transform_cos[idx_transform];
+    const real_simulation s = transform_sin[idx_transform];
+    auto accumulate = [&](real_simulation *accu, real_simulation value) {
+      if (i_snapshot == 0)
+      {
+        accu[idx_real] = 0.0;
+        accu[idx_imaginary] = 0.0;
+      }
+      accu[idx_real] += c * value;
+      accu[idx_imaginary] -= s * value;
+    };
+    if (kernels_need_velocities())
+    {
+      accumulate(accu_vx, vx_point);
+      accumulate(accu_vz, vz_point);
+    }
+    accumulate(accu_txx, txx_point);
+    accumulate(accu_tzz, tzz_point);
+    if (kernels_need_shear_stress())
+    {
+      accumulate(accu_txz, txz_point);
+    }
+  }
+}
+
+void fdModel::store_snapshot(int i_slot, int i_snapshot)
 {
 #pragma omp parallel for collapse(2)
-  for (int ix = 0; ix < nx; ++ix)
+  for (int ix = 0; ix < nx_snapshot; ++ix)
   {
-    for (int iz = 0; iz < nz; ++iz)
+    for (int iz = 0; iz < nz_snapshot; ++iz)
     {
+      auto idx_grid = linear_IDX(snapshot_ix[ix], snapshot_iz[iz], nx, nz);
+      store_snapshot_point(i_slot, i_snapshot, ix, iz, vx[idx_grid], vz[idx_grid],
+                           txx[idx_grid], tzz[idx_grid], txz[idx_grid]);
+    }
+  }
+}
 
-      auto idx = linear_IDX(ix, iz, nx, nz);
+void fdModel::record_receivers(real_simulation *ux, real_simulation *uz, int it)
+{
+#pragma omp parallel for collapse(1)
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    auto idx_rtf = linear_IDX(i_receiver, it, nr, nt);
+    auto idx_loc = linear_IDX(ix_receivers[i_receiver], iz_receivers[i_receiver], nx, nz);
 
-      mu[idx] = real_simulation(pow(vs[idx], 2) * rho[idx]);
-      lm[idx] = real_simulation(pow(vp[idx], 2) * rho[idx]);
-      la[idx] = lm[idx] - 2 * mu[idx];
-      b_vx[idx] = real_simulation(1.0 / rho[idx]);
-      b_vz[idx] = b_vx[idx];
+    if (it == 0)
+    {
+      ux[idx_rtf] = dt * vx[idx_loc] / (dx * dz);
+      uz[idx_rtf] = dt * vz[idx_loc] / (dx * dz);
+    }
+    else
+    {
+      auto idx_rtf_t_min_1 = linear_IDX(i_receiver, it - 1, nr, nt);
+
+      ux[idx_rtf] = ux[idx_rtf_t_min_1] + dt * vx[idx_loc] / (dx * dz);
+      uz[idx_rtf] = uz[idx_rtf_t_min_1] + dt * vz[idx_loc] / (dx * dz);
     }
   }
 }
 
-void fdModel::load_receivers(bool verbose)
+inline void fdModel::update_stresses_point(int ix, int iz, real_simulation time_step)
+{
+  int idx = linear_IDX(ix, iz, nx, nz);
+  int idx_xp1 = linear_IDX(ix + 1, iz, nx, nz);
+  int idx_xp2 = linear_IDX(ix + 2, iz, nx, nz);
+  int idx_xm1 = linear_IDX(ix - 1, iz, nx, nz);
+  int idx_xm2 = linear_IDX(ix - 2, iz, nx, nz);
+  int idx_zm1 = linear_IDX(ix, iz - 1, nx, nz);
+  int idx_zm2 = linear_IDX(ix, iz - 2, nx, nz);
+  int idx_zp1 = linear_IDX(ix, iz + 1, nx, nz);
+  int idx_zp2 = linear_IDX(ix, iz + 2, nx, nz);
+
+  txx[idx] =
+      taper[idx] *
+      (txx[idx] + time_step * (lm[idx] *
+                                   (c1 * (vx[idx_xp1] - vx[idx]) +
+                                    c2 * (vx[idx_xm1] - vx[idx_xp2])) /
+                                   dx +
+                               la[idx] *
+                                   (c1 * (vz[idx] - vz[idx_zm1]) +
+                                    c2 * (vz[idx_zm2] - vz[idx_zp1])) /
+                                   dz));
+  tzz[idx] =
+      taper[idx] *
+      (tzz[idx] + time_step * (la[idx] *
+                                   (c1 * (vx[idx_xp1] - vx[idx]) +
+                                    c2 * (vx[idx_xm1] - vx[idx_xp2])) /
+                                   dx +
+                               (lm[idx]) *
+                                   (c1 * (vz[idx] - vz[idx_zm1]) +
+                                    c2 * (vz[idx_zm2] - vz[idx_zp1])) /
+                                   dz));
+  txz[idx] = taper[idx] *
+             (txz[idx] + time_step * mu[idx] *
+                             ((c1 * (vx[idx_zp1] - vx[idx]) +
+                               c2 * (vx[idx_zm1] - vx[idx_zp2])) /
+                                  dz +
+                              (c1 * (vz[idx] - vz[idx_xm1]) +
+                               c2 * (vz[idx_xm2] - vz[idx_xp1])) /
+                                  dx));
+}
+
+inline void fdModel::update_velocities_point(int ix, int iz, real_simulation time_step)
+{
+  int idx = linear_IDX(ix, iz, nx, nz);
+  int idx_xp1 = linear_IDX(ix + 1, iz, nx, nz);
+  int idx_xp2 = linear_IDX(ix + 2, iz, nx, nz);
+  int idx_xm1 = linear_IDX(ix - 1, iz, nx, nz);
+  int idx_xm2 = linear_IDX(ix - 2, iz, nx, nz);
+  int idx_zm1 = linear_IDX(ix, iz - 1, nx, nz);
+  int idx_zm2 = linear_IDX(ix, iz - 2, nx, nz);
+  int idx_zp1 = linear_IDX(ix, iz + 1, nx, nz);
+  int idx_zp2 = linear_IDX(ix, iz + 2, nx, nz);
+
+  vx[idx] = taper[idx] *
+            (vx[idx] + b_vx[idx] * time_step *
+                           ((c1 * (txx[idx] - txx[idx_xm1]) +
+                             c2 * (txx[idx_xm2] - txx[idx_xp1])) /
+                                dx +
+                            (c1 * (txz[idx] - txz[idx_zm1]) +
+                             c2 * (txz[idx_zm2] - txz[idx_zp1])) /
+                                dz));
+  vz[idx] = taper[idx] *
+            (vz[idx] + b_vz[idx] * time_step *
+                           ((c1 * (txz[idx_xp1] - txz[idx]) +
+                             c2 * (txz[idx_xm1] - txz[idx_xp2])) /
+                                dx +
+                            (c1 * (tzz[idx_zp1] - tzz[idx]) +
+                             c2 * (tzz[idx_zm1] - tzz[idx_zp2])) /
+                                dz));
+}
+
+void fdModel::update_stresses(real_simulation time_step)
+{
+  if (active_region_tolerance > 0.0)
+  {
+#pragma omp parallel for
+    for (int i_row = 0; i_row < int(active_row_amplitude.size()); ++i_row)
+    {
+      int ix, iz_start, iz_end;
+      if (active_tile_row(i_row, ix, iz_start, iz_end))
+      {
+        for (int iz = iz_start; iz < iz_end; ++iz)
+        {
+          update_stresses_point(ix, iz, time_step);
+        }
+      }
+    }
+    return;
+  }
+
+#pragma omp parallel for collapse(2)
+  for (int ix = 2; ix < nx - 2; ++ix)
+  {
+    for (int iz = 2; iz < nz - 2; ++iz)
+    {
+      update_stresses_point(ix, iz, time_step);
+    }
+  }
+}
+
+void fdModel::update_velocities(real_simulation time_step)
+{
+  if (active_region_tolerance > 0.0)
+  {
+#pragma omp parallel for
+    for (int i_row = 0; i_row < int(active_row_amplitude.size()); ++i_row)
+    {
+      int ix, iz_start, iz_end;
+      real_simulation amplitude = 0.0;
+      if (active_tile_row(i_row, ix, iz_start, iz_end))
+      {
+        for (int iz = iz_start; iz < iz_end; ++iz)
+        {
+          update_velocities_point(ix, iz, time_step);
+          auto idx = linear_IDX(ix, iz, nx, nz);
+          amplitude = std::max({amplitude, std::abs(vx[idx]), std::abs(vz[idx])});
+        }
+      }
+      active_row_amplitude[i_row] = amplitude;
+    }
+    expand_active_region();
+    return;
+  }
+
+#pragma omp parallel for collapse(2)
+  for (int ix = 2; ix < nx - 2; ++ix)
+  {
+    for (int iz = 2; iz < nz - 2; ++iz)
+    {
+      update_velocities_point(ix, iz, time_step);
+    }
+  }
+}
+
+void fdModel::inject_source(int i_source, int it, real_simulation weight)
+{
+  activate_point(ix_sources[i_source], iz_sources[i_source]);
+  inject_source(i_source, it, weight, vx, vz, 1, 0);
+}
+
+void fdModel::inject_source(int i_source, int it, real_simulation weight,
+                            real_simulation *target_vx, real_simulation *target_vz,
+                            int lanes, int lane)
+{
+  // Don't parallelize in assignment! Creates race condition
+  // |-inject source
+  // | (x,x)-couple
+  auto idx_mt = linear_IDX(i_source, 0, 0, n_sources, 2, 2);
+
+  auto idx_stf = linear_IDX(i_source, it, n_sources, nt);
+
+  auto idx = linear_IDX(ix_sources[i_source], iz_sources[i_source], nx, nz);
+
+  auto idx_xm1 = linear_IDX(ix_sources[i_source] - 1, iz_sources[i_source], nx, nz);
+  auto idx_zm1 = linear_IDX(ix_sources[i_source], iz_sources[i_source] - 1, nx, nz);
+
+  auto idx_xp1 = linear_IDX(ix_sources[i_source] + 1, iz_sources[i_source], nx, nz);
+  auto idx_zp1 = linear_IDX(ix_sources[i_source], iz_sources[i_source] + 1, nx, nz);
+
+  auto idx_xp1zm1 = linear_IDX(ix_sources[i_source] + 1, iz_sources[i_source] - 1, nx, nz);
+  auto idx_xm1zp1 = linear_IDX(ix_sources[i_source] - 1, iz_sources[i_source] + 1, nx, nz);
+  auto idx_xm1zm1 = linear_IDX(ix_sources[i_source] - 1, iz_sources[i_source] - 1, nx, nz);
+
+  auto amplitude = weight * stf[idx_stf];
+
+  target_vx[idx_xm1 * lanes + lane] -=
+      moment[idx_mt] * amplitude * dt *
+      b_vz[idx_xm1] / (dx * dx * dx * dx);
+  target_vx[idx * lanes + lane] +=
+      moment[idx_mt] * amplitude * dt *
+      b_vz[idx] / (dx * dx * dx * dx);
+
+  // | (z,z)-couple
+  idx_mt = linear_IDX(i_source, 1, 1, n_sources, 2, 2);
+  target_vz[idx_zm1 * lanes + lane] -=
+      moment[idx_mt] * amplitude * dt *
+      b_vz[idx_zm1] / (dz * dz * dz * dz);
+  target_vz[idx * lanes + lane] +=
+      moment[idx_mt] * amplitude * dt *
+      b_vz[idx] / (dz * dz * dz * dz);
+
+  // | (x,z)-couple
+  idx_mt = linear_IDX(i_source, 0, 1, n_sources, 2, 2);
+  target_vx[idx_xm1zp1 * lanes + lane] +=
+      0.25 * moment[idx_mt] * amplitude * dt *
+      b_vz[idx_xm1zp1] /
+      (dx * dx * dx * dx);
+  target_vx[idx_zp1 * lanes + lane] +=
+      0.25 * moment[idx_mt] * amplitude * dt *
+      b_vz[idx_zp1] / (dx * dx * dx * dx);
+  target_vx[idx_xm1zm1 * lanes + lane] -=
+      0.25 * moment[idx_mt] * amplitude * dt *
+      b_vz[idx_xm1zm1] /
+      (dx * dx * dx * dx);
+  target_vx[idx_zm1 * lanes + lane] -=
+      0.25 * moment[idx_mt] * amplitude * dt *
+      b_vz[idx_zm1] / (dx * dx * dx * dx);
+
+  // | (z,x)-couple
+  idx_mt = linear_IDX(i_source, 1, 0, n_sources, 2, 2);
+  target_vz[idx_xp1zm1 * lanes + lane] +=
+      0.25 * moment[idx_mt] * amplitude * dt *
+      b_vz[idx_xp1zm1] /
+      (dz * dz * dz * dz);
+  target_vz[idx_xp1 * lanes + lane] +=
+      0.25 * moment[idx_mt] * amplitude * dt *
+      b_vz[idx_xp1] / (dz * dz * dz * dz);
+  target_vz[idx_xm1zm1 * lanes + lane] -=
+      0.25 * moment[idx_mt] * amplitude * dt *
+      b_vz[idx_xm1zm1] /
+      (dz * dz * dz * dz);
+  target_vz[idx_xm1 * lanes + lane] -=
+      0.25 * moment[idx_mt] * amplitude * dt *
+      b_vz[idx_xm1] / (dz * dz * dz * dz);
+}
+
+void fdModel::inject_adjoint_sources(const real_simulation *a_ux,
+                                     const real_simulation *a_uz, int it)
+{
+  for (int ir = 0; ir < nr; ++ir)
+  {
+    auto idx_rec_loc = linear_IDX(ix_receivers[ir], iz_receivers[ir], nx, nz);
+    auto idx_rec = linear_IDX(ir, it, nr, nt);
+
+    if (a_ux[idx_rec] != 0.0 or a_uz[idx_rec] != 0.0)
+    {
+      activate_point(ix_receivers[ir], iz_receivers[ir]);
+    }
+    vx[idx_rec_loc] += dt * b_vx[idx_rec_loc] * a_ux[idx_rec] / (dx * dz);
+    vz[idx_rec_loc] += dt * b_vz[idx_rec_loc] * a_uz[idx_rec] / (dx * dz);
+  }
+}
+
+inline void fdModel::correlate_kernels_point(
+    int idx, real_simulation weight, real_simulation forward_vx,
+    real_simulation forward_vz, real_simulation forward_txx,
+    real_simulation forward_tzz, real_simulation forward_txz,
+    real_simulation adjoint_vx, real_simulation adjoint_vz,
+    real_simulation adjoint_txx, real_simulation adjoint_tzz,
+    real_simulation adjoint_txz)
+{
+  if (kernels_need_velocities())
+  {
+    density_l_kernel[idx] -= weight * (forward_vx * adjoint_vx + forward_vz * adjoint_vz);
+
+    forward_illumination[idx] +=
+        weight * (forward_vx * forward_vx + forward_vz * forward_vz);
+    adjoint_illumination[idx] +=
+        weight * (adjoint_vx * adjoint_vx + adjoint_vz * adjoint_vz);
+  }
+
+  lambda_kernel[idx] +=
+      weight *
+      (((forward_txx - (forward_tzz * la[idx]) / lm[idx]) +
+        (forward_tzz - (forward_txx * la[idx]) / lm[idx])) *
+       ((adjoint_txx - (adjoint_tzz * la[idx]) / lm[idx]) +
+        (adjoint_tzz - (adjoint_txx * la[idx]) / lm[idx]))) /
+      ((lm[idx] - ((la[idx] * la[idx]) / (lm[idx]))) *
+       (lm[idx] - ((la[idx] * la[idx]) / (lm[idx]))));
+
+  if (kernels_need_shear_stress())
+  {
+    mu_kernel[idx] +=
+        weight * 2 *
+        ((((adjoint_txx - (adjoint_tzz * la[idx]) / lm[idx]) *
+           (forward_txx - (forward_tzz * la[idx]) / lm[idx])) +
+          ((adjoint_tzz - (adjoint_txx * la[idx]) / lm[idx]) *
+           (forward_tzz - (forward_txx * la[idx]) / lm[idx]))) /
+             ((lm[idx] - ((la[idx] * la[idx]) / (lm[idx]))) *
+              (lm[idx] - ((la[idx] * la[idx]) / (lm[idx])))) +
+         2 * (adjoint_txz * forward_txz / (4 * mu[idx] * mu[idx])));
+  }
+}
+
+void fdModel::free_snapshot_points(int &i_point_x_begin, int &i_point_x_end,
+                                   int &i_point_z_begin, int &i_point_z_end) const
+{
+  i_point_x_begin = int(std::lower_bound(snapshot_ix.begin(), snapshot_ix.end(),
+                                         np_boundary + nx_inner_boundary) -
+                        snapshot_ix.begin());
+  i_point_x_end = int(std::lower_bound(snapshot_ix.begin(), snapshot_ix.end(),
+                                       np_boundary + nx_inner - nx_inner_boundary) -
+                      snapshot_ix.begin());
+  i_point_z_begin = int(std::lower_bound(snapshot_iz.begin(), snapshot_iz.end(),
+                                         np_boundary + nz_inner_boundary) -
+                        snapshot_iz.begin());
+  i_point_z_end = int(std::lower_bound(snapshot_iz.begin(), snapshot_iz.end(),
+                                       np_boundary + nz_inner - nz_inner_boundary) -
+                      snapshot_iz.begin());
+}
+
+void fdModel::correlate_kernels(int i_slot, int i_snapshot)
+{
+  int ix_begin, ix_end, iz_begin, iz_end;
+  free_snapshot_points(ix_begin, ix_end, iz_begin, iz_end);
+  const bool velocities = kernels_need_velocities();
+  const bool shear_stress = kernels_need_shear_stress();
+
+  // Todo, [X] rewrite for only relevant
+  // parameters [ ] Check if done properly
+#pragma omp parallel for collapse(2)
+  for (int i_point_x = ix_begin; i_point_x < ix_end; ++i_point_x)
+  {
+    for (int i_point_z = iz_begin; i_point_z < iz_end; ++i_point_z)
+    {
+      auto idx = linear_IDX(snapshot_ix[i_point_x], snapshot_iz[i_point_z], nx, nz);
+
+      auto idx_accu = linear_IDX(i_slot, i_snapshot, i_point_x, i_point_z, n_shots,
+                                 snapshots, nx_snapshot, nz_snapshot);
+
+      // Integration weight in time and over the grid points the point represents.
+      const real_simulation weight = snapshot_interval * dt *
+                                     (snapshot_weight_x[i_point_x] *
+                                      snapshot_weight_z[i_point_z]);
+
+      // Fields that are not stored are not used either.
+      correlate_kernels_point(idx, weight, velocities ? accu_vx[idx_accu] : 0.0,
+                              velocities ? accu_vz[idx_accu] : 0.0, accu_txx[idx_accu],
+                              accu_tzz[idx_accu],
+                              shear_stress ? accu_txz[idx_accu] : 0.0, vx[idx],
+                              vz[idx], txx[idx], tzz[idx], txz[idx]);
+    }
+  }
+}
+
+void fdModel::accumulate_adjoint_transform(int i_snapshot)
+{
+  const int n_frequencies = int(kernel_frequencies.size());
+  const bool velocities = kernels_need_velocities();
+  const bool shear_stress = kernels_need_shear_stress();
+#pragma omp parallel for collapse(2)
+  for (int i_point_x = 0; i_point_x < nx_snapshot; ++i_point_x)
+  {
+    for (int i_point_z = 0; i_point_z < nz_snapshot; ++i_point_z)
+    {
+      auto idx = linear_IDX(snapshot_ix[i_point_x], snapshot_iz[i_point_z], nx, nz);
+      for (int i_frequency = 0; i_frequency < n_frequencies; ++i_frequency)
+      {
+        auto idx_real = linear_IDX(2 * i_frequency, i_point_x, i_point_z,
+                                   2 * n_frequencies, nx_snapshot, nz_snapshot);
+        auto idx_imaginary = idx_real + nx_snapshot * nz_snapshot;
+        auto idx_transform =
+            linear_IDX(i_snapshot, i_frequency, snapshots, n_frequencies);
+        const real_simulation c = transform_cos[idx_transform];
+        const real_simulation s = transform_sin[idx_transform];
+
+        if (velocities)
+        {
+          adjoint_transform_vx[idx_real] += c * vx[idx];
+          adjoint_transform_vx[idx_imaginary] -= s * vx[idx];
+          adjoint_transform_vz[idx_real] += c * vz[idx];
+          adjoint_transform_vz[idx_imaginary] -= s * vz[idx];
+        }
+        adjoint_transform_txx[idx_real] += c * txx[idx];
+        adjoint_transform_txx[idx_imaginary] -= s * txx[idx];
+        adjoint_transform_tzz[idx_real] += c * tzz[idx];
+        adjoint_transform_tzz[idx_imaginary] -= s * tzz[idx];
+        if (shear_stress)
+        {
+          adjoint_transform_txz[idx_real] += c * txz[idx];
+          adjoint_transform_txz[idx_imaginary] -= s * txz[idx];
+        }
+      }
+    }
+  }
+}
+
+void fdModel::correlate_frequency_kernels(int i_slot)
+{
+  const int n_frequencies = int(kernel_frequencies.size());
+  int ix_begin, ix_end, iz_begin, iz_end;
+  free_snapshot_points(ix_begin, ix_end, iz_begin, iz_end);
+  const bool velocities = kernels_need_velocities();
+  const bool shear_stress = kernels_need_shear_stress();
+
+  // The real part of the product of the forward transform and the conjugate
+  // adjoint transform is the sum of the correlations of the real and of the
+  // imaginary parts.
+#pragma omp parallel for collapse(2)
+  for (int i_point_x = ix_begin; i_point_x < ix_end; ++i_point_x)
+  {
+    for (int i_point_z = iz_begin; i_point_z < iz_end; ++i_point_z)
+    {
+      auto idx = linear_IDX(snapshot_ix[i_point_x], snapshot_iz[i_point_z], nx, nz);
+      for (int i_frequency = 0; i_frequency < n_frequencies; ++i_frequency)
+      {
+        const real_simulation weight =
+            kernel_frequency_weights[i_frequency] *
+            (snapshot_weight_x[i_point_x] * snapshot_weight_z[i_point_z]);
+        for (int part = 0; part < 2; ++part)
+        {
+          auto idx_accu =
+              linear_IDX(i_slot, 2 * i_frequency + part, i_point_x, i_point_z, n_shots,
+                         2 * n_frequencies, nx_snapshot, nz_snapshot);
+          auto idx_transform = linear_IDX(2 * i_frequency + part, i_point_x, i_point_z,
+                                          2 * n_frequencies, nx_snapshot, nz_snapshot);
+          correlate_kernels_point(
+              idx, weight, velocities ? accu_vx[idx_accu] : 0.0,
+              velocities ? accu_vz[idx_accu] : 0.0, accu_txx[idx_accu],
+              accu_tzz[idx_accu], shear_stress ? accu_txz[idx_accu] : 0.0,
+              velocities ? adjoint_transform_vx[idx_transform] : 0.0,
+              velocities ? adjoint_transform_vz[idx_transform] : 0.0,
+              adjoint_transform_txx[idx_transform], adjoint_transform_tzz[idx_transform],
+              shear_stress ? adjoint_transform_txz[idx_transform] : 0.0);
+        }
+      }
+    }
+  }
+}
+
+void fdModel::write_receivers() { write_receivers(std::string("")); }
+
+void fdModel::write_receivers(const std::string prefix)
 {
   std::string filename_ux;
   std::string filename_uz;
 
-  std::ifstream receiver_file_ux;
-  std::ifstream receiver_file_uz;
+  std::ofstream receiver_file_ux;
+  std::ofstream receiver_file_uz;
 
   for (int i_shot = 0; i_shot < n_shots; ++i_shot)
   {
-    // Create filename from folder and shot.
     filename_ux = observed_data_folder + "/rtf_ux" + std::to_string(i_shot) + ".txt";
     filename_uz = observed_data_folder + "/rtf_uz" + std::to_string(i_shot) + ".txt";
 
-    // Attempt to open the file by its filename.
     receiver_file_ux.open(filename_ux);
     receiver_file_uz.open(filename_uz);
 
-    // Check if the file actually exists
-    if (verbose)
+    receiver_file_ux.precision(std::numeric_limits<real_simulation>::digits10 + 10);
+    receiver_file_uz.precision(std::numeric_limits<real_simulation>::digits10 + 10);
+
+    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
     {
-      std::cout << "File for ux data at shot " << i_shot << " is "
-                << (receiver_file_ux.good() ? "good (exists at least)." : "ungood.")
-                << std::endl;
-      std::cout << "File for uz data at shot " << i_shot << " is "
-                << (receiver_file_uz.good() ? "good (exists at least)." : "ungood.")
-                << std::endl;
+      receiver_file_ux << std::endl;
+      receiver_file_uz << std::endl;
+      for (int it = 0; it < nt; ++it)
+      {
+        auto idx_rec = linear_IDX(i_shot, i_receiver, it, n_shots, nr, nt);
+        receiver_file_ux << rtf_ux[idx_rec] << " ";
+        receiver_file_uz << rtf_uz[idx_rec] << " ";
+      }
     }
-    if (!receiver_file_ux.good() or !receiver_file_uz.good())
+    receiver_file_ux.close();
+    receiver_file_uz.close();
+  }
+}
+
+std::string fdModel::receiver_filename(int i_shot) const
+{
+  return observed_data_folder + "/rtf" + std::to_string(i_shot) + ".bin";
+}
+
+void fdModel::write_receivers_binary()
+{
+  receiver_file_header header;
+  std::memcpy(header.magic, receiver_file_magic, sizeof(header.magic));
+  header.byte_order = binary_file_byte_order;
+  header.version = binary_file_version;
+  header.sample_size = sizeof(real_simulation);
+  header.n_components = 2;
+  header.nr = nr;
+  header.nt = nt;
+  header.dt = dt;
+  header.data_offset = receiver_file_data_offset(nr);
+
+  std::vector<int32_t> geometry(2 * nr);
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    geometry[i_receiver] = ix_receivers[i_receiver];
+    geometry[nr + i_receiver] = iz_receivers[i_receiver];
+  }
+  std::vector<char> padding(header.data_offset - sizeof(header) -
+                                geometry.size() * sizeof(int32_t),
+                            0);
+
+  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+  {
+    auto filename = receiver_filename(i_shot);
+    std::ofstream receiver_file(filename, std::ios::binary);
+    if (!receiver_file.good())
     {
-      throw std::invalid_argument("Not all data is present!");
+      throw std::invalid_argument("Could not open " + filename + " for writing.");
     }
 
-    real_simulation placeholder_ux;
-    real_simulation placeholder_uz;
+    auto idx_shot = linear_IDX(i_shot, 0, 0, n_shots, nr, nt);
+    auto trace_bytes = std::streamsize(nr) * nt * sizeof(real_simulation);
 
-    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+    receiver_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    receiver_file.write(reinterpret_cast<const char *>(geometry.data()),
+                        geometry.size() * sizeof(int32_t));
+    receiver_file.write(padding.data(), padding.size());
+    receiver_file.write(reinterpret_cast<const char *>(rtf_ux + idx_shot), trace_bytes);
+    receiver_file.write(reinterpret_cast<const char *>(rtf_uz + idx_shot), trace_bytes);
+
+    if (!receiver_file.good())
     {
-      for (int it = 0; it < nt; ++it)
-      {
-        receiver_file_ux >> placeholder_ux;
-        receiver_file_uz >> placeholder_uz;
+      throw std::invalid_argument("Could not write " + filename + ".");
+    }
+  }
+}
 
-        auto idx_receiver = linear_IDX(i_shot, i_receiver, it, n_shots, nr, nt);
+void fdModel::load_receiver_file(int i_shot, const std::string &filename)
+{
+  mapped_file file(filename);
 
-        rtf_ux_true[idx_receiver] = placeholder_ux;
-        rtf_uz_true[idx_receiver] = placeholder_uz;
+  receiver_file_header header;
+  if (file.size() < sizeof(header))
+  {
+    throw std::invalid_argument("Receiver file " + filename + " is truncated.");
+  }
+  std::memcpy(&header, file.data(), sizeof(header));
+
+  if (std::memcmp(header.magic, receiver_file_magic, sizeof(header.magic)) != 0 or
+      header.byte_order != binary_file_byte_order or
+      header.version != binary_file_version or header.n_components != 2 or
+      (header.sample_size != sizeof(float) and header.sample_size != sizeof(double)))
+  {
+    throw std::invalid_argument(filename + " is not a receiver file of this version "
+                                           "and byte order.");
+  }
+  if (header.nr != nr or header.nt != nt or
+      std::abs(header.dt - dt) > 1e-6 * std::abs(dt))
+  {
+    throw std::invalid_argument("The shape or time step of receiver file " + filename +
+                                " does not match the set up.");
+  }
+  if (header.data_offset != receiver_file_data_offset(nr) or
+      file.size() != header.data_offset + 2 * uint64_t(nr) * nt * header.sample_size)
+  {
+    throw std::invalid_argument("Receiver file " + filename + " has the wrong size.");
+  }
+
+  std::vector<int32_t> geometry(2 * nr);
+  std::memcpy(geometry.data(), file.data() + sizeof(header),
+              geometry.size() * sizeof(int32_t));
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    if (geometry[i_receiver] != ix_receivers[i_receiver] or
+        geometry[nr + i_receiver] != iz_receivers[i_receiver])
+    {
+      throw std::invalid_argument("The receiver positions of " + filename +
+                                  " do not match the set up.");
+    }
+  }
+
+  auto idx_shot = linear_IDX(i_shot, 0, 0, n_shots, nr, nt);
+  auto n_samples = nr * nt;
+  const char *data = file.data() + header.data_offset;
+  if (header.sample_size == sizeof(real_simulation))
+  {
+    std::memcpy(rtf_ux_true + idx_shot, data, n_samples * sizeof(real_simulation));
+    std::memcpy(rtf_uz_true + idx_shot, data + n_samples * sizeof(real_simulation),
+                n_samples * sizeof(real_simulation));
+  }
+  else
+  {
+    // Single precision samples, widened on the fly. The mapping is not
+    // necessarily aligned for float access, hence the copies.
+#pragma omp parallel for
+    for (int i_sample = 0; i_sample < n_samples; ++i_sample)
+    {
+      float sample_ux, sample_uz;
+      std::memcpy(&sample_ux, data + i_sample * sizeof(float), sizeof(float));
+      std::memcpy(&sample_uz, data + (n_samples + i_sample) * sizeof(float),
+                  sizeof(float));
+      rtf_ux_true[idx_shot + i_sample] = sample_ux;
+      rtf_uz_true[idx_shot + i_sample] = sample_uz;
+    }
+  }
+}
+
+void fdModel::write_receivers_segy(const std::string &filename_ux,
+                                   const std::string &filename_uz, bool observed)
+{
+  write_segy_component(filename_ux, observed ? rtf_ux_true : rtf_ux, "UX");
+  write_segy_component(filename_uz, observed ? rtf_uz_true : rtf_uz, "UZ");
+}
+
+void fdModel::write_segy_component(const std::string &filename,
+                                   const real_simulation *traces,
+                                   const std::string &component)
+{
+  auto sample_interval = int(std::round(dt * 1e6));
+  if (nt > 65535 or sample_interval < 1 or sample_interval > 65535)
+  {
+    throw std::invalid_argument("The number of samples or the time step can not be "
+                                "represented in SEG-Y.");
+  }
+
+  std::ofstream segy_file(filename, std::ios::binary);
+  if (!segy_file.good())
+  {
+    throw std::invalid_argument("Could not open " + filename + " for writing.");
+  }
+
+  // File headers.
+  std::vector<char> file_header(segy_file_header_size, 0);
+  write_segy_textual_header(
+      file_header.data(),
+      "C 1 SYNTHETIC SEISMOGRAMS WRITTEN BY PSVWAVE\n"
+      "C 2 COMPONENT " +
+          component + "\nC 3 SHOTS " + std::to_string(n_shots) + " RECEIVERS " +
+          std::to_string(nr) + " SAMPLES " + std::to_string(nt) + " INTERVAL " +
+          std::to_string(sample_interval) +
+          " US\n"
+          "C 4 FIELD RECORD NUMBER IS SHOT + 1, TRACE NUMBER IS RECEIVER + 1\n"
+          "C 5 COORDINATES IN CM RELATIVE TO THE INNER DOMAIN\n"
+          "C40 END TEXTUAL HEADER\n");
+  write_segy_int16(file_header.data() + segy_traces_per_ensemble, int16_t(nr));
+  write_segy_int16(file_header.data() + segy_sample_interval, int16_t(sample_interval));
+  write_segy_int16(file_header.data() + segy_samples_per_trace, int16_t(nt));
+  write_segy_int16(file_header.data() + segy_format_code, segy_format_ieee);
+  write_segy_int16(file_header.data() + segy_measurement_system, 1);
+  write_segy_int16(file_header.data() + segy_revision, 0x0100);
+  write_segy_int16(file_header.data() + segy_fixed_length_flag, 1);
+  segy_file.write(file_header.data(), file_header.size());
+
+  // One shot at a time, so memory use does not grow with the survey.
+  const size_t trace_size = segy_trace_header_size + 4 * size_t(nt);
+  std::vector<char> shot_buffer(nr * trace_size);
+  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+  {
+    real_simulation source_x = 0.0;
+    real_simulation source_z = 0.0;
+    for (const auto &i_source : which_source_to_fire_in_which_shot[i_shot])
+    {
+      source_x += (ix_sources[i_source] - np_boundary) * dx;
+      source_z += (iz_sources[i_source] - np_boundary) * dz;
+    }
+    auto n_shot_sources = which_source_to_fire_in_which_shot[i_shot].size();
+    if (n_shot_sources > 0)
+    {
+      source_x /= n_shot_sources;
+      source_z /= n_shot_sources;
+    }
+
+#pragma omp parallel for
+    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+    {
+      char *trace = shot_buffer.data() + i_receiver * trace_size;
+      std::fill(trace, trace + segy_trace_header_size, 0);
+      write_segy_int32(trace + segy_trace_sequence_line, i_shot * nr + i_receiver + 1);
+      write_segy_int32(trace + segy_field_record, i_shot + 1);
+      write_segy_int32(trace + segy_trace_number, i_receiver + 1);
+      write_segy_int16(trace + segy_trace_identification, 1);
+      write_segy_int16(trace + segy_elevation_scalar, -100);
+      write_segy_int16(trace + segy_coordinate_scalar, -100);
+      write_segy_int32(trace + segy_receiver_elevation,
+                       int32_t(std::round(
+                           -100 * (iz_receivers[i_receiver] - np_boundary) * dz)));
+      write_segy_int32(trace + segy_source_depth, int32_t(std::round(100 * source_z)));
+      write_segy_int32(trace + segy_source_x, int32_t(std::round(100 * source_x)));
+      write_segy_int32(trace + segy_group_x,
+                       int32_t(std::round(
+                           100 * (ix_receivers[i_receiver] - np_boundary) * dx)));
+      write_segy_int16(trace + segy_trace_samples, int16_t(nt));
+      write_segy_int16(trace + segy_trace_sample_interval, int16_t(sample_interval));
+      encode_segy_samples(traces + linear_IDX(i_shot, i_receiver, 0, n_shots, nr, nt),
+                          nt, trace + segy_trace_header_size);
+    }
+    segy_file.write(shot_buffer.data(), shot_buffer.size());
+  }
+
+  if (!segy_file.good())
+  {
+    throw std::invalid_argument("Could not write " + filename + ".");
+  }
+}
+
+void fdModel::load_receivers_segy(const std::string &filename_ux,
+                                  const std::string &filename_uz, bool verbose)
+{
+  load_segy_component(filename_ux, rtf_ux_true, verbose);
+  load_segy_component(filename_uz, rtf_uz_true, verbose);
+}
+
+void fdModel::load_segy_component(const std::string &filename, real_simulation *target,
+                                  bool verbose)
+{
+  mapped_file file(filename);
+  const char *data = file.data();
+
+  if (file.size() < size_t(segy_file_header_size))
+  {
+    throw std::invalid_argument("SEG-Y file " + filename + " is truncated.");
+  }
+
+  int format = read_segy_int16(data + segy_format_code);
+  int samples = uint16_t(read_segy_int16(data + segy_samples_per_trace));
+  int sample_interval = uint16_t(read_segy_int16(data + segy_sample_interval));
+  if (format != segy_format_ibm and format != segy_format_ieee)
+  {
+    throw std::invalid_argument("SEG-Y file " + filename +
+                                " does not contain IBM or IEEE floats.");
+  }
+  if (samples != nt or std::abs(sample_interval - dt * 1e6) > 0.5)
+  {
+    throw std::invalid_argument("The samples per trace or sample interval of " +
+                                filename + " do not match the set up.");
+  }
+
+  const size_t trace_size = segy_trace_header_size + 4 * size_t(nt);
+  const size_t n_traces = (file.size() - segy_file_header_size) / trace_size;
+  if ((file.size() - segy_file_header_size) % trace_size != 0 or
+      n_traces != size_t(n_shots) * nr)
+  {
+    throw std::invalid_argument("SEG-Y file " + filename + " does not contain " +
+                                std::to_string(n_shots * nr) +
+                                " traces of equal length.");
+  }
+
+  // Read the trace headers in parallel.
+  std::vector<int32_t> records(n_traces);
+  std::vector<int32_t> trace_numbers(n_traces);
+#pragma omp parallel for
+  for (size_t i_trace = 0; i_trace < n_traces; ++i_trace)
+  {
+    const char *trace = data + segy_file_header_size + i_trace * trace_size;
+    records[i_trace] = read_segy_int32(trace + segy_field_record);
+    trace_numbers[i_trace] = read_segy_int32(trace + segy_trace_number);
+  }
+
+  // Shots are the field records in order of appearance, receivers the trace
+  // numbers within a record.
+  std::map<int32_t, int> shot_of_record;
+  std::vector<size_t> trace_of_receiver(n_traces, n_traces);
+  for (size_t i_trace = 0; i_trace < n_traces; ++i_trace)
+  {
+    auto inserted = shot_of_record.insert({records[i_trace], int(shot_of_record.size())});
+    int i_shot = inserted.first->second;
+    int i_receiver = trace_numbers[i_trace] - 1;
+    if (i_shot >= n_shots or i_receiver < 0 or i_receiver >= nr or
+        trace_of_receiver[linear_IDX(i_shot, i_receiver, n_shots, nr)] != n_traces)
+    {
+      throw std::invalid_argument("The field records and trace numbers of " +
+                                  filename + " do not map onto the shots and " +
+                                  "receivers of the set up.");
+    }
+    trace_of_receiver[linear_IDX(i_shot, i_receiver, n_shots, nr)] = i_trace;
+  }
+
+  // Stream the samples shot by shot, releasing the pages of every shot after use.
+  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+  {
+    size_t first_trace = n_traces;
+    size_t last_trace = 0;
+#pragma omp parallel for reduction(min : first_trace) reduction(max : last_trace)
+    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+    {
+      auto i_trace = trace_of_receiver[linear_IDX(i_shot, i_receiver, n_shots, nr)];
+      first_trace = std::min(first_trace, i_trace);
+      last_trace = std::max(last_trace, i_trace);
+      decode_segy_samples(data + segy_file_header_size + i_trace * trace_size +
+                              segy_trace_header_size,
+                          format, nt,
+                          target + linear_IDX(i_shot, i_receiver, 0, n_shots, nr, nt));
+    }
+    file.release(segy_file_header_size + first_trace * trace_size,
+                 (last_trace - first_trace + 1) * trace_size);
+  }
+
+  if (verbose)
+  {
+    std::cout << "Loaded " << n_traces << " "
+              << (format == segy_format_ibm ? "IBM" : "IEEE") << " float traces from "
+              << filename << std::endl;
+  }
+}
+
+void fdModel::write_sources()
+{
+  std::string filename_sources;
+  std::ofstream shot_file;
+
+  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+  {
+    filename_sources = stf_folder + "/sources_shot_" + std::to_string(i_shot) + ".txt";
+
+    shot_file.open(filename_sources);
+
+    shot_file.precision(std::numeric_limits<real_simulation>::digits10 + 10);
+
+    for (int i_source : which_source_to_fire_in_which_shot[i_shot])
+    {
+      shot_file << std::endl;
+      for (int it = 0; it < nt; ++it)
+      {
+        auto idx_source = linear_IDX(i_source, it, n_sources, nt);
+        shot_file << stf[idx_source] << " ";
+      }
+    }
+    shot_file.close();
+  }
+}
+
+void fdModel::update_from_velocity()
+{
+#pragma omp parallel for collapse(2)
+  for (int ix = 0; ix < nx; ++ix)
+  {
+    for (int iz = 0; iz < nz; ++iz)
+    {
+
+      auto idx = linear_IDX(ix, iz, nx, nz);
+
+      mu[idx] = real_simulation(pow(vs[idx], 2) * rho[idx]);
+      lm[idx] = real_simulation(pow(vp[idx], 2) * rho[idx]);
+      la[idx] = lm[idx] - 2 * mu[idx];
+      b_vx[idx] = real_simulation(1.0 / rho[idx]);
+      b_vz[idx] = b_vx[idx];
+    }
+  }
+}
+
+void fdModel::load_receivers(bool verbose)
+{
+  std::string filename_ux;
+  std::string filename_uz;
+
+  std::ifstream receiver_file_ux;
+  std::ifstream receiver_file_uz;
+
+  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+  {
+    // Prefer the binary container, plaintext is the fallback.
+    auto filename_binary = receiver_filename(i_shot);
+    if (file_exists(filename_binary))
+    {
+      if (verbose)
+      {
+        std::cout << "Loading binary data for shot " << i_shot << " from "
+                  << filename_binary << std::endl;
+      }
+      load_receiver_file(i_shot, filename_binary);
+      continue;
+    }
+
+    // Create filename from folder and shot.
+    filename_ux = observed_data_folder + "/rtf_ux" + std::to_string(i_shot) + ".txt";
+    filename_uz = observed_data_folder + "/rtf_uz" + std::to_string(i_shot) + ".txt";
+
+    // Attempt to open the file by its filename.
+    receiver_file_ux.open(filename_ux);
+    receiver_file_uz.open(filename_uz);
+
+    // Check if the file actually exists
+    if (verbose)
+    {
+      std::cout << "File for ux data at shot " << i_shot << " is "
+                << (receiver_file_ux.good() ? "good (exists at least)." : "ungood.")
+                << std::endl;
+      std::cout << "File for uz data at shot " << i_shot << " is "
+                << (receiver_file_uz.good() ? "good (exists at least)." : "ungood.")
+                << std::endl;
+    }
+    if (!receiver_file_ux.good() or !receiver_file_uz.good())
+    {
+      throw std::invalid_argument("Not all data is present!");
+    }
+
+    real_simulation placeholder_ux;
+    real_simulation placeholder_uz;
+
+    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+    {
+      for (int it = 0; it < nt; ++it)
+      {
+        receiver_file_ux >> placeholder_ux;
+        receiver_file_uz >> placeholder_uz;
+
+        auto idx_receiver = linear_IDX(i_shot, i_receiver, it, n_shots, nr, nt);
+
+        rtf_ux_true[idx_receiver] = placeholder_ux;
+        rtf_uz_true[idx_receiver] = placeholder_uz;
+      }
+    }
+
+    // Check data was large enough for set up
+    if (!receiver_file_ux.good() or !receiver_file_uz.good())
+    {
+      std::cout << "Received bad state of file at end of reading! Does "
+                   "the data match the set up?"
+                << std::endl;
+      throw std::invalid_argument("Not enough data is present!");
+    }
+    // Try to load more data ...
+    receiver_file_ux >> placeholder_ux;
+    receiver_file_uz >> placeholder_uz;
+    // ... which shouldn't be possible
+    if (receiver_file_ux.good() or receiver_file_uz.good())
+    {
+      std::cout << "Received good state of file past reading! Does the "
+                   "data match the set up?"
+                << std::endl;
+      throw std::invalid_argument("Too much data is present!");
+    }
+
+    receiver_file_uz.close();
+    receiver_file_ux.close();
+  }
+}
+
+void fdModel::calculate_l2_misfit() { accumulate_l2_misfit(false); }
+
+void fdModel::calculate_l2_adjoint_sources()
+{
+#pragma omp parallel for collapse(2)
+  for (int is = 0; is < n_shots; ++is)
+  {
+    for (int ir = 0; ir < nr; ++ir)
+    {
+      auto idx_trace = linear_IDX(is, ir, 0, n_shots, nr, nt);
+#pragma omp simd
+      for (int it = 0; it < nt; ++it)
+      {
+        a_stf_ux[idx_trace + it] = rtf_ux[idx_trace + it] - rtf_ux_true[idx_trace + it];
+        a_stf_uz[idx_trace + it] = rtf_uz[idx_trace + it] - rtf_uz_true[idx_trace + it];
+      }
+    }
+  }
+}
+
+void fdModel::calculate_l2_misfit_and_adjoint_sources() { accumulate_l2_misfit(true); }
+
+void fdModel::accumulate_l2_misfit(bool store_adjoint_sources)
+{
+  accumulate_l2_trace_misfits(store_adjoint_sources, 0, n_shots);
+  reduce_trace_misfits();
+}
+
+void fdModel::accumulate_l2_trace_misfits(bool store_adjoint_sources, int first_shot,
+                                          int end_shot)
+{
+  // Every trace is summed by a single thread, so the result does not depend on
+  // the amount of threads or the scheduling.
+#pragma omp parallel for collapse(2)
+  for (int is = first_shot; is < end_shot; ++is)
+  {
+    for (int ir = 0; ir < nr; ++ir)
+    {
+      auto idx_trace = linear_IDX(is, ir, 0, n_shots, nr, nt);
+      real_simulation trace_misfit = 0.0;
+      if (store_adjoint_sources)
+      {
+#pragma omp simd reduction(+ : trace_misfit)
+        for (int it = 0; it < nt; ++it)
+        {
+          auto residual_ux = rtf_ux[idx_trace + it] - rtf_ux_true[idx_trace + it];
+          auto residual_uz = rtf_uz[idx_trace + it] - rtf_uz_true[idx_trace + it];
+          a_stf_ux[idx_trace + it] = residual_ux;
+          a_stf_uz[idx_trace + it] = residual_uz;
+          trace_misfit += residual_ux * residual_ux + residual_uz * residual_uz;
+        }
+      }
+      else
+      {
+#pragma omp simd reduction(+ : trace_misfit)
+        for (int it = 0; it < nt; ++it)
+        {
+          auto residual_ux = rtf_ux[idx_trace + it] - rtf_ux_true[idx_trace + it];
+          auto residual_uz = rtf_uz[idx_trace + it] - rtf_uz_true[idx_trace + it];
+          trace_misfit += residual_ux * residual_ux + residual_uz * residual_uz;
+        }
+      }
+      misfit_per_trace[linear_IDX(is, ir, n_shots, nr)] = 0.5 * dt * trace_misfit;
+    }
+  }
+}
+
+void fdModel::reduce_trace_misfits()
+{
+  // Reduce the traces in a fixed order.
+  misfit = 0;
+  for (int ir = 0; ir < nr; ++ir)
+  {
+    misfit_per_receiver[ir] = 0.0;
+  }
+  for (int is = 0; is < n_shots; ++is)
+  {
+    misfit_per_shot[is] = 0.0;
+    for (int ir = 0; ir < nr; ++ir)
+    {
+      auto trace_misfit = misfit_per_trace[linear_IDX(is, ir, n_shots, nr)];
+      misfit_per_shot[is] += trace_misfit;
+      misfit_per_receiver[ir] += trace_misfit;
+    }
+    misfit += misfit_per_shot[is];
+  }
+}
+
+void fdModel::calculate_traveltime_misfit_and_adjoint_sources()
+{
+  calculate_trace_misfits(&fdModel::traveltime_misfit_trace);
+}
+
+void fdModel::calculate_envelope_misfit_and_adjoint_sources()
+{
+  calculate_trace_misfits(&fdModel::envelope_misfit_trace);
+}
+
+void fdModel::calculate_correlation_misfit_and_adjoint_sources()
+{
+  calculate_trace_misfits(&fdModel::correlation_misfit_trace);
+}
+
+void fdModel::calculate_trace_misfits(trace_misfit_function misfit_function)
+{
+#pragma omp parallel for collapse(2)
+  for (int is = 0; is < n_shots; ++is)
+  {
+    for (int ir = 0; ir < nr; ++ir)
+    {
+      auto idx_trace = linear_IDX(is, ir, 0, n_shots, nr, nt);
+      misfit_per_trace[linear_IDX(is, ir, n_shots, nr)] =
+          (this->*misfit_function)(rtf_ux + idx_trace, rtf_ux_true + idx_trace,
+                                   a_stf_ux + idx_trace) +
+          (this->*misfit_function)(rtf_uz + idx_trace, rtf_uz_true + idx_trace,
+                                   a_stf_uz + idx_trace);
+    }
+  }
+
+  reduce_trace_misfits();
+}
+
+real_simulation fdModel::traveltime_misfit_trace(const real_simulation *synthetic,
+                                                 const real_simulation *observed,
+                                                 real_simulation *adjoint_source) const
+{
+  // Velocity of the synthetic trace, which gives the adjoint source.
+  std::vector<real_simulation> synthetic_velocity(nt);
+  real_simulation velocity_energy = 0.0;
+  for (int it = 0; it < nt; ++it)
+  {
+    auto previous = it > 0 ? synthetic[it - 1] : 0.0;
+    auto next = it < nt - 1 ? synthetic[it + 1] : 0.0;
+    synthetic_velocity[it] = (next - previous) / (2 * dt);
+    velocity_energy += dt * synthetic_velocity[it] * synthetic_velocity[it];
+  }
+
+  real_simulation observed_energy = 0.0;
+  for (int it = 0; it < nt; ++it)
+  {
+    observed_energy += observed[it] * observed[it];
+  }
+
+  if (velocity_energy == 0.0 or observed_energy == 0.0)
+  {
+    std::fill(adjoint_source, adjoint_source + nt, 0.0);
+    return 0.0;
+  }
+
+  // Cross-correlation by zero padded FFT, lag k at index k modulo n_fft.
+  const int n_fft = 2 * nt;
+  Eigen::FFT<real_simulation> fft;
+  std::vector<real_simulation> padded(n_fft, 0.0);
+  std::vector<std::complex<real_simulation>> synthetic_spectrum, observed_spectrum;
+  std::copy(synthetic, synthetic + nt, padded.begin());
+  fft.fwd(synthetic_spectrum, padded);
+  std::copy(observed, observed + nt, padded.begin());
+  fft.fwd(observed_spectrum, padded);
+  for (int i_frequency = 0; i_frequency < n_fft; ++i_frequency)
+  {
+    synthetic_spectrum[i_frequency] *= std::conj(observed_spectrum[i_frequency]);
+  }
+  std::vector<real_simulation> correlation;
+  fft.inv(correlation, synthetic_spectrum);
+
+  int best_lag = 0;
+  for (int lag = -(nt - 1); lag < nt; ++lag)
+  {
+    if (correlation[(lag + n_fft) % n_fft] > correlation[(best_lag + n_fft) % n_fft])
+    {
+      best_lag = lag;
+    }
+  }
+
+  // Sub-sample refinement with a parabola through the peak.
+  auto before = correlation[(best_lag - 1 + n_fft) % n_fft];
+  auto peak = correlation[(best_lag + n_fft) % n_fft];
+  auto after = correlation[(best_lag + 1 + n_fft) % n_fft];
+  auto curvature = before - 2 * peak + after;
+  real_simulation fraction = curvature < 0.0 ? 0.5 * (before - after) / curvature : 0.0;
+
+  // Positive when the synthetic arrives late.
+  auto traveltime_shift = (best_lag + fraction) * dt;
+
+  for (int it = 0; it < nt; ++it)
+  {
+    adjoint_source[it] = -traveltime_shift * synthetic_velocity[it] / velocity_energy;
+  }
+
+  return 0.5 * traveltime_shift * traveltime_shift;
+}
+
+real_simulation fdModel::envelope_misfit_trace(const real_simulation *synthetic,
+                                               const real_simulation *observed,
+                                               real_simulation *adjoint_source) const
+{
+  std::vector<real_simulation> synthetic_hilbert(nt), observed_hilbert(nt);
+  hilbert_transform(synthetic, synthetic_hilbert.data());
+  hilbert_transform(observed, observed_hilbert.data());
+
+  std::vector<real_simulation> synthetic_envelope(nt);
+  std::vector<real_simulation> envelope_difference(nt);
+  real_simulation maximum_envelope = 0.0;
+  real_simulation trace_misfit = 0.0;
+  for (int it = 0; it < nt; ++it)
+  {
+    synthetic_envelope[it] =
+        std::sqrt(synthetic[it] * synthetic[it] +
+                  synthetic_hilbert[it] * synthetic_hilbert[it]);
+    envelope_difference[it] =
+        synthetic_envelope[it] - std::sqrt(observed[it] * observed[it] +
+                                           observed_hilbert[it] * observed_hilbert[it]);
+    maximum_envelope = std::max(maximum_envelope, synthetic_envelope[it]);
+    trace_misfit += 0.5 * dt * envelope_difference[it] * envelope_difference[it];
+  }
+
+  if (maximum_envelope == 0.0)
+  {
+    std::fill(adjoint_source, adjoint_source + nt, 0.0);
+    return trace_misfit;
+  }
+
+  // Adjoint source dE s / E - H(dE H(s) / E), with a water level on E.
+  const real_simulation water_level = 1e-10 * maximum_envelope;
+  std::vector<real_simulation> weighted_hilbert(nt), transformed(nt);
+  for (int it = 0; it < nt; ++it)
+  {
+    auto weight = envelope_difference[it] / (synthetic_envelope[it] + water_level);
+    adjoint_source[it] = weight * synthetic[it];
+    weighted_hilbert[it] = weight * synthetic_hilbert[it];
+  }
+  hilbert_transform(weighted_hilbert.data(), transformed.data());
+  for (int it = 0; it < nt; ++it)
+  {
+    adjoint_source[it] -= transformed[it];
+  }
+
+  return trace_misfit;
+}
+
+real_simulation fdModel::correlation_misfit_trace(const real_simulation *synthetic,
+                                                  const real_simulation *observed,
+                                                  real_simulation *adjoint_source) const
+{
+  real_simulation cross = 0.0;
+  real_simulation synthetic_energy = 0.0;
+  real_simulation observed_energy = 0.0;
+  for (int it = 0; it < nt; ++it)
+  {
+    cross += dt * synthetic[it] * observed[it];
+    synthetic_energy += dt * synthetic[it] * synthetic[it];
+    observed_energy += dt * observed[it] * observed[it];
+  }
+
+  if (synthetic_energy == 0.0 or observed_energy == 0.0)
+  {
+    std::fill(adjoint_source, adjoint_source + nt, 0.0);
+    return 0.0;
+  }
+
+  auto norms = std::sqrt(synthetic_energy * observed_energy);
+  auto correlation = cross / norms;
+  for (int it = 0; it < nt; ++it)
+  {
+    adjoint_source[it] = -(observed[it] / norms - correlation * synthetic[it] /
+                                                      synthetic_energy);
+  }
+
+  return 1.0 - correlation;
+}
+
+void fdModel::hilbert_transform(const real_simulation *trace,
+                                real_simulation *transformed) const
+{
+  // Multiplication by -i sign(f) of the zero padded spectrum, which is exactly
+  // anti-self-adjoint after truncation to nt samples.
+  const int n_fft = 2 * nt;
+  Eigen::FFT<real_simulation> fft;
+  std::vector<real_simulation> padded(n_fft, 0.0);
+  std::copy(trace, trace + nt, padded.begin());
+  std::vector<std::complex<real_simulation>> spectrum;
+  fft.fwd(spectrum, padded);
+  spectrum[0] = 0.0;
+  spectrum[nt] = 0.0;
+  for (int i_frequency = 1; i_frequency < nt; ++i_frequency)
+  {
+    spectrum[i_frequency] *= std::complex<real_simulation>(0.0, -1.0);
+    spectrum[n_fft - i_frequency] *= std::complex<real_simulation>(0.0, 1.0);
+  }
+  std::vector<real_simulation> result;
+  fft.inv(result, spectrum);
+  std::copy(result.begin(), result.begin() + nt, transformed);
+}
+
+void fdModel::low_pass_filter(const real_simulation *trace, real_simulation *filtered,
+                              real_simulation max_frequency) const
+{
+  // A causal filter keeps signals zero before the first sample, so filtering the
+  // source time functions and the seismograms gives consistent data.
+  const int order = 6;
+  if (max_frequency >= 0.5 / dt)
+  {
+    std::copy(trace, trace + nt, filtered);
+    return;
+  }
+
+  std::copy(trace, trace + nt, filtered);
+  // Cascade of second order sections, bilinear transform of the Butterworth poles.
+  const real_simulation w0 = 2.0 * PI * max_frequency * dt;
+  for (int i_section = 0; i_section < order / 2; ++i_section)
+  {
+    real_simulation q = 1.0 / (2.0 * sin(PI * (2 * i_section + 1) / (2.0 * order)));
+    real_simulation alpha_section = sin(w0) / (2.0 * q);
+    real_simulation a0 = 1.0 + alpha_section;
+    real_simulation b0 = (1.0 - cos(w0)) / (2.0 * a0);
+    real_simulation b1 = (1.0 - cos(w0)) / a0;
+    real_simulation a1 = -2.0 * cos(w0) / a0;
+    real_simulation a2 = (1.0 - alpha_section) / a0;
+
+    real_simulation x1 = 0.0, x2 = 0.0, y1 = 0.0, y2 = 0.0;
+    for (int it = 0; it < nt; ++it)
+    {
+      real_simulation x0 = filtered[it];
+      real_simulation y0 = b0 * x0 + b1 * x1 + b0 * x2 - a1 * y1 - a2 * y2;
+      x2 = x1;
+      x1 = x0;
+      y2 = y1;
+      y1 = y0;
+      filtered[it] = y0;
+    }
+  }
+}
+
+void fdModel::map_kernels_to_velocity()
+{
+#pragma omp parallel for collapse(2)
+  for (int ix = 0; ix < nx; ++ix)
+  {
+    for (int iz = 0; iz < nz; ++iz)
+    {
+      auto idx = linear_IDX(ix, iz, nx, nz);
+      vp_kernel[idx] = 2 * vp[idx] * lambda_kernel[idx] / b_vx[idx];
+      vs_kernel[idx] = (2 * vs[idx] * mu_kernel[idx] -
+                        4 * vs[idx] * lambda_kernel[idx]) /
+                       b_vx[idx];
+      density_v_kernel[idx] =
+          density_l_kernel[idx] +
+          (vp[idx] * vp[idx] - 2 * vs[idx] * vs[idx]) *
+              lambda_kernel[idx] +
+          vs[idx] * vs[idx] * mu_kernel[idx];
+
+      // Kernels that were not selected lack some of their terms.
+      if (not(kernel_selection & kernel_vp))
+      {
+        vp_kernel[idx] = 0.0;
+      }
+      if (not(kernel_selection & kernel_vs))
+      {
+        vs_kernel[idx] = 0.0;
+      }
+      if (not(kernel_selection & kernel_rho))
+      {
+        density_v_kernel[idx] = 0.0;
+      }
+    }
+  }
+}
+
+void fdModel::load_model(const std::string &de_path, const std::string &vp_path,
+                         const std::string &vs_path, bool verbose)
+{
+  if (!file_exists(de_path) or !file_exists(vp_path) or !file_exists(vs_path))
+  {
+    throw std::invalid_argument("The files for target models don't seem to exist.\r\n"
+                                "Paths:\r\n"
+                                "\tDensity target: " +
+                                de_path +
+                                "\r\n"
+                                "\tP-wave target : " +
+                                vp_path +
+                                "\r\n"
+                                "\tS-wave target : " +
+                                vs_path + "\r\n");
+  }
+
+  double startTime = 0;
+  if (verbose)
+  {
+    std::cout << "Loading models." << std::endl;
+    std::cout << "File for density: " << de_path << std::endl;
+    std::cout << "File for P-wave velocity: " << vp_path << std::endl;
+    std::cout << "File for S-wave velocity: " << vs_path << std::endl;
+    startTime = omp_get_wtime();
+  }
+
+  // Files are stored in the same (x major) order as the fields.
+  load_values(de_path, size_t(nx) * nz, rho);
+  load_values(vp_path, size_t(nx) * nz, vp);
+  load_values(vs_path, size_t(nx) * nz, vs);
+
+  update_from_velocity();
+  if (verbose)
+  {
+    std::cout << "Seconds elapsed for loading models: " << omp_get_wtime() - startTime
+              << std::endl
+              << std::endl;
+  }
+}
+
+void fdModel::run_model(bool verbose, bool simulate_adjoint)
+{
+  if (shot_window_aperture > 0)
+  {
+    // Every window model holds the snapshots of its own shot.
+    if (simulate_adjoint)
+    {
+      reset_kernels();
+    }
+    for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+    {
+      shot_window window = get_shot_window(i_shot, shot_window_aperture);
+      fdModel window_model(*this, window);
+      window_model.run_model(verbose, simulate_adjoint);
+      add_shot_window_results(window_model, window, simulate_adjoint);
+    }
+    reduce_trace_misfits();
+    if (simulate_adjoint)
+    {
+      map_kernels_to_velocity();
+    }
+    return;
+  }
+
+  if (shot_batch_size > 1)
+  {
+    for (int i_first = 0; i_first < n_shots; i_first += shot_batch_size)
+    {
+      std::vector<int> batch;
+      for (int i_shot = i_first; i_shot < std::min(n_shots, i_first + shot_batch_size);
+           ++i_shot)
+      {
+        batch.push_back(i_shot);
+      }
+      forward_simulate_batch(batch, true, verbose);
+    }
+  }
+  else
+  {
+    for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+    {
+      forward_simulate(i_shot, true, verbose);
+    }
+  }
+  if (simulate_adjoint)
+  {
+    calculate_l2_misfit_and_adjoint_sources();
+    reset_kernels();
+    for (int is = 0; is < n_shots; ++is)
+    {
+      adjoint_simulate(is, verbose);
+    }
+    map_kernels_to_velocity();
+  }
+  else
+  {
+    calculate_l2_misfit();
+  }
+}
+
+shot_window fdModel::get_shot_window(int i_shot, int aperture) const
+{
+  if (i_shot < 0 or i_shot >= n_shots or aperture < 0)
+  {
+    throw std::invalid_argument("Shot index out of range or negative aperture.");
+  }
+  if (which_source_to_fire_in_which_shot[i_shot].empty())
+  {
+    throw std::invalid_argument("The shot fires no sources.");
+  }
+
+  int ix_min = nx_inner;
+  int ix_max = -1;
+  for (const auto &i_source : which_source_to_fire_in_which_shot[i_shot])
+  {
+    ix_min = std::min(ix_min, ix_sources[i_source] - np_boundary);
+    ix_max = std::max(ix_max, ix_sources[i_source] - np_boundary);
+  }
+  // The live receiver spread of the shot, i.e. the receivers with observed data.
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    if (receiver_has_observed_data(i_shot, i_receiver))
+    {
+      ix_min = std::min(ix_min, ix_receivers[i_receiver] - np_boundary);
+      ix_max = std::max(ix_max, ix_receivers[i_receiver] - np_boundary);
+    }
+  }
+
+  shot_window window;
+  window.i_shot = i_shot;
+  window.ix_start = std::max(ix_min - aperture, 0);
+  window.ix_end = std::min(ix_max + aperture, nx_inner - 1);
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    int ix = ix_receivers[i_receiver] - np_boundary;
+    if (ix >= window.ix_start and ix <= window.ix_end)
+    {
+      window.receivers.push_back(i_receiver);
+    }
+  }
+  return window;
+}
+
+bool fdModel::receiver_has_observed_data(int i_shot, int i_receiver) const
+{
+  auto idx = linear_IDX(i_shot, i_receiver, 0, n_shots, nr, nt);
+  for (int it = 0; it < nt; ++it)
+  {
+    if (rtf_ux_true[idx + it] != 0.0 or rtf_uz_true[idx + it] != 0.0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void fdModel::add_shot_window_results(const fdModel &window_model,
+                                      const shot_window &window, bool add_kernels)
+{
+  // Receivers outside of the window have no observed data for the shot, see
+  // get_shot_window(), and do not record it.
+  for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+  {
+    auto idx = linear_IDX(window.i_shot, i_receiver, 0, n_shots, nr, nt);
+    std::fill(rtf_ux + idx, rtf_ux + idx + nt, 0.0);
+    std::fill(rtf_uz + idx, rtf_uz + idx + nt, 0.0);
+    std::fill(a_stf_ux + idx, a_stf_ux + idx + nt, 0.0);
+    std::fill(a_stf_uz + idx, a_stf_uz + idx + nt, 0.0);
+    misfit_per_trace[linear_IDX(window.i_shot, i_receiver, n_shots, nr)] = 0.0;
+  }
+  for (int i_receiver = 0; i_receiver < window_model.nr; ++i_receiver)
+  {
+    auto receiver = window.receivers[i_receiver];
+    auto idx = linear_IDX(window.i_shot, receiver, 0, n_shots, nr, nt);
+    auto idx_window = linear_IDX(0, i_receiver, 0, 1, window_model.nr, nt);
+    std::copy(window_model.rtf_ux + idx_window, window_model.rtf_ux + idx_window + nt,
+              rtf_ux + idx);
+    std::copy(window_model.rtf_uz + idx_window, window_model.rtf_uz + idx_window + nt,
+              rtf_uz + idx);
+    std::copy(window_model.a_stf_ux + idx_window,
+              window_model.a_stf_ux + idx_window + nt, a_stf_ux + idx);
+    std::copy(window_model.a_stf_uz + idx_window,
+              window_model.a_stf_uz + idx_window + nt, a_stf_uz + idx);
+    misfit_per_trace[linear_IDX(window.i_shot, receiver, n_shots, nr)] =
+        window_model.misfit_per_trace[i_receiver];
+  }
+
+  if (!add_kernels)
+  {
+    return;
+  }
+  // Kernels are only computed inside the inner boundary of this model.
+  const int ix_start =
+      std::max(window.ix_start, nx_inner_boundary) + np_boundary;
+  const int ix_end =
+      std::min(window.ix_end + 1, nx_inner - nx_inner_boundary) + np_boundary;
+#pragma omp parallel for collapse(2)
+  for (int ix = ix_start; ix < ix_end; ++ix)
+  {
+    for (int iz = 0; iz < nz; ++iz)
+    {
+      auto idx = linear_IDX(ix, iz, nx, nz);
+      auto idx_window =
+          linear_IDX(ix - window.ix_start, iz, window_model.nx, window_model.nz);
+      lambda_kernel[idx] += window_model.lambda_kernel[idx_window];
+      mu_kernel[idx] += window_model.mu_kernel[idx_window];
+      density_l_kernel[idx] += window_model.density_l_kernel[idx_window];
+      forward_illumination[idx] += window_model.forward_illumination[idx_window];
+      adjoint_illumination[idx] += window_model.adjoint_illumination[idx_window];
+    }
+  }
+}
+
+lbfgs_result fdModel::minimize_lbfgs(const lbfgs_settings &settings, bool verbose)
+{
+  Eigen::VectorXd x = get_model_vector().cast<double>();
+
+  lbfgs optimizer(settings);
+  auto result = optimizer.minimize(
+      [this](const Eigen::VectorXd &m, Eigen::VectorXd &g) {
+        set_model_vector(m.cast<real_simulation>());
+        run_model(false, true);
+        g = get_gradient_vector().cast<double>();
+        return double(misfit);
+      },
+      x, verbose);
+
+  set_model_vector(x.cast<real_simulation>());
+  return result;
+}
+
+int fdModel::coarsening_factor(real_simulation max_frequency,
+                               real_simulation points_per_wavelength) const
+{
+  if (max_frequency <= 0.0 or points_per_wavelength <= 0.0)
+  {
+    throw std::invalid_argument(
+        "The maximum frequency and points per wavelength should be positive.");
+  }
+
+  real_simulation min_velocity, max_velocity;
+  velocity_extremes(min_velocity, max_velocity);
+  real_simulation largest_spacing =
+      min_velocity / (max_frequency * points_per_wavelength);
+  int coarsening = std::max(1, int(largest_spacing / std::max(dx, dz)));
+
+  // Keep at least one free grid point in every direction, with the same rounding
+  // as the coarsening constructor.
+  auto free_points = [&](int n_inner, int n_inner_boundary) {
+    return (n_inner - 1) / coarsening + 1 -
+           2 * ((n_inner_boundary + coarsening - 1) / coarsening);
+  };
+  while (coarsening > 1 and (free_points(nx_inner, nx_inner_boundary) < 1 or
+                             free_points(nz_inner, nz_inner_boundary) < 1))
+  {
+    coarsening--;
+  }
+  return coarsening;
+}
+
+std::vector<multiscale_stage_result>
+fdModel::minimize_multiscale(const std::vector<multiscale_stage> &stages, bool verbose)
+{
+  std::vector<multiscale_stage_result> results;
+  for (const auto &stage : stages)
+  {
+    int coarsening = coarsening_factor(stage.max_frequency, stage.points_per_wavelength);
+    if (verbose)
+    {
+      std::cout << "Multiscale stage up to " << stage.max_frequency
+                << " Hz, grid coarsened by a factor " << coarsening << "." << std::endl;
+    }
+
+    fdModel coarse(*this, coarsening, stage.max_frequency);
+    const fdModel coarse_start(coarse, false);
+    auto optimization = coarse.minimize_lbfgs(stage.optimizer, verbose);
+    add_coarse_update(coarse, coarse_start, coarsening);
+
+    results.push_back({coarsening, optimization});
+  }
+  return results;
+}
+
+void fdModel::add_coarse_update(const fdModel &coarse, const fdModel &coarse_start,
+                                int coarsening)
+{
+  const real_simulation *fields[3] = {coarse.vp, coarse.vs, coarse.rho};
+  const real_simulation *start_fields[3] = {coarse_start.vp, coarse_start.vs,
+                                            coarse_start.rho};
+  real_simulation *fine_fields[3] = {vp, vs, rho};
+
+#pragma omp parallel for collapse(2)
+  for (int ix = np_boundary + nx_inner_boundary;
+       ix < np_boundary + nx_inner - nx_inner_boundary; ++ix)
+  {
+    for (int iz = np_boundary + nz_inner_boundary;
+         iz < np_boundary + nz_inner - nz_inner_boundary; ++iz)
+    {
+      // Position on the coarse grid, which shares the first grid point inside the
+      // absorbing boundary.
+      real_simulation x =
+          coarse.np_boundary + real_simulation(ix - np_boundary) / coarsening;
+      real_simulation z =
+          coarse.np_boundary + real_simulation(iz - np_boundary) / coarsening;
+      for (int i_field = 0; i_field < 3; ++i_field)
+      {
+        fine_fields[i_field][linear_IDX(ix, iz, nx, nz)] +=
+            coarse.interpolate_field(fields[i_field], x, z) -
+            coarse.interpolate_field(start_fields[i_field], x, z);
+      }
+    }
+  }
+
+  // Project onto the basis functions; this also updates the Lamé fields.
+  set_model_vector(get_model_vector());
+}
+
+real_simulation fdModel::interpolate_field(const real_simulation *field,
+                                           real_simulation x, real_simulation z) const
+{
+  x = std::min(std::max(x, real_simulation(0.0)), real_simulation(nx - 1));
+  z = std::min(std::max(z, real_simulation(0.0)), real_simulation(nz - 1));
+  int ix = std::min(int(x), nx - 2);
+  int iz = std::min(int(z), nz - 2);
+  real_simulation wx = x - ix;
+  real_simulation wz = z - iz;
+
+  return (1 - wx) * (1 - wz) * field[linear_IDX(ix, iz, nx, nz)] +
+         wx * (1 - wz) * field[linear_IDX(ix + 1, iz, nx, nz)] +
+         (1 - wx) * wz * field[linear_IDX(ix, iz + 1, nx, nz)] +
+         wx * wz * field[linear_IDX(ix + 1, iz + 1, nx, nz)];
+}
+
+void fdModel::velocity_extremes(real_simulation &min_velocity,
+                                real_simulation &max_velocity) const
+{
+  min_velocity = std::numeric_limits<real_simulation>::infinity();
+  max_velocity = 0.0;
+  for (int idx = 0; idx < nx * nz; ++idx)
+  {
+    min_velocity = std::min(min_velocity, vp[idx]);
+    max_velocity = std::max(max_velocity, vp[idx]);
+    if (vs[idx] > 0.0)
+    {
+      min_velocity = std::min(min_velocity, vs[idx]);
+    }
+  }
+}
+
+real_simulation fdModel::stable_time_step(real_simulation max_velocity,
+                                          real_simulation dx, real_simulation dz) const
+{
+  // Courant limit of the staggered grid scheme, 1 / (v (|c1| + |c2|) |k_dx|).
+  return 1.0 / (max_velocity * (std::abs(c1) + std::abs(c2)) *
+                std::sqrt(1.0 / (dx * dx) + 1.0 / (dz * dz)));
+}
+
+real_simulation fdModel::max_stable_time_step() const
+{
+  real_simulation min_velocity, max_velocity;
+  velocity_extremes(min_velocity, max_velocity);
+  return stable_time_step(max_velocity, dx, dz);
+}
+
+simulation_plan fdModel::plan_simulation(real_simulation points_per_wavelength,
+                                         real_simulation courant_safety,
+                                         real_simulation frequency_factor) const
+{
+  if (points_per_wavelength <= 0.0 or courant_safety <= 0.0 or courant_safety > 1.0 or
+      frequency_factor <= 0.0)
+  {
+    throw std::invalid_argument("The points per wavelength and frequency factor "
+                                "should be positive, and the Courant safety in (0, 1].");
+  }
+
+  real_simulation min_velocity, max_velocity;
+  velocity_extremes(min_velocity, max_velocity);
+
+  simulation_plan plan;
+  plan.max_frequency = frequency_factor * peak_frequency;
+  real_simulation scale =
+      min_velocity / (plan.max_frequency * points_per_wavelength) / std::max(dx, dz);
+  plan.dx = dx * scale;
+  plan.dz = dz * scale;
+  plan.nx_inner = int(std::lround((nx_inner - 1) / scale)) + 1;
+  plan.nz_inner = int(std::lround((nz_inner - 1) / scale)) + 1;
+
+  plan.max_stable_dt = stable_time_step(max_velocity, plan.dx, plan.dz);
+  plan.current_max_stable_dt = stable_time_step(max_velocity, dx, dz);
+  plan.dt = courant_safety * plan.max_stable_dt;
+  plan.nt = int(std::floor((nt - 1) * dt / plan.dt)) + 1;
+
+  plan.relative_cost = double(plan.nx_inner + 2 * np_boundary) *
+                       (plan.nz_inner + 2 * np_boundary) * plan.nt /
+                       (double(nx) * nz * nt);
+  return plan;
+}
+
+void fdModel::run_on_workers(int n_items, int n_workers, bool snapshot_storage,
+                             const worker_function &work)
+{
+  if (n_items <= 0)
+  {
+    return;
+  }
+  n_workers = count_workers(n_items, n_workers);
+  const int threads_per_worker = std::max(1, omp_get_max_threads() / n_workers);
+
+  std::vector<std::exception_ptr> errors(n_workers);
+  std::vector<std::thread> workers;
+
+  for (int i_worker = 0; i_worker < n_workers; ++i_worker)
+  {
+    workers.emplace_back([&, i_worker]() {
+      try
+      {
+        // The thread count only applies to parallel regions of this thread.
+        omp_set_num_threads(threads_per_worker);
+        fdModel worker(*this, false);
+        if (snapshot_storage)
+        {
+          worker.share_snapshot_slot();
+        }
+        const int first_item =
+            int(static_cast<long long>(i_worker) * n_items / n_workers);
+        const int end_item =
+            int(static_cast<long long>(i_worker + 1) * n_items / n_workers);
+        for (int item = first_item; item < end_item; ++item)
+        {
+          work(worker, i_worker, item);
+        }
+      }
+      catch (...)
+      {
+        errors[i_worker] = std::current_exception();
+      }
+    });
+  }
+  for (auto &worker : workers)
+  {
+    worker.join();
+  }
+  for (const auto &error : errors)
+  {
+    if (error)
+    {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+int fdModel::count_workers(int n_items, int n_workers) const
+{
+  if (n_workers <= 0)
+  {
+    n_workers = std::max(1, int(std::thread::hardware_concurrency()));
+  }
+  return std::max(1, std::min(n_workers, n_items));
+}
+
+void fdModel::evaluate_models(const dynamic_matrix &model_vectors,
+                              dynamic_vector &misfits, dynamic_matrix &gradients,
+                              int n_workers)
+{
+  const int n_models = model_vectors.rows();
+  const int n_parameters = get_model_vector().size();
+  if (model_vectors.cols() != n_parameters)
+  {
+    throw std::invalid_argument("Every model vector should have " +
+                                std::to_string(n_parameters) + " entries.");
+  }
+
+  misfits = dynamic_vector::Zero(n_models);
+  gradients = dynamic_matrix::Zero(n_models, n_parameters);
+
+  // Work items are ordered model major, so every worker processes the shots of a
+  // few consecutive models, and later workers never process earlier models.
+  const int n_items = n_models * n_shots;
+  n_workers = count_workers(n_items, n_workers);
+  dynamic_vector item_misfits(n_items);
+  // The gradient of every worker and model, in row i_model + i_worker. The rows
+  // of consecutive workers do not overlap; every row records its model.
+  dynamic_matrix worker_gradients =
+      dynamic_matrix::Zero(n_models + n_workers - 1, n_parameters);
+  std::vector<int> worker_gradient_model(n_models + n_workers - 1, -1);
+  std::vector<int> current_model(n_workers, -1);
+
+  run_on_workers(n_items, n_workers, true, [&](fdModel &worker, int i_worker, int item) {
+    const int i_model = item / n_shots;
+    const int i_shot = item % n_shots;
+
+    if (i_model != current_model[i_worker])
+    {
+      worker.set_model_vector(model_vectors.row(i_model).transpose());
+      current_model[i_worker] = i_model;
+      worker_gradient_model[i_model + i_worker] = i_model;
+    }
+
+    worker.forward_simulate(i_shot, true, false);
+
+    worker.accumulate_l2_trace_misfits(true, i_shot, i_shot + 1);
+    real_simulation shot_misfit = 0.0;
+    for (int ir = 0; ir < nr; ++ir)
+    {
+      shot_misfit += worker.misfit_per_trace[linear_IDX(i_shot, ir, n_shots, nr)];
+    }
+    item_misfits[item] = shot_misfit;
+
+    worker.reset_kernels();
+    worker.adjoint_simulate(i_shot, false);
+    worker.map_kernels_to_velocity();
+    worker_gradients.row(i_model + i_worker) += worker.get_gradient_vector().transpose();
+  });
+
+  for (int i_model = 0; i_model < n_models; ++i_model)
+  {
+    for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+    {
+      misfits[i_model] += item_misfits[i_model * n_shots + i_shot];
+    }
+    for (int i_worker = 0; i_worker < n_workers; ++i_worker)
+    {
+      if (worker_gradient_model[i_model + i_worker] == i_model)
+      {
+        gradients.row(i_model) += worker_gradients.row(i_model + i_worker);
       }
     }
+  }
+}
 
-    // Check data was large enough for set up
-    if (!receiver_file_ux.good() or !receiver_file_uz.good())
+real_simulation fdModel::forward_simulate_misfit(int i_shot, real_simulation misfit_bound)
+{
+  if (i_shot < 0 or i_shot >= n_shots)
+  {
+    throw std::invalid_argument("Shot index out of range.");
+  }
+  reset_wavefields();
+
+  // Running displacement and squared residual per receiver replace the traces.
+  std::vector<real_simulation> receiver_ux(nr, 0.0), receiver_uz(nr, 0.0);
+  std::vector<real_simulation> trace_misfits(nr, 0.0);
+  const real_simulation *shot_ux_true =
+      rtf_ux_true + linear_IDX(i_shot, 0, 0, n_shots, nr, nt);
+  const real_simulation *shot_uz_true =
+      rtf_uz_true + linear_IDX(i_shot, 0, 0, n_shots, nr, nt);
+
+  // The running misfit only decides on aborting; the result is summed per trace.
+  real_simulation running_misfit = 0.0;
+  bool aborted = false;
+  for (int it = 0; it < nt; ++it)
+  {
+    real_simulation sample_misfit = 0.0;
+#pragma omp parallel for reduction(+ : sample_misfit)
+    for (int ir = 0; ir < nr; ++ir)
     {
-      std::cout << "Received bad state of file at end of reading! Does "
-                   "the data match the set up?"
-                << std::endl;
-      throw std::invalid_argument("Not enough data is present!");
+      auto idx_loc = linear_IDX(ix_receivers[ir], iz_receivers[ir], nx, nz);
+      receiver_ux[ir] += dt * vx[idx_loc] / (dx * dz);
+      receiver_uz[ir] += dt * vz[idx_loc] / (dx * dz);
+      auto residual_ux = receiver_ux[ir] - shot_ux_true[linear_IDX(ir, it, nr, nt)];
+      auto residual_uz = receiver_uz[ir] - shot_uz_true[linear_IDX(ir, it, nr, nt)];
+      auto residual = residual_ux * residual_ux + residual_uz * residual_uz;
+      trace_misfits[ir] += residual;
+      sample_misfit += residual;
     }
-    // Try to load more data ...
-    receiver_file_ux >> placeholder_ux;
-    receiver_file_uz >> placeholder_uz;
-    // ... which shouldn't be possible
-    if (receiver_file_ux.good() or receiver_file_uz.good())
+    running_misfit += 0.5 * dt * sample_misfit;
+    if (running_misfit > misfit_bound)
     {
-      std::cout << "Received good state of file past reading! Does the "
-                   "data match the set up?"
-                << std::endl;
-      throw std::invalid_argument("Too much data is present!");
+      aborted = true;
+      break;
     }
 
-    receiver_file_uz.close();
-    receiver_file_ux.close();
+    update_stresses(dt);
+    update_velocities(dt);
+    for (const auto &i_source : which_source_to_fire_in_which_shot[i_shot])
+    {
+      inject_source(i_source, it, 1.0);
+    }
   }
+
+  real_simulation shot_misfit = 0.0;
+  for (int ir = 0; ir < nr; ++ir)
+  {
+    misfit_per_trace[linear_IDX(i_shot, ir, n_shots, nr)] = 0.5 * dt * trace_misfits[ir];
+    shot_misfit += misfit_per_trace[linear_IDX(i_shot, ir, n_shots, nr)];
+  }
+  // Rounding in the differently ordered sums should not hide an abort.
+  return aborted ? std::max(shot_misfit, running_misfit) : shot_misfit;
 }
 
-void fdModel::calculate_l2_misfit()
+real_simulation fdModel::forward_simulate_misfit_all(real_simulation misfit_bound)
 {
-  misfit = 0;
+  real_simulation total_misfit = 0.0;
   for (int i_shot = 0; i_shot < n_shots; ++i_shot)
   {
-    for (int i_receiver = 0; i_receiver < nr; ++i_receiver)
+    total_misfit += forward_simulate_misfit(i_shot, misfit_bound - total_misfit);
+    if (total_misfit > misfit_bound)
     {
-      for (int it = 0; it < nt; ++it)
-      {
-
-        auto idx_receiver = linear_IDX(i_shot, i_receiver, it, n_shots, nr, nt);
-
-        misfit += 0.5 * dt * pow(rtf_ux_true[idx_receiver] - rtf_ux[idx_receiver], 2);
-        misfit += 0.5 * dt * pow(rtf_uz_true[idx_receiver] - rtf_uz[idx_receiver], 2);
-      }
+      break;
     }
   }
+  return total_misfit;
 }
 
-void fdModel::calculate_l2_adjoint_sources()
+void fdModel::evaluate_trial_steps(const Eigen::Ref<const dynamic_vector> &model_vector,
+                                   const Eigen::Ref<const dynamic_vector> &direction,
+                                   const std::vector<real_simulation> &steps,
+                                   std::vector<real_simulation> &misfits, int n_workers)
 {
-#pragma omp parallel for collapse(3)
-  for (int is = 0; is < n_shots; ++is)
+  if (model_vector.size() != free_parameters or direction.size() != free_parameters)
   {
-    for (int ir = 0; ir < nr; ++ir)
+    throw std::invalid_argument("The model vector and direction should have " +
+                                std::to_string(free_parameters) + " entries.");
+  }
+
+  const int n_steps = steps.size();
+  const int n_items = n_steps * n_shots;
+  std::vector<real_simulation> item_misfits(n_items);
+  // Indexed by worker; there are at most as many workers as items.
+  std::vector<int> current_step(n_items, -1);
+
+  // Workers only run misfit-only forward simulations, so they need no snapshots.
+  run_on_workers(n_items, n_workers, false, [&](fdModel &worker, int i_worker, int item) {
+    const int i_step = item / n_shots;
+    const int i_shot = item % n_shots;
+
+    if (i_step != current_step[i_worker])
     {
-      for (int it = 0; it < nt; ++it)
-      {
-        auto idx_receiver = linear_IDX(is, ir, it, n_shots, nr, nt);
-        a_stf_ux[idx_receiver] = rtf_ux[idx_receiver] - rtf_ux_true[idx_receiver];
-        a_stf_uz[idx_receiver] = rtf_uz[idx_receiver] - rtf_uz_true[idx_receiver];
-      }
+      worker.set_model_vector(model_vector + steps[i_step] * direction);
+      current_step[i_worker] = i_step;
+    }
+    item_misfits[item] = worker.forward_simulate_misfit(i_shot);
+  });
+
+  misfits.assign(n_steps, 0.0);
+  for (int i_step = 0; i_step < n_steps; ++i_step)
+  {
+    for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+    {
+      misfits[i_step] += item_misfits[i_step * n_shots + i_shot];
     }
   }
 }
 
-void fdModel::map_kernels_to_velocity()
+void fdModel::seed_source_encoding(unsigned int seed) { encoding_generator.seed(seed); }
+
+void fdModel::draw_source_encoding(bool phase_encoding, int max_shift)
+{
+  if (phase_encoding and (max_shift < 0 or max_shift >= nt))
+  {
+    throw std::invalid_argument("The maximum encoding shift should lie in [0, nt).");
+  }
+
+  std::uniform_int_distribution<int> polarity_distribution(0, 1);
+  std::uniform_int_distribution<int> shift_distribution(0,
+                                                        phase_encoding ? max_shift : 0);
+
+  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+  {
+    encoding_polarities[i_shot] =
+        polarity_distribution(encoding_generator) == 0 ? real_simulation(-1.0)
+                                                       : real_simulation(1.0);
+    encoding_shifts[i_shot] = shift_distribution(encoding_generator);
+  }
+}
+
+void fdModel::encode_observed_data()
 {
 #pragma omp parallel for collapse(2)
-  for (int ix = 0; ix < nx; ++ix)
+  for (int ir = 0; ir < nr; ++ir)
   {
-    for (int iz = 0; iz < nz; ++iz)
+    for (int it = 0; it < nt; ++it)
     {
-      auto idx = linear_IDX(ix, iz, nx, nz);
-      vp_kernel[idx] = 2 * vp[idx] * lambda_kernel[idx] / b_vx[idx];
-      vs_kernel[idx] = (2 * vs[idx] * mu_kernel[idx] -
-                        4 * vs[idx] * lambda_kernel[idx]) /
-                       b_vx[idx];
-      density_v_kernel[idx] =
-          density_l_kernel[idx] +
-          (vp[idx] * vp[idx] - 2 * vs[idx] * vs[idx]) *
-              lambda_kernel[idx] +
-          vs[idx] * vs[idx] * mu_kernel[idx];
+      real_simulation encoded_ux = 0.0;
+      real_simulation encoded_uz = 0.0;
+      for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+      {
+        int it_shot = it - encoding_shifts[i_shot];
+        if (it_shot < 0)
+          continue;
+
+        auto idx_receiver = linear_IDX(i_shot, ir, it_shot, n_shots, nr, nt);
+        encoded_ux += encoding_polarities[i_shot] * rtf_ux_true[idx_receiver];
+        encoded_uz += encoding_polarities[i_shot] * rtf_uz_true[idx_receiver];
+      }
+      auto idx_encoded = linear_IDX(ir, it, nr, nt);
+      rtf_ux_true_encoded[idx_encoded] = encoded_ux;
+      rtf_uz_true_encoded[idx_encoded] = encoded_uz;
     }
   }
 }
 
-void fdModel::load_model(const std::string &de_path, const std::string &vp_path,
-                         const std::string &vs_path, bool verbose)
+void fdModel::forward_simulate_encoded(bool store_fields, bool verbose)
 {
-  std::ifstream de_file;
-  std::ifstream vp_file;
-  std::ifstream vs_file;
+  if (store_fields)
+  {
+    require_snapshot_storage();
+  }
 
-  de_file.open(de_path);
-  vp_file.open(vp_path);
-  vs_file.open(vs_path);
+  reset_wavefields();
 
-  // Check if the file actually exists
+  double startTime = 0, stopTime = 0, secsElapsed = 0;
   if (verbose)
   {
-    std::cout << "Loading models." << std::endl;
-    std::cout << "File: " << de_path << std::endl;
-    std::cout << "File for density is "
-              << (de_file.good() ? "good (exists at least)." : "ungood.") << std::endl;
-    std::cout << "File: " << vp_path << std::endl;
-    std::cout << "File for P-wave velocity is "
-              << (vp_file.good() ? "good (exists at least)." : "ungood.") << std::endl;
-    std::cout << "File: " << vs_path << std::endl;
-    std::cout << "File for S-wave velocity is "
-              << (vs_file.good() ? "good (exists at least)." : "ungood.") << std::endl;
-  }
-  if (!de_file.good() or !vp_file.good() or !vs_file.good())
-  {
-    throw std::invalid_argument("The files for target models don't seem to exist.\r\n"
-                                "Paths:\r\n"
-                                "\tDensity target: " +
-                                de_path +
-                                "\r\n"
-                                "\tP-wave target : " +
-                                vp_path +
-                                "\r\n"
-                                "\tS-wave target : " +
-                                vs_path + "\r\n");
+    startTime = real_simulation(omp_get_wtime());
   }
 
-  real_simulation placeholder_de;
-  real_simulation placeholder_vp;
-  real_simulation placeholder_vs;
-
-  int iter = 0;
-
-  for (int ix = 0; ix < nx; ++ix)
+  for (int it = 0; it < nt; ++it)
   {
-    for (int iz = 0; iz < nz; ++iz)
+    // The supershot borrows the snapshot storage of the first shot.
+    if (it % snapshot_interval == 0 and store_fields)
     {
+      store_snapshot(0, it / snapshot_interval);
+    }
 
-      auto idx = linear_IDX(ix, iz, nx, nz);
-
-      de_file >> placeholder_de;
-      vp_file >> placeholder_vp;
-      vs_file >> placeholder_vs;
+    record_receivers(rtf_ux_encoded, rtf_uz_encoded, it);
 
-      std::cout << iter << " " << ix << " " << iz << " " << de_file.good() << " "
-                << std::endl;
+    update_stresses(dt);
+    update_velocities(dt);
 
-      rho[idx] = placeholder_de;
-      vp[idx] = placeholder_vp;
-      vs[idx] = placeholder_vs;
-      iter++;
+    // Fire the sources of every shot, each shot with its own polarity and delay.
+    for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+    {
+      int it_shot = it - encoding_shifts[i_shot];
+      if (it_shot < 0)
+        continue;
 
-      if (!de_file.good() or !vp_file.good() or !vs_file.good())
+      for (const auto &i_source : which_source_to_fire_in_which_shot[i_shot])
       {
-        throw std::invalid_argument("Received bad state of one of the files at end of "
-                                    "reading. Does the data match the domain?");
+        inject_source(i_source, it_shot, encoding_polarities[i_shot]);
       }
     }
   }
 
-  // Check data was large enough for set up
-  if (!de_file.good() or !vp_file.good() or !vs_file.good())
+  if (verbose)
   {
-    std::cout << "Received bad state of one of the files at end of "
-                 "reading. Does the data match the domain?"
-              << std::endl
-              << "File states: " << std::endl
-              << "Density:" << de_file.good() << std::endl
-              << "P-wave: " << vp_file.good() << std::endl
-              << "S-Wave: " << vs_file.good() << std::endl;
-    throw std::invalid_argument("Not enough data is present!");
-  }
-  // Try to load more data ...
-  de_file >> placeholder_de;
-  vp_file >> placeholder_vp;
-  vs_file >> placeholder_vs;
-  // ... which shouldn't be possible
-  if (de_file.good() or vp_file.good() or vs_file.good())
-  {
-    std::cout << "Received good state of file past reading. Does the data "
-                 "match the domain?"
+    stopTime = omp_get_wtime();
+    secsElapsed = stopTime - startTime;
+    std::cout << "Seconds elapsed for encoded forward wave simulation: " << secsElapsed
               << std::endl;
-    throw std::invalid_argument("Too much data is present!");
   }
+}
 
-  de_file.close();
-  vp_file.close();
-  vs_file.close();
+void fdModel::adjoint_simulate_encoded(bool verbose)
+{
+  adjoint_simulate_slot(0, a_stf_ux_encoded, a_stf_uz_encoded, verbose);
+}
 
-  update_from_velocity();
-  if (verbose)
-    std::cout << std::endl;
+void fdModel::calculate_encoded_l2_misfit() { accumulate_encoded_l2_misfit(false); }
+
+void fdModel::calculate_encoded_l2_misfit_and_adjoint_sources()
+{
+  accumulate_encoded_l2_misfit(true);
 }
 
-void fdModel::run_model(bool verbose, bool simulate_adjoint)
+void fdModel::accumulate_encoded_l2_misfit(bool store_adjoint_sources)
 {
-  for (int i_shot = 0; i_shot < n_shots; ++i_shot)
+  // Every trace is summed by a single thread and the traces are reduced in a fixed
+  // order, as in accumulate_l2_trace_misfits().
+  std::vector<real_simulation> trace_misfits(nr);
+#pragma omp parallel for
+  for (int ir = 0; ir < nr; ++ir)
   {
-    forward_simulate(i_shot, true, verbose);
+    auto idx_trace = linear_IDX(ir, 0, nr, nt);
+    real_simulation trace_misfit = 0.0;
+    if (store_adjoint_sources)
+    {
+#pragma omp simd reduction(+ : trace_misfit)
+      for (int it = 0; it < nt; ++it)
+      {
+        auto residual_ux =
+            rtf_ux_encoded[idx_trace + it] - rtf_ux_true_encoded[idx_trace + it];
+        auto residual_uz =
+            rtf_uz_encoded[idx_trace + it] - rtf_uz_true_encoded[idx_trace + it];
+        a_stf_ux_encoded[idx_trace + it] = residual_ux;
+        a_stf_uz_encoded[idx_trace + it] = residual_uz;
+        trace_misfit += residual_ux * residual_ux + residual_uz * residual_uz;
+      }
+    }
+    else
+    {
+#pragma omp simd reduction(+ : trace_misfit)
+      for (int it = 0; it < nt; ++it)
+      {
+        auto residual_ux =
+            rtf_ux_encoded[idx_trace + it] - rtf_ux_true_encoded[idx_trace + it];
+        auto residual_uz =
+            rtf_uz_encoded[idx_trace + it] - rtf_uz_true_encoded[idx_trace + it];
+        trace_misfit += residual_ux * residual_ux + residual_uz * residual_uz;
+      }
+    }
+    trace_misfits[ir] = 0.5 * dt * trace_misfit;
   }
-  calculate_l2_misfit();
-  if (simulate_adjoint)
+
+  misfit = 0;
+  for (int ir = 0; ir < nr; ++ir)
   {
-    calculate_l2_adjoint_sources();
-    reset_kernels();
-    for (int is = 0; is < n_shots; ++is)
+    misfit += trace_misfits[ir];
+  }
+}
+
+void fdModel::calculate_encoded_l2_adjoint_sources()
+{
+#pragma omp parallel for collapse(2)
+  for (int ir = 0; ir < nr; ++ir)
+  {
+    for (int it = 0; it < nt; ++it)
     {
-      adjoint_simulate(is, verbose);
+      auto idx = linear_IDX(ir, it, nr, nt);
+      a_stf_ux_encoded[idx] = rtf_ux_encoded[idx] - rtf_ux_true_encoded[idx];
+      a_stf_uz_encoded[idx] = rtf_uz_encoded[idx] - rtf_uz_true_encoded[idx];
     }
+  }
+}
+
+void fdModel::run_model_encoded(bool verbose, bool simulate_adjoint, bool phase_encoding,
+                                int max_shift)
+{
+  draw_source_encoding(phase_encoding, max_shift);
+  encode_observed_data();
+  forward_simulate_encoded(simulate_adjoint, verbose);
+  accumulate_encoded_l2_misfit(simulate_adjoint);
+  if (simulate_adjoint)
+  {
+    reset_kernels();
+    adjoint_simulate_encoded(verbose);
     map_kernels_to_velocity();
   }
 }
@@ -1319,6 +4112,8 @@ void fdModel::reset_kernels()
       lambda_kernel[idx] = 0.0;
       mu_kernel[idx] = 0.0;
       density_l_kernel[idx] = 0.0;
+      forward_illumination[idx] = 0.0;
+      adjoint_illumination[idx] = 0.0;
     }
   }
 }
@@ -1355,163 +4150,228 @@ void fdModel::write_kernels()
   file_kernel_density.close();
 }
 
-dynamic_vector fdModel::get_model_vector()
+sparse_matrix fdModel::block_basis() const
 {
-  // Assert that the chosen parametrization makes full blocks (i.e. that we
-  // don't have 3 horizontal subdivisions for 20 points, which would result in a
-  // non-rounded number for points per cell)
-  assert(nx_free_parameters % basis_gridpoints_x == 0 and
-         nz_free_parameters % basis_gridpoints_z == 0);
+  const int n_blocks_x = nx_free_parameters / basis_gridpoints_x;
+  const int n_blocks_z = nz_free_parameters / basis_gridpoints_z;
 
-  int n_free_per_par = nx_free_parameters * nz_free_parameters /
-                       (basis_gridpoints_x * basis_gridpoints_z);
+  std::vector<Eigen::Triplet<real_simulation>> entries;
+  entries.reserve(nx_free_parameters * nz_free_parameters);
+  for (int ix = 0; ix < nx_free_parameters; ++ix)
+  {
+    for (int iz = 0; iz < nz_free_parameters; ++iz)
+    {
+      // Parameters are ordered z major.
+      int i_parameter = ix / basis_gridpoints_x + (iz / basis_gridpoints_z) * n_blocks_x;
+      entries.emplace_back(linear_IDX(ix, iz, nx_free_parameters, nz_free_parameters),
+                           i_parameter, 1.0);
+    }
+  }
 
-  dynamic_vector m = dynamic_vector(n_free_per_par * 3, 1);
+  sparse_matrix result(nx_free_parameters * nz_free_parameters,
+                       n_blocks_x * n_blocks_z);
+  result.setFromTriplets(entries.begin(), entries.end());
+  return result;
+}
+
+void fdModel::set_basis(const sparse_matrix &new_basis)
+{
+  if (new_basis.rows() != nx_free_parameters * nz_free_parameters)
+  {
+    throw std::invalid_argument("The basis should have a row for each of the " +
+                                std::to_string(nx_free_parameters * nz_free_parameters) +
+                                " free grid points.");
+  }
 
-  // Loop over points within the free zone, so excluding boundary and non-free
-  // parameters
-  for (int ix = 0; ix < nx_free_parameters / basis_gridpoints_x; ++ix)
+  basis = new_basis;
+  basis.makeCompressed();
+  basis_transpose = basis.transpose();
+  basis_average = basis_transpose;
+  for (int i_parameter = 0; i_parameter < basis_average.outerSize(); ++i_parameter)
   {
-    for (int iz = 0; iz < nz_free_parameters / basis_gridpoints_z; ++iz)
+    real_simulation weight = 0.0;
+    for (sparse_matrix::InnerIterator entry(basis_average, i_parameter); entry; ++entry)
+    {
+      weight += entry.value();
+    }
+    if (weight == 0.0)
     {
-      // Model vector index
-      int i_parameter = ix + iz * nx_free_parameters / basis_gridpoints_x;
+      throw std::invalid_argument("Every basis function should have a nonzero sum.");
+    }
+    for (sparse_matrix::InnerIterator entry(basis_average, i_parameter); entry; ++entry)
+    {
+      entry.valueRef() /= weight;
+    }
+  }
 
-      // Global x index
-      int gix = ix * basis_gridpoints_x + nx_inner_boundary + np_boundary;
-      // Global z index
-      int giz = iz * basis_gridpoints_z + nz_inner_boundary + np_boundary;
+  free_parameters = 3 * basis.cols();
+  basis_workspace.resize(basis.rows());
+}
 
-      m[i_parameter] = 0;
-      m[i_parameter + n_free_per_par] = 0;
-      m[i_parameter + 2 * n_free_per_par] = 0;
+void fdModel::set_snapshot_quadrature(int stride_x, int stride_z)
+{
+  if (stride_x < 1 or stride_z < 1 or stride_x > nx_free_parameters or
+      stride_z > nz_free_parameters)
+  {
+    throw std::invalid_argument("Snapshot strides should lie between 1 and the number "
+                                "of free grid points in their direction.");
+  }
 
-      // Average over the points in the cell
-      // We could easily just retrieve one of the values in the block, but when
-      // loading a model onto the grid, all the gridpoindts might not be the
-      // same value.
-      for (int sub_ix = 0; sub_ix < basis_gridpoints_x; sub_ix++)
-      {
-        for (int sub_iz = 0; sub_iz < basis_gridpoints_z; sub_iz++)
-        {
+  snapshot_stride_x = stride_x;
+  snapshot_stride_z = stride_z;
 
-          auto idx = linear_IDX(gix + sub_ix, giz + sub_iz, nx, nz);
+  deallocate_snapshots();
+  allocate_snapshots();
+}
 
-          m[i_parameter] += vp[idx] /
-                            (basis_gridpoints_x * basis_gridpoints_z);
-          m[i_parameter + n_free_per_par] += vs[idx] /
-                                             (basis_gridpoints_x * basis_gridpoints_z);
-          m[i_parameter + 2 * n_free_per_par] +=
-              rho[idx] /
-              (basis_gridpoints_x * basis_gridpoints_z);
-        }
-      }
-    }
+void fdModel::set_kernel_selection(int selection)
+{
+  if (selection < 1 or selection > kernel_all)
+  {
+    throw std::invalid_argument("The kernel selection should combine kernel_vp, "
+                                "kernel_vs and kernel_rho.");
   }
-  return m;
+
+  kernel_selection = selection;
+
+  deallocate_snapshots();
+  allocate_snapshots();
 }
 
-void fdModel::set_model_vector(dynamic_vector m)
+void fdModel::set_kernel_frequencies(const std::vector<real_simulation> &frequencies)
 {
-  assert(nx_free_parameters % basis_gridpoints_x == 0 and
-         nz_free_parameters % basis_gridpoints_z == 0);
+  std::vector<real_simulation> sorted_frequencies(frequencies);
+  std::sort(sorted_frequencies.begin(), sorted_frequencies.end());
+  const real_simulation nyquist_frequency = 0.5 / (snapshot_interval * dt);
+  for (size_t i_frequency = 0; i_frequency < sorted_frequencies.size(); ++i_frequency)
+  {
+    if (sorted_frequencies[i_frequency] < 0.0 or
+        sorted_frequencies[i_frequency] > (1.0 + 1e-9) * nyquist_frequency or
+        (i_frequency > 0 and
+         sorted_frequencies[i_frequency] == sorted_frequencies[i_frequency - 1]))
+    {
+      throw std::invalid_argument(
+          "Kernel frequencies should be distinct and lie between 0 and the Nyquist "
+          "frequency of the snapshots, " +
+          std::to_string(nyquist_frequency) + " Hz.");
+    }
+  }
 
-  int n_free_per_par = nx_free_parameters * nz_free_parameters /
-                       (basis_gridpoints_x * basis_gridpoints_z);
+  kernel_frequencies = sorted_frequencies;
 
-  assert(m.size() == n_free_per_par * 3);
+  deallocate_snapshots();
+  allocate_snapshots();
+}
 
-  // Loop over points within the free zone, so excluding boundary and non-free
-  // parameters
-  for (int ix = 0; ix < nx_free_parameters / basis_gridpoints_x; ++ix)
+void fdModel::gather_free_grid_points(const real_simulation *field)
+{
+  const int n_points = free_grid_points.size();
+#pragma omp parallel for
+  for (int i_point = 0; i_point < n_points; ++i_point)
   {
-    for (int iz = 0; iz < nz_free_parameters / basis_gridpoints_z; ++iz)
-    {
-      // Model vector index
-      int i_parameter = ix + iz * nx_free_parameters / basis_gridpoints_x;
+    basis_workspace[i_point] = field[free_grid_points[i_point]];
+  }
+}
 
-      // Global x index
-      int gix = ix * basis_gridpoints_x + nx_inner_boundary + np_boundary;
-      // Global z index
-      int giz = iz * basis_gridpoints_z + nz_inner_boundary + np_boundary;
+void fdModel::scatter_free_grid_points(real_simulation *field)
+{
+  const int n_points = free_grid_points.size();
+#pragma omp parallel for
+  for (int i_point = 0; i_point < n_points; ++i_point)
+  {
+    field[free_grid_points[i_point]] = basis_workspace[i_point];
+  }
+}
 
-      // Average over the points in the cell
-      // We could easily just retrieve one of the values in the block, but when
-      // loading a model onto the grid, all the gridpoindts might not be the
-      // same value.
-      for (int sub_ix = 0; sub_ix < basis_gridpoints_x; sub_ix++)
-      {
-        for (int sub_iz = 0; sub_iz < basis_gridpoints_z; sub_iz++)
-        {
+dynamic_vector fdModel::get_model_vector()
+{
+  const int n_per_field = basis.cols();
+  dynamic_vector m(3 * n_per_field);
 
-          auto idx = linear_IDX(gix + sub_ix, giz + sub_iz, nx, nz);
+  real_simulation *fields[3] = {vp, vs, rho};
+  for (int i_field = 0; i_field < 3; ++i_field)
+  {
+    gather_free_grid_points(fields[i_field]);
+    m.segment(i_field * n_per_field, n_per_field).noalias() =
+        basis_average * basis_workspace;
+  }
+  return m;
+}
 
-          vp[idx] = m[i_parameter];
-          vs[idx] = m[i_parameter + n_free_per_par];
-          rho[idx] = m[i_parameter + 2 * n_free_per_par];
-        }
-      }
-    }
+void fdModel::set_model_vector(const Eigen::Ref<const dynamic_vector> &m)
+{
+  const int n_per_field = basis.cols();
+  if (m.size() != 3 * n_per_field)
+  {
+    throw std::invalid_argument("The model vector should have " +
+                                std::to_string(3 * n_per_field) + " entries.");
+  }
+
+  real_simulation *fields[3] = {vp, vs, rho};
+  for (int i_field = 0; i_field < 3; ++i_field)
+  {
+    basis_workspace.noalias() = basis * m.segment(i_field * n_per_field, n_per_field);
+    scatter_free_grid_points(fields[i_field]);
   }
   update_from_velocity();
 }
 
 dynamic_vector fdModel::get_gradient_vector()
 {
-  // Assert that the chosen parametrization makes full blocks (i.e. that we
-  // don't have 3 horizontal subdivisions for 20 points, which would result in a
-  // non-rounded number for points per cell)
-  assert(nx_free_parameters % basis_gridpoints_x == 0 and
-         nz_free_parameters % basis_gridpoints_z == 0);
+  const int n_per_field = basis.cols();
+  dynamic_vector g(3 * n_per_field);
 
-  int n_free_per_par = nx_free_parameters * nz_free_parameters /
-                       (basis_gridpoints_x * basis_gridpoints_z);
-
-  dynamic_vector g = dynamic_vector(n_free_per_par * 3, 1);
-
-  // Loop over points within the free zone, so excluding boundary and non-free
-  // parameters
-  for (int ix = 0; ix < nx_free_parameters / basis_gridpoints_x; ++ix)
+  real_simulation *kernels[3] = {vp_kernel, vs_kernel, density_v_kernel};
+  for (int i_field = 0; i_field < 3; ++i_field)
   {
-    for (int iz = 0; iz < nz_free_parameters / basis_gridpoints_z; ++iz)
-    {
-      // Model vector index
-      int i_parameter = ix + iz * nx_free_parameters / basis_gridpoints_x;
+    gather_free_grid_points(kernels[i_field]);
+    g.segment(i_field * n_per_field, n_per_field).noalias() =
+        basis_transpose * basis_workspace;
+  }
+  return g;
+}
 
-      // Global x index
-      int gix = ix * basis_gridpoints_x + nx_inner_boundary + np_boundary;
-      // Global z index
-      int giz = iz * basis_gridpoints_z + nz_inner_boundary + np_boundary;
+dynamic_vector fdModel::get_preconditioner_vector(bool use_adjoint_illumination,
+                                                  real_simulation water_level)
+{
+  if (water_level <= 0.0)
+  {
+    throw std::invalid_argument("The water level should be positive.");
+  }
+  if (not kernels_need_velocities())
+  {
+    throw std::invalid_argument("The illumination is only accumulated along with the "
+                                "rho kernel, see set_kernel_selection().");
+  }
 
-      g[i_parameter] = 0;
-      g[i_parameter + n_free_per_par] = 0;
-      g[i_parameter + 2 * n_free_per_par] = 0;
+  // Pseudo-Hessian diagonal on the free grid points.
+#pragma omp parallel for
+  for (int i_point = 0; i_point < int(free_grid_points.size()); ++i_point)
+  {
+    auto idx = free_grid_points[i_point];
+    basis_workspace[i_point] =
+        use_adjoint_illumination
+            ? std::sqrt(forward_illumination[idx] * adjoint_illumination[idx])
+            : forward_illumination[idx];
+  }
 
-      // Average over the points in the cell
-      // We could easily just retrieve one of the values in the block, but when
-      // loading a model onto the grid, all the gridpoindts might not be the
-      // same value.
-      for (int sub_ix = 0; sub_ix < basis_gridpoints_x; sub_ix++)
-      {
-        for (int sub_iz = 0; sub_iz < basis_gridpoints_z; sub_iz++)
-        {
+  // The diagonal of basis^T H basis, normalized to a maximum of 1.
+  const int n_per_field = basis.cols();
+  dynamic_vector illumination =
+      sparse_matrix(basis_transpose.cwiseAbs2()) * basis_workspace;
+  real_simulation maximum = illumination.maxCoeff();
+  if (maximum > 0.0)
+  {
+    illumination /= maximum;
+  }
 
-          auto idx = linear_IDX(gix + sub_ix, giz + sub_iz, nx, nz);
-
-          g[i_parameter] +=
-              vp_kernel[idx]; // / (basis_gridpoints_x *
-                              // basis_gridpoints_z);
-          g[i_parameter + n_free_per_par] +=
-              vs_kernel[idx]; // / (basis_gridpoints_x *
-                              // basis_gridpoints_z);
-          g[i_parameter + 2 * n_free_per_par] +=
-              density_v_kernel[idx]; //  / (basis_gridpoints_x
-                                     //  * basis_gridpoints_z);
-        }
-      }
-    }
+  dynamic_vector preconditioner(3 * n_per_field);
+  for (int i_field = 0; i_field < 3; ++i_field)
+  {
+    preconditioner.segment(i_field * n_per_field, n_per_field) =
+        (illumination.array() + water_level).inverse();
   }
-  return g;
+  return preconditioner;
 }
 
 dynamic_vector fdModel::load_vector(const std::string &model_vector_path,
@@ -1521,19 +4381,16 @@ dynamic_vector fdModel::load_vector(const std::string &model_vector_path,
 
   dynamic_vector m = dynamic_vector(n_free_per_par * 3, 1);
 
-  std::ifstream model_vector_file;
-  model_vector_file.open(model_vector_path);
-
   // Check if the file actually exists
   if (verbose)
   {
     std::cout << "Loading model vector." << std::endl;
     std::cout << "File: " << model_vector_path << std::endl;
     std::cout << "File is "
-              << (model_vector_file.good() ? "good (exists at least)." : "ungood.")
+              << (file_exists(model_vector_path) ? "good (exists at least)." : "ungood.")
               << std::endl;
   }
-  if (!model_vector_file.good())
+  if (!file_exists(model_vector_path))
   {
     throw std::invalid_argument("The files for target models don't seem to exist.\r\n"
                                 "Paths:\r\n"
@@ -1541,33 +4398,8 @@ dynamic_vector fdModel::load_vector(const std::string &model_vector_path,
                                 model_vector_path + "\r\n");
   }
 
-  real_simulation placeholder_model_vector;
-  for (int i = 0; i < n_free_per_par * 3; ++i)
-  {
-    model_vector_file >> placeholder_model_vector;
-    m[i] = placeholder_model_vector;
-  }
-
-  // Check data was large enough for set up
-  if (!model_vector_file.good())
-  {
-    std::cout << "Received bad state of one of the files at end of "
-                 "reading. Does the data match the domain?"
-              << std::endl;
-    throw std::invalid_argument("Not enough data is present!");
-  }
-  // Try to load more data ...
-  model_vector_file >> placeholder_model_vector;
-  // ... which shouldn't be possible
-  if (model_vector_file.good())
-  {
-    std::cout << "Received good state of file past reading. Does the data "
-                 "match the domain?"
-              << std::endl;
-    throw std::invalid_argument("Too much data is present!");
-  }
+  load_values(model_vector_path, size_t(n_free_per_par) * 3, m.data());
 
-  model_vector_file.close();
   return m;
 }
 
@@ -5,6 +5,10 @@
 #ifndef FDMODEL_H
 #define FDMODEL_H
 
+#include <functional>
+#include <limits>
+#include <memory>
+#include <random>
 #include <string>
 
 #include <vector>
@@ -13,6 +17,8 @@
 #include "Eigen/Sparse"
 
 #include "contiguous_arrays.h"
+#include "lbfgs.h"
+#include "wavefield_writer.h"
 
 //! Typedef that determines simulation precision.
 //! On x86_64 systems it is typically fastest to use double,
@@ -25,6 +31,79 @@ using real_simulation = double;
 //! It is of dynamic size.
 using dynamic_vector = Eigen::Matrix<real_simulation, Eigen::Dynamic, 1>;
 
+//! Typedef that is a shorthand for a dynamic matrix with one model vector per row.
+//! It is row major, so every model vector is contiguous, as in NumPy.
+using dynamic_matrix =
+    Eigen::Matrix<real_simulation, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+//! Typedef that is a shorthand for the correct precision sparse matrix. It is row
+//! major, so products with dense vectors parallelize over rows in Eigen.
+using sparse_matrix = Eigen::SparseMatrix<real_simulation, Eigen::RowMajor>;
+
+//!  \brief Frequency band, grid sampling and optimizer settings of one stage of a
+//!  multiscale inversion.
+struct multiscale_stage
+{
+  //! Corner frequency of the low pass filter applied to the observed data and source
+  //! time functions, in Hz.
+  real_simulation max_frequency;
+  //! Smallest number of grid points per wavelength at max_frequency, used to
+  //! choose the grid coarsening.
+  real_simulation points_per_wavelength = 6.0;
+  lbfgs_settings optimizer;
+};
+
+//!  \brief Outcome of one stage of a multiscale inversion.
+struct multiscale_stage_result
+{
+  //! Factor by which the grid spacing and time step of the stage were increased.
+  int coarsening;
+  lbfgs_result optimization;
+};
+
+//!  \brief Grid spacing, time step and cost of a simulation, as proposed by
+//!  fdModel::plan_simulation().
+struct simulation_plan
+{
+  real_simulation dx;
+  real_simulation dz;
+  real_simulation dt;
+  int nt;
+  int nx_inner;
+  int nz_inner;
+  //! Largest time step for which the scheme is stable on the planned grid.
+  real_simulation max_stable_dt;
+  //! Largest stable time step on the current grid; a larger dt is unstable.
+  real_simulation current_max_stable_dt;
+  //! Highest frequency sampled with the requested points per wavelength, in Hz.
+  real_simulation max_frequency;
+  //! Number of grid points times time steps, relative to the current model.
+  real_simulation relative_cost;
+};
+
+//!  \brief Parameters whose kernels adjoint simulations compute, combined as a
+//!  bitmask in fdModel::kernel_selection.
+enum kernel_parameter
+{
+  kernel_vp = 1,
+  kernel_vs = 2,
+  kernel_rho = 4,
+  kernel_all = 7
+};
+
+//!  \brief Sub-grid around the sources and live receivers of a shot, as found by
+//!  fdModel::get_shot_window().
+struct shot_window
+{
+  int i_shot;
+  //! First and last grid index in x of the window, counted from the absorbing
+  //! boundary as for the sources and receivers in the configuration.
+  int ix_start;
+  int ix_end;
+  //! Receivers inside the window, which record the shot.
+  std::vector<int> receivers;
+};
+
 //! \brief Finite difference wave modelling class.
 //!
 //! This class contains everything needed to do finite difference wave forward
@@ -65,6 +144,58 @@ public:
 
   fdModel(const fdModel &model);
 
+  //!  \brief Copy constructor that optionally leaves out the snapshot storage.
+  //!
+  //!  Copies without snapshot storage cannot store fields or simulate adjoints,
+  //!  but are much smaller; they are meant for misfit-only evaluation.
+  //!
+  //!  @param model Model to copy.
+  //!  @param snapshot_storage Boolean controlling the allocation of accu_*.
+  fdModel(const fdModel &model, bool snapshot_storage);
+
+  //!  \brief Constructor for a coarsened and low pass filtered copy of a model.
+  //!
+  //!  Grid spacing and time step are multiplied by coarsening, so the Courant
+  //!  number is unchanged. Every coarse grid point holds the average of vp, vs and
+  //!  rho over the fine grid points nearest to it, and sources and receivers move
+  //!  to the nearest coarse grid point. Source time functions and observed data
+  //!  are low pass filtered to max_frequency with low_pass_filter() and
+  //!  decimated, and the moment tensors are scaled such that the coarse synthetics
+  //!  match the filtered fine synthetics. Every coarse free grid point is a
+  //!  parameter of the model vector. No snapshots, synthetics or kernels are
+  //!  copied.
+  //!
+  //!  @param model Model to coarsen.
+  //!  @param coarsening Integer factor by which the grid is coarsened.
+  //!  @param max_frequency Corner frequency of the low pass filter, in Hz.
+  fdModel(const fdModel &model, int coarsening, real_simulation max_frequency);
+
+  //!  \brief Constructor for a copy of a model resampled onto a simulation plan.
+  //!
+  //!  The medium is bilinearly interpolated onto the planned grid, sources and
+  //!  receivers move to the nearest planned grid point, and source time functions
+  //!  and observed data are linearly interpolated in time. The moment tensors are
+  //!  scaled such that the synthetics keep their amplitude. The grid spacing may
+  //!  only change by a common factor in x and z, see plan_simulation(). Every
+  //!  free grid point is a parameter of the model vector. No snapshots,
+  //!  synthetics or kernels are copied.
+  //!
+  //!  @param model Model to resample.
+  //!  @param plan Grid spacing and time step, typically from plan_simulation().
+  fdModel(const fdModel &model, const simulation_plan &plan);
+
+  //!  \brief Constructor for a single shot model on the window of a shot.
+  //!
+  //!  The window spans the full depth and is surrounded by its own absorbing
+  //!  boundary, whose medium is taken from the grid points around the window. The
+  //!  model holds the sources of the shot and the receivers of the window as its
+  //!  only shot, with their source time functions, moment tensors and observed
+  //!  data. No snapshots, synthetics or kernels are copied.
+  //!
+  //!  @param model Model to extract the window from.
+  //!  @param window Window of one of its shots, see get_shot_window().
+  fdModel(const fdModel &model, const shot_window &window);
+
   //!  \brief Destructor for the class.
   //!
   //!  The destructor properly addresses every used new keyword in the
@@ -100,9 +231,79 @@ public:
   //!  not required (i.e. no adjoint modeling), forward simulation should be
   //!  faster without storage.
   //!  @param verbose Boolean controlling if modelling should be verbose.
+  //!  @param output_wavefields Boolean controlling if wavefields are written to
+  //!  disk according to wavefield_output, by a background thread.
   void forward_simulate(int i_shot, bool store_fields, bool verbose,
                         bool output_wavefields = false);
 
+  //!  \brief Method to advance the forward simulation of a shot by one time step.
+  //!
+  //!  Stores the snapshot (if due and requested), records sample it of the
+  //!  seismograms, updates all fields and injects the sources.
+  //!
+  //!  @param i_shot Shot being simulated.
+  //!  @param it Time step to take.
+  //!  @param store_fields Boolean to control storage of wavefields.
+  //!  @param shot_ux Start of the horizontal seismograms of this shot.
+  //!  @param shot_uz Start of the vertical seismograms of this shot.
+  void forward_time_step(int i_shot, int it, bool store_fields,
+                         real_simulation *shot_ux, real_simulation *shot_uz);
+
+  //!  \brief Method to start a forward simulation that is advanced with step().
+  //!
+  //!  Resets the wavefields. Between calls to step(), the current wavefields and
+  //!  the seismograms recorded so far can be inspected. Running all nt steps gives
+  //!  the same result as forward_simulate().
+  //!
+  //!  @param i_shot Integer controlling which shot to simulate.
+  //!  @param store_fields Boolean to control storage of wavefields.
+  void begin_forward_simulation(int i_shot, bool store_fields);
+
+  //!  \brief Method to advance the simulation started by begin_forward_simulation().
+  //!
+  //!  Takes up to n_steps time steps, stopping at nt. After every
+  //!  step_callback_interval steps step_callback is called; the simulation pauses
+  //!  when it returns false.
+  //!
+  //!  @param n_steps Maximum number of time steps to take.
+  //!  @returns Number of time steps taken since the start, i.e. the number of
+  //!  valid samples in the seismograms of the shot.
+  int step(int n_steps);
+
+  //!  \brief Whether the simulation started by begin_forward_simulation() has
+  //!  taken all nt time steps (or none was started).
+  bool simulation_finished() const;
+
+  //!  \brief Method to forward simulate several shots in one sweep over the grid.
+  //!
+  //!  All shots share the model, so the dynamic fields of up to 8 shots are
+  //!  interleaved with the shot as innermost dimension, one SIMD lane per shot.
+  //!  The static fields are then loaded once per grid point for all shots in the
+  //!  batch. Larger lists are simulated in consecutive batches. Seismograms and
+  //!  snapshots are identical to those of forward_simulate().
+  //!
+  //!  @param shots Shots to simulate.
+  //!  @param store_fields Boolean to control storage of wavefields.
+  //!  @param verbose Boolean controlling if modelling should be verbose.
+  void forward_simulate_batch(const std::vector<int> &shots, bool store_fields,
+                              bool verbose);
+
+  //!  \brief Method to compute the seismograms of all shots from simulations at
+  //!  the receivers.
+  //!
+  //!  Uses source-receiver reciprocity: for every receiver component an impulsive
+  //!  point force is simulated at the receiver, and the transposed moment tensor
+  //!  injection stencil is read at every source. The readings are contracted with
+  //!  the source's moment tensor, integrated and convolved with its source time
+  //!  function, after which the sources of each shot are stacked into rtf_ux and
+  //!  rtf_uz. This costs 2 * nr simulations instead of n_shots, and is therefore
+  //!  worthwhile when there are fewer receivers than shots. Wavefields are not
+  //!  stored, so no kernels can be computed from this simulation. The seismograms
+  //!  agree with forward_simulate() up to rounding errors.
+  //!
+  //!  @param verbose Boolean controlling if modelling should be verbose.
+  void reciprocal_simulate(bool verbose);
+
   //!  \brief Method to adjoint simulate wavefields for a specific shot.
   //!
   //!  Adjoint simulate wavefields of shot i_shot based on currently loaded models
@@ -123,17 +324,81 @@ public:
 
   void write_receivers(std::string prefix);
 
+  //!  \brief Method to write out synthetic seismograms to binary receiver files.
+  //!
+  //!  Every shot generates a single file rtf<shot>.bin in observed_data_folder,
+  //!  holding a header with shape, time step and receiver positions, followed by
+  //!  the ux and uz seismograms in native double precision (see binary_files.h).
+  //!  load_receivers() prefers these files over the plaintext ones.
+  void write_receivers_binary();
+
+  //!  \brief Path of the binary receiver file of a shot.
+  //!
+  //!  @param i_shot Shot of the receiver file.
+  std::string receiver_filename(int i_shot) const;
+
+  //!  \brief Method to load the observed seismograms of one shot from a binary
+  //!  receiver file.
+  //!
+  //!  The file is memory mapped and copied straight into rtf_ux_true and
+  //!  rtf_uz_true. Header, shape and receiver positions are checked against the
+  //!  set up, throwing std::invalid_argument on any mismatch.
+  //!
+  //!  @param i_shot Shot to load the seismograms into.
+  //!  @param filename Path to the receiver file.
+  void load_receiver_file(int i_shot, const std::string &filename);
+
   //!  \brief Method to write out source signals to plaintext.
   //!
   //!  This method writes out the source time function (without moment tensor) to
   //!  plaintext file. Useful for e.g. visualizing the source staggering.
   void write_sources();
 
+  //!  \brief Method to write seismograms to SEG-Y files.
+  //!
+  //!  Writes one SEG-Y (rev 1) file per component, with big-endian IEEE samples.
+  //!  The field record number of every trace is its shot + 1, the trace number
+  //!  its receiver + 1. Source and receiver coordinates are stored in cm
+  //!  relative to the inner domain. Shots are written one at a time, so memory
+  //!  use does not depend on the amount of shots.
+  //!
+  //!  @param filename_ux Path of the file for the horizontal component.
+  //!  @param filename_uz Path of the file for the vertical component.
+  //!  @param observed Boolean controlling whether the observed instead of the
+  //!  synthetic seismograms are written.
+  void write_receivers_segy(const std::string &filename_ux,
+                            const std::string &filename_uz, bool observed = false);
+
+  void write_segy_component(const std::string &filename,
+                            const real_simulation *traces,
+                            const std::string &component);
+
+  //!  \brief Method to load observed seismograms from SEG-Y files.
+  //!
+  //!  Reads one SEG-Y (rev 1) file per component with IBM or IEEE samples. The
+  //!  files are memory mapped. Trace headers are scanned in parallel, after which
+  //!  every distinct field record number (in order of appearance) is a shot and
+  //!  the trace number within the record (1-based) its receiver. Samples are
+  //!  then converted shot by shot, releasing the pages of every shot afterwards,
+  //!  so surveys larger than memory can be loaded. The number of traces, samples
+  //!  and the sample interval have to match the set up.
+  //!
+  //!  @param filename_ux Path of the file for the horizontal component.
+  //!  @param filename_uz Path of the file for the vertical component.
+  //!  @param verbose Controls the verbosity of the method during loading.
+  void load_receivers_segy(const std::string &filename_ux,
+                           const std::string &filename_uz, bool verbose);
+
+  void load_segy_component(const std::string &filename, real_simulation *target,
+                           bool verbose);
+
   //!  \brief Method to load receiver files.
   //!
   //!  This method loads receiver data from observed_data_folder folder into the
   //!  object. The data has to exactly match the set-up, and be named according to
-  //!  component and shot (as generated by write_receivers() ).
+  //!  component and shot (as generated by write_receivers() ). For every shot a
+  //!  binary receiver file (as generated by write_receivers_binary() ) is used
+  //!  when present, otherwise the plaintext files are parsed.
   //!
   //!  @param verbose Controls the verbosity of the method during loading.
   void load_receivers(bool verbose);
@@ -155,7 +420,9 @@ public:
   //!  \brief Method to calculate L2 misfit.
   //!
   //!  This method calculates L2 misfit between observed seismograms and synthetic
-  //!  seismograms and stores it in the misfit field.
+  //!  seismograms and stores it in the misfit field. The contributions of every
+  //!  trace, shot and receiver are stored in misfit_per_trace, misfit_per_shot
+  //!  and misfit_per_receiver.
   void calculate_l2_misfit();
 
   //!  \brief Method to calculate L2 adjoint sources
@@ -163,15 +430,114 @@ public:
   //!  seismograms and stores it in the misfit field.
   void calculate_l2_adjoint_sources();
 
-  //!  \brief Method to load models from plaintext into the model.
+  //!  \brief Method to calculate L2 misfit and adjoint sources in one pass.
+  //!
+  //!  Equivalent to calculate_l2_misfit() followed by
+  //!  calculate_l2_adjoint_sources(), but reads the seismograms only once.
+  void calculate_l2_misfit_and_adjoint_sources();
+
+  //!  \brief Shared implementation of the L2 misfit, optionally storing the
+  //!  residuals as adjoint sources.
+  //!
+  //!  Traces are summed in parallel and reduced in a fixed order, so the misfit
+  //!  does not depend on the amount of threads.
+  //!
+  //!  @param store_adjoint_sources Boolean controlling if a_stf_ux/a_stf_uz are
+  //!  written.
+  void accumulate_l2_misfit(bool store_adjoint_sources);
+
+  //!  \brief Method to compute misfit_per_trace for a range of shots, optionally
+  //!  storing the residuals as adjoint sources.
+  //!
+  //!  @param store_adjoint_sources Boolean controlling if a_stf_ux/a_stf_uz are
+  //!  written.
+  //!  @param first_shot First shot to compute.
+  //!  @param end_shot One past the last shot to compute.
+  void accumulate_l2_trace_misfits(bool store_adjoint_sources, int first_shot,
+                                   int end_shot);
+
+  //!  \brief Method to sum misfit_per_trace into misfit, misfit_per_shot and
+  //!  misfit_per_receiver in a fixed order.
+  void reduce_trace_misfits();
+
+  //!  \brief Method to calculate the cross-correlation traveltime misfit and its
+  //!  adjoint sources.
+  //!
+  //!  For every trace the traveltime shift dT of the synthetic with respect to
+  //!  the observed trace is picked from the maximum of their cross-correlation
+  //!  (with sub-sample parabolic refinement). The misfit per trace is dT^2 / 2,
+  //!  the adjoint source is -dT v(t) / int v^2 dt, with v the time derivative
+  //!  of the synthetic trace. Misfit is summed over both components.
+  void calculate_traveltime_misfit_and_adjoint_sources();
+
+  //!  \brief Method to calculate the envelope misfit and its adjoint sources.
+  //!
+  //!  The misfit per trace is int (E_syn - E_obs)^2 dt / 2, with E the envelope
+  //!  computed through the Hilbert transform.
+  void calculate_envelope_misfit_and_adjoint_sources();
+
+  //!  \brief Method to calculate the normalized correlation misfit and its
+  //!  adjoint sources.
+  //!
+  //!  The misfit per trace is 1 - int s d dt / (||s|| ||d||), which is
+  //!  insensitive to the amplitude of the synthetic trace.
+  void calculate_correlation_misfit_and_adjoint_sources();
+
+  //!  \brief Signature of a single trace misfit: returns the misfit of the
+  //!  synthetic trace with respect to the observed trace, and writes the adjoint
+  //!  source. All three point to nt samples.
+  typedef real_simulation (fdModel::*trace_misfit_function)(
+      const real_simulation *synthetic, const real_simulation *observed,
+      real_simulation *adjoint_source) const;
+
+  //!  \brief Method to evaluate a trace misfit in parallel for every shot,
+  //!  receiver and component, filling the misfit fields and adjoint sources.
+  //!
+  //!  @param misfit_function Misfit to evaluate per trace.
+  void calculate_trace_misfits(trace_misfit_function misfit_function);
+
+  real_simulation traveltime_misfit_trace(const real_simulation *synthetic,
+                                          const real_simulation *observed,
+                                          real_simulation *adjoint_source) const;
+  real_simulation envelope_misfit_trace(const real_simulation *synthetic,
+                                        const real_simulation *observed,
+                                        real_simulation *adjoint_source) const;
+  real_simulation correlation_misfit_trace(const real_simulation *synthetic,
+                                           const real_simulation *observed,
+                                           real_simulation *adjoint_source) const;
+
+  //!  \brief Method to compute the Hilbert transform of a trace of nt samples.
+  //!
+  //!  @param trace Input trace.
+  //!  @param transformed Output trace.
+  void hilbert_transform(const real_simulation *trace,
+                         real_simulation *transformed) const;
+
+  //!  \brief Method to low pass filter a trace of nt samples with a causal sixth
+  //!  order Butterworth filter.
+  //!
+  //!  Being causal and time invariant, filtering the source time functions gives
+  //!  the same seismograms as filtering the seismograms. Frequencies above the
+  //!  Nyquist frequency leave the trace unchanged.
+  //!
+  //!  @param trace Input trace.
+  //!  @param filtered Output trace, which may be the input trace.
+  //!  @param max_frequency Corner frequency of the filter, in Hz.
+  void low_pass_filter(const real_simulation *trace, real_simulation *filtered,
+                       real_simulation max_frequency) const;
+
+  //!  \brief Method to load models from files into the model.
   //!
   //!  This methods loads any appropriate model (expressed in density, P-wave
   //!  velocity, and S-wave velocity) into the class and updates the Lamé fields
-  //!  accordingly.
+  //!  accordingly. Every file holds nx * nz values in x major order, as NPY
+  //!  array, raw binary (.bin/.raw) or plaintext; see load_values() in
+  //!  binary_files.h. Binary files are memory mapped, plaintext is parsed in
+  //!  parallel.
   //!
-  //!  @param de_path Relative path to plaintext de file.
-  //!  @param vp_path Relative path to plaintext vp file.
-  //!  @param vs_path Relative path to plaintext vs file.
+  //!  @param de_path Relative path to de file.
+  //!  @param vp_path Relative path to vp file.
+  //!  @param vs_path Relative path to vs file.
   //!  @param verbose Boolean controlling the verbosity of the method.
   void load_model(const std::string &de_path, const std::string &vp_path,
                   const std::string &vs_path, bool verbose);
@@ -183,18 +549,517 @@ public:
   //!  calculation and optionally adjoint source calculation, adjoint modelling
   //!  and kernel projection.
   //!
+  //!  With shot_window_aperture > 0 every shot is simulated on its own window,
+  //!  see get_shot_window(); receivers outside the window have no observed data,
+  //!  do not record the shot and have no misfit. Otherwise shots are simulated on
+  //!  the full grid. Windowing is an approximation: the absorbing boundary of a
+  //!  window lies in the medium, so reflections from outside the window are lost
+  //!  and the error of seismograms, misfit and kernels shrinks as the aperture
+  //!  grows. Only windows covering the full grid reproduce full grid simulations.
+  //!
   //!  @param verbose Boolean controlling the verbosity of the method.
   //!  @param simulate_adjoint Boolean controlling the execution of the adjoint
   //!  simulation and kernel computation.
   void run_model(bool verbose, bool simulate_adjoint);
 
+  //!  \brief Method to find the window a shot is simulated on in run_model().
+  //!
+  //!  The window spans the sources of the shot and its live receiver spread, the
+  //!  receivers with observed data for the shot, padded by aperture grid points
+  //!  in x and limited to the grid inside the absorbing boundary. Only receivers
+  //!  without observed data can fall outside of it.
+  //!
+  //!  @param i_shot Shot index.
+  //!  @param aperture Padding of the window beyond the sources and live
+  //!  receivers, in grid points.
+  //!  @returns The extent of the window and the receivers inside it.
+  shot_window get_shot_window(int i_shot, int aperture) const;
+
+  //!  \brief Method to check if a receiver has non-zero observed data for a shot.
+  bool receiver_has_observed_data(int i_shot, int i_receiver) const;
+
+  //!  \brief Method to copy the synthetics, adjoint sources and trace misfits of a
+  //!  single shot model into its shot, and add its kernels to the kernels of this
+  //!  model.
+  //!
+  //!  @param window_model Model created from window.
+  //!  @param window Window of one of the shots of this model.
+  //!  @param add_kernels Boolean controlling the addition of the kernels.
+  void add_shot_window_results(const fdModel &window_model, const shot_window &window,
+                               bool add_kernels);
+
+  //!  \brief Method to minimize the L2 misfit over the model vector with L-BFGS.
+  //!
+  //!  Every evaluation sets the model vector and calls run_model() with adjoint
+  //!  simulation, so shot batching through shot_batch_size applies. On return the
+  //!  model holds the best model vector; synthetics and kernels are those of the
+  //!  last evaluated trial model.
+  //!
+  //!  @param settings History size, Wolfe constants, bounds and stopping criteria.
+  //!  @param verbose Boolean controlling the printing of per-iteration reports.
+  lbfgs_result minimize_lbfgs(const lbfgs_settings &settings, bool verbose);
+
+  //!  \brief Method to find the largest grid coarsening that still samples the
+  //!  shortest wavelength at max_frequency with points_per_wavelength points.
+  //!
+  //!  The shortest wavelength follows from the smallest non-zero velocity in the
+  //!  model. The coarsening is limited such that the coarse grid keeps at least one
+  //!  free grid point in every direction.
+  //!
+  //!  @param max_frequency Highest frequency to simulate, in Hz.
+  //!  @param points_per_wavelength Smallest number of grid points per wavelength.
+  //!  @returns The coarsening factor, at least 1.
+  int coarsening_factor(real_simulation max_frequency,
+                        real_simulation points_per_wavelength) const;
+
+  //!  \brief Method to minimize the L2 misfit with frequency continuation on
+  //!  successively finer grids.
+  //!
+  //!  Every stage coarsens this model as far as its max_frequency allows, see
+  //!  coarsening_factor() and fdModel(const fdModel &, int, real_simulation), runs
+  //!  minimize_lbfgs() on the coarse model and adds the bilinearly interpolated
+  //!  model change to the free grid points of this model, which is then projected
+  //!  onto the basis functions. Bounds in the optimizer settings refer to the
+  //!  coarse model vector of a stage. Stages are run in the given order, usually of
+  //!  increasing max_frequency.
+  //!
+  //!  @param stages Frequency band and optimizer settings per stage.
+  //!  @param verbose Boolean controlling the printing of per-iteration reports.
+  //!  @returns The coarsening and optimizer outcome per stage.
+  std::vector<multiscale_stage_result>
+  minimize_multiscale(const std::vector<multiscale_stage> &stages, bool verbose);
+
+  //!  \brief Method to add the model change of a coarsened copy to the free grid
+  //!  points of this model by bilinear interpolation.
+  //!
+  //!  @param coarse Coarsened copy after the model change.
+  //!  @param coarse_start Coarsened copy before the model change.
+  //!  @param coarsening Coarsening factor of both copies.
+  void add_coarse_update(const fdModel &coarse, const fdModel &coarse_start,
+                         int coarsening);
+
+  //!  \brief Method to bilinearly interpolate a field at a fractional grid index.
+  //!
+  //!  Positions outside of the grid take the value at the nearest edge.
+  //!
+  //!  @param field Field of shape (nx, nz).
+  //!  @param x Fractional grid index in x.
+  //!  @param z Fractional grid index in z.
+  real_simulation interpolate_field(const real_simulation *field, real_simulation x,
+                                    real_simulation z) const;
+
+  //!  \brief Method to find the smallest non-zero and the largest velocity in the
+  //!  model.
+  //!
+  //!  @param min_velocity Smallest of vp and the non-zero vs.
+  //!  @param max_velocity Largest vp.
+  void velocity_extremes(real_simulation &min_velocity,
+                         real_simulation &max_velocity) const;
+
+  //!  \brief Method to compute the largest stable time step of the fourth order
+  //!  staggered grid scheme.
+  //!
+  //!  @param max_velocity Largest P-wave velocity.
+  //!  @param dx Grid spacing in x.
+  //!  @param dz Grid spacing in z.
+  //!  @returns The time step at which the Courant number reaches its limit.
+  real_simulation stable_time_step(real_simulation max_velocity, real_simulation dx,
+                                   real_simulation dz) const;
+
+  //!  \brief Method to compute the largest stable time step on the current grid for
+  //!  the largest velocity of the loaded model. Simulations with a larger dt are
+  //!  unstable; constructors do not check this, as the model may be loaded later.
+  real_simulation max_stable_time_step() const;
+
+  //!  \brief Method to plan the coarsest grid and largest time step that simulate
+  //!  the current model accurately.
+  //!
+  //!  The highest frequency is frequency_factor times peak_frequency. The grid
+  //!  spacing follows from the shortest wavelength at that frequency, keeping the
+  //!  ratio of dx and dz, and the time step is courant_safety times the stable time
+  //!  step on that grid for the largest velocity in the model. The plan also
+  //!  reports the stable time step of the current grid, see max_stable_time_step().
+  //!  The simulated duration and domain stay the same. Apply the plan with
+  //!  fdModel(const fdModel &, const simulation_plan &).
+  //!
+  //!  @param points_per_wavelength Smallest number of grid points per wavelength.
+  //!  @param courant_safety Fraction of the stable time step to use, in (0, 1].
+  //!  @param frequency_factor Highest simulated frequency relative to the peak
+  //!  frequency of the sources.
+  //!  @returns The planned grid, time step and relative cost.
+  simulation_plan plan_simulation(real_simulation points_per_wavelength,
+                                  real_simulation courant_safety,
+                                  real_simulation frequency_factor) const;
+
+  //!  \brief Method to compute the L2 misfit and gradient of many model vectors.
+  //!
+  //!  Equivalent to calling set_model_vector(), run_model() and
+  //!  get_gradient_vector() for every row of model_vectors, but every model and
+  //!  shot is a separate work item. The items are shared between n_workers copies
+  //!  of this model, each running in its own thread with an equal share of the
+  //!  OpenMP threads. Every worker holds a copy of the model with a single snapshot
+  //!  slot, see share_snapshot_slot(). Shots are always simulated one at a time on
+  //!  the full grid; shot_batch_size and shot_window_aperture are ignored.
+  //!
+  //!  Misfits are summed over shots in a fixed order. Gradients are summed per
+  //!  worker and model, and these sums over workers in a fixed order, so results
+  //!  do not depend on the scheduling, but may differ in rounding between worker
+  //!  counts. They agree with run_model() up to rounding, as kernels are mapped to
+  //!  velocity per shot.
+  //!
+  //!  @param model_vectors Matrix with one model vector per row.
+  //!  @param misfits Output vector with the misfit per model.
+  //!  @param gradients Output matrix with the gradient vector per model.
+  //!  @param n_workers Number of model copies working in parallel; 0 selects
+  //!  the number of hardware threads, limited by the number of work items.
+  void evaluate_models(const dynamic_matrix &model_vectors, dynamic_vector &misfits,
+                       dynamic_matrix &gradients, int n_workers);
+
+  //!  \brief Function run on a worker copy of the model for a work item, given
+  //!  the worker's index.
+  typedef std::function<void(fdModel &worker, int i_worker, int item)> worker_function;
+
+  //!  \brief Method to process work items on copies of this model in parallel.
+  //!
+  //!  Every one of n_workers threads processes a contiguous block of items in
+  //!  order, on its own copy of this model with an equal share of the OpenMP
+  //!  threads. The blocks of consecutive workers follow each other and differ in
+  //!  size by at most one item. Exceptions in workers are rethrown after all
+  //!  workers have finished.
+  //!
+  //!  @param n_items Number of work items.
+  //!  @param n_workers Number of workers, see count_workers().
+  //!  @param snapshot_storage Boolean controlling if the copies store snapshots,
+  //!  in a single shared slot.
+  //!  @param work Function processing one item.
+  void run_on_workers(int n_items, int n_workers, bool snapshot_storage,
+                      const worker_function &work);
+
+  //!  \brief Method to find the number of workers run_on_workers() starts.
+  //!
+  //!  @param n_items Number of work items.
+  //!  @param n_workers Requested number of workers; 0 selects the number of
+  //!  hardware threads.
+  //!  @returns The number of workers, never more than the number of items.
+  int count_workers(int n_items, int n_workers) const;
+
+  //!  \brief Method to compute the L2 misfit of a shot with a lean forward
+  //!  simulation.
+  //!
+  //!  No snapshots and no seismograms are stored; the residual with the observed
+  //!  data is accumulated at every time step from a running displacement per
+  //!  receiver. The misfit per trace of the shot is written to misfit_per_trace.
+  //!  Agrees with forward_simulate() followed by calculate_l2_misfit() up to
+  //!  rounding.
+  //!
+  //!  The simulation stops early once the misfit accumulated so far exceeds
+  //!  misfit_bound. The misfit of an aborted shot is the partial misfit, which
+  //!  exceeds the bound, and misfit_per_trace then holds partial trace misfits.
+  //!
+  //!  @param i_shot Integer representing which shot will be simulated.
+  //!  @param misfit_bound Misfit above which the simulation is aborted.
+  //!  @returns The L2 misfit of the shot, or the partial misfit if aborted.
+  real_simulation forward_simulate_misfit(
+      int i_shot,
+      real_simulation misfit_bound = std::numeric_limits<real_simulation>::infinity());
+
+  //!  \brief Method to compute the L2 misfit of all shots with lean forward
+  //!  simulations, stopping as soon as the total exceeds a bound.
+  //!
+  //!  Shots are simulated in order with forward_simulate_misfit(), each bounded by
+  //!  what remains of misfit_bound, and the remaining shots are skipped once the
+  //!  bound is exceeded. Useful to reject line search trials or sampler proposals
+  //!  that cannot beat the current best misfit at a fraction of the cost.
+  //!
+  //!  @param misfit_bound Misfit above which the simulations are aborted.
+  //!  @returns The L2 misfit of all shots, or a partial misfit exceeding
+  //!  misfit_bound if aborted.
+  real_simulation forward_simulate_misfit_all(
+      real_simulation misfit_bound = std::numeric_limits<real_simulation>::infinity());
+
+  //!  \brief Method to evaluate the L2 misfit at several step lengths along a
+  //!  search direction in parallel.
+  //!
+  //!  Every step and shot is a separate work item, evaluated with
+  //!  forward_simulate_misfit() on copies of this model without snapshot storage.
+  //!  The state of this model is not changed.
+  //!
+  //!  @param model_vector Model vector at step length zero.
+  //!  @param direction Search direction in model vector space.
+  //!  @param steps Step lengths to evaluate.
+  //!  @param misfits Output misfit per step length.
+  //!  @param n_workers Number of model copies working in parallel; 0 selects the
+  //!  number of hardware threads.
+  void evaluate_trial_steps(const Eigen::Ref<const dynamic_vector> &model_vector,
+                            const Eigen::Ref<const dynamic_vector> &direction,
+                            const std::vector<real_simulation> &steps,
+                            std::vector<real_simulation> &misfits, int n_workers);
+
+  //!  \brief Method to throw if this model has no snapshot storage.
+  void require_snapshot_storage() const;
+
+  //!  \brief Method to store the snapshots of every shot in a single slot.
+  //!
+  //!  Shrinks accu_* to the snapshots of one shot, which every forward simulation
+  //!  overwrites. The adjoint simulation of a shot then has to follow its forward
+  //!  simulation, and batched forward simulations cannot store fields.
+  void share_snapshot_slot();
+
+  //!  \brief Method to get the slot of accu_* holding the snapshots of a shot.
+  //!
+  //!  @param i_shot Shot index.
+  //!  @returns Zero if the snapshot slot is shared, the shot index otherwise.
+  int snapshot_slot(int i_shot) const;
+
   //!  \brief Method to reset all Lamé sensitivity kernels to zero.
   //!
-  //!  This method resets all sensitivity kernels to zero. Essential before
-  //!  performing new adjoint simulations, as otherwise the kernels of subsequent
-  //!  simulations would stack.
+  //!  This method resets all sensitivity kernels and the illumination to zero.
+  //!  Essential before performing new adjoint simulations, as otherwise the
+  //!  kernels of subsequent simulations would stack.
   void reset_kernels();
 
+  // ---- SIMULATION BUILDING BLOCKS ----
+  //!  \brief Method to set all dynamic fields (velocities and stresses) to zero.
+  //!
+  //!  Also deactivates all tiles of the active region.
+  void reset_wavefields();
+
+  //!  \brief Method to deactivate all tiles of the active region, sized by
+  //!  active_region_tile_size.
+  void reset_active_region();
+
+  //!  \brief Method to activate the tiles of a grid point and its direct
+  //!  neighbours, which injection stencils write to.
+  //!
+  //!  Does nothing if active_region_tolerance is zero.
+  //!
+  //!  @param ix Grid index in x.
+  //!  @param iz Grid index in z.
+  void activate_point(int ix, int iz);
+
+  //!  \brief Method to activate the neighbours of every active tile whose velocity
+  //!  amplitude in the last sweep exceeds active_region_tolerance times the
+  //!  largest amplitude.
+  //!
+  //!  Waves cross at most a few grid points per time step, so a tile is active
+  //!  long before the wavefront reaches its far edge.
+  void expand_active_region();
+
+  //!  \brief Method to get the fraction of the tiles that are active.
+  //!
+  //!  @returns One if active_region_tolerance is zero.
+  real_simulation active_region_fraction() const;
+
+  //!  \brief Method to find the grid row of a swept row of the active tiles.
+  //!
+  //!  Rows are numbered tile by tile, active_region_tile_size rows per tile, and
+  //!  limited to the interior 2..nx-2 x 2..nz-2 updated by the stencils.
+  //!
+  //!  @param i_row Row number.
+  //!  @param ix Grid index in x of the row.
+  //!  @param iz_start First grid index in z of the row.
+  //!  @param iz_end Grid index in z after the row.
+  //!  @returns Whether the row lies within the interior.
+  bool active_tile_row(int i_row, int &ix, int &iz_start, int &iz_end) const;
+
+  //!  \brief Method to compute the snapshot points and allocate accu_* and the
+  //!  adjoint transforms for them.
+  void allocate_snapshots();
+
+  //!  \brief Method to free accu_* and the adjoint transforms.
+  void deallocate_snapshots();
+
+  //!  \brief Method to copy the current dynamic fields at the snapshot points into
+  //!  the snapshot accumulators.
+  //!
+  //!  With kernel frequencies the fields are added to the running Fourier
+  //!  transforms instead, see set_kernel_frequencies().
+  //!
+  //!  @param i_slot Shot slot of the accumulators to write to.
+  //!  @param i_snapshot Snapshot index within the slot.
+  void store_snapshot(int i_slot, int i_snapshot);
+
+  //!  \brief Method to store the dynamic fields at one snapshot point.
+  inline void store_snapshot_point(int i_slot, int i_snapshot, int i_point_x,
+                                   int i_point_z, real_simulation vx_point,
+                                   real_simulation vz_point, real_simulation txx_point,
+                                   real_simulation tzz_point, real_simulation txz_point);
+
+  //!  \brief Method to record the displacement at all receivers for time step it.
+  //!
+  //!  Displacement is obtained by integrating velocity in time, so the traces at
+  //!  it - 1 have to be recorded before.
+  //!
+  //!  @param ux Pointer to the horizontal traces of one shot, shape (nr, nt).
+  //!  @param uz Pointer to the vertical traces of one shot, shape (nr, nt).
+  //!  @param it Time step to record.
+  void record_receivers(real_simulation *ux, real_simulation *uz, int it);
+
+  //!  \brief Method to time integrate the stress fields over a single step.
+  //!
+  //!  @param time_step Signed time step, dt for forward and -dt for adjoint
+  //!  modelling.
+  void update_stresses(real_simulation time_step);
+
+  //!  \brief Method to time integrate the stresses at a single grid point.
+  void update_stresses_point(int ix, int iz, real_simulation time_step);
+
+  //!  \brief Method to time integrate the velocity fields over a single step.
+  //!
+  //!  @param time_step Signed time step, dt for forward and -dt for adjoint
+  //!  modelling.
+  void update_velocities(real_simulation time_step);
+
+  //!  \brief Method to time integrate the velocities at a single grid point.
+  void update_velocities_point(int ix, int iz, real_simulation time_step);
+
+  //!  \brief Method to inject a single moment tensor source into the velocity
+  //!  fields.
+  //!
+  //!  @param i_source Source to inject.
+  //!  @param it Sample of the source time function to inject.
+  //!  @param weight Scalar applied to the source time function, e.g. an encoding
+  //!  polarity.
+  void inject_source(int i_source, int it, real_simulation weight);
+
+  //!  \brief Method to inject a single moment tensor source into one lane of
+  //!  interleaved velocity fields.
+  //!
+  //!  @param target_vx Horizontal velocity field with lanes as innermost dimension.
+  //!  @param target_vz Vertical velocity field with lanes as innermost dimension.
+  //!  @param lanes Number of interleaved lanes.
+  //!  @param lane Lane to inject into.
+  void inject_source(int i_source, int it, real_simulation weight,
+                     real_simulation *target_vx, real_simulation *target_vz, int lanes,
+                     int lane);
+
+  //!  \brief Method to inject adjoint sources at all receivers for time step it.
+  //!
+  //!  @param a_ux Pointer to the horizontal adjoint sources of one shot, shape
+  //!  (nr, nt).
+  //!  @param a_uz Pointer to the vertical adjoint sources of one shot, shape
+  //!  (nr, nt).
+  //!  @param it Time step to inject.
+  void inject_adjoint_sources(const real_simulation *a_ux, const real_simulation *a_uz,
+                              int it);
+
+  //!  \brief Method to correlate the current (adjoint) wavefield with a stored
+  //!  forward snapshot, adding the result to the Lamé kernels.
+  //!
+  //!  Only the snapshot points inside the inner boundary are correlated; each adds
+  //!  the correlation times the number of grid points it represents.
+  //!
+  //!  @param i_slot Shot slot of the accumulators to read from.
+  //!  @param i_snapshot Snapshot index within the slot.
+  void correlate_kernels(int i_slot, int i_snapshot);
+
+  //!  \brief Method to find the range of snapshot points inside the inner boundary.
+  void free_snapshot_points(int &i_point_x_begin, int &i_point_x_end,
+                            int &i_point_z_begin, int &i_point_z_end) const;
+
+  //!  \brief Method to add the correlation of forward and adjoint field values at
+  //!  grid point idx, times weight, to the Lamé kernels and the illumination.
+  inline void correlate_kernels_point(
+      int idx, real_simulation weight, real_simulation forward_vx,
+      real_simulation forward_vz, real_simulation forward_txx,
+      real_simulation forward_tzz, real_simulation forward_txz,
+      real_simulation adjoint_vx, real_simulation adjoint_vz,
+      real_simulation adjoint_txx, real_simulation adjoint_tzz,
+      real_simulation adjoint_txz);
+
+  //!  \brief Method to add the current adjoint fields at the snapshot points to the
+  //!  running Fourier transforms of the adjoint simulation.
+  //!
+  //!  @param i_snapshot Snapshot index of the current time step.
+  void accumulate_adjoint_transform(int i_snapshot);
+
+  //!  \brief Method to correlate the Fourier transforms of the adjoint simulation
+  //!  with those of a forward simulation, adding the result to the Lamé kernels.
+  //!
+  //!  @param i_slot Shot slot of the accumulators to read from.
+  void correlate_frequency_kernels(int i_slot);
+
+  //!  \brief Method to adjoint simulate a wavefield from arbitrary adjoint sources.
+  //!
+  //!  @param i_slot Shot slot of the snapshot accumulators to correlate with.
+  //!  @param a_ux Pointer to the horizontal adjoint sources, shape (nr, nt).
+  //!  @param a_uz Pointer to the vertical adjoint sources, shape (nr, nt).
+  //!  @param verbose Boolean controlling if modelling should be verbose.
+  void adjoint_simulate_slot(int i_slot, const real_simulation *a_ux,
+                             const real_simulation *a_uz, bool verbose);
+
+  //!  \brief Batched forward simulation kernel for a fixed number of lanes.
+  template <int lanes>
+  void forward_simulate_lanes(const std::vector<int> &shots, bool store_fields);
+
+  // ---- SOURCE ENCODING ----
+  //!  \brief Method to seed the random generator used for source encoding.
+  void seed_source_encoding(unsigned int seed);
+
+  //!  \brief Method to draw new random encoding codes for all shots.
+  //!
+  //!  Every shot receives a random polarity (+1 or -1) and, for phase encoding, a
+  //!  random delay of 0 to max_shift samples. Codes should be redrawn every
+  //!  iteration of a stochastic inversion.
+  //!
+  //!  @param phase_encoding Boolean controlling if random delays are drawn.
+  //!  @param max_shift Maximum delay in samples, only used for phase encoding.
+  void draw_source_encoding(bool phase_encoding, int max_shift);
+
+  //!  \brief Method to combine the observed data of all shots into the encoded
+  //!  observed data, using the current encoding codes.
+  void encode_observed_data();
+
+  //!  \brief Method to forward simulate the encoded supershot.
+  //!
+  //!  Fires the sources of all shots in a single simulation, each shot with its
+  //!  encoding polarity and delay. When storing fields, the snapshots are written
+  //!  to the slot of the first shot, overwriting its snapshots.
+  //!
+  //!  @param store_fields Boolean to control storage of wavefields.
+  //!  @param verbose Boolean controlling if modelling should be verbose.
+  void forward_simulate_encoded(bool store_fields, bool verbose);
+
+  //!  \brief Method to adjoint simulate the encoded supershot, adding its
+  //!  correlation to the kernels.
+  void adjoint_simulate_encoded(bool verbose);
+
+  //!  \brief Method to calculate the L2 misfit between the encoded synthetic and
+  //!  encoded observed data. Stores it in the misfit field.
+  void calculate_encoded_l2_misfit();
+
+  //!  \brief Method to calculate the L2 adjoint sources of the encoded supershot.
+  void calculate_encoded_l2_adjoint_sources();
+
+  //!  \brief Method to calculate the L2 misfit and adjoint sources of the encoded
+  //!  supershot in a single pass.
+  void calculate_encoded_l2_misfit_and_adjoint_sources();
+
+  //!  \brief Method to compute the encoded L2 misfit per trace in parallel and sum
+  //!  the traces in a fixed order, so the misfit does not depend on the amount of
+  //!  threads.
+  //!
+  //!  @param store_adjoint_sources Boolean controlling if a_stf_ux_encoded/
+  //!  a_stf_uz_encoded are written.
+  void accumulate_encoded_l2_misfit(bool store_adjoint_sources);
+
+  //!  \brief Method to perform all steps of source encoded FWI for a single
+  //!  random supershot.
+  //!
+  //!  Draws new codes, encodes the observed data, forward simulates and optionally
+  //!  computes the kernels. The cost is that of a single shot, irrespective of
+  //!  n_shots. The resulting misfit and kernels are stochastic estimates of those of
+  //!  run_model().
+  //!
+  //!  @param verbose Boolean controlling the verbosity of the method.
+  //!  @param simulate_adjoint Boolean controlling the execution of the adjoint
+  //!  simulation and kernel computation.
+  //!  @param phase_encoding Boolean controlling if random delays are used on top of
+  //!  random polarities.
+  //!  @param max_shift Maximum delay in samples, only used for phase encoding.
+  void run_model_encoded(bool verbose, bool simulate_adjoint, bool phase_encoding = false,
+                         int max_shift = 0);
+
   // ----  FIELDS ----
   // |--< Utility fields >--
   // | Finite difference coefficients
@@ -228,6 +1093,10 @@ public:
   real_simulation *vp_kernel;
   real_simulation *vs_kernel;
   real_simulation *density_v_kernel;
+  // | Energy of the forward and adjoint velocity fields, summed over snapshots
+  // | and shots along with the kernels
+  real_simulation *forward_illumination;
+  real_simulation *adjoint_illumination;
   // | Static physical fields for the starting model
   real_simulation *starting_rho;
   real_simulation *starting_vp;
@@ -250,6 +1119,27 @@ public:
   real_simulation *accu_txx;
   real_simulation *accu_tzz;
   real_simulation *accu_txz;
+  // | Owners of accu_*, shared with views of the snapshots so the arrays outlive
+  // | deallocate_snapshots() while a view exists
+  std::shared_ptr<real_simulation> accu_vx_storage;
+  std::shared_ptr<real_simulation> accu_vz_storage;
+  std::shared_ptr<real_simulation> accu_txx_storage;
+  std::shared_ptr<real_simulation> accu_tzz_storage;
+  std::shared_ptr<real_simulation> accu_txz_storage;
+  // | Fourier transforms of the adjoint fields [real, imaginary per frequency]
+  // | [snapshot point x][snapshot point z]
+  real_simulation *adjoint_transform_vx;
+  real_simulation *adjoint_transform_vz;
+  real_simulation *adjoint_transform_txx;
+  real_simulation *adjoint_transform_tzz;
+  real_simulation *adjoint_transform_txz;
+  // | Encoded supershot traces
+  real_simulation *rtf_ux_encoded;
+  real_simulation *rtf_uz_encoded;
+  real_simulation *rtf_ux_true_encoded;
+  real_simulation *rtf_uz_true_encoded;
+  real_simulation *a_stf_ux_encoded;
+  real_simulation *a_stf_uz_encoded;
 
   std::vector<int> shape_grid;
   std::vector<int> shape_t;
@@ -257,6 +1147,12 @@ public:
   std::vector<int> shape_moment;
   std::vector<int> shape_receivers;
   std::vector<int> shape_accu;
+  std::vector<int> shape_unused_accu;
+  std::vector<int> shape_adjoint_transform;
+  std::vector<int> shape_encoded_receivers;
+  std::vector<int> shape_trace_misfits;
+  std::vector<int> shape_shot_misfits;
+  std::vector<int> shape_receiver_misfits;
 
   // -- Definition of simulation --
   // | Domain
@@ -292,28 +1188,235 @@ public:
   int snapshot_interval;
 
   int snapshots;
+  //! Whether accu_* hold snapshots of every shot; see fdModel(const fdModel &, bool).
+  bool snapshot_storage = true;
+  //! Whether all shots store their snapshots in the first slot; see
+  //! share_snapshot_slot().
+  bool shared_snapshot_slot = false;
+  //! Spacing in grid points of the snapshot points; see set_snapshot_quadrature().
+  int snapshot_stride_x = 1;
+  int snapshot_stride_z = 1;
+  //! First and one past the last grid index in x and z of the grid points divided
+  //! into snapshot cells, {x_begin, x_end, z_begin, z_end}. Empty for the free grid
+  //! points; windows keep the cells of their model, see get_snapshot_cells().
+  std::vector<int> snapshot_cells;
+  //! Grid indices of the snapshot points in x and z, and the number of grid
+  //! points in x and z that each of them represents.
+  std::vector<int> snapshot_ix;
+  std::vector<int> snapshot_iz;
+  std::vector<real_simulation> snapshot_weight_x;
+  std::vector<real_simulation> snapshot_weight_z;
+  int nx_snapshot;
+  int nz_snapshot;
+  //! Frequencies of the Fourier transforms in accu_*, in Hz, their quadrature
+  //! weights, and the cosine and sine of the transforms per [snapshot][frequency];
+  //! see set_kernel_frequencies().
+  std::vector<real_simulation> kernel_frequencies;
+  std::vector<real_simulation> kernel_frequency_weights;
+  std::vector<real_simulation> transform_cos;
+  std::vector<real_simulation> transform_sin;
   int nx;
   int nz;
   int nx_free_parameters;
   int nz_free_parameters;
 
+  // | Source encoding codes per shot
+  std::vector<real_simulation> encoding_polarities;
+  std::vector<int> encoding_shifts;
+  std::mt19937 encoding_generator;
+
+  //! Number of shots run_model() simulates per batched forward sweep. A value of
+  //! 1 simulates every shot separately.
+  int shot_batch_size = 1;
+
+  //! Padding in grid points of the window beyond the sources and live receivers of
+  //! every shot on which run_model() simulates the shot, see get_shot_window().
+  //! Larger apertures cost more but lose fewer reflections from outside the window.
+  //! Zero simulates every shot on the full grid.
+  int shot_window_aperture = 0;
+
+  //! Bitmask of kernel_parameter values whose kernels adjoint simulations compute,
+  //! see set_kernel_selection().
+  int kernel_selection = kernel_all;
+
+  //! Interval, fields, window and file of wavefield output during
+  //! forward_simulate(..., output_wavefields = true).
+  wavefield_output_settings wavefield_output;
+
+  //! Called by step() every step_callback_interval time steps with the shot and
+  //! the number of steps taken. Returning false pauses the simulation.
+  std::function<bool(int, int)> step_callback;
+  int step_callback_interval = 0;
+
+  //! Velocity amplitude, relative to the largest amplitude of the last time step,
+  //! above which an active tile activates its neighbours. update_stresses() and
+  //! update_velocities() only sweep active tiles; tiles also become active when a
+  //! source, adjoint source or reciprocal force is injected into them. Zero sweeps
+  //! the full grid. This pays off when waves cross only part of the grid during a
+  //! simulation, e.g. forward simulations of long lines with short records; adjoint
+  //! simulations inject at every receiver, so their region soon covers the spread.
+  real_simulation active_region_tolerance = 0.0;
+  //! Edge length of the tiles of the active region, in grid points.
+  int active_region_tile_size = 32;
+
+  // | Active region of the current simulation: tile flags, the active tiles in
+  // | order of activation and the largest velocity amplitude per swept tile row
+  int nx_tiles = 0;
+  int nz_tiles = 0;
+  std::vector<char> tile_active;
+  std::vector<int> active_tiles;
+  std::vector<real_simulation> active_row_amplitude;
+
+  // | State of the simulation advanced by step()
+  int stepping_shot = -1;
+  int stepping_time_step = 0;
+  bool stepping_store_fields = false;
+
   int basis_gridpoints_x = 1; // How many gridpoints there are in a basis function
   int basis_gridpoints_z = 1;
   int free_parameters;
 
+  // | Basis functions [free grid points][parameters per field], their transpose
+  // | and the transpose normalized to weighted averages. Free grid points are
+  // | the grid points inside the inner boundary, in x major order.
+  sparse_matrix basis;
+  sparse_matrix basis_transpose;
+  sparse_matrix basis_average;
+  std::vector<int> free_grid_points;
+  dynamic_vector basis_workspace;
+
   // -- Helper stuff for inverse problems --
   // real_simulation data_variance_ux[n_shots][nr][nt];
   // real_simulation data_variance_uz[n_shots][nr][nt];
 
   real_simulation misfit;
+  // | L2 misfit per trace [n_shots][nr], summed per shot and per receiver
+  real_simulation *misfit_per_trace;
+  real_simulation *misfit_per_shot;
+  real_simulation *misfit_per_receiver;
   std::string observed_data_folder;
   std::string stf_folder;
 
   void write_kernels();
 
+  //!  \brief Method to get the model vector, the vp, vs and rho fields projected
+  //!  onto the basis functions.
+  //!
+  //!  Every parameter is the average of the free grid points in its basis
+  //!  function, weighted by the basis function.
   dynamic_vector get_model_vector();
-  void set_model_vector(dynamic_vector m);
+
+  //!  \brief Method to set vp, vs and rho on the free grid points from a model
+  //!  vector, as basis * m per field.
+  //!
+  //!  @param m Model vector of size free_parameters.
+  void set_model_vector(const Eigen::Ref<const dynamic_vector> &m);
+
+  //!  \brief Method to get the gradient of the misfit with respect to the model
+  //!  vector, as basis^T * kernel per field.
   dynamic_vector get_gradient_vector();
+
+  //!  \brief Method to get a diagonal preconditioner for the gradient vector from
+  //!  the wavefield energy accumulated during adjoint simulations.
+  //!
+  //!  The pseudo-Hessian diagonal is the forward wavefield energy per grid point
+  //!  or, with use_adjoint_illumination, the geometric mean of the forward and
+  //!  adjoint energies, projected as basis^T H basis and normalized to a maximum
+  //!  of 1. The preconditioner is its inverse, stabilized by the water level, and
+  //!  is the same for vp, vs and rho. Multiplying it elementwise with
+  //!  get_gradient_vector() balances near-source and deep updates. Throws if the
+  //!  kernel selection excludes rho, as the illumination is then not accumulated.
+  //!
+  //!  @param use_adjoint_illumination Boolean controlling the use of the adjoint
+  //!  wavefield energy.
+  //!  @param water_level Positive value added to the normalized diagonal.
+  //!  @returns Preconditioner of the size of the model vector.
+  dynamic_vector get_preconditioner_vector(bool use_adjoint_illumination,
+                                           real_simulation water_level);
+
+  //!  \brief Method to replace the basis functions of the model vector.
+  //!
+  //!  By default every parameter is a block of basis_gridpoints_x times
+  //!  basis_gridpoints_z grid points. Any other basis, e.g. smooth or irregular
+  //!  cells, can be used instead. get_model_vector() then returns weighted averages,
+  //!  which reproduce m exactly for bases where every free grid point belongs to
+  //!  exactly one basis function.
+  //!
+  //!  @param new_basis Sparse matrix of shape [free grid points][parameters per
+  //!  field], with free grid points in x major order.
+  void set_basis(const sparse_matrix &new_basis);
+
+  //!  \brief Method to store snapshots on a coarser lattice than the grid.
+  //!
+  //!  The free grid points are divided into cells of stride_x times stride_z grid
+  //!  points, and snapshots only hold the grid point at the centre of every cell.
+  //!  Kernels are then a midpoint quadrature: the correlation at the centre of a
+  //!  cell, times the number of grid points in the cell, is added at the centre
+  //!  and the other grid points of the cell receive no kernel. Snapshot memory and
+  //!  the cost of kernel computation shrink by stride_x * stride_z, and the
+  //!  gradient vector stays a quadrature of the exact one as long as the basis
+  //!  functions are smooth over a cell. With the block basis, strides that divide
+  //!  basis_gridpoints_x and basis_gridpoints_z keep every cell in one block;
+  //!  strides equal to them store one point per parameter. Strides of 1, the
+  //!  default, store the full grid. Shot windows in run_model() store the part of
+  //!  the lattice inside the window. Stored snapshots are discarded.
+  //!
+  //!  @param stride_x Cell width in grid points.
+  //!  @param stride_z Cell height in grid points.
+  void set_snapshot_quadrature(int stride_x, int stride_z);
+
+  //!  \brief Method to find the grid points divided into snapshot cells by
+  //!  set_snapshot_quadrature(), from x_begin up to x_end and z_begin up to z_end.
+  void get_snapshot_cells(int &x_begin, int &x_end, int &z_begin, int &z_end) const;
+
+  //!  \brief Method to compute kernels from Fourier transforms at a few frequencies
+  //!  instead of time-domain snapshots.
+  //!
+  //!  Forward simulations then accumulate the discrete Fourier transform of the
+  //!  fields, sampled every snapshot_interval time steps, at every frequency in
+  //!  accu_*; adjoint simulations do the same and add the frequency-domain
+  //!  products to the kernels. By Parseval's theorem, every frequency stands for
+  //!  the band up to halfway to its neighbours (or one frequency resolution of the
+  //!  snapshots if it is the only one). Taking all multiples of the frequency
+  //!  resolution 1 / (snapshots * snapshot_interval * dt) up to the Nyquist
+  //!  frequency reproduces the time-domain kernels; a few frequencies inside the
+  //!  source band give the kernels of few-frequency inversion. Snapshot memory
+  //!  scales with twice the number of frequencies instead of snapshots. An empty
+  //!  list, the default, uses snapshots. Stored snapshots are discarded.
+  //!
+  //!  @param frequencies Distinct frequencies in Hz, from zero up to the Nyquist
+  //!  frequency of the snapshots.
+  void set_kernel_frequencies(const std::vector<real_simulation> &frequencies);
+
+  //!  \brief Method to compute the kernels of only some parameters.
+  //!
+  //!  Only the fields the selected kernels need are stored in accu_* and only
+  //!  their correlation terms are evaluated. The vp kernel needs the normal
+  //!  stresses, the vs kernel also the shear stress. The rho kernel in the
+  //!  velocity parametrization combines the Lamé kernels, so it needs all five
+  //!  fields. The illumination, which needs the velocities, is only accumulated
+  //!  along with the rho kernel; without it the illumination stays zero and
+  //!  get_preconditioner_vector() throws. Kernels that are not selected are
+  //!  zero after map_kernels_to_velocity(). Stored snapshots are discarded.
+  //!
+  //!  @param selection Bitmask of kernel_vp, kernel_vs and kernel_rho.
+  void set_kernel_selection(int selection);
+
+  //!  \brief Method to check if the selected kernels need velocity snapshots.
+  bool kernels_need_velocities() const;
+
+  //!  \brief Method to check if the selected kernels need shear stress snapshots.
+  bool kernels_need_shear_stress() const;
+
+  //!  \brief Method to construct the default basis of rectangular blocks of
+  //!  basis_gridpoints_x times basis_gridpoints_z grid points.
+  sparse_matrix block_basis() const;
+
+  //!  \brief Method to copy a field on the free grid points into basis_workspace.
+  void gather_free_grid_points(const real_simulation *field);
+
+  //!  \brief Method to copy basis_workspace into a field on the free grid points.
+  void scatter_free_grid_points(real_simulation *field);
   dynamic_vector load_vector(const std::string &vector_path, bool verbose);
 };
 
@@ -0,0 +1,386 @@
+#include "lbfgs.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <omp.h>
+#include <stdexcept>
+
+lbfgs::lbfgs(const lbfgs_settings &_settings) : settings(_settings)
+{
+  if (settings.history < 1 or settings.max_iterations < 0 or
+      settings.max_line_search_evaluations < 1 or settings.wolfe_c1 <= 0.0 or
+      settings.wolfe_c1 >= settings.wolfe_c2 or settings.wolfe_c2 >= 1.0 or
+      settings.initial_step <= 0.0)
+  {
+    throw std::invalid_argument("Invalid L-BFGS settings.");
+  }
+}
+
+bool lbfgs::bounded() const
+{
+  return settings.lower_bounds.size() > 0 or settings.upper_bounds.size() > 0;
+}
+
+void lbfgs::project(Eigen::VectorXd &x) const
+{
+  if (bounded())
+  {
+    x = x.cwiseMax(settings.lower_bounds).cwiseMin(settings.upper_bounds);
+  }
+}
+
+double lbfgs::projected_gradient_norm(const Eigen::VectorXd &x) const
+{
+  if (!bounded())
+  {
+    return gradient.cwiseAbs().maxCoeff();
+  }
+  return ((x - gradient)
+              .cwiseMax(settings.lower_bounds)
+              .cwiseMin(settings.upper_bounds) -
+          x)
+      .cwiseAbs()
+      .maxCoeff();
+}
+
+void lbfgs::compute_direction(const Eigen::VectorXd &x)
+{
+  // Variables at a bound with the gradient pointing outward stay fixed.
+  auto fixed = [&](int i) {
+    return bounded() and
+           ((x[i] <= settings.lower_bounds[i] and gradient[i] > 0.0) or
+            (x[i] >= settings.upper_bounds[i] and gradient[i] < 0.0));
+  };
+
+  // Two-loop recursion, with the direction as work vector.
+  direction = gradient;
+  for (int i = 0; i < direction.size(); ++i)
+  {
+    if (fixed(i))
+    {
+      direction[i] = 0.0;
+    }
+  }
+  const int history = settings.history;
+  for (int k = history_size - 1; k >= 0; --k)
+  {
+    int column = (history_start + k) % history;
+    alpha_history[column] = rho_history[column] * s_history.col(column).dot(direction);
+    direction -= alpha_history[column] * y_history.col(column);
+  }
+  if (history_size > 0)
+  {
+    int newest = (history_start + history_size - 1) % history;
+    direction *= s_history.col(newest).dot(y_history.col(newest)) /
+                 y_history.col(newest).squaredNorm();
+  }
+  for (int k = 0; k < history_size; ++k)
+  {
+    int column = (history_start + k) % history;
+    double beta = rho_history[column] * y_history.col(column).dot(direction);
+    direction += (alpha_history[column] - beta) * s_history.col(column);
+  }
+  direction = -direction;
+  for (int i = 0; i < direction.size(); ++i)
+  {
+    if (fixed(i))
+    {
+      direction[i] = 0.0;
+    }
+  }
+
+  // Fall back to steepest descent if the history does not give a descent
+  // direction.
+  if (history_size > 0 and direction.dot(gradient) >= 0.0)
+  {
+    history_size = 0;
+    compute_direction(x);
+  }
+}
+
+double lbfgs::maximum_step(const Eigen::VectorXd &x) const
+{
+  double maximum = std::numeric_limits<double>::infinity();
+  if (!bounded())
+  {
+    return maximum;
+  }
+  for (int i = 0; i < x.size(); ++i)
+  {
+    if (direction[i] > 0.0)
+    {
+      maximum = std::min(maximum, (settings.upper_bounds[i] - x[i]) / direction[i]);
+    }
+    else if (direction[i] < 0.0)
+    {
+      maximum = std::min(maximum, (settings.lower_bounds[i] - x[i]) / direction[i]);
+    }
+  }
+  return std::max(maximum, 0.0);
+}
+
+double lbfgs::evaluate(const objective_function &objective, const Eigen::VectorXd &x,
+                       double step)
+{
+  x_trial = x + step * direction;
+  project(x_trial);
+  evaluations++;
+  return objective(x_trial, gradient_trial);
+}
+
+// Safeguarded cubic interpolation of the minimum between two line search points.
+static double interpolate(double a_low, double f_low, double slope_low, double a_high,
+                          double f_high, double slope_high)
+{
+  double bisection = 0.5 * (a_low + a_high);
+  if (!std::isfinite(f_high) or !std::isfinite(slope_high))
+  {
+    return bisection;
+  }
+  double d1 = slope_low + slope_high - 3.0 * (f_low - f_high) / (a_low - a_high);
+  double discriminant = d1 * d1 - slope_low * slope_high;
+  if (discriminant < 0.0)
+  {
+    return bisection;
+  }
+  double d2 = std::copysign(std::sqrt(discriminant), a_high - a_low);
+  double a = a_high - (a_high - a_low) * (slope_high + d2 - d1) /
+                          (slope_high - slope_low + 2.0 * d2);
+
+  double margin = 0.1 * std::abs(a_high - a_low);
+  if (!std::isfinite(a) or a < std::min(a_low, a_high) + margin or
+      a > std::max(a_low, a_high) - margin)
+  {
+    return bisection;
+  }
+  return a;
+}
+
+bool lbfgs::line_search(const objective_function &objective, Eigen::VectorXd &x,
+                        double &misfit, double &step, double maximum)
+{
+  // Bracketing and zooming as in Nocedal & Wright, algorithms 3.5 and 3.6. The
+  // low point always satisfies the sufficient decrease condition.
+  const double misfit_start = misfit;
+  const double slope_start = gradient.dot(direction);
+  const double c1 = settings.wolfe_c1;
+  const double c2 = settings.wolfe_c2;
+
+  double a_low = 0.0, f_low = misfit_start, slope_low = slope_start;
+  double a_high = 0.0, f_high = 0.0, slope_high = 0.0;
+  bool bracketed = false;
+  double a = step;
+
+  for (int i = 0; i < settings.max_line_search_evaluations; ++i)
+  {
+    if (bracketed)
+    {
+      a = interpolate(a_low, f_low, slope_low, a_high, f_high, slope_high);
+    }
+    double f = evaluate(objective, x, a);
+    double slope = gradient_trial.dot(direction);
+
+    if (!std::isfinite(f) or f > misfit_start + c1 * a * slope_start or f >= f_low)
+    {
+      a_high = a;
+      f_high = f;
+      slope_high = slope;
+      bracketed = true;
+      continue;
+    }
+    if (std::abs(slope) <= -c2 * slope_start)
+    {
+      x = x_trial;
+      gradient = gradient_trial;
+      misfit = f;
+      step = a;
+      return true;
+    }
+    if (bracketed ? slope * (a_high - a_low) >= 0.0 : slope >= 0.0)
+    {
+      a_high = a_low;
+      f_high = f_low;
+      slope_high = slope_low;
+      bracketed = true;
+    }
+    a_low = a;
+    f_low = f;
+    slope_low = slope;
+    x_low = x_trial;
+    gradient_low = gradient_trial;
+
+    if (!bracketed)
+    {
+      // Steps that reach a bound are accepted without the curvature condition.
+      if (a >= maximum)
+      {
+        break;
+      }
+      a = std::min(2.0 * a, maximum);
+    }
+  }
+
+  if (a_low > 0.0)
+  {
+    x = x_low;
+    gradient = gradient_low;
+    misfit = f_low;
+    step = a_low;
+    return true;
+  }
+  return false;
+}
+
+void lbfgs::push_history(const Eigen::VectorXd &x)
+{
+  // Pairs without positive curvature would make the Hessian indefinite.
+  double sy = (x - x_previous).dot(gradient - gradient_previous);
+  if (sy <= 1e-10 * (x - x_previous).norm() * (gradient - gradient_previous).norm())
+  {
+    return;
+  }
+
+  const int history = settings.history;
+  int column;
+  if (history_size < history)
+  {
+    column = (history_start + history_size) % history;
+    history_size++;
+  }
+  else
+  {
+    column = history_start;
+    history_start = (history_start + 1) % history;
+  }
+  s_history.col(column) = x - x_previous;
+  y_history.col(column) = gradient - gradient_previous;
+  rho_history[column] = 1.0 / sy;
+}
+
+lbfgs_result lbfgs::minimize(const objective_function &objective, Eigen::VectorXd &x,
+                             bool verbose)
+{
+  const int n = x.size();
+  if (bounded())
+  {
+    if (settings.lower_bounds.size() == 0)
+    {
+      settings.lower_bounds =
+          Eigen::VectorXd::Constant(n, -std::numeric_limits<double>::infinity());
+    }
+    if (settings.upper_bounds.size() == 0)
+    {
+      settings.upper_bounds =
+          Eigen::VectorXd::Constant(n, std::numeric_limits<double>::infinity());
+    }
+    if (settings.lower_bounds.size() != n or settings.upper_bounds.size() != n or
+        (settings.lower_bounds.array() > settings.upper_bounds.array()).any())
+    {
+      throw std::invalid_argument("The bounds should have the size of the model and "
+                                  "lower bounds should not exceed upper bounds.");
+    }
+  }
+
+  s_history.resize(n, settings.history);
+  y_history.resize(n, settings.history);
+  rho_history.resize(settings.history);
+  alpha_history.resize(settings.history);
+  history_size = 0;
+  history_start = 0;
+  gradient.resize(n);
+  direction.resize(n);
+  x_trial.resize(n);
+  gradient_trial.resize(n);
+  x_low.resize(n);
+  gradient_low.resize(n);
+  x_previous.resize(n);
+  gradient_previous.resize(n);
+
+  lbfgs_result result;
+  result.stop_reason = "Maximum number of iterations reached.";
+
+  double start_time = omp_get_wtime();
+  project(x);
+  double misfit = objective(x, gradient);
+  const double initial_norm = projected_gradient_norm(x);
+  result.iterations.push_back(
+      {0, misfit, initial_norm, 0.0, 1, omp_get_wtime() - start_time});
+  if (verbose)
+  {
+    std::cout << "L-BFGS iteration 0, misfit: " << misfit
+              << ", projected gradient: " << initial_norm << std::endl;
+  }
+
+  auto initial_step = [&](double maximum) {
+    if (history_size > 0)
+    {
+      return std::min(1.0, maximum);
+    }
+    double x_scale = x.cwiseAbs().maxCoeff();
+    double step = settings.initial_step * (x_scale > 0.0 ? x_scale : 1.0) /
+                  direction.cwiseAbs().maxCoeff();
+    return std::min(step, maximum);
+  };
+
+  for (int iteration = 1; iteration <= settings.max_iterations; ++iteration)
+  {
+    double norm = projected_gradient_norm(x);
+    if (norm == 0.0 or norm <= settings.gradient_tolerance * initial_norm)
+    {
+      result.stop_reason = "Projected gradient tolerance reached.";
+      break;
+    }
+
+    start_time = omp_get_wtime();
+    evaluations = 0;
+    x_previous = x;
+    gradient_previous = gradient;
+    const double misfit_previous = misfit;
+
+    compute_direction(x);
+    double maximum = maximum_step(x);
+    double step = initial_step(maximum);
+    bool found = maximum > 0.0 and line_search(objective, x, misfit, step, maximum);
+    if (!found and history_size > 0)
+    {
+      // Retry once along steepest descent.
+      history_size = 0;
+      compute_direction(x);
+      maximum = maximum_step(x);
+      step = initial_step(maximum);
+      found = maximum > 0.0 and line_search(objective, x, misfit, step, maximum);
+    }
+    if (!found)
+    {
+      result.stop_reason = "Line search failed to decrease the misfit.";
+      break;
+    }
+
+    push_history(x);
+
+    norm = projected_gradient_norm(x);
+    result.iterations.push_back(
+        {iteration, misfit, norm, step, evaluations, omp_get_wtime() - start_time});
+    if (verbose)
+    {
+      std::cout << "L-BFGS iteration " << iteration << ", misfit: " << misfit
+                << ", projected gradient: " << norm << ", step: " << step
+                << ", evaluations: " << evaluations
+                << ", time: " << result.iterations.back().seconds << " s" << std::endl;
+    }
+
+    if (misfit_previous - misfit <= settings.misfit_tolerance * std::abs(misfit_previous))
+    {
+      result.stop_reason = "Misfit tolerance reached.";
+      break;
+    }
+  }
+
+  if (verbose)
+  {
+    std::cout << result.stop_reason << std::endl;
+  }
+  result.misfit = misfit;
+  return result;
+}
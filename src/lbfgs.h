@@ -0,0 +1,114 @@
+#ifndef LBFGS_H
+#define LBFGS_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Eigen/Dense"
+
+//!  \brief Settings of the L-BFGS optimizer.
+//!
+//!  Bounds are optional; empty vectors mean unbounded. The optimizer stops when
+//!  the projected gradient has decreased by gradient_tolerance relative to the
+//!  starting model, when an iteration decreases the misfit by less than
+//!  misfit_tolerance relative to the misfit, or after max_iterations.
+struct lbfgs_settings
+{
+  //! Number of model and gradient updates kept to approximate the Hessian.
+  int history = 10;
+  int max_iterations = 20;
+  //! Maximum number of objective evaluations per line search.
+  int max_line_search_evaluations = 10;
+  double gradient_tolerance = 1e-5;
+  double misfit_tolerance = 1e-8;
+  //! Sufficient decrease (c1) and curvature (c2) constants of the strong Wolfe
+  //! conditions.
+  double wolfe_c1 = 1e-4;
+  double wolfe_c2 = 0.9;
+  //! Largest relative model change of the first trial step, used as long as no
+  //! history is available to scale the step.
+  double initial_step = 0.01;
+  Eigen::VectorXd lower_bounds;
+  Eigen::VectorXd upper_bounds;
+};
+
+//!  \brief Report of a single L-BFGS iteration.
+struct lbfgs_iteration
+{
+  int iteration;
+  double misfit;
+  //! Infinity norm of the gradient projected onto the bounds.
+  double projected_gradient_norm;
+  double step_length;
+  int evaluations;
+  double seconds;
+};
+
+//!  \brief Outcome of an L-BFGS minimization.
+struct lbfgs_result
+{
+  double misfit;
+  std::vector<lbfgs_iteration> iterations;
+  std::string stop_reason;
+};
+
+//!  \brief Limited memory BFGS optimizer with a strong Wolfe line search and
+//!  optional bound constraints.
+//!
+//!  Bounds are handled by projection: variables at a bound whose gradient points
+//!  outward are fixed for the iteration, and steps are limited to the feasible
+//!  region. All buffers are allocated once per minimization and reused between
+//!  iterations.
+class lbfgs
+{
+public:
+  //! Objective function, returning the misfit at x and writing its gradient.
+  typedef std::function<double(const Eigen::VectorXd &x, Eigen::VectorXd &gradient)>
+      objective_function;
+
+  explicit lbfgs(const lbfgs_settings &settings);
+
+  //!  \brief Minimize the objective, starting from and updating x.
+  //!
+  //!  @param objective Objective function.
+  //!  @param x Starting model on input, best model on output.
+  //!  @param verbose Boolean controlling the printing of per-iteration reports.
+  lbfgs_result minimize(const objective_function &objective, Eigen::VectorXd &x,
+                        bool verbose);
+
+private:
+  lbfgs_settings settings;
+
+  // | History of model (s) and gradient (y) updates, as ring buffers of columns
+  Eigen::MatrixXd s_history;
+  Eigen::MatrixXd y_history;
+  Eigen::VectorXd rho_history;
+  Eigen::VectorXd alpha_history;
+  int history_size;
+  int history_start;
+
+  // | Current point, search direction and line search points
+  Eigen::VectorXd gradient;
+  Eigen::VectorXd direction;
+  Eigen::VectorXd x_trial;
+  Eigen::VectorXd gradient_trial;
+  Eigen::VectorXd x_low;
+  Eigen::VectorXd gradient_low;
+  Eigen::VectorXd x_previous;
+  Eigen::VectorXd gradient_previous;
+  int evaluations;
+
+  bool bounded() const;
+  void project(Eigen::VectorXd &x) const;
+  double projected_gradient_norm(const Eigen::VectorXd &x) const;
+  void compute_direction(const Eigen::VectorXd &x);
+  double maximum_step(const Eigen::VectorXd &x) const;
+  double evaluate(const objective_function &objective, const Eigen::VectorXd &x,
+                  double step);
+  bool line_search(const objective_function &objective, Eigen::VectorXd &x,
+                   double &misfit, double &step, double maximum);
+  void push_history(const Eigen::VectorXd &x);
+};
+
+#endif // LBFGS_H
@@ -1,6 +1,7 @@
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
 #include <pybind11/eigen.h>
+#include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <stddef.h>
@@ -8,6 +9,8 @@
 #include <stdio.h>
 
 #include <iostream>
+#include <limits>
+#include <omp.h>
 #include <thread>
 #include <vector>
 
@@ -30,36 +33,23 @@ std::ostream &operator<<(std::ostream &os, std::vector<T> vec)
   return os;
 }
 
+// Wrap a C-contiguous array. Without a base object, the data is copied into a new
+// array. With a base object, the array is a view on the data that keeps base alive.
 template <class T>
-py::array_t<T> array_to_numpy(T ****pointer, std::vector<ssize_t> shape)
+py::array_t<T> array_to_numpy(T *pointer, std::vector<ssize_t> shape,
+                              py::handle base = py::handle(), bool writeable = true)
 {
-  return py::array_t<T>(py::buffer_info(
-      ***pointer, sizeof(T), py::format_descriptor<T>::format(), 4, shape,
-      std::vector<size_t>{shape[3] * shape[2] * shape[1] * sizeof(T),
-                          shape[3] * shape[2] * sizeof(T), shape[3] * sizeof(T),
-                          sizeof(T)}));
-}
-template <class T>
-py::array_t<T> array_to_numpy(T ***pointer, std::vector<ssize_t> shape)
-{
-  return py::array_t<T>(py::buffer_info(
-      **pointer, sizeof(T), py::format_descriptor<T>::format(), 3, shape,
-      std::vector<size_t>{shape[2] * shape[1] * sizeof(T), shape[2] * sizeof(T),
-                          sizeof(T)}));
-}
-template <class T>
-py::array_t<T> array_to_numpy(T **pointer, std::vector<ssize_t> shape)
-{
-  return py::array_t<T>(
-      py::buffer_info(*pointer, sizeof(T), py::format_descriptor<T>::format(), 2, shape,
-                      std::vector<size_t>{shape[1] * sizeof(T), sizeof(T)}));
-}
-template <class T>
-py::array_t<T> array_to_numpy(T *pointer, std::vector<ssize_t> shape)
-{
-  return py::array_t<T>(py::buffer_info(pointer, sizeof(T),
-                                        py::format_descriptor<T>::format(), 1, shape,
-                                        std::vector<size_t>{sizeof(T)}));
+  std::vector<ssize_t> strides(shape.size(), sizeof(T));
+  for (int i = (int)shape.size() - 2; i >= 0; --i)
+  {
+    strides[i] = strides[i + 1] * shape[i + 1];
+  }
+  py::array_t<T> array(shape, strides, pointer, base);
+  if (!writeable)
+  {
+    array.attr("setflags")(py::arg("write") = false);
+  }
+  return array;
 }
 
 template <class T>
@@ -82,47 +72,22 @@ void copy_data_cast(T1 *destination, T2 *source, int size)
   }
 }
 
-class fdModelExtended : public fdModel
+// Sets the number of OpenMP threads for the lifetime of the guard. The thread count is
+// an ICV of the calling thread, so simulations running concurrently from several
+// Python threads each keep their own override.
+class omp_thread_guard
 {
 public:
-  using fdModel::fdModel;
-
-  py::tuple get_snapshots()
-  {
-    std::vector<ssize_t> shape = {n_shots, snapshots, nx, nz};
-    return py::make_tuple(
-        array_to_numpy(accu_vx, shape), array_to_numpy(accu_vz, shape),
-        array_to_numpy(accu_txx, shape), array_to_numpy(accu_tzz, shape),
-        array_to_numpy(accu_txz, shape));
-  };
-
-  py::tuple get_extent(bool include_absorbing_boundary = true)
-  {
-    if (include_absorbing_boundary)
-    {
-      return py::make_tuple(-np_boundary, dx * (nx_inner + np_boundary), -np_boundary,
-                            dz * (nz_inner + np_boundary));
-    }
-    else
-    {
-      return py::make_tuple(0, dx * nx_inner, 0, dz * nz_inner);
-    }
-  };
-
-  void forward_simulate_explicit_threads(int i_shot, bool store_fields, bool verbose,
-                                         bool output_wavefields,
-                                         int omp_threads_override)
+  omp_thread_guard(int omp_threads_override, bool verbose)
+      : old_limit(omp_get_max_threads()), verbose(verbose)
   {
-    const auto old_limit = omp_get_max_threads();
-    const auto optimal = std::thread::hardware_concurrency();
-
     if (verbose)
     {
       std::cout << "OpenMP info:" << std::endl
-                << "  Original thread limit: " << omp_get_max_threads() << std::endl
-                << "  Hardware concurrency: " << optimal << std::endl;
+                << "  Original thread limit: " << old_limit << std::endl
+                << "  Hardware concurrency: " << std::thread::hardware_concurrency()
+                << std::endl;
     }
-
     if (omp_threads_override != 0)
     {
       if (verbose)
@@ -132,76 +97,147 @@ public:
       }
       omp_set_num_threads(omp_threads_override);
     }
-    else
-    {
-      if (verbose)
-      {
-        std::cout << "  Setting original number of threads: " << omp_get_max_threads()
-                  << std::endl;
-      }
-      omp_set_num_threads(omp_get_max_threads());
-    }
-
     if (verbose)
     {
       std::cout << "  Actual threads: " << omp_get_max_threads() << std::endl;
     }
+  }
 
-    forward_simulate(i_shot, store_fields, verbose, output_wavefields);
-
+  ~omp_thread_guard()
+  {
     if (verbose)
     {
-      std::cout << "  Resetting threads to: " << old_limit << std::endl
-                << std::endl;
+      std::cout << "  Resetting threads to: " << old_limit << std::endl << std::endl;
     }
     omp_set_num_threads(old_limit);
   }
 
-  void adjoint_simulate_explicit_threads(int i_shot, bool verbose,
-                                         int omp_threads_override)
+private:
+  const int old_limit;
+  const bool verbose;
+};
+
+class fdModelExtended : public fdModel
+{
+public:
+  using fdModel::fdModel;
+
+  // Either a copy of a field, or a view that shares memory with, and keeps alive, this
+  // model. Fields other than the snapshots are allocated once at construction, so
+  // views stay valid.
+  template <class T>
+  py::array_t<T> field_to_numpy(T *field, std::vector<ssize_t> shape, bool copy,
+                                bool writeable)
   {
-    const auto old_limit = omp_get_max_threads();
-    const auto optimal = std::thread::hardware_concurrency();
+    if (copy)
+    {
+      return array_to_numpy(field, shape);
+    }
+    auto self = py::cast(this, py::return_value_policy::reference);
+    return array_to_numpy(field, shape, self, writeable);
+  }
 
-    if (verbose)
+  // Either a copy of a snapshot array, or a view that shares ownership of it. The
+  // snapshots are reallocated by set_snapshot_quadrature() and the like, after which
+  // views keep the discarded array alive instead of this model.
+  py::array_t<real_simulation> snapshot_to_numpy(
+      const std::shared_ptr<real_simulation> &storage, std::vector<ssize_t> shape,
+      bool copy, bool writeable)
+  {
+    if (copy)
     {
-      std::cout << "OpenMP info:" << std::endl
-                << "  Original thread limit: " << omp_get_max_threads() << std::endl
-                << "  Hardware concurrency: " << optimal << std::endl;
+      return array_to_numpy(storage.get(), shape);
     }
+    py::capsule owner(new std::shared_ptr<real_simulation>(storage), [](void *pointer) {
+      delete static_cast<std::shared_ptr<real_simulation> *>(pointer);
+    });
+    return array_to_numpy(storage.get(), shape, owner, writeable);
+  }
 
-    if (omp_threads_override != 0)
+  py::tuple get_snapshots(bool copy = true, bool writeable = false)
+  {
+    std::vector<ssize_t> shape(shape_accu.begin(), shape_accu.end());
+    std::vector<ssize_t> shape_unused(shape_unused_accu.begin(),
+                                      shape_unused_accu.end());
+    // Fields the selected kernels do not need are returned without snapshots.
+    auto &shape_velocities = kernels_need_velocities() ? shape : shape_unused;
+    auto &shape_shear_stress = kernels_need_shear_stress() ? shape : shape_unused;
+    return py::make_tuple(
+        snapshot_to_numpy(accu_vx_storage, shape_velocities, copy, writeable),
+        snapshot_to_numpy(accu_vz_storage, shape_velocities, copy, writeable),
+        snapshot_to_numpy(accu_txx_storage, shape, copy, writeable),
+        snapshot_to_numpy(accu_tzz_storage, shape, copy, writeable),
+        snapshot_to_numpy(accu_txz_storage, shape_shear_stress, copy, writeable));
+  };
+
+  py::tuple get_extent(bool include_absorbing_boundary = true)
+  {
+    if (include_absorbing_boundary)
     {
-      if (verbose)
-      {
-        std::cout << "  Setting override number of threads: " << omp_threads_override
-                  << std::endl;
-      }
-      omp_set_num_threads(omp_threads_override);
+      return py::make_tuple(-np_boundary, dx * (nx_inner + np_boundary), -np_boundary,
+                            dz * (nz_inner + np_boundary));
     }
     else
     {
-      if (verbose)
-      {
-        std::cout << "  Setting original number of threads: " << omp_get_max_threads()
-                  << std::endl;
-      }
-      omp_set_num_threads(omp_get_max_threads());
+      return py::make_tuple(0, dx * nx_inner, 0, dz * nz_inner);
     }
+  };
 
-    if (verbose)
-    {
-      std::cout << "  Actual threads: " << omp_get_max_threads() << std::endl;
-    }
+  void forward_simulate_explicit_threads(int i_shot, bool store_fields, bool verbose,
+                                         bool output_wavefields,
+                                         int omp_threads_override)
+  {
+    omp_thread_guard threads(omp_threads_override, verbose);
+    forward_simulate(i_shot, store_fields, verbose, output_wavefields);
+  }
 
+  void adjoint_simulate_explicit_threads(int i_shot, bool verbose,
+                                         int omp_threads_override)
+  {
+    omp_thread_guard threads(omp_threads_override, verbose);
     adjoint_simulate(i_shot, verbose);
+  }
 
-    if (verbose)
+  // Runs work on worker copies of this model with the GIL released. Workers copy this
+  // model without holding the GIL, so a Python step callback may not be copied along.
+  template <typename Work> void run_workers_without_gil(const Work &work)
+  {
+    auto callback = std::move(step_callback);
+    step_callback = nullptr;
+    try
     {
-      std::cout << "  Resetting threads to: " << old_limit << std::endl
-                << std::endl;
+      py::gil_scoped_release release;
+      work();
     }
-    omp_set_num_threads(old_limit);
+    catch (...)
+    {
+      step_callback = std::move(callback);
+      throw;
+    }
+    step_callback = std::move(callback);
+  }
+
+  py::tuple evaluate_models_without_gil(const dynamic_matrix &model_vectors,
+                                        int n_workers)
+  {
+    dynamic_vector misfits;
+    dynamic_matrix gradients;
+    run_workers_without_gil(
+        [&]() { evaluate_models(model_vectors, misfits, gradients, n_workers); });
+    return py::make_tuple(misfits, gradients);
+  }
+
+  std::vector<real_simulation>
+  evaluate_trial_steps_without_gil(const dynamic_vector &model_vector,
+                                   const dynamic_vector &direction,
+                                   const std::vector<real_simulation> &steps,
+                                   int n_workers)
+  {
+    std::vector<real_simulation> misfits;
+    run_workers_without_gil([&]() {
+      evaluate_trial_steps(model_vector, direction, steps, misfits, n_workers);
+    });
+    return misfits;
   }
 
   py::tuple get_coordinates(bool in_units)
@@ -245,11 +281,12 @@ public:
     return py::make_tuple(array_IX, array_IZ);
   }
 
-  py::tuple get_parameter_fields()
+  py::tuple get_parameter_fields(bool copy = true)
   {
-    auto array_vp = array_to_numpy(vp, std::vector<ssize_t>{nx, nz});
-    auto array_vs = array_to_numpy(vs, std::vector<ssize_t>{nx, nz});
-    auto array_rho = array_to_numpy(rho, std::vector<ssize_t>{nx, nz});
+    // Views are read-only, as the Lamé parameters have to follow every change.
+    auto array_vp = field_to_numpy(vp, std::vector<ssize_t>{nx, nz}, copy, false);
+    auto array_vs = field_to_numpy(vs, std::vector<ssize_t>{nx, nz}, copy, false);
+    auto array_rho = field_to_numpy(rho, std::vector<ssize_t>{nx, nz}, copy, false);
     return py::make_tuple(array_vp, array_vs, array_rho);
   }
 
@@ -296,31 +333,88 @@ public:
     update_from_velocity();
   }
 
-  py::tuple get_kernels()
+  py::tuple get_kernels(bool copy = true, bool writeable = false)
   {
-    auto array_vp_kernel = array_to_numpy(vp_kernel, std::vector<ssize_t>{nx, nz});
-    auto array_vs_kernel = array_to_numpy(vs_kernel, std::vector<ssize_t>{nx, nz});
-    auto array_rho_kernel =
-        array_to_numpy(density_v_kernel, std::vector<ssize_t>{nx, nz});
+    std::vector<ssize_t> shape{nx, nz};
+    auto array_vp_kernel = field_to_numpy(vp_kernel, shape, copy, writeable);
+    auto array_vs_kernel = field_to_numpy(vs_kernel, shape, copy, writeable);
+    auto array_rho_kernel = field_to_numpy(density_v_kernel, shape, copy, writeable);
     return py::make_tuple(array_vp_kernel, array_vs_kernel, array_rho_kernel);
   }
 
-  py::tuple get_synthetic_data()
+  py::tuple get_illumination(bool copy = true, bool writeable = false)
   {
-    auto array_rtf_ux = array_to_numpy(rtf_ux, std::vector<ssize_t>{n_shots, nr, nt});
-    auto array_rtf_uz = array_to_numpy(rtf_uz, std::vector<ssize_t>{n_shots, nr, nt});
+    std::vector<ssize_t> shape{nx, nz};
+    auto array_forward = field_to_numpy(forward_illumination, shape, copy, writeable);
+    auto array_adjoint = field_to_numpy(adjoint_illumination, shape, copy, writeable);
+    return py::make_tuple(array_forward, array_adjoint);
+  }
+
+  py::tuple get_synthetic_data(bool copy = true, bool writeable = false)
+  {
+    std::vector<ssize_t> shape{n_shots, nr, nt};
+    auto array_rtf_ux = field_to_numpy(rtf_ux, shape, copy, writeable);
+    auto array_rtf_uz = field_to_numpy(rtf_uz, shape, copy, writeable);
     return py::make_tuple(array_rtf_ux, array_rtf_uz);
   }
 
-  py::tuple get_observed_data()
+  py::tuple get_observed_data(bool copy = true, bool writeable = false)
   {
-    auto array_rtf_ux_true =
-        array_to_numpy(rtf_ux_true, std::vector<ssize_t>{n_shots, nr, nt});
-    auto array_rtf_uz_true =
-        array_to_numpy(rtf_uz_true, std::vector<ssize_t>{n_shots, nr, nt});
+    std::vector<ssize_t> shape{n_shots, nr, nt};
+    auto array_rtf_ux_true = field_to_numpy(rtf_ux_true, shape, copy, writeable);
+    auto array_rtf_uz_true = field_to_numpy(rtf_uz_true, shape, copy, writeable);
     return py::make_tuple(array_rtf_ux_true, array_rtf_uz_true);
   }
 
+  py::tuple get_encoded_data(bool copy = true, bool writeable = false)
+  {
+    std::vector<ssize_t> shape{nr, nt};
+    auto array_rtf_ux = field_to_numpy(rtf_ux_encoded, shape, copy, writeable);
+    auto array_rtf_uz = field_to_numpy(rtf_uz_encoded, shape, copy, writeable);
+    auto array_rtf_ux_true = field_to_numpy(rtf_ux_true_encoded, shape, copy, writeable);
+    auto array_rtf_uz_true = field_to_numpy(rtf_uz_true_encoded, shape, copy, writeable);
+    return py::make_tuple(array_rtf_ux, array_rtf_uz, array_rtf_ux_true,
+                          array_rtf_uz_true);
+  }
+
+  py::tuple get_wavefields(bool copy = true, bool writeable = false)
+  {
+    std::vector<ssize_t> shape = {nx, nz};
+    return py::make_tuple(field_to_numpy(vx, shape, copy, writeable),
+                          field_to_numpy(vz, shape, copy, writeable),
+                          field_to_numpy(txx, shape, copy, writeable),
+                          field_to_numpy(tzz, shape, copy, writeable),
+                          field_to_numpy(txz, shape, copy, writeable));
+  }
+
+  void set_step_callback(py::object callback, int interval)
+  {
+    if (callback.is_none())
+    {
+      step_callback = nullptr;
+      step_callback_interval = 0;
+      return;
+    }
+    // Callbacks that return nothing continue the simulation.
+    step_callback = [callback](int i_shot, int it) {
+      py::gil_scoped_acquire acquire;
+      py::object result = callback(i_shot, it);
+      return result.is_none() or result.cast<bool>();
+    };
+    step_callback_interval = interval;
+  }
+
+  py::tuple get_misfits(bool copy = true)
+  {
+    auto array_per_trace = field_to_numpy(
+        misfit_per_trace, std::vector<ssize_t>{n_shots, nr}, copy, false);
+    auto array_per_shot =
+        field_to_numpy(misfit_per_shot, std::vector<ssize_t>{n_shots}, copy, false);
+    auto array_per_receiver =
+        field_to_numpy(misfit_per_receiver, std::vector<ssize_t>{nr}, copy, false);
+    return py::make_tuple(array_per_trace, array_per_shot, array_per_receiver);
+  }
+
   py::tuple get_receivers(bool in_units, bool include_absorbing_boundary_as_index)
   {
     // Create new arrays
@@ -424,6 +518,11 @@ public:
     return std::move(new fdModelExtended(*this));
   }
 
+  fdModelExtended *resample(const simulation_plan &plan)
+  {
+    return new fdModelExtended(*this, plan);
+  }
+
   void set_observed_data(py::array_t<real_simulation> ux,
                          py::array_t<real_simulation> uz)
   {
@@ -462,6 +561,119 @@ PYBIND11_MODULE(__psvWave_cpp, m)
   py::options options;
   options.disable_function_signatures();
 
+  py::class_<wavefield_output_settings>(m, "WavefieldOutputSettings",
+                                        "Settings of wavefield output during forward "
+                                        "simulation.")
+      .def(py::init<>())
+      .def_readwrite("path", &wavefield_output_settings::path,
+                     "File the frames are written (or appended) to.")
+      .def_readwrite("interval", &wavefield_output_settings::interval,
+                     "Number of time steps between frames.")
+      .def_readwrite("fields", &wavefield_output_settings::fields,
+                     "Bit mask of the fields to write: 1 vx, 2 vz, 4 txx, 8 tzz, 16 "
+                     "txz.")
+      .def_readwrite("ix_start", &wavefield_output_settings::ix_start)
+      .def_readwrite("ix_end", &wavefield_output_settings::ix_end,
+                     "End of the window in x (exclusive), -1 for the full domain.")
+      .def_readwrite("iz_start", &wavefield_output_settings::iz_start)
+      .def_readwrite("iz_end", &wavefield_output_settings::iz_end,
+                     "End of the window in z (exclusive), -1 for the full domain.")
+      .def_readwrite("decimation_x", &wavefield_output_settings::decimation_x)
+      .def_readwrite("decimation_z", &wavefield_output_settings::decimation_z)
+      .def_readwrite("ring_size", &wavefield_output_settings::ring_size,
+                     "Number of frames queued before the simulation waits on disk.");
+
+  py::class_<lbfgs_settings>(m, "LBFGSSettings", "Settings of the L-BFGS optimizer.")
+      .def(py::init<>())
+      .def_readwrite("history", &lbfgs_settings::history,
+                     "Number of model and gradient updates kept.")
+      .def_readwrite("max_iterations", &lbfgs_settings::max_iterations)
+      .def_readwrite("max_line_search_evaluations",
+                     &lbfgs_settings::max_line_search_evaluations,
+                     "Maximum number of misfit and gradient evaluations per line "
+                     "search.")
+      .def_readwrite("gradient_tolerance", &lbfgs_settings::gradient_tolerance,
+                     "Stop when the projected gradient has decreased by this factor.")
+      .def_readwrite("misfit_tolerance", &lbfgs_settings::misfit_tolerance,
+                     "Stop when an iteration decreases the misfit by less than this "
+                     "fraction.")
+      .def_readwrite("wolfe_c1", &lbfgs_settings::wolfe_c1)
+      .def_readwrite("wolfe_c2", &lbfgs_settings::wolfe_c2)
+      .def_readwrite("initial_step", &lbfgs_settings::initial_step,
+                     "Largest relative model change of the first trial step.")
+      .def_readwrite("lower_bounds", &lbfgs_settings::lower_bounds,
+                     "Lower bound per model parameter, or an empty array.")
+      .def_readwrite("upper_bounds", &lbfgs_settings::upper_bounds,
+                     "Upper bound per model parameter, or an empty array.");
+
+  py::class_<lbfgs_iteration>(m, "LBFGSIteration", "Report of an L-BFGS iteration.")
+      .def_readonly("iteration", &lbfgs_iteration::iteration)
+      .def_readonly("misfit", &lbfgs_iteration::misfit)
+      .def_readonly("projected_gradient_norm", &lbfgs_iteration::projected_gradient_norm)
+      .def_readonly("step_length", &lbfgs_iteration::step_length)
+      .def_readonly("evaluations", &lbfgs_iteration::evaluations)
+      .def_readonly("seconds", &lbfgs_iteration::seconds);
+
+  py::class_<lbfgs_result>(m, "LBFGSResult", "Outcome of an L-BFGS minimization.")
+      .def_readonly("misfit", &lbfgs_result::misfit)
+      .def_readonly("iterations", &lbfgs_result::iterations)
+      .def_readonly("stop_reason", &lbfgs_result::stop_reason);
+
+  py::class_<multiscale_stage>(m, "MultiscaleStage",
+                               "Frequency band and settings of a multiscale stage.")
+      .def(py::init<>())
+      .def_readwrite("max_frequency", &multiscale_stage::max_frequency,
+                     "Corner frequency of the low pass filter applied to the observed "
+                     "data and source time functions, in Hz.")
+      .def_readwrite("points_per_wavelength", &multiscale_stage::points_per_wavelength,
+                     "Smallest number of grid points per wavelength at max_frequency.")
+      .def_readwrite("optimizer", &multiscale_stage::optimizer);
+
+  py::class_<multiscale_stage_result>(m, "MultiscaleStageResult",
+                                      "Outcome of a multiscale stage.")
+      .def_readonly("coarsening", &multiscale_stage_result::coarsening,
+                    "Factor by which the grid of the stage was coarsened.")
+      .def_readonly("optimization", &multiscale_stage_result::optimization);
+
+  py::class_<simulation_plan>(m, "SimulationPlan",
+                              "Grid spacing, time step and cost of a simulation.")
+      .def(py::init<>())
+      .def_readwrite("dx", &simulation_plan::dx)
+      .def_readwrite("dz", &simulation_plan::dz)
+      .def_readwrite("dt", &simulation_plan::dt)
+      .def_readwrite("nt", &simulation_plan::nt)
+      .def_readwrite("nx_inner", &simulation_plan::nx_inner)
+      .def_readwrite("nz_inner", &simulation_plan::nz_inner)
+      .def_readwrite("max_stable_dt", &simulation_plan::max_stable_dt,
+                     "Largest time step for which the scheme is stable on the planned "
+                     "grid.")
+      .def_readwrite("current_max_stable_dt", &simulation_plan::current_max_stable_dt,
+                     "Largest time step for which the scheme is stable on the grid of "
+                     "the model the plan was made for.")
+      .def_readwrite("max_frequency", &simulation_plan::max_frequency,
+                     "Highest frequency sampled with the requested points per "
+                     "wavelength, in Hz.")
+      .def_readwrite("relative_cost", &simulation_plan::relative_cost,
+                     "Number of grid points times time steps, relative to the model "
+                     "the plan was made for.");
+
+  m.attr("kernel_vp") = int(kernel_vp);
+  m.attr("kernel_vs") = int(kernel_vs);
+  m.attr("kernel_rho") = int(kernel_rho);
+  m.attr("kernel_all") = int(kernel_all);
+
+  py::class_<shot_window>(m, "ShotWindow",
+                          "Columns of the grid and receivers a shot is simulated with.")
+      .def_readonly("i_shot", &shot_window::i_shot)
+      .def_readonly("ix_start", &shot_window::ix_start,
+                    "First grid index in x of the window, inside the absorbing "
+                    "boundary.")
+      .def_readonly("ix_end", &shot_window::ix_end,
+                    "Last grid index in x of the window, inside the absorbing "
+                    "boundary.")
+      .def_readonly("receivers", &shot_window::receivers,
+                    "Receivers inside the window, which record the shot.");
+
   py::class_<fdModelExtended>(m, "fdModel",
                               R"mydelimiter(fdModel(configuration_file_path: str)
     Class to simulate P-SV wave phyiscs and its adjoint state.
@@ -474,13 +686,16 @@ PYBIND11_MODULE(__psvWave_cpp, m)
            "\n"
            "Returns a copy of the object, duplicating all members.")
       .def("forward_simulate", &fdModelExtended::forward_simulate_explicit_threads,
+           py::call_guard<py::gil_scoped_release>(),
            py::arg("i_shot"), py::arg("store_fields") = true,
            py::arg("verbose") = false, py::arg("output_wavefields") = false,
            py::arg("omp_threads_override") = 0,
            "forward_simulate(i_shot: int, store_fields: bool = True, verbose: bool = "
            "False, output_wavefields: bool = False, omp_threads_override: int = 0)\n"
            "\n"
-           "Run forward simulations for a given 'shot'.\n"
+           "Run forward simulations for a given 'shot'. The GIL is released while "
+           "simulating, so other Python threads, including simulations of other "
+           "models, keep running.\n"
            "\n"
            ":param i_shot: Integer representing which shot will be simulated.\n"
            ":type  i_shot: int\n"
@@ -490,12 +705,148 @@ PYBIND11_MODULE(__psvWave_cpp, m)
            ":param verbose: Boolean controlling the verbosity of the simulation.\n"
            ":type  verbose: bool\n"
            ":param output_wavefields: Boolean controlling whether or not wavefields "
-           "are written to disk.\n"
+           "are written to disk, as configured by `wavefield_output`. Files can be "
+           "read with :func:`psvWave.read_wavefield_file`.\n"
            ":type  output_wavefields: boolean\n"
            ":param omp_threads_override: Integer determining the amounts of threads "
            "that will be used. Defaults to the environment variable if not passed / "
            "0.\n"
            ":type  omp_threads_override: int\n")
+      .def("begin_forward_simulation", &fdModelExtended::begin_forward_simulation,
+           py::arg("i_shot"), py::arg("store_fields") = true,
+           "begin_forward_simulation(i_shot: int, store_fields: bool = True)\n"
+           "\n"
+           "Start a forward simulation of a shot that is advanced with "
+           ":meth:`~psvWave.fdModel.step`. Running all nt steps gives the same "
+           "result as :meth:`~psvWave.fdModel.forward_simulate`.\n"
+           "\n"
+           ":param i_shot: Integer representing which shot will be simulated.\n"
+           ":type  i_shot: int\n"
+           ":param store_fields: Boolean controlling whether or not wavefields are "
+           "stored, defaults to `True`.\n"
+           ":type  store_fields: bool\n")
+      .def("step", &fdModelExtended::step,
+           py::call_guard<py::gil_scoped_release>(), py::arg("n_steps"),
+           "step(n_steps: int) -> int\n"
+           "\n"
+           "Advance the current simulation by up to n_steps time steps. In between, "
+           ":meth:`~psvWave.fdModel.get_wavefields` and "
+           ":meth:`~psvWave.fdModel.get_synthetic_data` give the current state.\n"
+           "\n"
+           ":param n_steps: Maximum number of time steps to take.\n"
+           ":type  n_steps: int\n"
+           ":returns: Number of time steps taken since the start, i.e. the number of "
+           "valid samples in the seismograms of the shot.\n"
+           ":rtype: int")
+      .def("simulation_finished", &fdModelExtended::simulation_finished,
+           "simulation_finished() -> bool\n"
+           "\n"
+           "Whether the current simulation has taken all nt time steps.")
+      .def("set_step_callback", &fdModelExtended::set_step_callback,
+           py::arg("callback"), py::arg("interval"),
+           "set_step_callback(callback: Callable[[int, int], Optional[bool]], "
+           "interval: int)\n"
+           "\n"
+           "Register a function that :meth:`~psvWave.fdModel.step` calls every "
+           "interval time steps with the shot and the number of steps taken. "
+           "Returning False pauses the simulation, which can be resumed with "
+           "another call to step. Pass None to remove the callback.\n"
+           "\n"
+           ":param callback: Function to call.\n"
+           ":type  callback: Callable[[int, int], Optional[bool]]\n"
+           ":param interval: Number of time steps between calls.\n"
+           ":type  interval: int\n")
+      .def("get_wavefields", &fdModelExtended::get_wavefields, py::arg("copy") = true,
+           py::arg("writeable") = false,
+           "get_wavefields(copy: bool = True, writeable: bool = False) -> "
+           "Tuple[numpy.ndarray, numpy.ndarray, numpy.ndarray, numpy.ndarray, "
+           "numpy.ndarray]\n"
+           "\n"
+           "Get the current vx, vz, txx, tzz and txz fields, each of shape (nx, nz).\n"
+           "\n"
+           ":param copy: Return copies if `True`, or views that share memory with the "
+           "model if `False`. Views reflect later simulations and keep the model "
+           "alive, defaults to `True`.\n"
+           ":type  copy: bool\n"
+           ":param writeable: Whether views can be written to, defaults to `False`.\n"
+           ":type  writeable: bool\n")
+      .def("forward_simulate_batch", &fdModelExtended::forward_simulate_batch,
+           py::call_guard<py::gil_scoped_release>(),
+           py::arg("shots"), py::arg("store_fields") = true, py::arg("verbose") = false,
+           "forward_simulate_batch(shots: List[int], store_fields: bool = True, "
+           "verbose: bool = False)\n"
+           "\n"
+           "Run forward simulations for several shots at once. Up to 8 shots share "
+           "one sweep over the grid, with one SIMD lane per shot. Results are "
+           "identical to calling :meth:`~psvWave.fdModel.forward_simulate` per shot.\n"
+           "\n"
+           ":param shots: Shots to simulate.\n"
+           ":type  shots: List[int]\n"
+           ":param store_fields: Boolean controlling whether or not wavefields are "
+           "stored, defaults to `True`.\n"
+           ":type  store_fields: bool\n"
+           ":param verbose: Boolean controlling the verbosity of the simulation.\n"
+           ":type  verbose: bool\n")
+      .def_readwrite("shot_batch_size", &fdModelExtended::shot_batch_size,
+                     "Number of shots simulated per batched sweep in run_model.")
+      .def_readwrite("shot_window_aperture", &fdModelExtended::shot_window_aperture,
+                     "Padding in grid points of the window beyond the sources and "
+                     "the receivers with observed data of every shot on which "
+                     "run_model simulates the shot. Receivers outside the window "
+                     "have no observed data and do not record the shot. Windowing "
+                     "is an approximation: the absorbing boundary of a window lies "
+                     "in the medium, so reflections from outside the window are "
+                     "lost and the error shrinks as the aperture grows. Zero, the "
+                     "default, simulates every shot on the full grid.")
+      .def("get_shot_window", &fdModelExtended::get_shot_window, py::arg("i_shot"),
+           py::arg("aperture"),
+           "get_shot_window(i_shot: int, aperture: int) -> psvWave.ShotWindow\n"
+           "\n"
+           "Window a shot is simulated on for a given shot_window_aperture. It "
+           "spans the sources of the shot and the receivers with observed data for "
+           "it, padded by aperture grid points, and the full depth.\n"
+           "\n"
+           ":param i_shot: Shot index.\n"
+           ":type  i_shot: int\n"
+           ":param aperture: Padding of the window beyond the sources and live "
+           "receivers, in grid points.\n"
+           ":type  aperture: int\n"
+           ":returns: The extent of the window and the receivers inside it.\n"
+           ":rtype: psvWave.ShotWindow")
+      .def_readwrite("wavefield_output", &fdModelExtended::wavefield_output,
+                     "Settings of wavefield output, see "
+                     ":class:`~psvWave.WavefieldOutputSettings`.")
+      .def_readwrite("active_region_tolerance",
+                     &fdModelExtended::active_region_tolerance,
+                     "Velocity amplitude, relative to the largest amplitude of the last "
+                     "time step, above which a tile of the active region activates its "
+                     "neighbours. Simulations only update active tiles, which start at "
+                     "the (adjoint) sources. This pays off when waves cross only part "
+                     "of the grid during a simulation, e.g. forward simulations of "
+                     "long lines with short records; adjoint simulations inject at "
+                     "every receiver, so their region soon covers the spread. Zero, "
+                     "the default, updates the full grid.")
+      .def_readwrite("active_region_tile_size", &fdModelExtended::active_region_tile_size,
+                     "Edge length of the tiles of the active region, in grid points.")
+      .def("active_region_fraction", &fdModelExtended::active_region_fraction,
+           "active_region_fraction() -> float\n"
+           "\n"
+           "Fraction of the tiles that the current simulation updates.\n"
+           "\n"
+           ":returns: Fraction of active tiles, 1 if active_region_tolerance is zero.\n"
+           ":rtype: float")
+      .def("reciprocal_simulate", &fdModelExtended::reciprocal_simulate,
+           py::call_guard<py::gil_scoped_release>(),
+           py::arg("verbose") = false,
+           "reciprocal_simulate(verbose: bool = False)\n"
+           "\n"
+           "Compute the seismograms of all shots by simulating point forces at the "
+           "receivers and reading them at the sources (source-receiver reciprocity). "
+           "Requires 2 * nr simulations instead of n_shots. No wavefields are "
+           "stored, so kernels cannot be computed afterwards.\n"
+           "\n"
+           ":param verbose: Boolean controlling the verbosity of the simulation.\n"
+           ":type  verbose: bool\n")
       .def_readonly(
           "n_sources", &fdModelExtended::n_sources,
           "Number of sources across shots. Does not indicate how many per shot.")
@@ -512,9 +863,78 @@ PYBIND11_MODULE(__psvWave_cpp, m)
            "\n"
            "Update the model (vp, vs, rho) in the class.\n"
            "\n"
-           ":param m: vector of shape (free_parameters, 1).\n"
+           ":param m: vector of shape (free_parameters, 1). Contiguous float64 "
+           "arrays are used without copying.\n"
            ":type m: numpy.ndarray\n"
            "\n")
+      .def("set_basis", &fdModelExtended::set_basis, py::arg("basis"),
+           "set_basis(basis: scipy.sparse.csr_matrix)\n"
+           "\n"
+           "Replace the basis functions of the model vector. By default every "
+           "parameter is a block of npx by npz grid points. The model vector is "
+           "mapped to the grid as basis @ m per field, the gradient as basis.T @ "
+           "kernel, and :meth:`~psvWave.fdModel.get_model_vector` returns weighted "
+           "averages.\n"
+           "\n"
+           ":param basis: Sparse matrix of shape (nx_free_parameters * "
+           "nz_free_parameters, parameters per field), with the free grid points "
+           "in x major order.\n"
+           ":type  basis: scipy.sparse.csr_matrix\n")
+      .def("set_snapshot_quadrature", &fdModelExtended::set_snapshot_quadrature,
+           py::arg("stride_x"), py::arg("stride_z"),
+           "set_snapshot_quadrature(stride_x: int, stride_z: int)\n"
+           "\n"
+           "Store snapshots only at the centres of cells of stride_x by stride_z free "
+           "grid points. Kernels become a midpoint quadrature: each centre receives "
+           "the correlation times the number of grid points in its cell, so "
+           ":meth:`~psvWave.fdModel.get_gradient_vector` approximates the gradient "
+           "of bases that are smooth over a cell from a fraction of the snapshot "
+           "memory. Strides equal to npx and npz store one point per block. Strides "
+           "of 1 store the full grid. Shot windows, see shot_window_aperture, store "
+           "the part of the lattice inside the window. Stored snapshots are "
+           "discarded.\n"
+           "\n"
+           ":param stride_x: Cell width in grid points.\n"
+           ":type  stride_x: int\n"
+           ":param stride_z: Cell height in grid points.\n"
+           ":type  stride_z: int\n")
+      .def("set_kernel_frequencies", &fdModelExtended::set_kernel_frequencies,
+           py::arg("frequencies"),
+           "set_kernel_frequencies(frequencies: List[float])\n"
+           "\n"
+           "Compute kernels from running Fourier transforms of the forward and "
+           "adjoint wavefields at a few frequencies instead of time-domain "
+           "snapshots, so snapshot memory scales with the number of frequencies. "
+           "Every frequency stands for the band up to halfway to its neighbours; all "
+           "multiples of 1 / (snapshots * snapshot_interval * dt) up to the Nyquist "
+           "frequency reproduce the time-domain kernels. An empty list restores "
+           "snapshots. Stored snapshots are discarded.\n"
+           "\n"
+           ":param frequencies: Distinct frequencies in Hz, up to the Nyquist "
+           "frequency of the snapshots.\n"
+           ":type  frequencies: List[float]\n")
+      .def_readonly("kernel_frequencies", &fdModelExtended::kernel_frequencies,
+                    "Frequencies of the Fourier transforms kernels are computed from, "
+                    "empty for time-domain snapshots.")
+      .def("set_kernel_selection", &fdModelExtended::set_kernel_selection,
+           py::arg("selection"),
+           "set_kernel_selection(selection: int)\n"
+           "\n"
+           "Compute the kernels of only some parameters, storing only the snapshots "
+           "they need. The vp kernel needs the normal stresses, the vs kernel also "
+           "the shear stress and the rho kernel all fields. Illumination is only "
+           "accumulated along with the rho kernel, so without it "
+           ":meth:`~psvWave.fdModel.get_preconditioner_vector` raises. Kernels that "
+           "are not selected are zero. Stored snapshots are discarded.\n"
+           "\n"
+           ":param selection: Combination of psvWave.kernel_vp, psvWave.kernel_vs "
+           "and psvWave.kernel_rho, e.g. kernel_vp | kernel_vs.\n"
+           ":type  selection: int\n")
+      .def_readonly("kernel_selection", &fdModelExtended::kernel_selection,
+                    "Bitmask of the parameters whose kernels are computed.")
+      .def_readonly("basis", &fdModelExtended::basis,
+                    "Basis functions of the model vector, as a sparse matrix of shape "
+                    "(free grid points, parameters per field).")
       .def("get_gradient_vector", &fdModelExtended::get_gradient_vector,
            "get_gradient_vector() -> numpy.ndarray\n"
            "\n"
@@ -543,21 +963,81 @@ PYBIND11_MODULE(__psvWave_cpp, m)
            "\n"
            ":returns: Current gradient vector.\n"
            ":rtype: numpy.ndarray")
+      .def("get_preconditioner_vector", &fdModelExtended::get_preconditioner_vector,
+           py::arg("use_adjoint_illumination") = false, py::arg("water_level") = 0.01,
+           "get_preconditioner_vector(use_adjoint_illumination: bool = False, "
+           "water_level: float = 0.01) -> numpy.ndarray\n"
+           "\n"
+           "Returns a diagonal preconditioner for the gradient vector, the inverse of "
+           "a pseudo-Hessian diagonal built from the wavefield energy accumulated "
+           "during the adjoint simulations, see "
+           ":meth:`~psvWave.fdModel.get_illumination`. The diagonal is projected onto "
+           "the basis functions like the gradient and normalized to a maximum of 1. "
+           "Multiply it elementwise with :meth:`~psvWave.fdModel.get_gradient_vector` "
+           "to suppress the dominance of near-source energy. Raises a ValueError if "
+           "the kernel selection excludes rho, see "
+           ":meth:`~psvWave.fdModel.set_kernel_selection`, as the energy is then "
+           "not accumulated.\n"
+           "\n"
+           ":param use_adjoint_illumination: Use the geometric mean of the forward "
+           "and adjoint energies instead of the forward energy only.\n"
+           ":type  use_adjoint_illumination: bool\n"
+           ":param water_level: Positive value added to the normalized diagonal, "
+           "which limits the preconditioner to 1 / water_level.\n"
+           ":type  water_level: float\n"
+           ":returns: Preconditioner of the size of the model vector.\n"
+           ":rtype: numpy.ndarray")
       .def("load_vector", &fdModelExtended::load_vector,
            "load_vector(relative_path: str, verbose: bool) -> numpy.ndarray\n"
            "\n"
-           "Loads a vector of shape (free_parameters, 1) from a text file. Read in "
-           "precision `real_simulation`.\n")
+           "Loads a vector of shape (free_parameters, 1) from a text, NPY or raw "
+           "binary (.bin/.raw) file. Read in precision `real_simulation`.\n")
+      .def("load_model", &fdModelExtended::load_model, py::arg("de_path"),
+           py::arg("vp_path"), py::arg("vs_path"), py::arg("verbose") = false,
+           "load_model(de_path: str, vp_path: str, vs_path: str, verbose: bool = "
+           "False)\n"
+           "\n"
+           "Load density, P-wave and S-wave velocity models of shape (nx, nz) from "
+           "text, NPY or raw binary (.bin/.raw) files, and update Lamé's "
+           "parameters. Binary files are memory mapped, text is parsed in parallel.\n"
+           "\n"
+           ":param de_path: Path to the density file.\n"
+           ":type  de_path: str\n"
+           ":param vp_path: Path to the P-wave velocity file.\n"
+           ":type  vp_path: str\n"
+           ":param vs_path: Path to the S-wave velocity file.\n"
+           ":type  vs_path: str\n"
+           ":param verbose: Boolean controlling the verbosity of loading.\n"
+           ":type  verbose: bool\n")
       .def("get_snapshots", &fdModelExtended::get_snapshots,
-           py::return_value_policy::move,
-           "get_snapshots() -> Tuple[numpy.ndarray, numpy.ndarray, numpy.ndarray, "
-           "numpy.ndarray, numpy.ndarray]\n"
+           py::return_value_policy::move, py::arg("copy") = true,
+           py::arg("writeable") = false,
+           "get_snapshots(copy: bool = True, writeable: bool = False) -> "
+           "Tuple[numpy.ndarray, numpy.ndarray, numpy.ndarray, numpy.ndarray, "
+           "numpy.ndarray]\n"
+           "\n"
+           "Get snapshots of all the dynamical fields generated across all the shots, "
+           "of shape [shot][snapshot][x][z]. With a snapshot quadrature, see "
+           ":meth:`~psvWave.fdModel.set_snapshot_quadrature`, x and z index the "
+           "snapshot points instead of the grid. With kernel frequencies, see "
+           ":meth:`~psvWave.fdModel.set_kernel_frequencies`, the snapshot axis holds "
+           "the real and imaginary parts of the Fourier transform at every "
+           "frequency. Fields the selected kernels do not need, see "
+           ":meth:`~psvWave.fdModel.set_kernel_selection`, have no shots.\n"
            "\n"
-           "Get snapshots of all the dynamical fields generated across all the shots.")
+           ":param copy: Return copies if `True`, or views that share memory with the "
+           "model if `False`. Views reflect later simulations and keep their "
+           "snapshots alive. After set_snapshot_quadrature, set_kernel_frequencies "
+           "or set_kernel_selection they hold the discarded snapshots, defaults to "
+           "`True`.\n"
+           ":type  copy: bool\n"
+           ":param writeable: Whether views can be written to, defaults to `False`.\n"
+           ":type  writeable: bool\n")
       .def_readonly("dt", &fdModelExtended::dt, "Time discretization")
       .def_readonly("dz", &fdModelExtended::dz, "Vertical discretization")
       .def_readonly("dx", &fdModelExtended::dx, "Horizontal discretization")
       .def_readonly("nt", &fdModelExtended::nt, "Total time points")
+      .def_readonly("nr", &fdModelExtended::nr, "Number of receivers")
       .def_readonly("nz", &fdModelExtended::nz,
                     "Total vertical points, including boundary layer")
       .def_readonly("nx", &fdModelExtended::nx,
@@ -577,17 +1057,131 @@ PYBIND11_MODULE(__psvWave_cpp, m)
                     "The total amount of snapshots per shot.")
       .def("get_extent", &fdModelExtended::get_extent)
       .def("get_coordinates", &fdModelExtended::get_coordinates)
-      .def("get_parameter_fields", &fdModelExtended::get_parameter_fields)
-      .def("get_kernels", &fdModelExtended::get_kernels)
+      .def("get_parameter_fields", &fdModelExtended::get_parameter_fields,
+           py::arg("copy") = true,
+           "get_parameter_fields(copy: bool = True) -> Tuple[numpy.ndarray, "
+           "numpy.ndarray, numpy.ndarray]\n"
+           "\n"
+           "Get the vp, vs and rho fields. Views are read-only; use "
+           ":meth:`~psvWave.fdModel.set_parameter_fields` to change the model.\n"
+           "\n"
+           ":param copy: Return copies if `True`, or views that share memory with the "
+           "model if `False`. Views reflect later simulations and keep the model "
+           "alive, defaults to `True`.\n"
+           ":type  copy: bool\n")
+      .def("get_kernels", &fdModelExtended::get_kernels, py::arg("copy") = true,
+           py::arg("writeable") = false,
+           "get_kernels(copy: bool = True, writeable: bool = False) -> "
+           "Tuple[numpy.ndarray, numpy.ndarray, numpy.ndarray]\n"
+           "\n"
+           "Get the vp, vs and rho kernels.\n"
+           "\n"
+           ":param copy: Return copies if `True`, or views that share memory with the "
+           "model if `False`. Views reflect later simulations and keep the model "
+           "alive, defaults to `True`.\n"
+           ":type  copy: bool\n"
+           ":param writeable: Whether views can be written to, defaults to `False`.\n"
+           ":type  writeable: bool\n")
+      .def("get_illumination", &fdModelExtended::get_illumination,
+           py::arg("copy") = true, py::arg("writeable") = false,
+           "get_illumination(copy: bool = True, writeable: bool = False) -> "
+           "Tuple[numpy.ndarray, numpy.ndarray]\n"
+           "\n"
+           "Get the energy of the forward and adjoint velocity fields, accumulated "
+           "over the snapshots of all adjoint simulations since the last "
+           ":meth:`~psvWave.fdModel.reset_kernels`.\n"
+           "\n"
+           ":param copy: Return copies if `True`, or views that share memory with the "
+           "model if `False`. Views reflect later simulations and keep the model "
+           "alive, defaults to `True`.\n"
+           ":type  copy: bool\n"
+           ":param writeable: Whether views can be written to, defaults to `False`.\n"
+           ":type  writeable: bool\n")
       .def("set_parameter_fields", &fdModelExtended::set_parameter_fields)
-      .def("get_synthetic_data", &fdModelExtended::get_synthetic_data)
-      .def("get_observed_data", &fdModelExtended::get_observed_data)
+      .def("get_synthetic_data", &fdModelExtended::get_synthetic_data,
+           py::arg("copy") = true, py::arg("writeable") = false,
+           "get_synthetic_data(copy: bool = True, writeable: bool = False) -> "
+           "Tuple[numpy.ndarray, numpy.ndarray]\n"
+           "\n"
+           "Get the synthetic ux and uz data, each of shape (n_shots, nr, nt).\n"
+           "\n"
+           ":param copy: Return copies if `True`, or views that share memory with the "
+           "model if `False`. Views reflect later simulations and keep the model "
+           "alive, defaults to `True`.\n"
+           ":type  copy: bool\n"
+           ":param writeable: Whether views can be written to, defaults to `False`.\n"
+           ":type  writeable: bool\n")
+      .def("get_observed_data", &fdModelExtended::get_observed_data,
+           py::arg("copy") = true, py::arg("writeable") = false,
+           "get_observed_data(copy: bool = True, writeable: bool = False) -> "
+           "Tuple[numpy.ndarray, numpy.ndarray]\n"
+           "\n"
+           "Get the observed ux and uz data, each of shape (n_shots, nr, nt).\n"
+           "\n"
+           ":param copy: Return copies if `True`, or views that share memory with the "
+           "model if `False`. Views reflect later simulations and keep the model "
+           "alive, defaults to `True`.\n"
+           ":type  copy: bool\n"
+           ":param writeable: Whether views can be written to, defaults to `False`.\n"
+           ":type  writeable: bool\n")
       .def_readonly("n_shots", &fdModelExtended::n_shots, "Number of shots")
       .def_readonly("which_source_to_fire_in_which_shot",
                     &fdModelExtended::which_source_to_fire_in_which_shot,
                     "Which source fires in which shot.")
       .def("set_synthetic_data", &fdModelExtended::set_synthetic_data)
       .def("set_observed_data", &fdModelExtended::set_observed_data)
+      .def("write_receivers",
+           static_cast<void (fdModelExtended::*)()>(&fdModelExtended::write_receivers),
+           "write_receivers()\n"
+           "\n"
+           "Write the synthetic data of every shot to plaintext files rtf_ux<shot>.txt "
+           "and rtf_uz<shot>.txt in the observed data folder.")
+      .def("write_receivers_binary", &fdModelExtended::write_receivers_binary,
+           "write_receivers_binary()\n"
+           "\n"
+           "Write the synthetic data of every shot to a binary receiver file "
+           "rtf<shot>.bin in the observed data folder. These files can be read "
+           "without copies through :func:`psvWave.read_receiver_file`.")
+      .def("write_receivers_segy", &fdModelExtended::write_receivers_segy,
+           py::arg("filename_ux"), py::arg("filename_uz"), py::arg("observed") = false,
+           "write_receivers_segy(filename_ux: str, filename_uz: str, observed: bool = "
+           "False)\n"
+           "\n"
+           "Write the synthetic (or observed) data to one SEG-Y file per component, "
+           "with IEEE samples. The field record number of a trace is its shot + 1, "
+           "the trace number its receiver + 1.\n"
+           "\n"
+           ":param filename_ux: Path of the file for the horizontal component.\n"
+           ":type  filename_ux: str\n"
+           ":param filename_uz: Path of the file for the vertical component.\n"
+           ":type  filename_uz: str\n"
+           ":param observed: Write the observed instead of the synthetic data.\n"
+           ":type  observed: bool\n")
+      .def("load_receivers_segy", &fdModelExtended::load_receivers_segy,
+           py::arg("filename_ux"), py::arg("filename_uz"), py::arg("verbose") = false,
+           "load_receivers_segy(filename_ux: str, filename_uz: str, verbose: bool = "
+           "False)\n"
+           "\n"
+           "Load observed data from one SEG-Y file per component, with IBM or IEEE "
+           "samples. Every field record is a shot, in order of appearance, and the "
+           "trace number within the record is the receiver. The files are streamed "
+           "shot by shot from a memory map, so they need not fit in memory.\n"
+           "\n"
+           ":param filename_ux: Path of the file for the horizontal component.\n"
+           ":type  filename_ux: str\n"
+           ":param filename_uz: Path of the file for the vertical component.\n"
+           ":type  filename_uz: str\n"
+           ":param verbose: Boolean controlling the verbosity of loading.\n"
+           ":type  verbose: bool\n")
+      .def("load_receivers", &fdModelExtended::load_receivers,
+           py::arg("verbose") = false,
+           "load_receivers(verbose: bool = False)\n"
+           "\n"
+           "Load the observed data of every shot from the observed data folder, "
+           "preferring binary receiver files over plaintext files.\n"
+           "\n"
+           ":param verbose: Boolean controlling the verbosity of loading.\n"
+           ":type  verbose: bool\n")
       .def("get_sources", &fdModelExtended::get_sources, py::arg("in_units") = true,
            py::arg("include_absorbing_boundary_as_index") = true)
       .def("get_receivers", &fdModelExtended::get_receivers, py::arg("in_units") = true,
@@ -618,6 +1212,45 @@ PYBIND11_MODULE(__psvWave_cpp, m)
            "\n"
            "Calculate the adjoint sources corresponding to the L2 misfit w.r.t. the "
            "observed data.\n")
+      .def("calculate_l2_misfit_and_adjoint_sources",
+           &fdModelExtended::calculate_l2_misfit_and_adjoint_sources,
+           "calculate_l2_misfit_and_adjoint_sources()\n"
+           "\n"
+           "Calculate the L2 misfit and its adjoint sources in a single pass over "
+           "the seismograms.\n")
+      .def("calculate_traveltime_misfit_and_adjoint_sources",
+           &fdModelExtended::calculate_traveltime_misfit_and_adjoint_sources,
+           "calculate_traveltime_misfit_and_adjoint_sources()\n"
+           "\n"
+           "Calculate the cross-correlation traveltime misfit, 0.5 * dT^2 summed over "
+           "all traces, and write its adjoint sources.\n")
+      .def("calculate_envelope_misfit_and_adjoint_sources",
+           &fdModelExtended::calculate_envelope_misfit_and_adjoint_sources,
+           "calculate_envelope_misfit_and_adjoint_sources()\n"
+           "\n"
+           "Calculate the L2 misfit between the envelopes of the synthetic and "
+           "observed traces, and write its adjoint sources.\n")
+      .def("calculate_correlation_misfit_and_adjoint_sources",
+           &fdModelExtended::calculate_correlation_misfit_and_adjoint_sources,
+           "calculate_correlation_misfit_and_adjoint_sources()\n"
+           "\n"
+           "Calculate the normalized zero-lag correlation misfit, 1 - <s, d> / "
+           "(|s| |d|) summed over all traces, and write its adjoint sources.\n")
+      .def("get_misfits", &fdModelExtended::get_misfits, py::arg("copy") = true,
+           "get_misfits(copy: bool = True) -> Tuple[numpy.ndarray, numpy.ndarray, "
+           "numpy.ndarray]\n"
+           "\n"
+           "Get the L2 misfit per trace, per shot and per receiver, as computed by "
+           "the last misfit calculation.\n"
+           "\n"
+           ":param copy: Return copies if `True`, or views that share memory with the "
+           "model if `False`. Views reflect later simulations and keep the model "
+           "alive, defaults to `True`.\n"
+           ":type  copy: bool\n"
+
+           ":returns: Tuple of misfit per trace (n_shots, nr), per shot (n_shots) and "
+           "per receiver (nr).\n"
+           ":rtype: Tuple[numpy.ndarray, numpy.ndarray, numpy.ndarray]")
       .def_readonly(
           "misfit", &fdModelExtended::misfit,
           "Current misfit in the model.\n"
@@ -632,13 +1265,15 @@ PYBIND11_MODULE(__psvWave_cpp, m)
            "iterations otherwise. Making this manual allows for flexibility (e.g. "
            "different misfit per shot).\n")
       .def("adjoint_simulate", &fdModelExtended::adjoint_simulate_explicit_threads,
+           py::call_guard<py::gil_scoped_release>(),
            py::arg("i_shot"), py::arg("verbose") = false,
            py::arg("omp_threads_override") = 0,
            "adjoint_simulate(i_shot: int, verbose: bool, omp_threads_override: int)\n"
            "\n"
            "Adjoint simulate the wavefield for a given shot. This additionally "
            "correlates the adjoint wavefields for this shot with those stored in the "
-           "snapshots to calculate the sensitivity kernel in Lamé's parameters.\n"
+           "snapshots to calculate the sensitivity kernel in Lamé's parameters. The GIL "
+           "is released while simulating.\n"
            "\n"
            ":param i_shot: Integer representing which shot will be simulated.\n"
            ":type  i_shot: int\n"
@@ -648,11 +1283,278 @@ PYBIND11_MODULE(__psvWave_cpp, m)
            "that will be used. Defaults to the environment variable if not passed / "
            "0.\n"
            ":type  omp_threads_override: int\n")
+      .def("minimize_lbfgs", &fdModelExtended::minimize_lbfgs,
+           py::call_guard<py::gil_scoped_release>(), py::arg("settings"),
+           py::arg("verbose") = false,
+           "minimize_lbfgs(settings: psvWave.LBFGSSettings, verbose: bool = False) -> "
+           "psvWave.LBFGSResult\n"
+           "\n"
+           "Minimize the L2 misfit over the model vector with L-BFGS and a strong "
+           "Wolfe line search, running all forward and adjoint simulations "
+           "internally. Afterwards the model holds the best model vector.\n"
+           "\n"
+           ":param settings: History size, bounds and stopping criteria.\n"
+           ":type  settings: psvWave.LBFGSSettings\n"
+           ":param verbose: Boolean controlling the printing of per-iteration "
+           "reports.\n"
+           ":type  verbose: bool\n"
+           ":returns: Final misfit, per-iteration misfit, gradient norm, step length, "
+           "evaluations and timing, and the reason for stopping.\n"
+           ":rtype: psvWave.LBFGSResult")
+      .def("coarsening_factor", &fdModelExtended::coarsening_factor,
+           py::arg("max_frequency"), py::arg("points_per_wavelength") = 6.0,
+           "coarsening_factor(max_frequency: float, points_per_wavelength: float = 6.0) "
+           "-> int\n"
+           "\n"
+           "Largest factor by which the grid can be coarsened while the shortest "
+           "wavelength at max_frequency, from the smallest velocity in the model, "
+           "keeps points_per_wavelength grid points.\n"
+           "\n"
+           ":param max_frequency: Highest frequency to simulate, in Hz.\n"
+           ":type  max_frequency: float\n"
+           ":param points_per_wavelength: Smallest number of grid points per "
+           "wavelength.\n"
+           ":type  points_per_wavelength: float\n"
+           ":returns: The coarsening factor, at least 1.\n"
+           ":rtype: int")
+      .def("minimize_multiscale", &fdModelExtended::minimize_multiscale,
+           py::call_guard<py::gil_scoped_release>(), py::arg("stages"),
+           py::arg("verbose") = false,
+           "minimize_multiscale(stages: List[psvWave.MultiscaleStage], verbose: bool = "
+           "False) -> List[psvWave.MultiscaleStageResult]\n"
+           "\n"
+           "Minimize the L2 misfit with frequency continuation. Every stage low pass "
+           "filters the observed data and source time functions to its "
+           "max_frequency, runs :meth:`~psvWave.fdModel.minimize_lbfgs` on a copy of "
+           "the model on the coarsest grid that still resolves that frequency, and "
+           "interpolates the model change back onto this model. Low frequency stages "
+           "thus cost a fraction of fine grid iterations. Bounds in the optimizer "
+           "settings refer to the model vector of the coarse grid, which has one "
+           "parameter per free grid point and field.\n"
+           "\n"
+           ":param stages: Frequency band and optimizer settings per stage, usually "
+           "of increasing max_frequency.\n"
+           ":type  stages: List[psvWave.MultiscaleStage]\n"
+           ":param verbose: Boolean controlling the printing of per-iteration "
+           "reports.\n"
+           ":type  verbose: bool\n"
+           ":returns: Grid coarsening and optimizer outcome per stage.\n"
+           ":rtype: List[psvWave.MultiscaleStageResult]")
+      .def("stable_time_step", &fdModelExtended::stable_time_step,
+           py::arg("max_velocity"), py::arg("dx"), py::arg("dz"),
+           "stable_time_step(max_velocity: float, dx: float, dz: float) -> float\n"
+           "\n"
+           "Largest stable time step of the fourth order staggered grid scheme.\n"
+           "\n"
+           ":param max_velocity: Largest P-wave velocity.\n"
+           ":type  max_velocity: float\n"
+           ":param dx: Grid spacing in x.\n"
+           ":type  dx: float\n"
+           ":param dz: Grid spacing in z.\n"
+           ":type  dz: float\n"
+           ":returns: The time step at which the Courant number reaches its limit.\n"
+           ":rtype: float")
+      .def("max_stable_time_step", &fdModelExtended::max_stable_time_step,
+           "max_stable_time_step() -> float\n"
+           "\n"
+           "Largest stable time step on the current grid for the largest velocity of "
+           "the loaded model. Simulations with a larger dt are unstable.\n"
+           "\n"
+           ":returns: The time step at which the Courant number reaches its limit.\n"
+           ":rtype: float")
+      .def("plan_simulation", &fdModelExtended::plan_simulation,
+           py::arg("points_per_wavelength") = 6.0, py::arg("courant_safety") = 0.9,
+           py::arg("frequency_factor") = 2.5,
+           "plan_simulation(points_per_wavelength: float = 6.0, courant_safety: float "
+           "= 0.9, frequency_factor: float = 2.5) -> psvWave.SimulationPlan\n"
+           "\n"
+           "Plan the coarsest grid and largest time step that simulate the current "
+           "model accurately. The highest frequency is frequency_factor times the "
+           "peak frequency of the sources, the grid spacing follows from the shortest "
+           "wavelength at that frequency and the time step is courant_safety times "
+           "the stable time step for the largest velocity. The ratio of dx and dz, "
+           "the domain and the simulated duration are kept. Apply the plan with "
+           ":meth:`~psvWave.fdModel.resample`.\n"
+           "\n"
+           ":param points_per_wavelength: Smallest number of grid points per "
+           "wavelength.\n"
+           ":type  points_per_wavelength: float\n"
+           ":param courant_safety: Fraction of the stable time step to use.\n"
+           ":type  courant_safety: float\n"
+           ":param frequency_factor: Highest simulated frequency relative to the "
+           "peak frequency.\n"
+           ":type  frequency_factor: float\n"
+           ":returns: The planned grid, time step and relative cost.\n"
+           ":rtype: psvWave.SimulationPlan")
+      .def("resample", &fdModelExtended::resample, py::arg("plan"),
+           "resample(plan: psvWave.SimulationPlan) -> psvWave.fdModel\n"
+           "\n"
+           "Returns a copy of the model resampled onto a simulation plan. The medium "
+           "is interpolated, sources and receivers move to the nearest grid point, "
+           "and source time functions and observed data are interpolated in time. "
+           "Every free grid point is a parameter of the model vector; synthetics and "
+           "kernels are not copied.\n"
+           "\n"
+           ":param plan: Grid spacing and time step, typically from "
+           ":meth:`~psvWave.fdModel.plan_simulation`.\n"
+           ":type  plan: psvWave.SimulationPlan\n"
+           ":returns: The resampled model.\n"
+           ":rtype: psvWave.fdModel")
+      .def("evaluate_models", &fdModelExtended::evaluate_models_without_gil,
+           py::arg("model_vectors"), py::arg("n_workers") = 0,
+           "evaluate_models(model_vectors: numpy.ndarray, n_workers: int = 0) -> "
+           "Tuple[numpy.ndarray, numpy.ndarray]\n"
+           "\n"
+           "Compute the L2 misfit and gradient for many model vectors in one call. "
+           "Equivalent to setting every model vector, forward simulating all shots, "
+           "computing the L2 misfit and adjoint sources, adjoint simulating all shots "
+           "and mapping the kernels to velocity, but all models and shots are "
+           "scheduled over n_workers copies of the model, each storing the snapshots "
+           "of one shot at a time. Shots are simulated one at a time on the full "
+           "grid; shot_batch_size and shot_window_aperture are ignored. Gradients "
+           "may differ in rounding between worker counts. The state of this model is "
+           "not changed. The GIL is released while evaluating.\n"
+           "\n"
+           ":param model_vectors: Array of shape (n_models, n_parameters) with one "
+           "model vector per row.\n"
+           ":type  model_vectors: numpy.ndarray\n"
+           ":param n_workers: Number of model copies working in parallel, each "
+           "holding its own wavefield storage. Defaults to the number of hardware "
+           "threads if not passed / 0.\n"
+           ":type  n_workers: int\n"
+           ":returns: Misfit per model (n_models) and gradient per model "
+           "(n_models, n_parameters).\n"
+           ":rtype: Tuple[numpy.ndarray, numpy.ndarray]")
+      .def("forward_simulate_misfit", &fdModelExtended::forward_simulate_misfit,
+           py::call_guard<py::gil_scoped_release>(), py::arg("i_shot"),
+           py::arg("misfit_bound") = std::numeric_limits<real_simulation>::infinity(),
+           "forward_simulate_misfit(i_shot: int, misfit_bound: float = inf) -> float\n"
+           "\n"
+           "Compute the L2 misfit of a shot with a lean forward simulation. No "
+           "wavefields and no synthetic seismograms are stored; the residual with the "
+           "observed data is accumulated during time stepping. Agrees with "
+           ":meth:`~psvWave.fdModel.forward_simulate` followed by "
+           ":meth:`~psvWave.fdModel.calculate_l2_misfit` up to rounding, but leaves "
+           "the synthetic data untouched. The GIL is released while simulating.\n"
+           "\n"
+           ":param i_shot: Shot to simulate.\n"
+           ":type  i_shot: int\n"
+           ":param misfit_bound: The simulation is aborted as soon as the misfit "
+           "accumulated so far exceeds this bound.\n"
+           ":type  misfit_bound: float\n"
+           ":returns: The L2 misfit of the shot, or a partial misfit exceeding "
+           "misfit_bound if aborted.\n"
+           ":rtype: float")
+      .def("forward_simulate_misfit_all", &fdModelExtended::forward_simulate_misfit_all,
+           py::call_guard<py::gil_scoped_release>(),
+           py::arg("misfit_bound") = std::numeric_limits<real_simulation>::infinity(),
+           "forward_simulate_misfit_all(misfit_bound: float = inf) -> float\n"
+           "\n"
+           "Compute the L2 misfit of all shots with "
+           ":meth:`~psvWave.fdModel.forward_simulate_misfit`, stopping the current "
+           "and all remaining shots as soon as the total exceeds misfit_bound. A "
+           "trial that cannot beat the current best misfit is thus rejected at a "
+           "fraction of the cost of full simulations. The GIL is released while "
+           "simulating.\n"
+           "\n"
+           ":param misfit_bound: Misfit above which the simulations are aborted.\n"
+           ":type  misfit_bound: float\n"
+           ":returns: The L2 misfit of all shots, or a partial misfit exceeding "
+           "misfit_bound if aborted.\n"
+           ":rtype: float")
+      .def("evaluate_trial_steps", &fdModelExtended::evaluate_trial_steps_without_gil,
+           py::arg("model_vector"), py::arg("direction"), py::arg("steps"),
+           py::arg("n_workers") = 0,
+           "evaluate_trial_steps(model_vector: numpy.ndarray, direction: "
+           "numpy.ndarray, steps: List[float], n_workers: int = 0) -> List[float]\n"
+           "\n"
+           "Compute the L2 misfit at several step lengths along a search direction, "
+           "for example the trial points of a line search. Every step length and "
+           "shot is evaluated with :meth:`~psvWave.fdModel.forward_simulate_misfit` "
+           "on copies of the model without wavefield storage, scheduled over "
+           "n_workers threads. The state of this model is not changed. The GIL is "
+           "released while evaluating.\n"
+           "\n"
+           ":param model_vector: Model vector at step length zero.\n"
+           ":type  model_vector: numpy.ndarray\n"
+           ":param direction: Search direction in model vector space.\n"
+           ":type  direction: numpy.ndarray\n"
+           ":param steps: Step lengths to evaluate.\n"
+           ":type  steps: List[float]\n"
+           ":param n_workers: Number of model copies working in parallel. Defaults "
+           "to the number of hardware threads if not passed / 0.\n"
+           ":type  n_workers: int\n"
+           ":returns: Misfit per step length.\n"
+           ":rtype: List[float]")
       .def("map_kernels_to_velocity", &fdModelExtended::map_kernels_to_velocity,
            "map_kernels_to_velocity()\n"
            "\n"
            "Transform sensitivity kernels in Lamé parametrization (lambda, mu, rho) to "
-           "velocity parametrization (vp, vs, rho).");
+           "velocity parametrization (vp, vs, rho).")
+      .def("seed_source_encoding", &fdModelExtended::seed_source_encoding,
+           py::arg("seed"),
+           "seed_source_encoding(seed: int)\n"
+           "\n"
+           "Seed the random generator used to draw source encoding codes.")
+      .def("draw_source_encoding", &fdModelExtended::draw_source_encoding,
+           py::arg("phase_encoding") = false, py::arg("max_shift") = 0,
+           "draw_source_encoding(phase_encoding: bool = False, max_shift: int = 0)\n"
+           "\n"
+           "Draw a random polarity for every shot and, for phase encoding, a random "
+           "delay of up to `max_shift` samples.")
+      .def("encode_observed_data", &fdModelExtended::encode_observed_data,
+           "encode_observed_data()\n"
+           "\n"
+           "Combine the observed data of all shots using the current encoding codes.")
+      .def("forward_simulate_encoded", &fdModelExtended::forward_simulate_encoded,
+           py::arg("store_fields") = true, py::arg("verbose") = false,
+           "forward_simulate_encoded(store_fields: bool = True, verbose: bool = False)\n"
+           "\n"
+           "Simulate all shots at once as a single encoded supershot. Stored "
+           "snapshots overwrite those of the first shot.")
+      .def("adjoint_simulate_encoded", &fdModelExtended::adjoint_simulate_encoded,
+           py::arg("verbose") = false,
+           "adjoint_simulate_encoded(verbose: bool = False)\n"
+           "\n"
+           "Adjoint simulate the encoded supershot and correlate it into the kernels.")
+      .def("calculate_encoded_l2_misfit",
+           &fdModelExtended::calculate_encoded_l2_misfit,
+           "calculate_encoded_l2_misfit()\n"
+           "\n"
+           "Calculate L2 misfit of the encoded supershot w.r.t. the encoded data.")
+      .def("calculate_encoded_l2_adjoint_sources",
+           &fdModelExtended::calculate_encoded_l2_adjoint_sources,
+           "calculate_encoded_l2_adjoint_sources()\n"
+           "\n"
+           "Calculate the L2 adjoint sources of the encoded supershot.")
+      .def("calculate_encoded_l2_misfit_and_adjoint_sources",
+           &fdModelExtended::calculate_encoded_l2_misfit_and_adjoint_sources,
+           "calculate_encoded_l2_misfit_and_adjoint_sources()\n"
+           "\n"
+           "Calculate the L2 misfit and adjoint sources of the encoded supershot in a "
+           "single pass.")
+      .def("run_model_encoded", &fdModelExtended::run_model_encoded,
+           py::arg("verbose") = false, py::arg("simulate_adjoint") = true,
+           py::arg("phase_encoding") = false, py::arg("max_shift") = 0,
+           "run_model_encoded(verbose: bool = False, simulate_adjoint: bool = True, "
+           "phase_encoding: bool = False, max_shift: int = 0)\n"
+           "\n"
+           "Draw new encoding codes and compute the misfit and (optionally) kernels of "
+           "one random supershot, at the cost of a single shot.")
+      .def("get_encoded_data", &fdModelExtended::get_encoded_data,
+           py::arg("copy") = true, py::arg("writeable") = false,
+           "get_encoded_data(copy: bool = True, writeable: bool = False) -> "
+           "Tuple[numpy.ndarray, numpy.ndarray, numpy.ndarray, numpy.ndarray]\n"
+           "\n"
+           "Get the encoded synthetic (ux, uz) and encoded observed (ux, uz) data, "
+           "each of shape (nr, nt).\n"
+           "\n"
+           ":param copy: Return copies if `True`, or views that share memory with the "
+           "model if `False`. Views reflect later simulations and keep the model "
+           "alive, defaults to `True`.\n"
+           ":type  copy: bool\n"
+           ":param writeable: Whether views can be written to, defaults to `False`.\n"
+           ":type  writeable: bool\n");
 
   ;
 }
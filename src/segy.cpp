@@ -0,0 +1,79 @@
+#include "segy.h"
+
+namespace
+{
+char ascii_to_ebcdic(char character)
+{
+  if (character >= 'a' and character <= 'z')
+  {
+    character = char(character - 'a' + 'A');
+  }
+  if (character >= 'A' and character <= 'I')
+  {
+    return char(0xC1 + (character - 'A'));
+  }
+  if (character >= 'J' and character <= 'R')
+  {
+    return char(0xD1 + (character - 'J'));
+  }
+  if (character >= 'S' and character <= 'Z')
+  {
+    return char(0xE2 + (character - 'S'));
+  }
+  if (character >= '0' and character <= '9')
+  {
+    return char(0xF0 + (character - '0'));
+  }
+  switch (character)
+  {
+  case '.':
+    return char(0x4B);
+  case '(':
+    return char(0x4D);
+  case '+':
+    return char(0x4E);
+  case ')':
+    return char(0x5D);
+  case '-':
+    return char(0x60);
+  case '/':
+    return char(0x61);
+  case ',':
+    return char(0x6B);
+  case '_':
+    return char(0x6D);
+  case ':':
+    return char(0x7A);
+  case '=':
+    return char(0x7E);
+  default:
+    return char(0x40);
+  }
+}
+} // namespace
+
+void write_segy_textual_header(char *header, const std::string &text)
+{
+  std::memset(header, 0x40, segy_textual_header_size);
+
+  int card = 0;
+  int column = 0;
+  for (char character : text)
+  {
+    if (card >= segy_textual_header_size / 80)
+    {
+      break;
+    }
+    if (character == '\n')
+    {
+      card++;
+      column = 0;
+      continue;
+    }
+    if (column < 80)
+    {
+      header[card * 80 + column] = ascii_to_ebcdic(character);
+      column++;
+    }
+  }
+}
@@ -0,0 +1,151 @@
+#ifndef SEGY_H
+#define SEGY_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Sizes of the SEG-Y (rev 1) file and trace headers in bytes.
+const int segy_textual_header_size = 3200;
+const int segy_binary_header_size = 400;
+const int segy_file_header_size = segy_textual_header_size + segy_binary_header_size;
+const int segy_trace_header_size = 240;
+
+// 0-based byte offsets into the binary file header.
+const int segy_traces_per_ensemble = 3212;
+const int segy_sample_interval = 3216;
+const int segy_samples_per_trace = 3220;
+const int segy_format_code = 3224;
+const int segy_measurement_system = 3254;
+const int segy_revision = 3500;
+const int segy_fixed_length_flag = 3502;
+
+// 0-based byte offsets into a trace header.
+const int segy_trace_sequence_line = 0;
+const int segy_field_record = 8;
+const int segy_trace_number = 12;
+const int segy_trace_identification = 28;
+const int segy_receiver_elevation = 40;
+const int segy_source_depth = 48;
+const int segy_elevation_scalar = 68;
+const int segy_coordinate_scalar = 70;
+const int segy_source_x = 72;
+const int segy_group_x = 80;
+const int segy_trace_samples = 114;
+const int segy_trace_sample_interval = 116;
+
+// Supported sample formats.
+const int segy_format_ibm = 1;
+const int segy_format_ieee = 5;
+
+//!  \brief Read a big-endian 32 bit integer.
+inline int32_t read_segy_int32(const char *bytes)
+{
+  const unsigned char *b = reinterpret_cast<const unsigned char *>(bytes);
+  return int32_t(uint32_t(b[0]) << 24 | uint32_t(b[1]) << 16 | uint32_t(b[2]) << 8 |
+                 uint32_t(b[3]));
+}
+
+//!  \brief Read a big-endian 16 bit integer.
+inline int16_t read_segy_int16(const char *bytes)
+{
+  const unsigned char *b = reinterpret_cast<const unsigned char *>(bytes);
+  return int16_t(uint16_t(b[0]) << 8 | uint16_t(b[1]));
+}
+
+//!  \brief Write a big-endian 32 bit integer.
+inline void write_segy_int32(char *bytes, int32_t value)
+{
+  uint32_t bits = uint32_t(value);
+  bytes[0] = char(bits >> 24);
+  bytes[1] = char(bits >> 16);
+  bytes[2] = char(bits >> 8);
+  bytes[3] = char(bits);
+}
+
+//!  \brief Write a big-endian 16 bit integer.
+inline void write_segy_int16(char *bytes, int16_t value)
+{
+  uint16_t bits = uint16_t(value);
+  bytes[0] = char(bits >> 8);
+  bytes[1] = char(bits);
+}
+
+//!  \brief Decode big-endian SEG-Y samples.
+//!
+//!  Both conversions are branch free, so the loop vectorizes. IBM floats are
+//!  converted exactly: the 24 bit mantissa is scaled by a power of two that is
+//!  assembled directly as the bits of a double.
+//!
+//!  @param bytes Start of the samples.
+//!  @param format SEG-Y format code, segy_format_ibm or segy_format_ieee.
+//!  @param n Number of samples.
+//!  @param samples Output samples.
+template <class T>
+void decode_segy_samples(const char *bytes, int format, int n, T *samples)
+{
+  const unsigned char *b = reinterpret_cast<const unsigned char *>(bytes);
+  if (format == segy_format_ibm)
+  {
+#pragma omp simd
+    for (int i = 0; i < n; ++i)
+    {
+      uint32_t word = uint32_t(b[4 * i]) << 24 | uint32_t(b[4 * i + 1]) << 16 |
+                      uint32_t(b[4 * i + 2]) << 8 | uint32_t(b[4 * i + 3]);
+      double mantissa = double(word & 0x00ffffff);
+      // value = mantissa * 2^-24 * 16^(exponent - 64)
+      int64_t exponent = int64_t((word >> 24) & 0x7f) * 4 - 280;
+      uint64_t scale_bits = uint64_t(exponent + 1023) << 52;
+      double scale;
+      std::memcpy(&scale, &scale_bits, sizeof(scale));
+      double sign = 1.0 - 2.0 * double(word >> 31);
+      samples[i] = T(sign * mantissa * scale);
+    }
+  }
+  else
+  {
+#pragma omp simd
+    for (int i = 0; i < n; ++i)
+    {
+      uint32_t word = uint32_t(b[4 * i]) << 24 | uint32_t(b[4 * i + 1]) << 16 |
+                      uint32_t(b[4 * i + 2]) << 8 | uint32_t(b[4 * i + 3]);
+      float value;
+      std::memcpy(&value, &word, sizeof(value));
+      samples[i] = T(value);
+    }
+  }
+}
+
+//!  \brief Encode samples as big-endian IEEE floats (SEG-Y format 5).
+//!
+//!  @param samples Input samples.
+//!  @param n Number of samples.
+//!  @param bytes Start of the output, 4 * n bytes.
+template <class T>
+void encode_segy_samples(const T *samples, int n, char *bytes)
+{
+  unsigned char *b = reinterpret_cast<unsigned char *>(bytes);
+#pragma omp simd
+  for (int i = 0; i < n; ++i)
+  {
+    float value = float(samples[i]);
+    uint32_t word;
+    std::memcpy(&word, &value, sizeof(word));
+    b[4 * i] = (unsigned char)(word >> 24);
+    b[4 * i + 1] = (unsigned char)(word >> 16);
+    b[4 * i + 2] = (unsigned char)(word >> 8);
+    b[4 * i + 3] = (unsigned char)(word);
+  }
+}
+
+//!  \brief Fill the textual file header with EBCDIC encoded card images.
+//!
+//!  Every line of text becomes one 80 character card, padded with spaces. Only
+//!  letters, digits and common punctuation are translated, anything else becomes
+//!  a space.
+//!
+//!  @param header Start of the 3200 byte textual header.
+//!  @param text Lines of text separated by newlines.
+void write_segy_textual_header(char *header, const std::string &text);
+
+#endif
@@ -0,0 +1,195 @@
+#include "wavefield_writer.h"
+#include "binary_files.h"
+#include <cstring>
+#include <stdexcept>
+
+wavefield_writer::wavefield_writer(const wavefield_output_settings &settings, int _nx,
+                                   int _nz, double dt, double dx, double dz)
+    : nx(_nx), nz(_nz), ix_start(settings.ix_start), iz_start(settings.iz_start),
+      decimation_x(settings.decimation_x), decimation_z(settings.decimation_z),
+      fields(settings.fields)
+{
+  int ix_end = settings.ix_end < 0 ? nx : settings.ix_end;
+  int iz_end = settings.iz_end < 0 ? nz : settings.iz_end;
+  if (ix_start < 0 or ix_end > nx or ix_start >= ix_end or iz_start < 0 or
+      iz_end > nz or iz_start >= iz_end or decimation_x < 1 or decimation_z < 1 or
+      settings.interval < 1 or settings.ring_size < 1 or fields == 0 or fields > 31)
+  {
+    throw std::invalid_argument("Invalid wavefield output settings.");
+  }
+  nx_out = (ix_end - ix_start + decimation_x - 1) / decimation_x;
+  nz_out = (iz_end - iz_start + decimation_z - 1) / decimation_z;
+
+  wavefield_file_header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, wavefield_file_magic, sizeof(header.magic));
+  header.byte_order = binary_file_byte_order;
+  header.version = binary_file_version;
+  header.fields = fields;
+  header.nx = nx_out;
+  header.nz = nz_out;
+  header.ix_start = ix_start;
+  header.iz_start = iz_start;
+  header.decimation_x = decimation_x;
+  header.decimation_z = decimation_z;
+  header.interval = settings.interval;
+  header.dt = dt;
+  header.dx = dx;
+  header.dz = dz;
+
+  // Append to an existing file only if it holds the same kind of frames.
+  bool append = false;
+  {
+    std::ifstream existing(settings.path, std::ios::binary);
+    wavefield_file_header existing_header;
+    if (existing.read(reinterpret_cast<char *>(&existing_header),
+                      sizeof(existing_header)))
+    {
+      if (std::memcmp(&existing_header, &header, sizeof(header)) != 0)
+      {
+        throw std::invalid_argument("Wavefield file " + settings.path +
+                                    " exists with different settings.");
+      }
+      append = true;
+    }
+  }
+
+  file.open(settings.path, append ? std::ios::binary | std::ios::app
+                                  : std::ios::binary | std::ios::trunc);
+  if (!file.good())
+  {
+    throw std::invalid_argument("Could not open " + settings.path + " for writing.");
+  }
+  if (!append)
+  {
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  }
+
+  int n_fields = 0;
+  for (unsigned int field = 1; field <= wavefield_txz; field <<= 1)
+  {
+    n_fields += (fields & field) ? 1 : 0;
+  }
+  size_t frame_size = 2 * sizeof(int32_t) + size_t(n_fields) * nx_out * nz_out * 4;
+  ring.assign(settings.ring_size, std::vector<char>(frame_size));
+
+  writer_thread = std::thread(&wavefield_writer::write_frames, this);
+}
+
+wavefield_writer::~wavefield_writer()
+{
+  try
+  {
+    finish();
+  }
+  catch (const std::invalid_argument &)
+  {
+  }
+}
+
+void wavefield_writer::push(int i_shot, int it, const double *vx, const double *vz,
+                            const double *txx, const double *tzz, const double *txz)
+{
+  std::vector<char> *frame;
+  {
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    slot_freed.wait(lock, [this] { return queued < ring.size() or failed; });
+    if (failed)
+    {
+      return;
+    }
+    frame = &ring[next_to_fill];
+  }
+
+  // The slot is not touched by the writer thread until it is queued.
+  int32_t position[2] = {i_shot, it};
+  std::memcpy(frame->data(), position, sizeof(position));
+  char *data = frame->data() + sizeof(position);
+
+  const double *sources[5] = {vx, vz, txx, tzz, txz};
+  for (int i_field = 0; i_field < 5; ++i_field)
+  {
+    if (!(fields & (1u << i_field)))
+    {
+      continue;
+    }
+    const double *source = sources[i_field];
+#pragma omp parallel for
+    for (int ix_out = 0; ix_out < nx_out; ++ix_out)
+    {
+      const double *row = source + size_t(ix_start + ix_out * decimation_x) * nz;
+      char *destination = data + size_t(ix_out) * nz_out * 4;
+      for (int iz_out = 0; iz_out < nz_out; ++iz_out)
+      {
+        float value = float(row[iz_start + iz_out * decimation_z]);
+        std::memcpy(destination + iz_out * 4, &value, 4);
+      }
+    }
+    data += size_t(nx_out) * nz_out * 4;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    next_to_fill = (next_to_fill + 1) % ring.size();
+    queued++;
+  }
+  slot_filled.notify_one();
+}
+
+void wavefield_writer::finish()
+{
+  if (!writer_thread.joinable())
+  {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    closing = true;
+  }
+  slot_filled.notify_one();
+  writer_thread.join();
+
+  file.close();
+  if (failed or file.fail())
+  {
+    throw std::invalid_argument("Writing wavefields failed.");
+  }
+}
+
+void wavefield_writer::write_frames()
+{
+  while (true)
+  {
+    std::vector<char> *frame;
+    {
+      std::unique_lock<std::mutex> lock(ring_mutex);
+      slot_filled.wait(lock, [this] { return queued > 0 or closing; });
+      if (queued == 0)
+      {
+        return;
+      }
+      frame = &ring[next_to_write];
+    }
+
+    file.write(frame->data(), frame->size());
+
+    {
+      std::lock_guard<std::mutex> lock(ring_mutex);
+      if (!file.good())
+      {
+        failed = true;
+        queued = 0;
+      }
+      else
+      {
+        next_to_write = (next_to_write + 1) % ring.size();
+        queued--;
+      }
+    }
+    slot_freed.notify_one();
+    if (failed)
+    {
+      return;
+    }
+  }
+}
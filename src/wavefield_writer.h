@@ -0,0 +1,118 @@
+#ifndef WAVEFIELD_WRITER_H
+#define WAVEFIELD_WRITER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bit flags selecting the fields written to a wavefield file.
+const unsigned int wavefield_vx = 1;
+const unsigned int wavefield_vz = 2;
+const unsigned int wavefield_txx = 4;
+const unsigned int wavefield_tzz = 8;
+const unsigned int wavefield_txz = 16;
+
+//!  \brief Settings of wavefield output during forward simulation.
+//!
+//!  The window [ix_start, ix_end) x [iz_start, iz_end) is given in grid points
+//!  including the absorbing boundary, with -1 as end meaning the full domain.
+//!  Within the window every decimation_x-th and decimation_z-th point is written.
+struct wavefield_output_settings
+{
+  std::string path = "wavefields.bin";
+  int interval = 10;
+  unsigned int fields = wavefield_vx | wavefield_vz;
+  int ix_start = 0;
+  int ix_end = -1;
+  int iz_start = 0;
+  int iz_end = -1;
+  int decimation_x = 1;
+  int decimation_z = 1;
+  //! Number of frames that can be queued before the simulation waits on disk.
+  int ring_size = 4;
+};
+
+//!  \brief Header of a wavefield file.
+//!
+//!  The header is followed by frames, each holding the shot and time step
+//!  (int32) and then every selected field in the order vx, vz, txx, tzz, txz, as
+//!  float32 arrays of shape [nx][nz]. Frames of later simulations are appended to
+//!  an existing file with the same header.
+struct wavefield_file_header
+{
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+  uint32_t fields;
+  int32_t nx;
+  int32_t nz;
+  int32_t ix_start;
+  int32_t iz_start;
+  int32_t decimation_x;
+  int32_t decimation_z;
+  int32_t interval;
+  double dt;
+  double dx;
+  double dz;
+};
+
+//! Magic string identifying wavefield files.
+const char wavefield_file_magic[8] = {'P', 'S', 'V', 'W', 'F', 'D', '\0', '\0'};
+
+//!  \brief Background writer of wavefield frames.
+//!
+//!  push() copies the selected window of the fields into a free slot of a ring of
+//!  frame buffers and returns; a writer thread appends full slots to the file in
+//!  order. The simulation only waits when all slots are still being written.
+class wavefield_writer
+{
+public:
+  //!  \brief Open (or append to) the wavefield file and start the writer thread.
+  //!
+  //!  Throws std::invalid_argument for an invalid window or when an existing file
+  //!  has a different header.
+  wavefield_writer(const wavefield_output_settings &settings, int nx, int nz,
+                   double dt, double dx, double dz);
+
+  //! Finishes writing, without throwing.
+  ~wavefield_writer();
+
+  wavefield_writer(const wavefield_writer &) = delete;
+  wavefield_writer &operator=(const wavefield_writer &) = delete;
+
+  //!  \brief Queue a frame of the full fields of shape [nx][nz].
+  void push(int i_shot, int it, const double *vx, const double *vz, const double *txx,
+            const double *tzz, const double *txz);
+
+  //!  \brief Wait until all queued frames are written and close the file.
+  //!
+  //!  Throws std::invalid_argument if writing failed.
+  void finish();
+
+private:
+  void write_frames();
+
+  int nx, nz;
+  int ix_start, iz_start, decimation_x, decimation_z;
+  int nx_out, nz_out;
+  unsigned int fields;
+
+  std::ofstream file;
+  std::vector<std::vector<char>> ring;
+  size_t next_to_fill = 0;
+  size_t next_to_write = 0;
+  size_t queued = 0;
+  bool closing = false;
+  bool failed = false;
+
+  std::mutex ring_mutex;
+  std::condition_variable slot_freed;
+  std::condition_variable slot_filled;
+  std::thread writer_thread;
+};
+
+#endif
@@ -0,0 +1,143 @@
+//
+// Benchmark model loading from plaintext, NPY and raw binary files, on a grid of
+// Marmousi resolution. Not a test: run manually.
+//
+
+// Includes
+#include "../src/binary_files.h"
+#include "../src/fdModel.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <omp.h>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 100;
+  int nx_inner = 1700;
+  int nz_inner = 350;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 1;
+  int n_shots = 1;
+  std::vector<int> ix_sources_vector{25};
+  std::vector<int> iz_sources_vector{10};
+  std::vector<real_simulation> moment_angles_vector{90};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0}};
+  int nr = 1;
+  std::vector<int> ix_receivers_vector{10};
+  std::vector<int> iz_receivers_vector{90};
+  int snapshot_interval = 100;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  int n_points = model->nx * model->nz;
+  std::cout << "Grid points per parameter: " << n_points << std::endl;
+
+  // Reference model, written in every format.
+  std::vector<real_simulation> reference(3 * n_points);
+  for (int idx = 0; idx < n_points; ++idx)
+  {
+    reference[idx] = 1500 + 300 * std::sin(0.001 * idx);
+    reference[n_points + idx] = 2000 + 700 * std::cos(0.0007 * idx);
+    reference[2 * n_points + idx] = 800 + 200 * std::sin(0.0003 * idx);
+  }
+  std::vector<std::string> names{"de", "vp", "vs"};
+  for (int i_parameter = 0; i_parameter < 3; ++i_parameter)
+  {
+    const real_simulation *values = reference.data() + i_parameter * n_points;
+
+    std::ofstream text_file("benchmark_" + names[i_parameter] + ".txt");
+    text_file.precision(std::numeric_limits<real_simulation>::digits10 + 10);
+    for (int ix = 0; ix < model->nx; ++ix)
+    {
+      for (int iz = 0; iz < model->nz; ++iz)
+      {
+        text_file << values[linear_IDX(ix, iz, model->nx, model->nz)] << " ";
+      }
+      text_file << std::endl;
+    }
+
+    write_npy("benchmark_" + names[i_parameter] + ".npy", values,
+              {model->nx, model->nz});
+
+    std::ofstream raw_file("benchmark_" + names[i_parameter] + ".bin",
+                           std::ios::binary);
+    raw_file.write(reinterpret_cast<const char *>(values),
+                   n_points * sizeof(real_simulation));
+  }
+
+  bool consistent = true;
+
+  // Serial stream extraction, as model loading used to be done.
+  auto startTime = omp_get_wtime();
+  for (int i_parameter = 0; i_parameter < 3; ++i_parameter)
+  {
+    std::ifstream text_file("benchmark_" + names[i_parameter] + ".txt");
+    real_simulation placeholder;
+    for (int idx = 0; idx < n_points; ++idx)
+    {
+      text_file >> placeholder;
+    }
+  }
+  std::cout << "Serial stream extraction:  " << omp_get_wtime() - startTime << " s"
+            << std::endl;
+
+  for (const std::string extension : {".txt", ".npy", ".bin"})
+  {
+    startTime = omp_get_wtime();
+    model->load_model("benchmark_de" + extension, "benchmark_vp" + extension,
+                      "benchmark_vs" + extension, false);
+    std::cout << "load_model from " << extension << ":     "
+              << omp_get_wtime() - startTime << " s" << std::endl;
+
+    for (int idx = 0; idx < n_points; ++idx)
+    {
+      if (model->rho[idx] != reference[idx] or
+          model->vp[idx] != reference[n_points + idx] or
+          model->vs[idx] != reference[2 * n_points + idx])
+      {
+        std::cout << "Model loaded from " << extension << " differs." << std::endl;
+        consistent = false;
+        break;
+      }
+    }
+  }
+
+  for (const std::string extension : {".txt", ".npy", ".bin"})
+  {
+    for (const auto &name : names)
+    {
+      std::remove(("benchmark_" + name + extension).c_str());
+    }
+  }
+  delete model;
+
+  exit(consistent ? 0 : 1);
+}
@@ -1,3 +1,5 @@
+import os
+
 from matplotlib import animation
 import psvWave
 import matplotlib.pyplot as plt
@@ -213,8 +215,16 @@ ax2 = plt.subplot(212)
 plt.xlabel("x [m]")
 plt.ylabel("z [m]")
 
-vx, _, _, _, _ = model.get_snapshots()
-vx = vx[0, :, :, :]
+# Write every snapshot_interval-th wavefield of the first shot to disk, in the
+# background while simulating, and read the frames back from the container.
+if os.path.exists("wavefields.bin"):
+    os.remove("wavefields.bin")
+model.wavefield_output.path = "wavefields.bin"
+model.wavefield_output.interval = model.snapshot_interval
+model.wavefield_output.fields = 1  # vx
+model.forward_simulate(0, output_wavefields=True, omp_threads_override=6)
+
+vx = psvWave.read_wavefield_file("wavefields.bin")["vx"]
 
 # Get the receivers
 rx, rz = model.get_receivers()
@@ -0,0 +1,21 @@
+import psvWave
+import numpy
+
+
+def test_active_region():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    model.forward_simulate(0, store_fields=False)
+    ux, uz = (data.copy() for data in model.get_synthetic_data())
+
+    model.active_region_tolerance = 1e-6
+    model.begin_forward_simulation(0, store_fields=False)
+    model.step(100)
+    assert 0.0 < model.active_region_fraction() < 0.5
+
+    model.forward_simulate(0, store_fields=False)
+    ux_active, uz_active = model.get_synthetic_data()
+    assert numpy.allclose(ux_active, ux, rtol=0.0, atol=1e-6 * numpy.abs(ux).max())
+    assert numpy.allclose(uz_active, uz, rtol=0.0, atol=1e-6 * numpy.abs(uz).max())
@@ -0,0 +1,22 @@
+import psvWave
+import numpy
+
+
+def test_async_simulations_match():
+    configuration = "tests/test_configurations/default_testing_configuration.ini"
+    models = [psvWave.fdModel(configuration) for _ in range(3)]
+
+    reference = psvWave.fdModel(configuration)
+    reference.forward_simulate(0, omp_threads_override=1)
+    ux_reference, uz_reference = reference.get_synthetic_data()
+
+    futures = [
+        model.forward_simulate_async(0, omp_threads_override=1) for model in models
+    ]
+    for future in futures:
+        future.result()
+
+    for model in models:
+        ux, uz = model.get_synthetic_data()
+        assert numpy.all(ux[0] == ux_reference[0])
+        assert numpy.all(uz[0] == uz_reference[0])
@@ -0,0 +1,36 @@
+import psvWave
+import numpy
+
+
+def test_evaluate_models():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    # Observed data from a slower model.
+    vp, vs, rho = model.get_parameter_fields()
+    model.set_parameter_fields(0.95 * vp, vs, rho)
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    model.set_observed_data(*model.get_synthetic_data())
+    model.set_parameter_fields(vp, vs, rho)
+
+    m = model.get_model_vector()
+    model_vectors = numpy.stack([m, 0.99 * m])
+
+    misfits, gradients = model.evaluate_models(model_vectors)
+    assert misfits.shape == (2,)
+    assert gradients.shape == model_vectors.shape
+
+    for i_model, model_vector in enumerate(model_vectors):
+        model.set_model_vector(model_vector)
+        for i_shot in range(model.n_shots):
+            model.forward_simulate(i_shot)
+        model.calculate_l2_misfit_and_adjoint_sources()
+        model.reset_kernels()
+        for i_shot in range(model.n_shots):
+            model.adjoint_simulate(i_shot)
+        model.map_kernels_to_velocity()
+
+        assert misfits[i_model] == model.misfit
+        assert numpy.allclose(gradients[i_model], model.get_gradient_vector())
@@ -0,0 +1,36 @@
+import psvWave
+import numpy
+
+
+def test_illumination():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    # Observed data from a slower model.
+    vp, vs, rho = model.get_parameter_fields()
+    model.set_parameter_fields(0.95 * vp, vs, rho)
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    model.set_observed_data(*model.get_synthetic_data())
+    model.set_parameter_fields(vp, vs, rho)
+
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    model.calculate_l2_misfit_and_adjoint_sources()
+    model.reset_kernels()
+    for i_shot in range(model.n_shots):
+        model.adjoint_simulate(i_shot)
+    model.map_kernels_to_velocity()
+
+    forward, adjoint = model.get_illumination()
+    assert forward.shape == vp.shape and adjoint.shape == vp.shape
+    assert forward.max() > 0.0 and adjoint.max() > 0.0
+
+    preconditioner = model.get_preconditioner_vector(water_level=0.1)
+    assert preconditioner.shape == model.get_gradient_vector().shape
+    assert numpy.isclose(preconditioner.min(), 1.0 / 1.1)
+    assert preconditioner.max() <= 10.0
+
+    model.reset_kernels()
+    assert numpy.all(model.get_illumination()[0] == 0.0)
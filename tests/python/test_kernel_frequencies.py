@@ -0,0 +1,22 @@
+import psvWave
+import numpy
+import pytest
+
+
+def test_kernel_frequencies():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    model.set_kernel_frequencies([60.0, 40.0])
+    assert model.kernel_frequencies == [40.0, 60.0]
+
+    model.forward_simulate(0)
+    vx = model.get_snapshots()[0]
+    assert vx.shape == (model.n_shots, 4, model.nx, model.nz)
+
+    with pytest.raises(ValueError):
+        model.set_kernel_frequencies([1e6])
+
+    model.set_kernel_frequencies([])
+    assert model.get_snapshots()[0].shape[1] == model.snapshots
@@ -0,0 +1,46 @@
+import psvWave
+import numpy
+import pytest
+
+
+def test_kernel_selection():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    # Observed data from a slower model.
+    vp, vs, rho = model.get_parameter_fields()
+    model.set_parameter_fields(0.95 * vp, vs, rho)
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    model.set_observed_data(*model.get_synthetic_data())
+    model.set_parameter_fields(vp, vs, rho)
+
+    model.set_kernel_selection(psvWave.kernel_vp)
+    assert model.kernel_selection == psvWave.kernel_vp
+
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    vx, vz, txx, tzz, txz = model.get_snapshots()
+    assert vx.shape[0] == 0 and vz.shape[0] == 0 and txz.shape[0] == 0
+    assert txx.shape[0] == model.n_shots and tzz.shape[0] == model.n_shots
+
+    model.calculate_l2_misfit_and_adjoint_sources()
+    model.reset_kernels()
+    for i_shot in range(model.n_shots):
+        model.adjoint_simulate(i_shot)
+    model.map_kernels_to_velocity()
+
+    vp_kernel, vs_kernel, density_kernel = model.get_kernels()
+    assert numpy.abs(vp_kernel).max() > 0.0
+    assert numpy.all(vs_kernel == 0.0) and numpy.all(density_kernel == 0.0)
+
+    # The illumination is only accumulated along with the rho kernel.
+    with pytest.raises(ValueError):
+        model.get_preconditioner_vector()
+
+    with pytest.raises(ValueError):
+        model.set_kernel_selection(0)
+
+    model.set_kernel_selection(psvWave.kernel_all)
+    assert model.get_snapshots()[0].shape[0] == model.n_shots
@@ -0,0 +1,30 @@
+import psvWave
+import numpy
+
+
+def test_lbfgs():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    # Observed data from a slower model.
+    vp, vs, rho = model.get_parameter_fields()
+    model.set_parameter_fields(0.95 * vp, vs, rho)
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    model.set_observed_data(*model.get_synthetic_data())
+    model.set_parameter_fields(vp, vs, rho)
+
+    m = model.get_model_vector()
+    settings = psvWave.LBFGSSettings()
+    settings.max_iterations = 2
+    settings.lower_bounds = 0.9 * m
+    settings.upper_bounds = 1.1 * m
+
+    result = model.minimize_lbfgs(settings)
+
+    misfits = [iteration.misfit for iteration in result.iterations]
+    assert len(misfits) == 3
+    assert all(numpy.diff(misfits) < 0)
+    assert numpy.all(model.get_model_vector() >= settings.lower_bounds - 1e-9)
+    assert numpy.all(model.get_model_vector() <= settings.upper_bounds + 1e-9)
@@ -0,0 +1,33 @@
+import psvWave
+import numpy
+
+
+def test_misfit_only():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    # Observed data from a slower model.
+    vp, vs, rho = model.get_parameter_fields()
+    model.set_parameter_fields(0.95 * vp, vs, rho)
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    model.set_observed_data(*model.get_synthetic_data())
+    model.set_parameter_fields(vp, vs, rho)
+
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    model.calculate_l2_misfit()
+
+    misfit = sum(model.forward_simulate_misfit(i_shot) for i_shot in range(model.n_shots))
+    assert numpy.isclose(misfit, model.misfit, rtol=1e-12)
+
+    m = model.get_model_vector()
+    misfits = model.evaluate_trial_steps(m, -0.05 * m, [0.0, 0.5, 1.0])
+    assert len(misfits) == 3
+    assert numpy.isclose(misfits[0], misfit, rtol=1e-12)
+
+    model.set_model_vector(m)
+    assert model.forward_simulate_misfit_all() == misfit
+    bounded = model.forward_simulate_misfit_all(0.25 * misfit)
+    assert 0.25 * misfit < bounded < misfit
@@ -0,0 +1,33 @@
+import psvWave
+import numpy
+
+
+def test_multiscale():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    # Observed data from a slower model.
+    vp, vs, rho = model.get_parameter_fields()
+    model.set_parameter_fields(0.95 * vp, vs, rho)
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    model.set_observed_data(*model.get_synthetic_data())
+    model.set_parameter_fields(vp, vs, rho)
+
+    assert model.coarsening_factor(20.0) > model.coarsening_factor(40.0) >= 1
+
+    stages = []
+    for max_frequency in [20.0, 40.0]:
+        stage = psvWave.MultiscaleStage()
+        stage.max_frequency = max_frequency
+        stage.optimizer.max_iterations = 1
+        stages.append(stage)
+
+    results = model.minimize_multiscale(stages)
+
+    assert results[0].coarsening > results[1].coarsening >= 1
+    for result in results:
+        misfits = [iteration.misfit for iteration in result.optimization.iterations]
+        assert misfits[-1] < misfits[0]
+    assert not numpy.allclose(model.get_parameter_fields()[0], vp)
@@ -0,0 +1,29 @@
+import os
+
+import psvWave
+import numpy
+
+
+def test_binary_receivers():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    ux = numpy.random.randn(model.n_shots, model.nr, model.nt)
+    uz = numpy.random.randn(model.n_shots, model.nr, model.nt)
+    model.set_synthetic_data(ux, uz)
+    model.write_receivers_binary()
+
+    try:
+        ux_file, uz_file, dt, ix, iz = psvWave.read_receiver_file("./rtf0.bin")
+        assert numpy.all(ux_file == ux[0])
+        assert numpy.all(uz_file == uz[0])
+        assert dt == model.dt
+
+        model.load_receivers()
+        ux_observed, uz_observed = model.get_observed_data()
+        assert numpy.all(ux_observed == ux)
+        assert numpy.all(uz_observed == uz)
+    finally:
+        for i_shot in range(model.n_shots):
+            os.remove(f"./rtf{i_shot}.bin")
@@ -0,0 +1,39 @@
+import psvWave
+import numpy
+
+
+def test_shot_windows():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    # Observed data from a slower model.
+    vp, vs, rho = model.get_parameter_fields()
+    model.set_parameter_fields(0.95 * vp, vs, rho)
+    for i_shot in range(model.n_shots):
+        model.forward_simulate(i_shot)
+    model.set_observed_data(*model.get_synthetic_data())
+    model.set_parameter_fields(vp, vs, rho)
+
+    # The window spans the sources and the receivers with observed data.
+    window = model.get_shot_window(0, 5)
+    assert window.ix_start == 5 and window.ix_end == 195
+    assert len(window.receivers) == model.nr
+
+    # Receivers without observed data do not widen the window.
+    ux, uz = model.get_observed_data()
+    ux[:, 10:, :] = 0.0
+    uz[:, 10:, :] = 0.0
+    model.set_observed_data(ux, uz)
+    window = model.get_shot_window(0, 5)
+    assert window.ix_start == 5 and window.ix_end == 180
+    assert window.receivers == list(range(model.nr - 1))
+
+    m = model.get_model_vector()
+    misfits, gradients = model.evaluate_models(m[None, :])
+
+    # A window covering the full grid reproduces the full grid simulation.
+    model.shot_window_aperture = 1000
+    misfits_window, gradients_window = model.evaluate_models(m[None, :])
+    assert numpy.isclose(misfits_window[0], misfits[0])
+    assert numpy.allclose(gradients_window, gradients)
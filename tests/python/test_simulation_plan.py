@@ -0,0 +1,34 @@
+import psvWave
+import numpy
+
+
+def test_simulation_plan():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    max_stable_dt = model.stable_time_step(2000.0, model.dx, model.dz)
+    courant_limit = 1.0 / ((9.0 / 8.0 + 1.0 / 24.0) * numpy.sqrt(2.0))
+    assert numpy.isclose(max_stable_dt, courant_limit * model.dx / 2000.0)
+    assert model.dt < max_stable_dt
+
+    # The stable time step follows the loaded model.
+    vp, vs, rho = model.get_parameter_fields()
+    model.set_parameter_fields(1.1 * vp, vs, rho)
+    assert numpy.isclose(model.max_stable_time_step(), max_stable_dt / 1.1)
+    model.set_parameter_fields(vp, vs, rho)
+
+    plan = model.plan_simulation(points_per_wavelength=6.0, frequency_factor=1.0)
+    assert plan.dt <= plan.max_stable_dt
+    assert plan.current_max_stable_dt == model.max_stable_time_step()
+    assert plan.dx > model.dx and plan.dt > model.dt
+    assert plan.relative_cost < 1.0
+
+    planned = model.resample(plan)
+    assert planned.dx == plan.dx and planned.dt == plan.dt
+    assert planned.nt == plan.nt and planned.nx_inner == plan.nx_inner
+
+    for i_shot in range(planned.n_shots):
+        planned.forward_simulate(i_shot, store_fields=False)
+    ux, uz = planned.get_synthetic_data()
+    assert numpy.all(numpy.isfinite(ux)) and numpy.all(numpy.isfinite(uz))
@@ -0,0 +1,26 @@
+import psvWave
+import numpy
+
+
+def test_snapshot_quadrature():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    model.set_snapshot_quadrature(2, 2)
+    model.forward_simulate(0)
+    vx = model.get_snapshots()[0]
+    assert vx.shape == (
+        model.n_shots,
+        model.snapshots,
+        (model.nx_free_parameters + 1) // 2,
+        (model.nz_free_parameters + 1) // 2,
+    )
+
+    model.set_snapshot_quadrature(1, 1)
+    assert model.get_snapshots()[0].shape == (
+        model.n_shots,
+        model.snapshots,
+        model.nx,
+        model.nz,
+    )
@@ -0,0 +1,64 @@
+import gc
+
+import psvWave
+import numpy
+import pytest
+
+
+def test_views_share_memory():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+
+    ux_view, uz_view = model.get_synthetic_data(copy=False)
+    ux_copy, uz_copy = model.get_synthetic_data()
+    assert not ux_view.flags.owndata
+    assert not ux_view.flags.writeable
+    assert ux_copy.flags.writeable
+
+    ux = numpy.random.randn(model.n_shots, model.nr, model.nt)
+    model.set_synthetic_data(ux, ux)
+
+    # The view follows the model, the copy does not.
+    assert numpy.all(ux_view == ux)
+    assert not numpy.all(ux_copy == ux)
+
+    with pytest.raises(ValueError):
+        ux_view[0, 0, 0] = 1.0
+
+    vx, _, _, _, _ = model.get_wavefields(copy=False, writeable=True)
+    vx[0, 0] = 1.0
+    assert model.get_wavefields()[0][0, 0] == 1.0
+
+
+def test_views_keep_model_alive():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+    vp_copy, _, _ = model.get_parameter_fields()
+    vp_view, _, _ = model.get_parameter_fields(copy=False)
+    del model
+    gc.collect()
+
+    assert numpy.all(vp_view == vp_copy)
+
+
+def test_snapshot_views_outlive_reallocation():
+    model = psvWave.fdModel(
+        "tests/test_configurations/default_testing_configuration.ini"
+    )
+    model.forward_simulate(0)
+    txx_copy = model.get_snapshots()[2]
+    txx_view = model.get_snapshots(copy=False, writeable=True)[2]
+
+    # Setters discard the snapshots, the view keeps the discarded array.
+    model.set_snapshot_quadrature(2, 2)
+    model.set_kernel_selection(psvWave.kernel_vp)
+    model.set_kernel_frequencies([50.0])
+    model.forward_simulate(0)
+    del model
+    gc.collect()
+
+    assert numpy.all(txx_view == txx_copy)
+    txx_view[0, 0, 0, 0] = 1.0
+    assert txx_view[0, 0, 0, 0] == 1.0
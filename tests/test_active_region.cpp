@@ -0,0 +1,122 @@
+//
+// Test that simulations limited to the active region of the grid reproduce the
+// seismograms and kernels of full grid simulations, and that forward simulations on
+// a long line with a short record run faster.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  auto *model = make_test_model();
+  make_observed_data(model);
+
+  // Gradients are computed in the homogeneous model.
+  set_test_anomaly(model, 1.0);
+
+  // Full grid reference.
+  int n_receiver_samples = model->n_shots * model->nr * model->nt;
+  auto startTime = omp_get_wtime();
+  model->run_model(false, true);
+  auto full_time = omp_get_wtime() - startTime;
+  std::vector<real_simulation> reference_ux(model->rtf_ux,
+                                            model->rtf_ux + n_receiver_samples);
+  std::vector<real_simulation> reference_uz(model->rtf_uz,
+                                            model->rtf_uz + n_receiver_samples);
+  std::vector<real_simulation> reference_kernel(model->vp_kernel,
+                                                model->vp_kernel + model->nx * model->nz);
+
+  model->active_region_tolerance = 1e-6;
+  startTime = omp_get_wtime();
+  model->run_model(false, true);
+  auto active_time = omp_get_wtime() - startTime;
+  std::cout << "Elapsed time for full grid and active region simulations: " << full_time
+            << ", " << active_time << std::endl;
+
+  real_simulation data_error = 0.0;
+  real_simulation data_norm = 0.0;
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    data_error += pow(model->rtf_ux[idx] - reference_ux[idx], 2) +
+                  pow(model->rtf_uz[idx] - reference_uz[idx], 2);
+    data_norm += pow(reference_ux[idx], 2) + pow(reference_uz[idx], 2);
+  }
+  real_simulation kernel_error = 0.0;
+  real_simulation kernel_norm = 0.0;
+  for (int idx = 0; idx < model->nx * model->nz; ++idx)
+  {
+    kernel_error += pow(model->vp_kernel[idx] - reference_kernel[idx], 2);
+    kernel_norm += pow(reference_kernel[idx], 2);
+  }
+  real_simulation relative_data_error = sqrt(data_error / data_norm);
+  real_simulation relative_kernel_error = sqrt(kernel_error / kernel_norm);
+  std::cout << "Relative difference of seismograms and kernels: " << relative_data_error
+            << ", " << relative_kernel_error << std::endl;
+
+  delete model;
+
+  // The active region pays off when waves cross only a small part of the grid
+  // during the simulation: a forward simulation on a long line with a short record.
+  test_model_parameters long_line;
+  long_line.nt = 400;
+  long_line.nx_inner = 1000;
+  long_line.ix_sources = {24};
+  long_line.iz_sources = {10};
+  long_line.moment_angles = {90};
+  long_line.which_source_to_fire_in_which_shot = {{0}};
+  auto *long_model = make_test_model(long_line);
+  startTime = omp_get_wtime();
+  long_model->forward_simulate(0, false, false);
+  auto long_full_time = omp_get_wtime() - startTime;
+  int n_long_samples = long_model->nr * long_model->nt;
+  std::vector<real_simulation> long_reference_ux(long_model->rtf_ux,
+                                                 long_model->rtf_ux + n_long_samples);
+
+  long_model->active_region_tolerance = 1e-6;
+  startTime = omp_get_wtime();
+  long_model->forward_simulate(0, false, false);
+  auto long_active_time = omp_get_wtime() - startTime;
+  real_simulation long_fraction = long_model->active_region_fraction();
+  real_simulation long_error = 0.0;
+  real_simulation long_norm = 0.0;
+  for (int idx = 0; idx < n_long_samples; ++idx)
+  {
+    long_error += pow(long_model->rtf_ux[idx] - long_reference_ux[idx], 2);
+    long_norm += pow(long_reference_ux[idx], 2);
+  }
+  real_simulation relative_long_error = sqrt(long_error / long_norm);
+  std::cout << "Elapsed time for full grid and active region simulations on a long "
+               "line: "
+            << long_full_time << ", " << long_active_time
+            << ", fraction of active tiles: " << long_fraction
+            << ", relative difference of seismograms: " << relative_long_error
+            << std::endl;
+  delete long_model;
+
+  if (relative_data_error < 1e-6 and relative_kernel_error < 1e-6 and
+      relative_long_error < 1e-6 and long_fraction < 0.5 and
+      long_active_time < 0.5 * long_full_time)
+  {
+    std::cout << "Active region simulations match full grid simulations. The test "
+                 "succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Active region simulations differ from full grid simulations. The test "
+                 "failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,177 @@
+//
+// Test the basis projections of the model and gradient vectors, for blocks and for a
+// custom smooth basis.
+//
+
+// Includes
+#include "../src/fdModel.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 2000;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 4;
+  int npz = 3;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 4;
+  int n_shots = 3;
+  std::vector<int> ix_sources_vector{25, 75, 125, 175};
+  std::vector<int> iz_sources_vector{10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles_vector{90, 180, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0, 1}, {2}, {3}};
+  int nr = 19;
+  std::vector<int> ix_receivers_vector{10, 20, 30, 40, 50, 60, 70, 80, 90, 100,
+                                       110, 120, 130, 140, 150, 160, 170, 180, 190};
+  std::vector<int> iz_receivers_vector{90, 90, 90, 90, 90, 90, 90, 90, 90, 90,
+                                       90, 90, 90, 90, 90, 90, 90, 90, 90};
+  int snapshot_interval = 10;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  int nx_free = model->nx_free_parameters;
+  int nz_free = model->nz_free_parameters;
+  auto free_idx = [&](int ix, int iz) {
+    return linear_IDX(ix + nx_inner_boundary + np_boundary,
+                      iz + nz_inner_boundary + np_boundary, model->nx, model->nz);
+  };
+
+  // Fields that vary over every grid point.
+  for (int idx = 0; idx < model->nx * model->nz; ++idx)
+  {
+    model->vp[idx] = scalar_vp + std::sin(0.37 * idx);
+    model->vs[idx] = scalar_vs + std::cos(0.11 * idx);
+    model->rho[idx] = scalar_rho + std::sin(0.05 * idx);
+    model->vp_kernel[idx] = std::cos(0.23 * idx);
+    model->vs_kernel[idx] = std::sin(0.71 * idx);
+    model->density_v_kernel[idx] = std::cos(0.43 * idx);
+  }
+
+  // Reference block averages and sums, with parameters ordered z major.
+  int n_blocks_x = nx_free / npx;
+  int n_per_field = n_blocks_x * (nz_free / npz);
+  dynamic_vector reference_m = dynamic_vector::Zero(3 * n_per_field);
+  dynamic_vector reference_g = dynamic_vector::Zero(3 * n_per_field);
+  for (int ix = 0; ix < nx_free; ++ix)
+  {
+    for (int iz = 0; iz < nz_free; ++iz)
+    {
+      int i_parameter = ix / npx + (iz / npz) * n_blocks_x;
+      int idx = free_idx(ix, iz);
+      reference_m[i_parameter] += model->vp[idx] / (npx * npz);
+      reference_m[i_parameter + n_per_field] += model->vs[idx] / (npx * npz);
+      reference_m[i_parameter + 2 * n_per_field] += model->rho[idx] / (npx * npz);
+      reference_g[i_parameter] += model->vp_kernel[idx];
+      reference_g[i_parameter + n_per_field] += model->vs_kernel[idx];
+      reference_g[i_parameter + 2 * n_per_field] += model->density_v_kernel[idx];
+    }
+  }
+
+  real_simulation block_error =
+      std::max((model->get_model_vector() - reference_m).cwiseAbs().maxCoeff() /
+                   reference_m.cwiseAbs().maxCoeff(),
+               (model->get_gradient_vector() - reference_g).cwiseAbs().maxCoeff() /
+                   reference_g.cwiseAbs().maxCoeff());
+
+  model->set_model_vector(reference_m);
+  real_simulation round_trip_error =
+      (model->get_model_vector() - reference_m).cwiseAbs().maxCoeff() /
+      reference_m.cwiseAbs().maxCoeff();
+
+  // Smooth basis of linear interpolation between columns every 20 grid points in x.
+  int spacing = 20;
+  int n_columns = nx_free / spacing + 1;
+  std::vector<Eigen::Triplet<real_simulation>> entries;
+  for (int ix = 0; ix < nx_free; ++ix)
+  {
+    int i_column = ix / spacing;
+    real_simulation fraction = real_simulation(ix % spacing) / spacing;
+    for (int iz = 0; iz < nz_free; ++iz)
+    {
+      int i_point = linear_IDX(ix, iz, nx_free, nz_free);
+      entries.emplace_back(i_point, i_column, 1.0 - fraction);
+      if (fraction > 0.0)
+      {
+        entries.emplace_back(i_point, i_column + 1, fraction);
+      }
+    }
+  }
+  sparse_matrix smooth_basis(nx_free * nz_free, n_columns);
+  smooth_basis.setFromTriplets(entries.begin(), entries.end());
+  model->set_basis(smooth_basis);
+
+  dynamic_vector m(3 * n_columns);
+  for (int i = 0; i < m.size(); ++i)
+  {
+    m[i] = 1000.0 + 100.0 * std::sin(1.3 * i);
+  }
+  model->set_model_vector(m);
+
+  // The gradient is the adjoint of the model mapping: g . m = sum(kernel * field).
+  real_simulation field_product = 0.0;
+  for (int ix = 0; ix < nx_free; ++ix)
+  {
+    for (int iz = 0; iz < nz_free; ++iz)
+    {
+      int idx = free_idx(ix, iz);
+      field_product += model->vp_kernel[idx] * model->vp[idx] +
+                       model->vs_kernel[idx] * model->vs[idx] +
+                       model->density_v_kernel[idx] * model->rho[idx];
+    }
+  }
+  real_simulation vector_product = model->get_gradient_vector().dot(m);
+  real_simulation adjoint_error =
+      std::abs(field_product - vector_product) / std::abs(field_product);
+
+  // Copies keep the basis.
+  auto *copy = new fdModel(*model);
+  bool copy_has_basis = copy->free_parameters == 3 * n_columns and
+                        copy->get_model_vector().size() == m.size();
+  delete copy;
+
+  delete model;
+
+  std::cout << "Block error: " << block_error << ", round trip error: "
+            << round_trip_error << ", adjoint error: " << adjoint_error << std::endl;
+
+  if (block_error < 1e-12 and round_trip_error < 1e-12 and adjoint_error < 1e-10 and
+      copy_has_basis)
+  {
+    std::cout << "Basis projections are consistent. The test succeeded." << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Basis projections are not consistent. The test failed." << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,104 @@
+//
+// Test that batched evaluation of many model vectors reproduces separate evaluations.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  auto *model = make_test_model();
+  make_observed_data(model);
+
+  // Three candidate models around the homogeneous one.
+  dynamic_vector background(model->get_model_vector().size());
+  int n_free_per_par = background.size() / 3;
+  background.segment(0, n_free_per_par).setConstant(model->scalar_vp);
+  background.segment(n_free_per_par, n_free_per_par).setConstant(model->scalar_vs);
+  background.segment(2 * n_free_per_par, n_free_per_par).setConstant(model->scalar_rho);
+
+  int n_models = 3;
+  dynamic_matrix model_vectors(n_models, background.size());
+  for (int i_model = 0; i_model < n_models; ++i_model)
+  {
+    model_vectors.row(i_model) = background.transpose();
+    model_vectors.row(i_model).segment(0, n_free_per_par) *= 1.0 + 0.01 * i_model;
+  }
+
+  // Reference: one model at a time.
+  auto startTime = omp_get_wtime();
+  dynamic_vector reference_misfits(n_models);
+  dynamic_matrix reference_gradients(n_models, background.size());
+  for (int i_model = 0; i_model < n_models; ++i_model)
+  {
+    model->set_model_vector(model_vectors.row(i_model).transpose());
+    model->run_model(false, true);
+    reference_misfits[i_model] = model->misfit;
+    reference_gradients.row(i_model) = model->get_gradient_vector().transpose();
+  }
+  std::cout << "Elapsed time for separate evaluations: " << omp_get_wtime() - startTime
+            << std::endl;
+
+  startTime = omp_get_wtime();
+  dynamic_vector misfits;
+  dynamic_matrix gradients;
+  model->evaluate_models(model_vectors, misfits, gradients, 0);
+  std::cout << "Elapsed time for batched evaluation: " << omp_get_wtime() - startTime
+            << std::endl;
+
+  // Results do not depend on the scheduling, and different worker counts only
+  // change the rounding of the gradients.
+  dynamic_vector misfits_two_workers;
+  dynamic_matrix gradients_two_workers;
+  model->evaluate_models(model_vectors, misfits_two_workers, gradients_two_workers, 2);
+  dynamic_vector misfits_repeated;
+  dynamic_matrix gradients_repeated;
+  model->evaluate_models(model_vectors, misfits_repeated, gradients_repeated, 2);
+
+  // Workers store the snapshots of one shot at a time.
+  fdModel worker(*model, false);
+  worker.share_snapshot_slot();
+  bool single_snapshot_slot = worker.shape_accu[0] == 1;
+
+  delete model;
+
+  real_simulation misfit_difference = (misfits - reference_misfits).cwiseAbs().maxCoeff();
+  real_simulation gradient_difference =
+      (gradients - reference_gradients).cwiseAbs().maxCoeff();
+  real_simulation gradient_amplitude = reference_gradients.cwiseAbs().maxCoeff();
+  bool scheduling_independent =
+      misfits_repeated == misfits_two_workers and
+      gradients_repeated == gradients_two_workers and misfits == misfits_two_workers and
+      (gradients - gradients_two_workers).cwiseAbs().maxCoeff() <
+          1e-12 * gradient_amplitude;
+
+  std::cout << "Misfits: " << misfits.transpose() << std::endl
+            << "Maximum misfit difference: " << misfit_difference
+            << ", maximum gradient difference: " << gradient_difference
+            << ", maximum gradient amplitude: " << gradient_amplitude << std::endl;
+
+  if (misfits.minCoeff() > 0.0 and misfit_difference == 0.0 and
+      gradient_amplitude > 0.0 and gradient_difference < 1e-10 * gradient_amplitude and
+      scheduling_independent and single_snapshot_slot)
+  {
+    std::cout << "Batched evaluation matches separate evaluations. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Batched evaluation does not match separate evaluations. The test "
+                 "failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
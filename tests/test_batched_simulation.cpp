@@ -0,0 +1,122 @@
+//
+// Test that batched multi-shot simulation reproduces shot-by-shot simulation.
+//
+
+// Includes
+#include "../src/fdModel.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 2000;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 4;
+  int n_shots = 3;
+  std::vector<int> ix_sources_vector{25, 75, 125, 175};
+  std::vector<int> iz_sources_vector{10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles_vector{90, 180, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0, 1}, {2}, {3}};
+  int nr = 19;
+  std::vector<int> ix_receivers_vector{10, 20, 30, 40, 50, 60, 70, 80, 90, 100,
+                                       110, 120, 130, 140, 150, 160, 170, 180, 190};
+  std::vector<int> iz_receivers_vector{90, 90, 90, 90, 90, 90, 90, 90, 90, 90,
+                                       90, 90, 90, 90, 90, 90, 90, 90, 90};
+  int snapshot_interval = 10;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  int n_receiver_samples = model->n_shots * model->nr * model->nt;
+  int n_snapshot_samples = model->n_shots * model->snapshots * model->nx * model->nz;
+
+  // Reference: every shot separately.
+  auto startTime = omp_get_wtime();
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    model->forward_simulate(is, true, false);
+  }
+  std::cout << "Elapsed time for separate simulations: " << omp_get_wtime() - startTime
+            << std::endl;
+
+  auto *reference_ux = new real_simulation[n_receiver_samples];
+  auto *reference_accu_txz = new real_simulation[n_snapshot_samples];
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    reference_ux[idx] = model->rtf_ux[idx];
+  }
+  for (int idx = 0; idx < n_snapshot_samples; ++idx)
+  {
+    reference_accu_txz[idx] = model->accu_txz[idx];
+  }
+
+  // All shots in one batch.
+  startTime = omp_get_wtime();
+  model->forward_simulate_batch({0, 1, 2}, true, false);
+  std::cout << "Elapsed time for batched simulation: " << omp_get_wtime() - startTime
+            << std::endl;
+
+  real_simulation max_difference = 0.0;
+  real_simulation max_amplitude = 0.0;
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    max_difference =
+        std::max(max_difference, std::abs(model->rtf_ux[idx] - reference_ux[idx]));
+    max_amplitude = std::max(max_amplitude, std::abs(reference_ux[idx]));
+  }
+  for (int idx = 0; idx < n_snapshot_samples; ++idx)
+  {
+    max_difference = std::max(max_difference,
+                              std::abs(model->accu_txz[idx] - reference_accu_txz[idx]));
+  }
+
+  delete model;
+  delete[] reference_ux;
+  delete[] reference_accu_txz;
+
+  std::cout << "Maximum difference: " << max_difference
+            << ", maximum amplitude: " << max_amplitude << std::endl;
+
+  if (max_amplitude > 0.0 and max_difference < 1e-10 * max_amplitude)
+  {
+    std::cout << "Batched simulation matches separate simulations. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Batched simulation does not match separate simulations. The test "
+                 "failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,144 @@
+//
+// Test that binary receiver files round-trip and take precedence over plaintext.
+//
+
+// Includes
+#include "../src/fdModel.h"
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <omp.h>
+#include <stdexcept>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 1000;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 4;
+  int n_shots = 3;
+  std::vector<int> ix_sources_vector{25, 75, 125, 175};
+  std::vector<int> iz_sources_vector{10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles_vector{90, 180, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0, 1}, {2}, {3}};
+  int nr = 19;
+  std::vector<int> ix_receivers_vector{10, 20, 30, 40, 50, 60, 70, 80, 90, 100,
+                                       110, 120, 130, 140, 150, 160, 170, 180, 190};
+  std::vector<int> iz_receivers_vector{90, 90, 90, 90, 90, 90, 90, 90, 90, 90,
+                                       90, 90, 90, 90, 90, 90, 90, 90, 90};
+  int snapshot_interval = 10;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    model->forward_simulate(is, false, false);
+  }
+  int n_receiver_samples = model->n_shots * model->nr * model->nt;
+
+  bool succeeded = true;
+
+  // Plaintext only.
+  model->write_receivers();
+  model->load_receivers(false);
+  real_simulation max_text_difference = 0.0;
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    auto difference = std::abs(model->rtf_ux_true[idx] - model->rtf_ux[idx]);
+    max_text_difference = std::max(max_text_difference, difference);
+  }
+
+  // Binary files are preferred over plaintext, and reproduce the seismograms
+  // bitwise. The plaintext files are overwritten with doubled seismograms, so that
+  // loading them instead would be noticed.
+  model->write_receivers_binary();
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    model->rtf_ux[idx] *= 2;
+    model->rtf_uz[idx] *= 2;
+  }
+  model->write_receivers();
+  auto startTime = omp_get_wtime();
+  model->load_receivers(false);
+  std::cout << "Elapsed time for loading binary receivers: "
+            << omp_get_wtime() - startTime << std::endl;
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    if (2 * model->rtf_ux_true[idx] != model->rtf_ux[idx] or
+        2 * model->rtf_uz_true[idx] != model->rtf_uz[idx])
+    {
+      succeeded = false;
+    }
+  }
+  std::cout << "Maximum plaintext round-trip difference: " << max_text_difference
+            << std::endl;
+
+  // A receiver file of a different set up should be rejected.
+  std::vector<int> moved_receivers(ix_receivers_vector);
+  moved_receivers[0] += 1;
+  auto *other_model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, moved_receivers, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+  try
+  {
+    other_model->load_receivers(false);
+    std::cout << "Mismatching receiver file was accepted." << std::endl;
+    succeeded = false;
+  }
+  catch (const std::invalid_argument &error)
+  {
+    std::cout << "Mismatching receiver file was rejected: " << error.what()
+              << std::endl;
+  }
+
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    std::remove(model->receiver_filename(is).c_str());
+  }
+  delete model;
+  delete other_model;
+
+  if (succeeded)
+  {
+    std::cout << "Binary receiver files round-trip. The test succeeded." << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Binary receiver files do not round-trip. The test failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,113 @@
+//
+// Test that the illumination accumulated during adjoint simulations matches the
+// stored forward snapshots and gives a bounded preconditioner.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  auto *model = make_test_model();
+  make_observed_data(model);
+
+  // Gradient of the homogeneous model.
+  set_test_anomaly(model, 1.0);
+  auto startTime = omp_get_wtime();
+  model->run_model(false, true);
+  std::cout << "Elapsed time for forward and adjoint simulations: "
+            << omp_get_wtime() - startTime << std::endl;
+
+  // Reference forward illumination from the stored snapshots.
+  real_simulation illumination_error = 0.0;
+  real_simulation illumination_maximum = 0.0;
+  int ix_maximum = 0, iz_maximum = 0;
+  bool adjoint_positive = true;
+  for (int ix = model->np_boundary + model->nx_inner_boundary;
+       ix < model->np_boundary + model->nx_inner - model->nx_inner_boundary; ++ix)
+  {
+    for (int iz = model->np_boundary + model->nz_inner_boundary;
+         iz < model->np_boundary + model->nz_inner - model->nz_inner_boundary; ++iz)
+    {
+      real_simulation reference = 0.0;
+      for (int i_shot = 0; i_shot < model->n_shots; ++i_shot)
+      {
+        for (int i_snapshot = 0; i_snapshot < model->snapshots; ++i_snapshot)
+        {
+          auto idx_accu = linear_IDX(i_shot, i_snapshot, ix, iz, model->n_shots,
+                                     model->snapshots, model->nx, model->nz);
+          reference +=
+              model->snapshot_interval * model->dt *
+              (pow(model->accu_vx[idx_accu], 2) + pow(model->accu_vz[idx_accu], 2));
+        }
+      }
+      auto idx = linear_IDX(ix, iz, model->nx, model->nz);
+      illumination_error = std::max(
+          illumination_error, std::abs(model->forward_illumination[idx] - reference));
+      if (reference > illumination_maximum)
+      {
+        illumination_maximum = reference;
+        ix_maximum = ix - model->np_boundary;
+        iz_maximum = iz - model->np_boundary;
+      }
+      adjoint_positive = adjoint_positive and model->adjoint_illumination[idx] > 0.0;
+    }
+  }
+
+  // The sources lie above the free grid points, so the strongest illumination
+  // should be in the top row, below a source.
+  int source_distance = model->nx;
+  for (int i_source = 0; i_source < model->n_sources; ++i_source)
+  {
+    source_distance =
+        std::min(source_distance, std::abs(model->ix_sources[i_source] -
+                                           model->np_boundary - ix_maximum));
+  }
+
+  real_simulation water_level = 0.01;
+  dynamic_vector preconditioner = model->get_preconditioner_vector(false, water_level);
+  dynamic_vector adjoint_preconditioner =
+      model->get_preconditioner_vector(true, water_level);
+  bool preconditioner_bounded =
+      preconditioner.size() == model->get_model_vector().size() and
+      std::abs(preconditioner.minCoeff() - 1.0 / (1.0 + water_level)) < 1e-12 and
+      preconditioner.maxCoeff() <= 1.0 / water_level and
+      std::abs(adjoint_preconditioner.minCoeff() - 1.0 / (1.0 + water_level)) < 1e-12;
+
+  model->reset_kernels();
+  bool reset = model->get_preconditioner_vector(false, water_level).maxCoeff() ==
+               1.0 / water_level;
+  delete model;
+
+  std::cout << "Maximum illumination " << illumination_maximum << " at (" << ix_maximum
+            << ", " << iz_maximum << "), " << source_distance
+            << " grid points beside a source" << std::endl
+            << "Maximum difference with the snapshots: " << illumination_error
+            << std::endl
+            << "Preconditioner range: " << preconditioner.minCoeff() << " - "
+            << preconditioner.maxCoeff() << std::endl;
+
+  if (illumination_maximum > 0.0 and illumination_error < 1e-12 * illumination_maximum and
+      adjoint_positive and iz_maximum == model->nz_inner_boundary and source_distance <= 3 and
+      preconditioner_bounded and reset)
+  {
+    std::cout << "Illumination matches the forward snapshots. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Illumination does not match the forward snapshots. The test failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,89 @@
+//
+// Test that kernels from Fourier transforms at all frequencies of the snapshots match
+// the time-domain kernels, and that a few frequencies need a fraction of the memory.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  auto *model = make_test_model();
+  make_observed_data(model);
+  set_test_anomaly(model, 1.0);
+
+  auto relative_error = [](const dynamic_vector &a, const dynamic_vector &b) {
+    return (a - b).norm() / b.norm();
+  };
+
+  model->run_model(false, true);
+  dynamic_vector time_gradient = model->get_gradient_vector();
+  int time_size = model->shape_accu[1];
+
+  // Every frequency of the snapshots up to the Nyquist frequency.
+  real_simulation resolution =
+      1.0 / (model->snapshots * model->snapshot_interval * model->dt);
+  std::vector<real_simulation> frequencies;
+  for (int i_frequency = 0; i_frequency <= model->snapshots / 2; ++i_frequency)
+  {
+    frequencies.push_back(i_frequency * resolution);
+  }
+  model->set_kernel_frequencies(frequencies);
+  model->run_model(false, true);
+  dynamic_vector all_frequencies_gradient = model->get_gradient_vector();
+  real_simulation all_frequencies_error =
+      relative_error(all_frequencies_gradient, time_gradient);
+
+  // Batched simulations accumulate the same transforms.
+  model->shot_batch_size = 3;
+  model->run_model(false, true);
+  real_simulation batched_error =
+      relative_error(model->get_gradient_vector(), all_frequencies_gradient);
+  model->shot_batch_size = 1;
+
+  // A few frequencies around the peak frequency give a different kernel, but still a
+  // descent direction of the time-domain misfit.
+  model->set_kernel_frequencies({30.0, 40.0, 50.0, 60.0, 70.0});
+  model->run_model(false, true);
+  dynamic_vector few_frequencies_gradient = model->get_gradient_vector();
+  real_simulation memory_fraction = real_simulation(model->shape_accu[1]) / time_size;
+  real_simulation few_frequencies_correlation =
+      few_frequencies_gradient.dot(time_gradient) /
+      (few_frequencies_gradient.norm() * time_gradient.norm());
+
+  // Snapshots again.
+  model->set_kernel_frequencies({});
+  model->run_model(false, true);
+  real_simulation time_error =
+      relative_error(model->get_gradient_vector(), time_gradient);
+
+  std::cout << "Relative gradient difference with all frequencies, batched and "
+               "snapshots: "
+            << all_frequencies_error << ", " << batched_error << ", " << time_error
+            << std::endl;
+  std::cout << "Relative snapshot memory and gradient correlation with 5 frequencies: "
+            << memory_fraction << ", " << few_frequencies_correlation << std::endl;
+
+  if (all_frequencies_error < 1e-10 and batched_error < 1e-10 and time_error == 0.0 and
+      memory_fraction < 0.2 and few_frequencies_correlation > 0.4)
+  {
+    std::cout << "Frequency-domain kernels match time-domain kernels. The test "
+                 "succeeded."
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Frequency-domain kernels do not match time-domain kernels. The test "
+                 "failed."
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,138 @@
+//
+// Test that adjoint simulations that compute only some kernels store fewer snapshots and
+// reproduce the selected kernels of a simulation that computes all of them.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  test_model_parameters parameters;
+  parameters.npx = 4;
+  parameters.npz = 4;
+  auto *model = make_test_model(parameters);
+  make_observed_data(model);
+  set_test_anomaly(model, 1.0);
+
+  int n_grid = model->nx * model->nz;
+  auto copy_kernel = [&](const real_simulation *kernel) {
+    return std::vector<real_simulation>(kernel, kernel + n_grid);
+  };
+  auto relative_error = [&](const real_simulation *kernel,
+                            const std::vector<real_simulation> &reference) {
+    real_simulation difference = 0.0;
+    real_simulation norm = 0.0;
+    for (int idx = 0; idx < n_grid; ++idx)
+    {
+      difference += (kernel[idx] - reference[idx]) * (kernel[idx] - reference[idx]);
+      norm += reference[idx] * reference[idx];
+    }
+    return sqrt(difference / norm);
+  };
+  auto is_zero = [&](const real_simulation *kernel) {
+    for (int idx = 0; idx < n_grid; ++idx)
+    {
+      if (kernel[idx] != 0.0)
+      {
+        return false;
+      }
+    }
+    return true;
+  };
+  // Fraction of the five fields of which snapshots are stored.
+  auto stored_fields = [&]() {
+    return (2 + (model->kernels_need_velocities() ? 2 : 0) +
+            (model->kernels_need_shear_stress() ? 1 : 0)) /
+           5.0;
+  };
+
+  model->run_model(false, true);
+  auto vp_kernel = copy_kernel(model->vp_kernel);
+  auto vs_kernel = copy_kernel(model->vs_kernel);
+  auto density_kernel = copy_kernel(model->density_v_kernel);
+  dynamic_vector preconditioner = model->get_preconditioner_vector(false, 0.1);
+
+  model->set_kernel_selection(kernel_vp);
+  model->run_model(false, true);
+  real_simulation vp_fraction = stored_fields();
+  real_simulation vp_error = relative_error(model->vp_kernel, vp_kernel);
+  bool vp_others_zero = is_zero(model->vs_kernel) and is_zero(model->density_v_kernel);
+  // Without the rho kernel there is no illumination to precondition with.
+  bool vp_preconditioner_refused = false;
+  try
+  {
+    model->get_preconditioner_vector(false, 0.1);
+  }
+  catch (const std::invalid_argument &)
+  {
+    vp_preconditioner_refused = true;
+  }
+
+  model->set_kernel_selection(kernel_vs);
+  model->run_model(false, true);
+  real_simulation vs_fraction = stored_fields();
+  real_simulation vs_error = relative_error(model->vs_kernel, vs_kernel);
+  bool vs_others_zero = is_zero(model->vp_kernel) and is_zero(model->density_v_kernel);
+
+  model->set_kernel_selection(kernel_rho);
+  model->run_model(false, true);
+  real_simulation rho_error = relative_error(model->density_v_kernel, density_kernel);
+  bool rho_others_zero = is_zero(model->vp_kernel) and is_zero(model->vs_kernel);
+  bool rho_preconditioner_equal =
+      model->get_preconditioner_vector(false, 0.1) == preconditioner;
+
+  // Copies keep the selection and its snapshots.
+  model->set_kernel_selection(kernel_vp | kernel_vs);
+  model->run_model(false, true);
+  real_simulation copy_error;
+  {
+    fdModel copy(*model);
+    copy.reset_kernels();
+    for (int is = 0; is < copy.n_shots; ++is)
+    {
+      copy.adjoint_simulate(is, false);
+    }
+    copy.map_kernels_to_velocity();
+    copy_error = relative_error(copy.vp_kernel, vp_kernel) +
+                 relative_error(copy.vs_kernel, vs_kernel);
+  }
+
+  bool rejected = false;
+  try
+  {
+    model->set_kernel_selection(0);
+  }
+  catch (const std::invalid_argument &)
+  {
+    rejected = true;
+  }
+
+  std::cout << "Relative snapshot memory for vp and vs kernels: " << vp_fraction << ", "
+            << vs_fraction << std::endl;
+  std::cout << "Relative kernel difference for vp, vs, rho and copied: " << vp_error
+            << ", " << vs_error << ", " << rho_error << ", " << copy_error << std::endl;
+
+  if (vp_fraction < 0.5 and vs_fraction < 0.7 and vp_error < 1e-12 and
+      vs_error < 1e-12 and rho_error < 1e-12 and copy_error < 1e-12 and
+      vp_others_zero and vs_others_zero and rho_others_zero and rejected and
+      vp_preconditioner_refused and rho_preconditioner_equal)
+  {
+    std::cout << "Selected kernels match the full kernels. The test succeeded."
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Selected kernels do not match the full kernels. The test failed."
+              << std::endl;
+    exit(1);
+  }
+}
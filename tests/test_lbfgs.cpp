@@ -0,0 +1,112 @@
+//
+// Test the L-BFGS optimizer on analytic problems and a few iterations of
+// full-waveform inversion.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  auto *model = make_test_model();
+
+  bool succeeded = true;
+
+  // Rosenbrock function, without bounds.
+  lbfgs::objective_function rosenbrock = [](const Eigen::VectorXd &x,
+                                            Eigen::VectorXd &g) {
+    double f = 0.0;
+    g.setZero();
+    for (int i = 0; i + 1 < x.size(); ++i)
+    {
+      double a = x[i + 1] - x[i] * x[i];
+      double b = 1.0 - x[i];
+      f += 100.0 * a * a + b * b;
+      g[i] += -400.0 * x[i] * a - 2.0 * b;
+      g[i + 1] += 200.0 * a;
+    }
+    return f;
+  };
+  lbfgs_settings settings;
+  settings.max_iterations = 500;
+  settings.gradient_tolerance = 1e-10;
+  settings.misfit_tolerance = 0.0;
+  Eigen::VectorXd x = Eigen::VectorXd::Constant(10, -1.2);
+  auto result = lbfgs(settings).minimize(rosenbrock, x, false);
+  double rosenbrock_error = (x - Eigen::VectorXd::Ones(10)).cwiseAbs().maxCoeff();
+  std::cout << "Rosenbrock: " << result.iterations.size() - 1 << " iterations, error "
+            << rosenbrock_error << ", " << result.stop_reason << std::endl;
+  succeeded = succeeded and rosenbrock_error < 1e-5;
+
+  // Weighted quadratic with a minimum partly outside the bounds.
+  Eigen::VectorXd center(4), weights(4);
+  center << -2.0, 0.5, 3.0, 1.0;
+  weights << 1.0, 10.0, 100.0, 0.1;
+  lbfgs::objective_function quadratic = [&](const Eigen::VectorXd &x,
+                                            Eigen::VectorXd &g) {
+    g = 2.0 * weights.cwiseProduct(x - center);
+    return (x - center).cwiseAbs2().dot(weights);
+  };
+  settings.lower_bounds = Eigen::VectorXd::Constant(4, -1.0);
+  settings.upper_bounds = Eigen::VectorXd::Constant(4, 2.0);
+  x = Eigen::VectorXd::Zero(4);
+  result = lbfgs(settings).minimize(quadratic, x, false);
+  Eigen::VectorXd expected(4);
+  expected << -1.0, 0.5, 2.0, 1.0;
+  double bounded_error = (x - expected).cwiseAbs().maxCoeff();
+  std::cout << "Bounded quadratic: " << result.iterations.size() - 1
+            << " iterations, error " << bounded_error << ", " << result.stop_reason
+            << std::endl;
+  succeeded = succeeded and bounded_error < 1e-8;
+
+  make_observed_data(model);
+
+  // A few iterations of full-waveform inversion from the homogeneous model.
+  dynamic_vector starting(model->get_model_vector().size());
+  int n_free_per_par = starting.size() / 3;
+  starting.segment(0, n_free_per_par).setConstant(model->scalar_vp);
+  starting.segment(n_free_per_par, n_free_per_par).setConstant(model->scalar_vs);
+  starting.segment(2 * n_free_per_par, n_free_per_par).setConstant(model->scalar_rho);
+  model->set_model_vector(starting);
+
+  lbfgs_settings fwi_settings;
+  fwi_settings.max_iterations = 2;
+  fwi_settings.lower_bounds = 0.9 * starting;
+  fwi_settings.upper_bounds = 1.1 * starting;
+  result = model->minimize_lbfgs(fwi_settings, true);
+
+  bool decreasing = result.iterations.size() == 3;
+  for (size_t i = 1; i < result.iterations.size(); ++i)
+  {
+    decreasing =
+        decreasing and result.iterations[i].misfit < result.iterations[i - 1].misfit;
+  }
+  dynamic_vector final_model = model->get_model_vector();
+  bool within_bounds =
+      (final_model.array() >= fwi_settings.lower_bounds.array() - 1e-9).all() and
+      (final_model.array() <= fwi_settings.upper_bounds.array() + 1e-9).all();
+  succeeded = succeeded and decreasing and within_bounds and
+              result.misfit == result.iterations.back().misfit;
+
+  delete model;
+
+  if (succeeded)
+  {
+    std::cout << "L-BFGS converged on all problems. The test succeeded." << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "L-BFGS did not converge on all problems. The test failed." << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
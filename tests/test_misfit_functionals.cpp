@@ -0,0 +1,178 @@
+//
+// Test the traveltime, envelope and correlation misfits and their adjoint sources.
+//
+
+// Includes
+#include "../src/fdModel.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <string>
+
+#define PI_TEST 3.14159265
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 1000;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 4;
+  int n_shots = 3;
+  std::vector<int> ix_sources_vector{25, 75, 125, 175};
+  std::vector<int> iz_sources_vector{10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles_vector{90, 180, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0, 1}, {2}, {3}};
+  int nr = 19;
+  std::vector<int> ix_receivers_vector{10, 20, 30, 40, 50, 60, 70, 80, 90, 100,
+                                       110, 120, 130, 140, 150, 160, 170, 180, 190};
+  std::vector<int> iz_receivers_vector{90, 90, 90, 90, 90, 90, 90, 90, 90, 90,
+                                       90, 90, 90, 90, 90, 90, 90, 90, 90};
+  int snapshot_interval = 10;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  // Synthetic and observed traces are Ricker wavelets with a known time shift.
+  auto ricker = [&](real_simulation time) {
+    auto argument = std::pow(PI_TEST * peak_frequency * time, 2);
+    return (1 - 2 * argument) * std::exp(-argument);
+  };
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    for (int ir = 0; ir < model->nr; ++ir)
+    {
+      real_simulation observed_time = 0.08 + 0.002 * ir;
+      real_simulation synthetic_time = observed_time + 0.0013 * (is - 1);
+      for (int it = 0; it < model->nt; ++it)
+      {
+        auto idx = linear_IDX(is, ir, it, model->n_shots, model->nr, model->nt);
+        auto time = it * model->dt;
+        model->rtf_ux_true[idx] = 0.8 * ricker(time - observed_time);
+        model->rtf_uz_true[idx] = -0.5 * ricker(time - observed_time);
+        model->rtf_ux[idx] = ricker(time - synthetic_time);
+        model->rtf_uz[idx] = -0.7 * ricker(time - synthetic_time - 0.0005);
+      }
+    }
+  }
+
+  bool succeeded = true;
+
+  // The picked traveltime shifts should reproduce the imposed ones.
+  model->calculate_traveltime_misfit_and_adjoint_sources();
+  real_simulation expected_misfit = 0.0;
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    auto shift_ux = 0.0013 * (is - 1);
+    auto shift_uz = shift_ux + 0.0005;
+    expected_misfit += model->nr * 0.5 * (shift_ux * shift_ux + shift_uz * shift_uz);
+  }
+  std::cout << "Traveltime misfit: " << model->misfit << ", expected: " << expected_misfit
+            << std::endl;
+  if (std::abs(model->misfit - expected_misfit) > 1e-3 * expected_misfit)
+  {
+    succeeded = false;
+  }
+
+  // The adjoint sources should be the gradient of the misfit: compare with a
+  // finite difference along a smooth perturbation of the synthetics.
+  int n_receiver_samples = model->n_shots * model->nr * model->nt;
+  auto *perturbation = new real_simulation[n_receiver_samples];
+  auto *original = new real_simulation[n_receiver_samples];
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    auto time = (idx % model->nt) * model->dt;
+    perturbation[idx] = std::exp(-std::pow((time - 0.1) / 0.01, 2));
+    original[idx] = model->rtf_ux[idx];
+  }
+
+  std::vector<void (fdModel::*)()> misfits{
+      &fdModel::calculate_traveltime_misfit_and_adjoint_sources,
+      &fdModel::calculate_envelope_misfit_and_adjoint_sources,
+      &fdModel::calculate_correlation_misfit_and_adjoint_sources};
+  std::vector<std::string> names{"traveltime", "envelope", "correlation"};
+  std::vector<real_simulation> tolerances{1e-2, 1e-5, 1e-5};
+
+  real_simulation step = 1e-4;
+  for (int i_misfit = 0; i_misfit < int(misfits.size()); ++i_misfit)
+  {
+    (model->*misfits[i_misfit])();
+    real_simulation adjoint_derivative = 0.0;
+    for (int idx = 0; idx < n_receiver_samples; ++idx)
+    {
+      adjoint_derivative += model->dt * model->a_stf_ux[idx] * perturbation[idx];
+    }
+
+    for (int idx = 0; idx < n_receiver_samples; ++idx)
+    {
+      model->rtf_ux[idx] = original[idx] + step * perturbation[idx];
+    }
+    (model->*misfits[i_misfit])();
+    real_simulation misfit_plus = model->misfit;
+    for (int idx = 0; idx < n_receiver_samples; ++idx)
+    {
+      model->rtf_ux[idx] = original[idx] - step * perturbation[idx];
+    }
+    (model->*misfits[i_misfit])();
+    real_simulation misfit_minus = model->misfit;
+    for (int idx = 0; idx < n_receiver_samples; ++idx)
+    {
+      model->rtf_ux[idx] = original[idx];
+    }
+
+    real_simulation finite_difference = (misfit_plus - misfit_minus) / (2 * step);
+    real_simulation relative_error =
+        std::abs(finite_difference - adjoint_derivative) / std::abs(finite_difference);
+    std::cout << "Directional derivative of the " << names[i_misfit]
+              << " misfit, adjoint: " << adjoint_derivative
+              << ", finite difference: " << finite_difference
+              << ", relative error: " << relative_error << std::endl;
+    if (!(relative_error < tolerances[i_misfit]))
+    {
+      succeeded = false;
+    }
+  }
+
+  delete model;
+  delete[] perturbation;
+  delete[] original;
+
+  if (succeeded)
+  {
+    std::cout << "Misfits and adjoint sources are consistent. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Misfits and adjoint sources are not consistent. The test failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
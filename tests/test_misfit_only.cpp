@@ -0,0 +1,150 @@
+//
+// Test that misfit-only forward simulations and parallel trial step evaluation reproduce
+// the misfit of full forward simulations.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  auto *model = make_test_model();
+  make_observed_data(model);
+
+  // Synthetics from the homogeneous model.
+  set_test_anomaly(model, 1.0);
+
+  // Reference: full forward simulations followed by the L2 misfit.
+  auto startTime = omp_get_wtime();
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    model->forward_simulate(is, true, false);
+  }
+  model->calculate_l2_misfit();
+  real_simulation reference_misfit = model->misfit;
+  std::cout << "Elapsed time for full forward simulations: "
+            << omp_get_wtime() - startTime << std::endl;
+
+  // Misfit-only simulations should leave the synthetic data untouched.
+  int n_receiver_samples = model->n_shots * model->nr * model->nt;
+  std::vector<real_simulation> rtf_ux_before(model->rtf_ux,
+                                             model->rtf_ux + n_receiver_samples);
+  startTime = omp_get_wtime();
+  real_simulation lean_misfit = 0.0;
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    lean_misfit += model->forward_simulate_misfit(is);
+  }
+  std::cout << "Elapsed time for misfit-only forward simulations: "
+            << omp_get_wtime() - startTime << std::endl;
+  bool synthetics_untouched = true;
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    synthetics_untouched =
+        synthetics_untouched and rtf_ux_before[idx] == model->rtf_ux[idx];
+  }
+
+  // A bound above the misfit changes nothing, one below it aborts the simulations.
+  real_simulation unbounded_misfit = model->forward_simulate_misfit_all();
+  real_simulation loose_misfit = model->forward_simulate_misfit_all(2.0 * lean_misfit);
+  startTime = omp_get_wtime();
+  real_simulation misfit_bound = 0.25 * lean_misfit;
+  real_simulation aborted_misfit = model->forward_simulate_misfit_all(misfit_bound);
+  std::cout << "Elapsed time for aborted misfit-only forward simulations: "
+            << omp_get_wtime() - startTime << std::endl;
+  bool bound_respected = unbounded_misfit == lean_misfit and
+                         loose_misfit == lean_misfit and aborted_misfit > misfit_bound and
+                         aborted_misfit < lean_misfit;
+
+  // Trial steps along a search direction, evaluated in parallel and one at a time.
+  dynamic_vector start = model->get_model_vector();
+  dynamic_vector direction = dynamic_vector::Zero(start.size());
+  direction.segment(0, start.size() / 3).setConstant(model->scalar_vp);
+  std::vector<real_simulation> steps{0.0, 0.01, 0.03, 0.05};
+
+  startTime = omp_get_wtime();
+  std::vector<real_simulation> trial_misfits;
+  model->evaluate_trial_steps(start, direction, steps, trial_misfits, 0);
+  std::cout << "Elapsed time for parallel trial steps: " << omp_get_wtime() - startTime
+            << std::endl;
+
+  real_simulation trial_difference = 0.0;
+  for (size_t i_step = 0; i_step < steps.size(); ++i_step)
+  {
+    model->set_model_vector(start + steps[i_step] * direction);
+    real_simulation sequential_misfit = 0.0;
+    for (int is = 0; is < model->n_shots; ++is)
+    {
+      sequential_misfit += model->forward_simulate_misfit(is);
+    }
+    trial_difference =
+        std::max(trial_difference, std::abs(sequential_misfit - trial_misfits[i_step]));
+  }
+
+  // Copies without snapshot storage refuse to store fields, also for supershots.
+  bool lean_copy_refuses = false;
+  bool lean_copy_refuses_encoded = false;
+  {
+    fdModel lean_copy(*model, false);
+    try
+    {
+      lean_copy.forward_simulate(0, true, false);
+    }
+    catch (const std::invalid_argument &)
+    {
+      lean_copy_refuses = true;
+    }
+    try
+    {
+      lean_copy.run_model_encoded(false, true);
+    }
+    catch (const std::invalid_argument &)
+    {
+      lean_copy_refuses_encoded = true;
+    }
+  }
+
+  delete model;
+
+  real_simulation relative_difference =
+      std::abs(lean_misfit - reference_misfit) / reference_misfit;
+
+  std::cout << "Reference misfit: " << reference_misfit
+            << ", misfit-only: " << lean_misfit
+            << ", relative difference: " << relative_difference << std::endl
+            << "Trial misfits:";
+  for (const auto &trial_misfit : trial_misfits)
+  {
+    std::cout << " " << trial_misfit;
+  }
+  std::cout << std::endl
+            << "Maximum difference with sequential trial steps: " << trial_difference
+            << std::endl
+            << "Misfit aborted at bound " << misfit_bound << ": " << aborted_misfit
+            << std::endl;
+
+  if (reference_misfit > 0.0 and relative_difference < 1e-12 and synthetics_untouched and
+      trial_difference == 0.0 and trial_misfits[0] == lean_misfit and
+      lean_copy_refuses and lean_copy_refuses_encoded and bound_respected)
+  {
+    std::cout << "Misfit-only evaluation matches full simulations. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Misfit-only evaluation does not match full simulations. The test "
+                 "failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,105 @@
+//
+// Model shared by the tests: a homogeneous 200 x 100 grid with three shots fired by
+// four sources, recorded by a line of 19 receivers, and observed data from the same
+// model with a faster anomaly.
+//
+
+#ifndef TEST_MODEL_H
+#define TEST_MODEL_H
+
+#include <string>
+#include <vector>
+
+#include "../src/fdModel.h"
+
+//!  \brief Parameters of the test model, see make_test_model().
+struct test_model_parameters
+{
+  int nt = 600;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  std::vector<int> ix_sources{24, 74, 124, 174};
+  std::vector<int> iz_sources{10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles{90, 180, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0, 1}, {2}, {3}};
+  std::vector<int> ix_receivers{10,  20,  30,  40,  50,  60,  70,  80,  90, 100,
+                                110, 120, 130, 140, 150, 160, 170, 180, 190};
+  std::vector<int> iz_receivers{90, 90, 90, 90, 90, 90, 90, 90, 90, 90,
+                                90, 90, 90, 90, 90, 90, 90, 90, 90};
+  int snapshot_interval = 10;
+};
+
+//!  \brief Function to create the test model.
+//!
+//!  @param parameters Parameters of the model, by default the shared test model.
+//!  @returns The model, to be deleted by the caller.
+inline fdModel *
+make_test_model(const test_model_parameters &parameters = test_model_parameters())
+{
+  return new fdModel(
+      parameters.nt, parameters.nx_inner, parameters.nz_inner,
+      parameters.nx_inner_boundary, parameters.nz_inner_boundary, parameters.dx,
+      parameters.dz, parameters.dt, parameters.np_boundary, parameters.np_factor,
+      parameters.scalar_rho, parameters.scalar_vp, parameters.scalar_vs, parameters.npx,
+      parameters.npz, parameters.peak_frequency, parameters.source_timeshift,
+      parameters.delay_cycles_per_shot, int(parameters.ix_sources.size()),
+      int(parameters.which_source_to_fire_in_which_shot.size()), parameters.ix_sources,
+      parameters.iz_sources, parameters.moment_angles,
+      parameters.which_source_to_fire_in_which_shot, int(parameters.ix_receivers.size()),
+      parameters.ix_receivers, parameters.iz_receivers, parameters.snapshot_interval,
+      std::string("."), std::string("."));
+}
+
+//!  \brief Function to set the P-wave velocity of the anomaly of the test model.
+//!
+//!  The anomaly spans grid points 80 to 120 in x and 40 to 70 in z.
+//!
+//!  @param model Test model.
+//!  @param vp_factor Factor with respect to scalar_vp.
+inline void set_test_anomaly(fdModel *model, real_simulation vp_factor)
+{
+  for (int ix = 80; ix < 120; ++ix)
+  {
+    for (int iz = 40; iz < 70; ++iz)
+    {
+      model->vp[linear_IDX(ix + model->np_boundary, iz + model->np_boundary, model->nx,
+                           model->nz)] = vp_factor * model->scalar_vp;
+    }
+  }
+  model->update_from_velocity();
+}
+
+//!  \brief Function to set the observed data of the test model to the synthetics of
+//!  a model with a 5% faster anomaly, see set_test_anomaly().
+//!
+//!  @param model Test model, which keeps the anomaly.
+inline void make_observed_data(fdModel *model)
+{
+  set_test_anomaly(model, 1.05);
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    model->forward_simulate(is, false, false);
+  }
+  for (int idx = 0; idx < model->n_shots * model->nr * model->nt; ++idx)
+  {
+    model->rtf_ux_true[idx] = model->rtf_ux[idx];
+    model->rtf_uz_true[idx] = model->rtf_uz[idx];
+  }
+}
+
+#endif // TEST_MODEL_H
@@ -0,0 +1,116 @@
+//
+// Test that coarsened models reproduce low pass filtered fine synthetics and that
+// multiscale inversion carries the coarse model updates over to the fine grid.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  auto *model = make_test_model();
+  make_observed_data(model);
+
+  // A coarsened copy of the true model should reproduce the filtered data, up to
+  // the shift of the staggered grid points and the dispersion of the coarse grid.
+  real_simulation max_frequency = 40.0;
+  int coarsening = model->coarsening_factor(max_frequency, 6.0);
+  std::cout << "Coarsening for " << max_frequency << " Hz: " << coarsening << std::endl;
+
+  real_simulation coarse_error = 0.0;
+  real_simulation coarse_norm = 0.0;
+  {
+    fdModel coarse(*model, coarsening, max_frequency);
+    for (int is = 0; is < coarse.n_shots; ++is)
+    {
+      coarse.forward_simulate(is, false, false);
+    }
+    for (int idx = 0; idx < coarse.n_shots * coarse.nr * coarse.nt; ++idx)
+    {
+      coarse_error += pow(coarse.rtf_ux[idx] - coarse.rtf_ux_true[idx], 2) +
+                      pow(coarse.rtf_uz[idx] - coarse.rtf_uz_true[idx], 2);
+      coarse_norm += pow(coarse.rtf_ux_true[idx], 2) + pow(coarse.rtf_uz_true[idx], 2);
+    }
+  }
+  real_simulation relative_coarse_error = sqrt(coarse_error / coarse_norm);
+  std::cout << "Relative difference of coarse and filtered fine synthetics: "
+            << relative_coarse_error << std::endl;
+
+  // Invert from the homogeneous model in two frequency bands.
+  set_test_anomaly(model, 1.0);
+
+  std::vector<multiscale_stage> stages(2);
+  stages[0].max_frequency = 20.0;
+  stages[1].max_frequency = 40.0;
+  for (auto &stage : stages)
+  {
+    stage.optimizer.max_iterations = 2;
+  }
+
+  auto startTime = omp_get_wtime();
+  auto results = model->minimize_multiscale(stages, true);
+  std::cout << "Elapsed time for multiscale inversion: " << omp_get_wtime() - startTime
+            << std::endl;
+
+  // Coarsening the updated model again should give the misfit the last stage
+  // ended with, up to the smoothing of the interpolation.
+  real_simulation recoarsened_misfit;
+  {
+    fdModel coarse(*model, results.back().coarsening, stages.back().max_frequency);
+    recoarsened_misfit = coarse.forward_simulate_misfit_all();
+  }
+  real_simulation anomaly_vp = 0.0;
+  for (int ix = 80; ix < 120; ++ix)
+  {
+    for (int iz = 40; iz < 70; ++iz)
+    {
+      anomaly_vp += model->vp[linear_IDX(ix + model->np_boundary, iz + model->np_boundary,
+                                         model->nx, model->nz)] /
+                    (40 * 30);
+    }
+  }
+  bool anomaly_faster = anomaly_vp > model->scalar_vp;
+  delete model;
+
+  bool stages_decrease = true;
+  for (const auto &result : results)
+  {
+    const auto &optimization = result.optimization;
+    std::cout << "Coarsening " << result.coarsening << ", misfit "
+              << optimization.iterations.front().misfit << " -> " << optimization.misfit
+              << std::endl;
+    stages_decrease = stages_decrease and
+                      optimization.misfit < optimization.iterations.front().misfit;
+  }
+  real_simulation transfer_error =
+      std::abs(recoarsened_misfit - results.back().optimization.misfit) /
+      results.back().optimization.misfit;
+  std::cout << "Misfit of the coarsened final model: " << recoarsened_misfit
+            << ", relative difference: " << transfer_error << std::endl
+            << "Mean vp in the anomaly: " << anomaly_vp << std::endl;
+
+  if (coarsening == 2 and relative_coarse_error < 0.25 and results.size() == 2 and
+      results[0].coarsening > results[1].coarsening and stages_decrease and
+      transfer_error < 0.2 and anomaly_faster)
+  {
+    std::cout << "Multiscale inversion carries over model updates. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Multiscale inversion does not carry over model updates. The test "
+                 "failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,112 @@
+//
+// Test that reciprocal simulation from the receivers reproduces forward simulation.
+//
+
+// Includes
+#include "../src/fdModel.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 2000;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 6;
+  int n_shots = 5;
+  std::vector<int> ix_sources_vector{25, 55, 85, 115, 145, 175};
+  std::vector<int> iz_sources_vector{10, 10, 10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles_vector{90, 180, 45, 135, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{
+      {0}, {1}, {2, 3}, {4}, {5}};
+  int nr = 2;
+  std::vector<int> ix_receivers_vector{60, 140};
+  std::vector<int> iz_receivers_vector{90, 90};
+  int snapshot_interval = 10;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  int n_receiver_samples = model->n_shots * model->nr * model->nt;
+
+  // Reference: every shot simulated from its sources.
+  auto startTime = omp_get_wtime();
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    model->forward_simulate(is, false, false);
+  }
+  std::cout << "Elapsed time for forward simulations: " << omp_get_wtime() - startTime
+            << std::endl;
+
+  auto *reference_ux = new real_simulation[n_receiver_samples];
+  auto *reference_uz = new real_simulation[n_receiver_samples];
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    reference_ux[idx] = model->rtf_ux[idx];
+    reference_uz[idx] = model->rtf_uz[idx];
+  }
+
+  // All shots from simulations at the receivers.
+  startTime = omp_get_wtime();
+  model->reciprocal_simulate(false);
+  std::cout << "Elapsed time for reciprocal simulations: "
+            << omp_get_wtime() - startTime << std::endl;
+
+  real_simulation squared_difference = 0.0;
+  real_simulation squared_reference = 0.0;
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    squared_difference += std::pow(model->rtf_ux[idx] - reference_ux[idx], 2) +
+                          std::pow(model->rtf_uz[idx] - reference_uz[idx], 2);
+    squared_reference += std::pow(reference_ux[idx], 2) + std::pow(reference_uz[idx], 2);
+  }
+
+  delete model;
+  delete[] reference_ux;
+  delete[] reference_uz;
+
+  real_simulation relative_error = std::sqrt(squared_difference / squared_reference);
+  std::cout << "Relative L2 difference: " << relative_error << std::endl;
+
+  if (squared_reference > 0.0 and relative_error < 1e-10)
+  {
+    std::cout << "Reciprocal simulation matches forward simulation. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Reciprocal simulation does not match forward simulation. The test "
+                 "failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,149 @@
+//
+// Test SEG-Y writing and reading, including IBM floats and unsorted traces.
+//
+
+// Includes
+#include "../src/fdModel.h"
+#include "../src/segy.h"
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <omp.h>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 1000;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 4;
+  int n_shots = 3;
+  std::vector<int> ix_sources_vector{25, 75, 125, 175};
+  std::vector<int> iz_sources_vector{10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles_vector{90, 180, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0, 1}, {2}, {3}};
+  int nr = 19;
+  std::vector<int> ix_receivers_vector{10, 20, 30, 40, 50, 60, 70, 80, 90, 100,
+                                       110, 120, 130, 140, 150, 160, 170, 180, 190};
+  std::vector<int> iz_receivers_vector{90, 90, 90, 90, 90, 90, 90, 90, 90, 90,
+                                       90, 90, 90, 90, 90, 90, 90, 90, 90};
+  int snapshot_interval = 10;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  bool succeeded = true;
+
+  // IBM floats with known values.
+  const unsigned char ibm_bytes[] = {0x41, 0x10, 0x00, 0x00, 0xC2, 0x76, 0xA0, 0x00,
+                                     0x40, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+  const real_simulation ibm_values[] = {1.0, -118.625, 0.15625, 0.0};
+  real_simulation decoded[4];
+  decode_segy_samples(reinterpret_cast<const char *>(ibm_bytes), segy_format_ibm, 4,
+                      decoded);
+  for (int i = 0; i < 4; ++i)
+  {
+    if (decoded[i] != ibm_values[i])
+    {
+      std::cout << "IBM float " << i << " decoded as " << decoded[i] << std::endl;
+      succeeded = false;
+    }
+  }
+
+  // Round trip of single precision representable seismograms.
+  int n_receiver_samples = model->n_shots * model->nr * model->nt;
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    model->rtf_ux[idx] = float(std::sin(0.001 * idx) * std::exp(-1e-5 * idx));
+    model->rtf_uz[idx] = float(std::cos(0.003 * idx) * 1e-7);
+  }
+  model->write_receivers_segy("test_ux.sgy", "test_uz.sgy");
+  model->load_receivers_segy("test_ux.sgy", "test_uz.sgy", true);
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    if (model->rtf_ux_true[idx] != model->rtf_ux[idx] or
+        model->rtf_uz_true[idx] != model->rtf_uz[idx])
+    {
+      std::cout << "SEG-Y round trip changed the seismograms." << std::endl;
+      succeeded = false;
+      break;
+    }
+  }
+
+  // Traces in reverse order still map onto the right shots and receivers, as
+  // long as field records appear in shot order.
+  {
+    std::ifstream input("test_ux.sgy", std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(input)),
+                            std::istreambuf_iterator<char>());
+    input.close();
+    size_t trace_size = segy_trace_header_size + 4 * size_t(nt);
+    std::ofstream output("test_ux.sgy", std::ios::binary);
+    output.write(bytes.data(), segy_file_header_size);
+    for (int i_shot = 0; i_shot < model->n_shots; ++i_shot)
+    {
+      for (int i_receiver = model->nr - 1; i_receiver >= 0; --i_receiver)
+      {
+        output.write(bytes.data() + segy_file_header_size +
+                         (i_shot * model->nr + i_receiver) * trace_size,
+                     trace_size);
+      }
+    }
+  }
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    model->rtf_ux_true[idx] = 0.0;
+  }
+  model->load_receivers_segy("test_ux.sgy", "test_uz.sgy", false);
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    if (model->rtf_ux_true[idx] != model->rtf_ux[idx])
+    {
+      std::cout << "Reordered traces were not mapped back." << std::endl;
+      succeeded = false;
+      break;
+    }
+  }
+
+  std::remove("test_ux.sgy");
+  std::remove("test_uz.sgy");
+  delete model;
+
+  if (succeeded)
+  {
+    std::cout << "SEG-Y files round-trip. The test succeeded." << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "SEG-Y files do not round-trip. The test failed." << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
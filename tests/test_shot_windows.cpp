@@ -0,0 +1,175 @@
+//
+// Test that simulating every shot on a window around its sources reproduces full
+// grid simulations, exactly for windows covering the grid and approximately for
+// narrower windows, whose error shrinks as the aperture grows.
+//
+
+// Includes
+#include "test_model.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  auto *model = make_test_model();
+  make_observed_data(model);
+
+  // Every shot is only observed by the receivers within a spread around its sources.
+  int spread = 40;
+  for (int i_shot = 0; i_shot < model->n_shots; ++i_shot)
+  {
+    for (int i_receiver = 0; i_receiver < model->nr; ++i_receiver)
+    {
+      bool observed = false;
+      for (const auto &i_source : model->which_source_to_fire_in_which_shot[i_shot])
+      {
+        observed = observed or std::abs(model->ix_receivers[i_receiver] -
+                                        model->ix_sources[i_source]) <= spread;
+      }
+      if (not observed)
+      {
+        auto idx = linear_IDX(i_shot, i_receiver, 0, model->n_shots, model->nr,
+                              model->nt);
+        std::fill(model->rtf_ux_true + idx, model->rtf_ux_true + idx + model->nt, 0.0);
+        std::fill(model->rtf_uz_true + idx, model->rtf_uz_true + idx + model->nt, 0.0);
+      }
+    }
+  }
+
+  // Gradients are computed in the homogeneous model.
+  set_test_anomaly(model, 1.0);
+
+  // Full grid reference.
+  int n_receiver_samples = model->n_shots * model->nr * model->nt;
+  model->run_model(false, true);
+  real_simulation reference_misfit = model->misfit;
+  std::vector<real_simulation> reference_trace_misfits(
+      model->misfit_per_trace, model->misfit_per_trace + model->n_shots * model->nr);
+  std::vector<real_simulation> reference_ux(model->rtf_ux,
+                                            model->rtf_ux + n_receiver_samples);
+  std::vector<real_simulation> reference_uz(model->rtf_uz,
+                                            model->rtf_uz + n_receiver_samples);
+  std::vector<real_simulation> reference_kernel(model->vp_kernel,
+                                                model->vp_kernel + model->nx * model->nz);
+
+  // Windows covering the full grid.
+  model->shot_window_aperture = model->nx_inner;
+  model->run_model(false, true);
+  real_simulation kernel_error = 0.0;
+  real_simulation kernel_norm = 0.0;
+  for (int idx = 0; idx < model->nx * model->nz; ++idx)
+  {
+    kernel_error += pow(model->vp_kernel[idx] - reference_kernel[idx], 2);
+    kernel_norm += pow(reference_kernel[idx], 2);
+  }
+  real_simulation relative_misfit_error =
+      std::abs(model->misfit - reference_misfit) / reference_misfit;
+  real_simulation relative_kernel_error = sqrt(kernel_error / kernel_norm);
+  std::cout << "Relative difference of misfit and kernel for full windows: "
+            << relative_misfit_error << ", " << relative_kernel_error << std::endl;
+
+  // Narrower windows only record at the receivers near the sources and the live
+  // receivers of every shot. Their error, measured on the observed receivers, has to
+  // shrink as the aperture grows.
+  std::vector<int> apertures{10, 20, 40};
+  std::vector<real_simulation> data_errors;
+  std::vector<real_simulation> misfit_errors;
+  std::vector<real_simulation> costs;
+  real_simulation silent_amplitude = 0.0;
+  bool observed_receivers_recorded = true;
+  for (const auto &aperture : apertures)
+  {
+    model->shot_window_aperture = aperture;
+    auto startTime = omp_get_wtime();
+    model->run_model(false, true);
+    std::cout << "Elapsed time for windowed simulations with aperture " << aperture
+              << ": " << omp_get_wtime() - startTime << std::endl;
+
+    int window_columns = 0;
+    real_simulation data_error = 0.0;
+    real_simulation data_norm = 0.0;
+    real_simulation observed_misfit = 0.0;
+    real_simulation reference_observed_misfit = 0.0;
+    for (int i_shot = 0; i_shot < model->n_shots; ++i_shot)
+    {
+      shot_window window = model->get_shot_window(i_shot, aperture);
+      window_columns += window.ix_end - window.ix_start + 1;
+      std::vector<bool> live(model->nr, false);
+      for (const auto &receiver : window.receivers)
+      {
+        live[receiver] = true;
+      }
+      for (int i_receiver = 0; i_receiver < model->nr; ++i_receiver)
+      {
+        bool observed = model->receiver_has_observed_data(i_shot, i_receiver);
+        // Only receivers without observed data may fall outside of the window.
+        observed_receivers_recorded = observed_receivers_recorded and
+                                      (live[i_receiver] or not observed);
+        if (observed)
+        {
+          auto i_trace = linear_IDX(i_shot, i_receiver, model->n_shots, model->nr);
+          observed_misfit += model->misfit_per_trace[i_trace];
+          reference_observed_misfit += reference_trace_misfits[i_trace];
+        }
+        for (int it = 0; it < model->nt; ++it)
+        {
+          auto idx = linear_IDX(i_shot, i_receiver, it, model->n_shots, model->nr,
+                                model->nt);
+          if (observed)
+          {
+            data_error += pow(model->rtf_ux[idx] - reference_ux[idx], 2) +
+                          pow(model->rtf_uz[idx] - reference_uz[idx], 2);
+            data_norm += pow(reference_ux[idx], 2) + pow(reference_uz[idx], 2);
+          }
+          if (not live[i_receiver])
+          {
+            silent_amplitude = std::max({silent_amplitude,
+                                         std::abs(model->rtf_ux[idx]),
+                                         std::abs(model->rtf_uz[idx])});
+          }
+        }
+      }
+    }
+    data_errors.push_back(sqrt(data_error / data_norm));
+    misfit_errors.push_back(std::abs(observed_misfit - reference_observed_misfit) /
+                            reference_observed_misfit);
+    costs.push_back(real_simulation(window_columns) /
+                    (model->n_shots * model->nx_inner));
+    std::cout << "Relative difference of observed seismograms and their misfit: "
+              << data_errors.back() << ", " << misfit_errors.back()
+              << ", relative amount of simulated columns: " << costs.back()
+              << std::endl;
+  }
+  delete model;
+
+  bool error_shrinks = true;
+  for (size_t i = 1; i < apertures.size(); ++i)
+  {
+    error_shrinks = error_shrinks and data_errors[i] < data_errors[i - 1] and
+                    misfit_errors[i] < misfit_errors[i - 1] and costs[i] > costs[i - 1];
+  }
+
+  if (relative_misfit_error < 1e-12 and relative_kernel_error < 1e-10 and
+      error_shrinks and silent_amplitude == 0.0 and costs.front() < 0.6 and
+      observed_receivers_recorded)
+  {
+    std::cout << "Windowed simulations match full grid simulations. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Windowed simulations differ from full grid simulations. The test "
+                 "failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
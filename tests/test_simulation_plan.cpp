@@ -0,0 +1,107 @@
+//
+// Test that the stable time step bounds the Courant number of the scheme and that
+// models resampled onto a simulation plan reproduce the observed data at a lower
+// cost.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  // A finer grid with a lower frequency source, which the planner coarsens.
+  test_model_parameters parameters;
+  parameters.nt = 800;
+  parameters.nx_inner = 201;
+  parameters.nz_inner = 101;
+  parameters.dx = 1.0;
+  parameters.dz = 1.0;
+  parameters.peak_frequency = 25;
+  parameters.delay_cycles_per_shot = 2;
+  auto *model = make_test_model(parameters);
+  make_observed_data(model);
+
+  // The scheme should stay bounded just below the stable time step and blow up
+  // just above it.
+  real_simulation max_velocity = parameters.scalar_vp * 1.05;
+  real_simulation max_stable_dt =
+      model->stable_time_step(max_velocity, parameters.dx, parameters.dz);
+  std::cout << "Largest stable time step: " << max_stable_dt << std::endl;
+  real_simulation misfits[2];
+  real_simulation factors[2] = {0.98, 1.02};
+  for (int i = 0; i < 2; ++i)
+  {
+    fdModel unstable(*model, false);
+    unstable.dt = factors[i] * max_stable_dt;
+    misfits[i] = unstable.forward_simulate_misfit(0);
+    std::cout << "Misfit at " << factors[i] << " times the stable time step: "
+              << misfits[i] << std::endl;
+  }
+
+  // The stable time step is reported for the loaded model, including the faster
+  // anomaly, not for scalar_vp.
+  real_simulation model_max_stable_dt = model->max_stable_time_step();
+  real_simulation scalar_max_stable_dt =
+      model->stable_time_step(parameters.scalar_vp, parameters.dx, parameters.dz);
+
+  // Eight points per S wavelength at twice the peak frequency allow twice the grid
+  // spacing, on which sources and receivers keep their positions.
+  simulation_plan plan = model->plan_simulation(8.0, 0.9, 2.0);
+  std::cout << "Largest stable time step of the loaded model: " << model_max_stable_dt
+            << ", reported by the plan: " << plan.current_max_stable_dt << std::endl;
+  std::cout << "Planned dx " << plan.dx << ", dz " << plan.dz << ", dt " << plan.dt
+            << ", nt " << plan.nt << ", nx_inner " << plan.nx_inner << ", nz_inner "
+            << plan.nz_inner << ", relative cost " << plan.relative_cost << std::endl;
+
+  real_simulation planned_error = 0.0;
+  real_simulation planned_norm = 0.0;
+  {
+    fdModel planned(*model, plan);
+    for (int is = 0; is < planned.n_shots; ++is)
+    {
+      planned.forward_simulate(is, false, false);
+    }
+    for (int idx = 0; idx < planned.n_shots * planned.nr * planned.nt; ++idx)
+    {
+      planned_error += pow(planned.rtf_ux[idx] - planned.rtf_ux_true[idx], 2) +
+                       pow(planned.rtf_uz[idx] - planned.rtf_uz_true[idx], 2);
+      planned_norm +=
+          pow(planned.rtf_ux_true[idx], 2) + pow(planned.rtf_uz_true[idx], 2);
+    }
+  }
+  real_simulation relative_planned_error = sqrt(planned_error / planned_norm);
+  std::cout << "Relative difference of planned synthetics and observed data: "
+            << relative_planned_error << std::endl;
+  delete model;
+
+  real_simulation expected_dt =
+      1.0 / (max_velocity * (9.0 / 8.0 + 1.0 / 24.0) * sqrt(2.0) / parameters.dx);
+  if (std::abs(max_stable_dt - expected_dt) < 1e-12 * expected_dt and
+      std::isfinite(misfits[0]) and not(misfits[1] < 1e6 * misfits[0]) and
+      model_max_stable_dt == max_stable_dt and
+      plan.current_max_stable_dt == model_max_stable_dt and
+      model_max_stable_dt < scalar_max_stable_dt and
+      plan.dt <= plan.max_stable_dt and plan.relative_cost < 1.0 and
+      relative_planned_error < 0.25)
+  {
+    std::cout << "Planned simulations are stable and accurate. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Planned simulations are unstable or inaccurate. The test failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,125 @@
+//
+// Test that snapshots stored on a quadrature lattice give the gradient vector of the
+// block basis from a fraction of the snapshot memory.
+//
+
+// Includes
+#include "test_model.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  test_model_parameters parameters;
+  parameters.npx = 4;
+  parameters.npz = 4;
+  auto *model = make_test_model(parameters);
+  make_observed_data(model);
+  set_test_anomaly(model, 1.0);
+
+  auto snapshot_size = [&]() {
+    return model->shape_accu[0] * model->shape_accu[1] * model->shape_accu[2] *
+           model->shape_accu[3];
+  };
+  auto relative_error = [](const dynamic_vector &a, const dynamic_vector &b) {
+    return (a - b).norm() / b.norm();
+  };
+
+  model->run_model(false, true);
+  dynamic_vector full_gradient = model->get_gradient_vector();
+  int full_size = snapshot_size();
+
+  // Four snapshot points per block.
+  model->set_snapshot_quadrature(2, 2);
+  model->run_model(false, true);
+  dynamic_vector quadrature_gradient = model->get_gradient_vector();
+  real_simulation memory_fraction = real_simulation(snapshot_size()) / full_size;
+  real_simulation quadrature_error = relative_error(quadrature_gradient, full_gradient);
+
+  // Copies keep the lattice and its snapshots.
+  real_simulation copy_error;
+  {
+    fdModel copy(*model);
+    copy.reset_kernels();
+    for (int is = 0; is < copy.n_shots; ++is)
+    {
+      copy.adjoint_simulate(is, false);
+    }
+    copy.map_kernels_to_velocity();
+    copy_error = relative_error(copy.get_gradient_vector(), quadrature_gradient);
+  }
+
+  // Shot windows keep the lattice, so windows covering the full grid reproduce the
+  // gradient.
+  model->shot_window_aperture = model->nx_inner;
+  model->run_model(false, true);
+  real_simulation window_error =
+      relative_error(model->get_gradient_vector(), quadrature_gradient);
+  model->shot_window_aperture = 0;
+
+  // A window that starts at an odd column stores the snapshot points of the model
+  // inside it, with the same weights.
+  shot_window window = model->get_shot_window(0, 1);
+  bool window_lattice_aligned = window.ix_start % 2 == 1;
+  {
+    fdModel window_model(*model, window);
+    int i_model = 0;
+    for (int i_point = 0; i_point < window_model.nx_snapshot; ++i_point)
+    {
+      int ix = window_model.snapshot_ix[i_point] + window.ix_start;
+      while (i_model < model->nx_snapshot and model->snapshot_ix[i_model] < ix)
+      {
+        ++i_model;
+      }
+      window_lattice_aligned =
+          window_lattice_aligned and i_model < model->nx_snapshot and
+          model->snapshot_ix[i_model] == ix and
+          model->snapshot_weight_x[i_model] == window_model.snapshot_weight_x[i_point];
+    }
+    window_lattice_aligned = window_lattice_aligned and window_model.nx_snapshot > 0 and
+                             window_model.snapshot_iz == model->snapshot_iz;
+  }
+
+  // One snapshot point per block.
+  model->set_snapshot_quadrature(4, 4);
+  model->run_model(false, true);
+  real_simulation block_error =
+      relative_error(model->get_gradient_vector(), full_gradient);
+
+  // The full grid again.
+  model->set_snapshot_quadrature(1, 1);
+  model->run_model(false, true);
+  real_simulation full_error =
+      relative_error(model->get_gradient_vector(), full_gradient);
+
+  std::cout << "Relative snapshot memory with strides of 2: " << memory_fraction
+            << std::endl;
+  std::cout << "Relative gradient difference with strides of 2 in full windows: "
+            << window_error << ", window lattice aligned: " << window_lattice_aligned
+            << std::endl;
+  std::cout << "Relative gradient difference with strides of 2, 4, copied and 1: "
+            << quadrature_error << ", " << block_error << ", " << copy_error << ", "
+            << full_error << std::endl;
+
+  if (memory_fraction < 0.1 and quadrature_error < 0.2 and block_error < 0.3 and
+      copy_error < 1e-12 and full_error == 0.0 and window_error < 1e-10 and
+      window_lattice_aligned)
+  {
+    std::cout << "Quadrature snapshots reproduce the block gradient. The test "
+                 "succeeded."
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Quadrature snapshots do not reproduce the block gradient. The test "
+                 "failed."
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,132 @@
+//
+// Test that an encoded supershot equals the encoded sum of individual shots.
+//
+
+// Includes
+#include "../src/fdModel.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 2000;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 4;
+  int n_shots = 2;
+  std::vector<int> ix_sources_vector{25, 75, 125, 175};
+  std::vector<int> iz_sources_vector{10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles_vector{90, 180, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0, 1}, {2, 3}};
+  int nr = 19;
+  std::vector<int> ix_receivers_vector{10, 20, 30, 40, 50, 60, 70, 80, 90, 100,
+                                       110, 120, 130, 140, 150, 160, 170, 180, 190};
+  std::vector<int> iz_receivers_vector{90, 90, 90, 90, 90, 90, 90, 90, 90, 90,
+                                       90, 90, 90, 90, 90, 90, 90, 90, 90};
+  int snapshot_interval = 10;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  // Simulate all shots separately and use them as observed data.
+  for (int is = 0; is < model->n_shots; ++is)
+  {
+    model->forward_simulate(is, false, false);
+  }
+  for (int idx = 0; idx < model->n_shots * model->nr * model->nt; ++idx)
+  {
+    model->rtf_ux_true[idx] = model->rtf_ux[idx];
+    model->rtf_uz_true[idx] = model->rtf_uz[idx];
+  }
+
+  // Encode the separate shots and simulate the supershot with the same codes.
+  model->seed_source_encoding(0);
+  model->draw_source_encoding(true, 200);
+  model->encode_observed_data();
+  model->forward_simulate_encoded(false, true);
+
+  real_simulation max_difference = 0.0;
+  real_simulation max_amplitude = 0.0;
+  for (int idx = 0; idx < model->nr * model->nt; ++idx)
+  {
+    max_difference =
+        std::max(max_difference, std::abs(model->rtf_ux_encoded[idx] -
+                                          model->rtf_ux_true_encoded[idx]));
+    max_difference =
+        std::max(max_difference, std::abs(model->rtf_uz_encoded[idx] -
+                                          model->rtf_uz_true_encoded[idx]));
+    max_amplitude = std::max(max_amplitude, std::abs(model->rtf_ux_true_encoded[idx]));
+    max_amplitude = std::max(max_amplitude, std::abs(model->rtf_uz_true_encoded[idx]));
+  }
+
+  // The misfit of the supershot, with and without adjoint sources, against a serial
+  // sum.
+  real_simulation reference_misfit = 0.0;
+  for (int idx = 0; idx < model->nr * model->nt; ++idx)
+  {
+    auto residual_ux = model->rtf_ux_encoded[idx] - model->rtf_ux_true_encoded[idx];
+    auto residual_uz = model->rtf_uz_encoded[idx] - model->rtf_uz_true_encoded[idx];
+    reference_misfit +=
+        0.5 * model->dt * (residual_ux * residual_ux + residual_uz * residual_uz);
+  }
+  model->calculate_encoded_l2_misfit();
+  real_simulation misfit = model->misfit;
+  model->calculate_encoded_l2_misfit_and_adjoint_sources();
+  bool misfits_agree = model->misfit == misfit and
+                       std::abs(misfit - reference_misfit) <= 1e-12 * reference_misfit;
+  for (int idx = 0; idx < model->nr * model->nt; ++idx)
+  {
+    misfits_agree = misfits_agree and
+                    model->a_stf_ux_encoded[idx] ==
+                        model->rtf_ux_encoded[idx] - model->rtf_ux_true_encoded[idx];
+  }
+
+  delete model;
+
+  std::cout << "Maximum difference: " << max_difference
+            << ", maximum amplitude: " << max_amplitude << std::endl;
+  std::cout << "Encoded misfit: " << misfit << ", serial sum: " << reference_misfit
+            << std::endl;
+
+  if (max_amplitude > 0.0 and max_difference < 1e-10 * max_amplitude and
+      misfits_agree)
+  {
+    std::cout << "Encoded supershot matches the encoded shots. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Encoded supershot does not match the encoded shots. The test failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
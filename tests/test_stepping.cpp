@@ -0,0 +1,131 @@
+//
+// Test that stepping a simulation in chunks, with a callback that pauses it, reproduces
+// a regular forward simulation.
+//
+
+// Includes
+#include "../src/fdModel.h"
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <vector>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 2000;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 4;
+  int n_shots = 3;
+  std::vector<int> ix_sources_vector{25, 75, 125, 175};
+  std::vector<int> iz_sources_vector{10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles_vector{90, 180, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0, 1}, {2}, {3}};
+  int nr = 19;
+  std::vector<int> ix_receivers_vector{10, 20, 30, 40, 50, 60, 70, 80, 90, 100,
+                                       110, 120, 130, 140, 150, 160, 170, 180, 190};
+  std::vector<int> iz_receivers_vector{90, 90, 90, 90, 90, 90, 90, 90, 90, 90,
+                                       90, 90, 90, 90, 90, 90, 90, 90, 90};
+  int snapshot_interval = 10;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  int n_receiver_samples = model->nr * model->nt;
+  int n_snapshot_samples = model->snapshots * model->nx * model->nz;
+  int i_shot = 1;
+
+  // Reference: a regular forward simulation.
+  model->forward_simulate(i_shot, true, false);
+
+  std::vector<real_simulation> reference_ux(
+      model->rtf_ux + i_shot * n_receiver_samples,
+      model->rtf_ux + (i_shot + 1) * n_receiver_samples);
+  std::vector<real_simulation> reference_accu_vx(
+      model->accu_vx + i_shot * n_snapshot_samples,
+      model->accu_vx + (i_shot + 1) * n_snapshot_samples);
+
+  // Stepped simulation, paused once by the callback and resumed afterwards.
+  int n_callbacks = 0;
+  int pause_at = 700;
+  bool callback_arguments_ok = true;
+  model->step_callback_interval = 100;
+  model->step_callback = [&](int shot, int it) {
+    n_callbacks++;
+    callback_arguments_ok = callback_arguments_ok and shot == i_shot and it % 100 == 0;
+    return it != pause_at;
+  };
+
+  model->begin_forward_simulation(i_shot, true);
+  int steps_taken = model->step(333);
+  steps_taken = model->step(model->nt);
+  bool paused_correctly = steps_taken == pause_at and not model->simulation_finished();
+  while (not model->simulation_finished())
+  {
+    steps_taken = model->step(250);
+  }
+  std::cout << "Callbacks: " << n_callbacks << ", steps taken: " << steps_taken
+            << std::endl;
+
+  real_simulation max_difference = 0.0;
+  for (int idx = 0; idx < n_receiver_samples; ++idx)
+  {
+    max_difference =
+        std::max(max_difference, std::abs(model->rtf_ux[i_shot * n_receiver_samples + idx] -
+                                          reference_ux[idx]));
+  }
+  for (int idx = 0; idx < n_snapshot_samples; ++idx)
+  {
+    max_difference = std::max(
+        max_difference, std::abs(model->accu_vx[i_shot * n_snapshot_samples + idx] -
+                                 reference_accu_vx[idx]));
+  }
+
+  bool finished_correctly = steps_taken == model->nt and
+                            n_callbacks == model->nt / model->step_callback_interval and
+                            callback_arguments_ok;
+
+  delete model;
+
+  std::cout << "Maximum difference: " << max_difference << std::endl;
+
+  if (paused_correctly and finished_correctly and max_difference == 0.0)
+  {
+    std::cout << "Stepped simulation matches forward simulation. The test succeeded."
+              << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Stepped simulation does not match forward simulation. The test failed."
+              << std::endl
+              << std::endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,168 @@
+//
+// Test that wavefield output writes and appends the selected frames.
+//
+
+// Includes
+#include "../src/fdModel.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <omp.h>
+#include <stdexcept>
+
+int main()
+{
+  std::cout << "Maximum amount of OpenMP threads:" << omp_get_max_threads()
+            << std::endl;
+
+  int nt = 1000;
+  int nx_inner = 200;
+  int nz_inner = 100;
+  int nx_inner_boundary = 10;
+  int nz_inner_boundary = 20;
+  real_simulation dx = 1.249;
+  real_simulation dz = 1.249;
+  real_simulation dt = 0.00025;
+  int np_boundary = 25;
+  real_simulation np_factor = 0.015;
+  real_simulation scalar_rho = 1500.0;
+  real_simulation scalar_vp = 2000.0;
+  real_simulation scalar_vs = 800.0;
+  int npx = 1;
+  int npz = 1;
+  real_simulation peak_frequency = 50;
+  real_simulation source_timeshift = 0.005;
+  real_simulation delay_cycles_per_shot = 8;
+  int n_sources = 4;
+  int n_shots = 3;
+  std::vector<int> ix_sources_vector{25, 75, 125, 175};
+  std::vector<int> iz_sources_vector{10, 10, 10, 10};
+  std::vector<real_simulation> moment_angles_vector{90, 180, 90, 180};
+  std::vector<std::vector<int>> which_source_to_fire_in_which_shot{{0, 1}, {2}, {3}};
+  int nr = 19;
+  std::vector<int> ix_receivers_vector{10, 20, 30, 40, 50, 60, 70, 80, 90, 100,
+                                       110, 120, 130, 140, 150, 160, 170, 180, 190};
+  std::vector<int> iz_receivers_vector{90, 90, 90, 90, 90, 90, 90, 90, 90, 90,
+                                       90, 90, 90, 90, 90, 90, 90, 90, 90};
+  int snapshot_interval = 10;
+  std::string observed_data_folder(".");
+  std::string stf_folder(".");
+
+  auto *model = new fdModel(
+      nt, nx_inner, nz_inner, nx_inner_boundary, nz_inner_boundary, dx, dz, dt,
+      np_boundary, np_factor, scalar_rho, scalar_vp, scalar_vs, npx, npz,
+      peak_frequency, source_timeshift, delay_cycles_per_shot, n_sources, n_shots,
+      ix_sources_vector, iz_sources_vector, moment_angles_vector,
+      which_source_to_fire_in_which_shot, nr, ix_receivers_vector, iz_receivers_vector,
+      snapshot_interval, observed_data_folder, stf_folder);
+
+  // Every 37th step, so that the last frame holds the final fields.
+  std::remove("test_wavefields.bin");
+  model->wavefield_output.path = "test_wavefields.bin";
+  model->wavefield_output.interval = 37;
+  model->wavefield_output.fields = wavefield_vx | wavefield_txz;
+  model->wavefield_output.ix_start = 30;
+  model->wavefield_output.ix_end = 200;
+  model->wavefield_output.iz_start = 5;
+  model->wavefield_output.decimation_x = 3;
+  model->wavefield_output.decimation_z = 2;
+
+  auto startTime = omp_get_wtime();
+  model->forward_simulate(0, false, false, false);
+  std::cout << "Elapsed time without wavefield output: " << omp_get_wtime() - startTime
+            << std::endl;
+  startTime = omp_get_wtime();
+  model->forward_simulate(1, false, false, true);
+  model->forward_simulate(0, false, false, true);
+  std::cout << "Elapsed time for two shots with wavefield output: "
+            << omp_get_wtime() - startTime << std::endl;
+
+  bool succeeded = true;
+
+  int nx_out = (200 - 30 + 2) / 3;
+  int nz_out = (model->nz - 5 + 1) / 2;
+  int frames_per_shot = (nt - 1) / 37 + 1;
+  size_t frame_size = 8 + 2 * size_t(nx_out) * nz_out * 4;
+
+  std::ifstream input("test_wavefields.bin", std::ios::binary);
+  std::vector<char> bytes((std::istreambuf_iterator<char>(input)),
+                          std::istreambuf_iterator<char>());
+  input.close();
+
+  wavefield_file_header header;
+  std::memcpy(&header, bytes.data(), sizeof(header));
+  if (header.nx != nx_out or header.nz != nz_out or
+      bytes.size() != sizeof(header) + 2 * frames_per_shot * frame_size)
+  {
+    std::cout << "Wavefield file has the wrong shape or number of frames." << std::endl;
+    succeeded = false;
+  }
+  else
+  {
+    // The last frame of the appended shot 0 holds the final fields.
+    const char *frame =
+        bytes.data() + sizeof(header) + (2 * frames_per_shot - 1) * frame_size;
+    int32_t position[2];
+    std::memcpy(position, frame, sizeof(position));
+    if (position[0] != 0 or position[1] != 37 * (frames_per_shot - 1))
+    {
+      std::cout << "Last frame has the wrong shot or time step." << std::endl;
+      succeeded = false;
+    }
+    const real_simulation *fields[2] = {model->vx, model->txz};
+    for (int i_field = 0; i_field < 2; ++i_field)
+    {
+      for (int ix_out = 0; ix_out < nx_out; ++ix_out)
+      {
+        for (int iz_out = 0; iz_out < nz_out; ++iz_out)
+        {
+          float value;
+          std::memcpy(&value,
+                      frame + 8 + ((i_field * nx_out + ix_out) * nz_out + iz_out) * 4,
+                      4);
+          auto idx = linear_IDX(30 + 3 * ix_out, 5 + 2 * iz_out, model->nx, model->nz);
+          if (value != float(fields[i_field][idx]))
+          {
+            succeeded = false;
+          }
+        }
+      }
+    }
+    if (!succeeded)
+    {
+      std::cout << "Last frame does not match the final fields." << std::endl;
+    }
+  }
+
+  // Appending frames of different settings should be refused.
+  model->wavefield_output.decimation_x = 1;
+  try
+  {
+    model->forward_simulate(0, false, false, true);
+    std::cout << "Appending different frames was accepted." << std::endl;
+    succeeded = false;
+  }
+  catch (const std::invalid_argument &error)
+  {
+    std::cout << "Appending different frames was refused: " << error.what()
+              << std::endl;
+  }
+
+  std::remove("test_wavefields.bin");
+  delete model;
+
+  if (succeeded)
+  {
+    std::cout << "Wavefield output is consistent. The test succeeded." << std::endl
+              << std::endl;
+    exit(0);
+  }
+  else
+  {
+    std::cout << "Wavefield output is not consistent. The test failed." << std::endl
+              << std::endl;
+    exit(1);
+  }
+}